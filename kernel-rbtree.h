@@ -135,6 +135,14 @@ extern struct rb_node *rb_last(struct rb_root *);
 extern void rb_replace_node(struct rb_node *victim, struct rb_node *new_node,
                 struct rb_root *root);
 
+typedef void (*rb_augment_f)(struct rb_node *node, void *data);
+
+extern void rb_augment_insert(struct rb_node *node,
+                              rb_augment_f func, void *data);
+extern struct rb_node *rb_augment_erase_begin(struct rb_node *node);
+extern void rb_augment_erase_end(struct rb_node *node,
+                                 rb_augment_f func, void *data);
+
 static __inline void rb_link_node(struct rb_node * node, struct rb_node * parent,
                                   struct rb_node ** rb_link)
 {
@@ -2,623 +2,5137 @@
 #include <errno.h>
 #include <assert.h>
 
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 #include "rbdict.h"
 #include "kernel-rbtree.h"
+#include "rbdict_trace.h"
 
 static char* mystrdup(const char* s)
 {
-    char* res;
-    size_t len;
+    char* res;
+    size_t len;
+
+    if (!s) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    len = strlen(s) + 1;
+
+    res = (char*) malloc(len);
+    if (!res) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    memcpy(res, s, len);
+    return res;
+}
+/*------------------------------------------------------------*/
+
+/*
+ * Length aware binary keys/values. The descriptor and the bytes
+ * are allocated together so a clone is one malloc and one memcpy
+ */
+static void* clone_blob(const void* p)
+{
+    const struct rbdict_blob* b = (const struct rbdict_blob*) p;
+
+    if (!b) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return rbdict_blob_new(b->data, b->len);
+}
+/*------------------------------------------------------------*/
+
+static int compare_blob(const void* p1, const void* p2)
+{
+    const struct rbdict_blob* b1 = (const struct rbdict_blob*) p1;
+    const struct rbdict_blob* b2 = (const struct rbdict_blob*) p2;
+    size_t len = b1->len < b2->len ? b1->len : b2->len;
+    int result = len ? memcmp(b1->data, b2->data, len) : 0;
+
+    if (result)
+        return result;
+
+    return (b1->len > b2->len) - (b1->len < b2->len);
+}
+/*------------------------------------------------------------*/
+
+/*
+ * Interval keys. Ordered by lo then hi, copied with malloc like the
+ * other built-in key types
+ */
+static void* clone_interval(const void* p)
+{
+    const struct rbdict_interval* iv = (const struct rbdict_interval*) p;
+    struct rbdict_interval* res;
+
+    if (!iv || iv->hi < iv->lo) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    res = (struct rbdict_interval*) malloc(sizeof(*res));
+    if (!res) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    *res = *iv;
+    return res;
+}
+/*------------------------------------------------------------*/
+
+static int compare_interval(const void* p1, const void* p2)
+{
+    const struct rbdict_interval* i1 = (const struct rbdict_interval*) p1;
+    const struct rbdict_interval* i2 = (const struct rbdict_interval*) p2;
+
+    if (i1->lo != i2->lo)
+        return (i1->lo > i2->lo) - (i1->lo < i2->lo);
+    return (i1->hi > i2->hi) - (i1->hi < i2->hi);
+}
+/*------------------------------------------------------------*/
+
+struct rbdict_blob* rbdict_blob_new(const void* data, size_t len)
+{
+    struct rbdict_blob* res;
+
+    if (!data && len) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    res = (struct rbdict_blob*) malloc(sizeof(*res) + len);
+    if (!res) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    res->len = len;
+    res->data = res + 1;
+    if (len)
+        memcpy(res + 1, data, len);
+
+    return res;
+}
+/*------------------------------------------------------------*/
+
+/*
+ * 64 bit FNV-1a
+ */
+static uint64_t _rbdict_hash_bytes(const void* p, size_t len)
+{
+    const unsigned char* s = (const unsigned char*) p;
+    uint64_t h = 14695981039346656037ULL;
+
+    while (len--) {
+        h ^= *s++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+/*------------------------------------------------------------*/
+
+/*
+ * String interning pool. Each distinct string is stored once in a
+ * refcounted entry; dicts created against the pool hold a reference
+ * per key. The pool itself is freed when the creator and every dict
+ * using it have let go of it.
+ */
+struct strpool_entry {
+    struct strpool_entry* next;
+    struct rbdict_strpool* pool;
+    size_t refcnt;
+    uint64_t hash;
+    char str[1];
+};
+
+struct rbdict_strpool {
+    struct strpool_entry** buckets;
+    size_t nbuckets;
+    size_t nentries;
+    size_t users;
+};
+
+static __inline struct strpool_entry* str_to_entry(const void* s)
+{
+    return rb_entry(s, struct strpool_entry, str);
+}
+/*------------------------------------------------------------*/
+
+struct rbdict_strpool* rbdict_strpool_create(void)
+{
+    struct rbdict_strpool* pool;
+
+    pool = (struct rbdict_strpool*) malloc(sizeof(*pool));
+    if (!pool) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    pool->nbuckets = 64;
+    pool->nentries = 0;
+    pool->users = 1;
+    pool->buckets = (struct strpool_entry**) calloc(pool->nbuckets, sizeof(pool->buckets[0]));
+    if (!pool->buckets) {
+        free(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return pool;
+}
+/*------------------------------------------------------------*/
+
+static void _strpool_unuse(struct rbdict_strpool* pool)
+{
+    size_t i;
+
+    if (--pool->users)
+        return;
+
+    for (i = 0; i < pool->nbuckets; ++i) {
+        struct strpool_entry* e = pool->buckets[i];
+        while (e) {
+            struct strpool_entry* next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    free(pool->buckets);
+    free(pool);
+}
+/*------------------------------------------------------------*/
+
+void rbdict_strpool_destroy(struct rbdict_strpool* pool)
+{
+    if (pool)
+        _strpool_unuse(pool);
+}
+/*------------------------------------------------------------*/
+
+size_t rbdict_strpool_size(const struct rbdict_strpool* pool)
+{
+    return pool->nentries;
+}
+/*------------------------------------------------------------*/
+
+static int _strpool_grow(struct rbdict_strpool* pool)
+{
+    size_t nbuckets = pool->nbuckets * 2;
+    size_t i;
+    struct strpool_entry** buckets;
+
+    buckets = (struct strpool_entry**) calloc(nbuckets, sizeof(buckets[0]));
+    if (!buckets)
+        return -1;
+
+    for (i = 0; i < pool->nbuckets; ++i) {
+        struct strpool_entry* e = pool->buckets[i];
+        while (e) {
+            struct strpool_entry* next = e->next;
+            size_t b = e->hash & (nbuckets - 1);
+            e->next = buckets[b];
+            buckets[b] = e;
+            e = next;
+        }
+    }
+
+    free(pool->buckets);
+    pool->buckets = buckets;
+    pool->nbuckets = nbuckets;
+    return 0;
+}
+/*------------------------------------------------------------*/
+
+/*
+ * Return the pooled copy of S with its refcount incremented
+ */
+static char* _strpool_intern(struct rbdict_strpool* pool, const char* s)
+{
+    size_t len;
+    uint64_t h;
+    struct strpool_entry* e;
+
+    if (!s) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    len = strlen(s);
+    h = _rbdict_hash_bytes(s, len);
+
+    for (e = pool->buckets[h & (pool->nbuckets - 1)]; e; e = e->next) {
+        if (e->hash == h && strcmp(e->str, s) == 0) {
+            ++e->refcnt;
+            return e->str;
+        }
+    }
+
+    if (pool->nentries >= pool->nbuckets)
+        _strpool_grow(pool);   /* keep going with longer chains on failure */
+
+    e = (struct strpool_entry*) malloc(sizeof(*e) + len);
+    if (!e) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    e->pool = pool;
+    e->refcnt = 1;
+    e->hash = h;
+    memcpy(e->str, s, len + 1);
+    e->next = pool->buckets[h & (pool->nbuckets - 1)];
+    pool->buckets[h & (pool->nbuckets - 1)] = e;
+    ++pool->nentries;
+
+    return e->str;
+}
+/*------------------------------------------------------------*/
+
+static __inline void* _strpool_ref(const void* s)
+{
+    ++str_to_entry(s)->refcnt;
+    return (void*) s;
+}
+/*------------------------------------------------------------*/
+
+static void _strpool_release(void* s)
+{
+    struct strpool_entry* e = str_to_entry(s);
+    struct rbdict_strpool* pool = e->pool;
+    struct strpool_entry** link;
+
+    if (--e->refcnt)
+        return;
+
+    link = &pool->buckets[e->hash & (pool->nbuckets - 1)];
+    while (*link != e)
+        link = &(*link)->next;
+
+    *link = e->next;
+    --pool->nentries;
+    free(e);
+}
+/*------------------------------------------------------------*/
+
+static int compare_interned(const void* s1, const void* s2)
+{
+    if (s1 == s2)
+        return 0;
+    return strcmp((const char*) s1, (const char*) s2);
+}
+/*------------------------------------------------------------*/
+
+/*
+ * Slot of the optional hash index (RBDICT_HASH_INDEX). Open addressing
+ * with linear probing; an empty slot has a NULL pair.
+ */
+struct rbdict_hslot {
+    uint64_t hash;
+    struct rbdict_pair* pair;
+};
+
+/*
+ * Bounded cache state (max_entries / max_bytes options)
+ */
+struct rbdict_cache {
+    size_t max_entries;
+    size_t max_bytes;
+    size_t bytes;
+    struct rb_node* hand;
+    rbdict_sizeof_t entry_size;
+    rbdict_evict_t on_evict;
+    void* evict_user_data;
+};
+
+struct rbdict {
+    struct rb_root root;
+    struct rbdict_operations ops;
+    size_t nelem;
+    int flags;
+    struct rbdict_strpool* strpool;
+    struct rbdict_hslot* htab;
+    size_t hmask;
+    struct rbdict_snapshot* snapshots;
+    size_t pair_size;
+    size_t cache_off;
+    struct rbdict_cache cache;
+    size_t ttl_off;
+    struct rb_root expiry;
+    int64_t now;
+    rbdict_clock_t clock;
+    size_t gen;
+    size_t link_off;
+    struct rb_node* head;
+    struct rb_node* tail;
+    struct rbdict_allocator alloc;
+    size_t mem_used;
+    size_t mem_limit;
+    size_t mem_off;
+    rbdict_change_t on_change;
+    void* change_user_data;
+    size_t agg_off;
+    size_t ival_off;
+    struct rbdict_hot* hot;
+    size_t hot_mask;
+#ifndef _WIN32
+    pthread_rwlock_t lock;
+#endif
+};
+/*----------------------------------------------------------------*/
+
+#define NUMERIC_KEY (RBDICT_INT_KEY | RBDICT_UINT_KEY | RBDICT_DOUBLE_KEY)
+
+struct rbdict_pair {
+    struct rb_node m_node;
+    void* key;
+    void* value;
+};
+
+inline struct rbdict_pair* node_to_pair(struct rb_node* node)
+{
+    return rb_entry(node, struct rbdict_pair, m_node);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Optional per-pair state. Features that need it reserve room after
+ * struct rbdict_pair when the dict is created and find it at a fixed
+ * offset, so dicts that do not use them pay nothing.
+ */
+#define PAIR_EXT(pDict, p, off, type) ((type*)((char*)(p) + (pDict)->off))
+
+static size_t _rbdict_reserve_ext(struct rbdict* pDict, size_t size)
+{
+    size_t off = (pDict->pair_size + 7) & ~(size_t)7;
+    pDict->pair_size = off + size;
+    return off;
+}
+/*----------------------------------------------------------------*/
+
+/* CLOCK state of a cached pair */
+struct pair_cache {
+    size_t charge;
+    int referenced;
+};
+
+#define PAIR_CACHE(pDict, p) PAIR_EXT(pDict, p, cache_off, struct pair_cache)
+
+/* expiry of a pair in a RBDICT_TTL dict, indexed by (expire, address) */
+struct pair_ttl {
+    struct rb_node exp_node;
+    int64_t expire;
+};
+
+#define PAIR_TTL(pDict, p) PAIR_EXT(pDict, p, ttl_off, struct pair_ttl)
+
+/* in-order neighbours of a pair in a RBDICT_THREADED dict */
+struct pair_link {
+    struct rb_node* prev;
+    struct rb_node* next;
+};
+
+#define PAIR_LINK(pDict, p) PAIR_EXT(pDict, p, link_off, struct pair_link)
+
+/* aggregates of the int values in a pair's subtree (RBDICT_AGGREGATE) */
+struct pair_agg {
+    uint64_t sum;               /* wraps like two's complement */
+    int64_t min;
+    int64_t max;
+    size_t count;
+};
+
+#define PAIR_AGG(pDict, p) PAIR_EXT(pDict, p, agg_off, struct pair_agg)
+
+/* largest interval end in a pair's subtree (RBDICT_INTERVAL_KEY) */
+struct pair_ival {
+    int64_t max_hi;
+};
+
+#define PAIR_IVAL(pDict, p) PAIR_EXT(pDict, p, ival_off, struct pair_ival)
+
+/*
+ * bytes charged for the dict's own copy of a built-in value. An updater
+ * may shorten a string in place, so the size is not taken again at free
+ */
+struct pair_mem {
+    size_t value_size;
+};
+
+#define PAIR_MEM(pDict, p) PAIR_EXT(pDict, p, mem_off, struct pair_mem)
+/*----------------------------------------------------------------*/
+
+/*
+ * In-order stepping. Threaded dicts follow the explicit links, one
+ * load per step; others walk the tree
+ */
+static __inline struct rb_node* _rbdict_first(const struct rbdict* pRoot)
+{
+    if (pRoot->link_off)
+        return pRoot->head;
+    return rb_first((struct rb_root*) &pRoot->root);
+}
+
+static __inline struct rb_node* _rbdict_last(const struct rbdict* pRoot)
+{
+    if (pRoot->link_off)
+        return pRoot->tail;
+    return rb_last((struct rb_root*) &pRoot->root);
+}
+
+static __inline struct rb_node* _rbdict_next(const struct rbdict* pRoot, struct rb_node* node)
+{
+    if (pRoot->link_off)
+        return PAIR_LINK(pRoot, node_to_pair(node))->next;
+    return rb_next(node);
+}
+
+static __inline struct rb_node* _rbdict_prev(const struct rbdict* pRoot, struct rb_node* node)
+{
+    if (pRoot->link_off)
+        return PAIR_LINK(pRoot, node_to_pair(node))->prev;
+    return rb_prev(node);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Thread a node just linked below PARENT at LINK between its in-order
+ * neighbours: a left child comes right before its parent, a right
+ * child right after it
+ */
+static void _link_thread(struct rbdict* pRoot,
+                         struct rb_node* node,
+                         struct rb_node* parent,
+                         struct rb_node** link)
+{
+    struct pair_link* l = PAIR_LINK(pRoot, node_to_pair(node));
+
+    if (!parent) {
+        l->prev = l->next = NULL;
+    }
+    else if (link == &parent->rb_left) {
+        l->next = parent;
+        l->prev = PAIR_LINK(pRoot, node_to_pair(parent))->prev;
+    }
+    else {
+        l->prev = parent;
+        l->next = PAIR_LINK(pRoot, node_to_pair(parent))->next;
+    }
+
+    if (l->prev)
+        PAIR_LINK(pRoot, node_to_pair(l->prev))->next = node;
+    else
+        pRoot->head = node;
+
+    if (l->next)
+        PAIR_LINK(pRoot, node_to_pair(l->next))->prev = node;
+    else
+        pRoot->tail = node;
+}
+/*----------------------------------------------------------------*/
+
+static void _unlink_thread(struct rbdict* pRoot, struct rb_node* node)
+{
+    struct pair_link* l = PAIR_LINK(pRoot, node_to_pair(node));
+
+    if (l->prev)
+        PAIR_LINK(pRoot, node_to_pair(l->prev))->next = l->next;
+    else
+        pRoot->head = l->next;
+
+    if (l->next)
+        PAIR_LINK(pRoot, node_to_pair(l->next))->prev = l->prev;
+    else
+        pRoot->tail = l->prev;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Subtree aggregates. A node's aggregate is recomputed from its value
+ * and its children's aggregates; the kernel's rb_augment helpers call
+ * this on every node an insert or erase touches, value changes redo
+ * the path to the root.
+ */
+static void _agg_update(struct rb_node* node, void* data)
+{
+    const struct rbdict* pRoot = (const struct rbdict*) data;
+    struct pair_agg* a = PAIR_AGG(pRoot, node_to_pair(node));
+    int64_t v = (int64_t)(intptr_t) node_to_pair(node)->value;
+    struct rb_node* child[2];
+    int i;
+
+    a->sum = (uint64_t) v;
+    a->min = a->max = v;
+    a->count = 1;
+
+    child[0] = node->rb_left;
+    child[1] = node->rb_right;
+    for (i = 0; i < 2; ++i) {
+        if (child[i]) {
+            const struct pair_agg* c = PAIR_AGG(pRoot, node_to_pair(child[i]));
+            a->sum += c->sum;
+            if (c->min < a->min)
+                a->min = c->min;
+            if (c->max > a->max)
+                a->max = c->max;
+            a->count += c->count;
+        }
+    }
+}
+/*----------------------------------------------------------------*/
+
+static void _agg_path(struct rbdict* pRoot, struct rb_node* node)
+{
+    for (; node; node = node->rb_parent)
+        _agg_update(node, pRoot);
+}
+/*----------------------------------------------------------------*/
+
+/* an interval node's max_hi, from its key and its children */
+static void _ival_update(struct rb_node* node, void* data)
+{
+    const struct rbdict* pRoot = (const struct rbdict*) data;
+    struct pair_ival* iv = PAIR_IVAL(pRoot, node_to_pair(node));
+    int64_t m = ((const struct rbdict_interval*) node_to_pair(node)->key)->hi;
+
+    if (node->rb_left && PAIR_IVAL(pRoot, node_to_pair(node->rb_left))->max_hi > m)
+        m = PAIR_IVAL(pRoot, node_to_pair(node->rb_left))->max_hi;
+    if (node->rb_right && PAIR_IVAL(pRoot, node_to_pair(node->rb_right))->max_hi > m)
+        m = PAIR_IVAL(pRoot, node_to_pair(node->rb_right))->max_hi;
+    iv->max_hi = m;
+}
+/*----------------------------------------------------------------*/
+
+/* an interval key the tree cannot hold */
+static __inline int _ival_bad_key(const struct rbdict* pRoot, const void* key)
+{
+    const struct rbdict_interval* iv = (const struct rbdict_interval*) key;
+    return pRoot->ival_off && (!iv || iv->hi < iv->lo);
+}
+/*----------------------------------------------------------------*/
+
+/* all the per-subtree data a dict keeps */
+static __inline int _augmented(const struct rbdict* pRoot)
+{
+    return pRoot->agg_off || pRoot->ival_off;
+}
+
+static void _augment_update(struct rb_node* node, void* data)
+{
+    const struct rbdict* pRoot = (const struct rbdict*) data;
+
+    if (pRoot->agg_off)
+        _agg_update(node, data);
+    if (pRoot->ival_off)
+        _ival_update(node, data);
+}
+/*----------------------------------------------------------------*/
+
+/* every node, bottom up */
+static void _augment_build(struct rbdict* pRoot, struct rb_node* node)
+{
+    if (!node)
+        return;
+    _augment_build(pRoot, node->rb_left);
+    _augment_build(pRoot, node->rb_right);
+    _augment_update(node, pRoot);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Dict memory. Everything the dict owns goes through its allocator
+ * and is counted in mem_used; past mem_limit allocations fail.
+ */
+static void* _default_alloc(void* ctx, size_t size)
+{
+    return malloc(size);
+}
+/*----------------------------------------------------------------*/
+
+static void _default_free(void* ctx, void* p, size_t size)
+{
+    free(p);
+}
+/*----------------------------------------------------------------*/
+
+static void* _default_realloc(void* ctx, void* p, size_t old_size, size_t size)
+{
+    return realloc(p, size);
+}
+/*----------------------------------------------------------------*/
+
+static const struct rbdict_allocator default_allocator = {
+    _default_alloc, _default_free, NULL, _default_realloc
+};
+
+static __inline int _custom_alloc(const struct rbdict* pDict)
+{
+    return pDict->alloc.alloc != _default_alloc;
+}
+/*----------------------------------------------------------------*/
+
+static __inline int _mem_charge(struct rbdict* pDict, size_t size)
+{
+    if (pDict->mem_limit && pDict->mem_used + size > pDict->mem_limit) {
+        errno = ENOMEM;
+        return -1;
+    }
+    pDict->mem_used += size;
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+static void* _rbdict_alloc(struct rbdict* pDict, size_t size)
+{
+    void* p;
+
+    if (_mem_charge(pDict, size) < 0)
+        return NULL;
+
+    if ((p = pDict->alloc.alloc(pDict->alloc.ctx, size)) == NULL) {
+        pDict->mem_used -= size;
+        errno = ENOMEM;
+        return NULL;
+    }
+    return p;
+}
+/*----------------------------------------------------------------*/
+
+static void _rbdict_free(struct rbdict* pDict, void* p, size_t size)
+{
+    if (p) {
+        pDict->alloc.free(pDict->alloc.ctx, p, size);
+        pDict->mem_used -= size;
+    }
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Resize P from OLD_SIZE to SIZE bytes with the allocator's realloc,
+ * which the caller has checked is there
+ */
+static void* _rbdict_realloc(struct rbdict* pDict, void* p, size_t old_size, size_t size)
+{
+    void* res;
+
+    if (size > old_size && _mem_charge(pDict, size - old_size) < 0)
+        return NULL;
+
+    if ((res = pDict->alloc.realloc(pDict->alloc.ctx, p, old_size, size)) == NULL) {
+        if (size > old_size)
+            pDict->mem_used -= size - old_size;
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (size < old_size)
+        pDict->mem_used -= old_size - size;
+    return res;
+}
+/*----------------------------------------------------------------*/
+
+static size_t _builtin_size(const void* p, int is_str, int is_blob)
+{
+    if (is_str)
+        return strlen((const char*) p) + 1;
+    if (is_blob)
+        return sizeof(struct rbdict_blob) + ((const struct rbdict_blob*) p)->len;
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Built-in string and blob keys/values are copied into dict memory.
+ * Pooled keys belong to the pool
+ */
+static __inline int _own_key(const struct rbdict* pDict)
+{
+    return !(pDict->flags & NUMERIC_KEY) &&
+           (pDict->flags & (RBDICT_STR_KEY | RBDICT_BLOB_KEY)) &&
+           !pDict->strpool;
+}
+
+static __inline int _own_value(const struct rbdict* pDict)
+{
+    return !(pDict->flags & RBDICT_INT_VAL) &&
+           (pDict->flags & (RBDICT_STR_VAL | RBDICT_BLOB_VAL));
+}
+/*----------------------------------------------------------------*/
+
+#ifdef RBDICT_USDT
+/* key length in bytes for the trace probes, 0 for custom keys */
+static size_t _rbdict_key_size(const struct rbdict* pDict, const void* key)
+{
+    if (pDict->flags & NUMERIC_KEY)
+        return sizeof(int64_t);
+    if (!key)
+        return 0;
+    if (pDict->flags & RBDICT_STR_KEY)
+        return strlen((const char*) key);
+    if (pDict->flags & RBDICT_BLOB_KEY)
+        return ((const struct rbdict_blob*) key)->len;
+    if (pDict->flags & RBDICT_INTERVAL_KEY)
+        return sizeof(struct rbdict_interval);
+    return 0;
+}
+/*----------------------------------------------------------------*/
+#endif
+
+/* write the built-in P of SIZE bytes into RES */
+static void _builtin_fill(void* res, const void* p, int is_str, size_t size)
+{
+    if (is_str) {
+        memcpy(res, p, size);
+    }
+    else {
+        const struct rbdict_blob* b = (const struct rbdict_blob*) p;
+        struct rbdict_blob* copy = (struct rbdict_blob*) res;
+
+        copy->len = b->len;
+        copy->data = copy + 1;
+        if (b->len)
+            memcpy(copy + 1, b->data, b->len);
+    }
+}
+/*----------------------------------------------------------------*/
+
+static void* _rbdict_copy_builtin(struct rbdict* pDict, const void* p, int is_str)
+{
+    size_t size = _builtin_size(p, is_str, !is_str);
+    void* res = _rbdict_alloc(pDict, size);
+
+    if (res)
+        _builtin_fill(res, p, is_str, size);
+    return res;
+}
+/*----------------------------------------------------------------*/
+
+static void _rbdict_destroy_key(struct rbdict* pDict, void* k)
+{
+    if (_own_key(pDict))
+        _rbdict_free(pDict, k, _builtin_size(k, pDict->flags & RBDICT_STR_KEY, 1));
+    else
+        pDict->ops.k_destroy(k);
+}
+/*----------------------------------------------------------------*/
+
+static void _rbdict_destroy_value(struct rbdict* pDict, void* v)
+{
+    if (!_own_value(pDict))
+        pDict->ops.v_destroy(v);
+    else if (v)
+        _rbdict_free(pDict, v, _builtin_size(v, pDict->flags & RBDICT_STR_VAL, 1));
+}
+/*----------------------------------------------------------------*/
+
+static struct rbdict_pair* make_rbdict_pair(struct rbdict* pDict, void* k, void* v)
+{
+    struct rbdict_pair* n = (struct rbdict_pair*) _rbdict_alloc(pDict, pDict->pair_size);
+
+    if (!n)
+        return NULL;
+
+    memset(&n->m_node, 0, sizeof(n->m_node));
+    if (pDict->pair_size > sizeof(*n))
+        memset(n + 1, 0, pDict->pair_size - sizeof(*n));
+    n->key = k;
+    n->value = v;
+    if (pDict->mem_off && v)
+        PAIR_MEM(pDict, n)->value_size = _builtin_size(v, pDict->flags & RBDICT_STR_VAL, 1);
+
+    return n;
+}
+/*----------------------------------------------------------------*/
+
+/* free the value of pair P, own copies by the size they were charged */
+static void _rbdict_destroy_pair_value(struct rbdict* pDict, struct rbdict_pair* p)
+{
+    if (pDict->mem_off)
+        _rbdict_free(pDict, p->value, PAIR_MEM(pDict, p)->value_size);
+    else
+        pDict->ops.v_destroy(p->value);
+}
+/*----------------------------------------------------------------*/
+
+static void destroy_rbdict_pair(struct rbdict* pDict, struct rbdict_pair* p)
+{
+    if (p) {
+        _rbdict_destroy_key(pDict, p->key);
+        _rbdict_destroy_pair_value(pDict, p);
+        _rbdict_free(pDict, p, pDict->pair_size);
+    }
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Hot key table. Slot i holds a pair found by rbdict_search whose key
+ * hashes to i with its full hash, and in the pointer's low bit whether
+ * it was hit since. The hash spares a visit to the pair on misses. A
+ * tree lookup takes over a slot whose bit is clear and clears a set
+ * one, the CLOCK rule of the bounded cache, so one-off lookups of
+ * cold keys do not push out the hot ones. Unlinking a pair clears its
+ * slot. Slots are read and written with relaxed atomics so that
+ * concurrent readers only race on what a slot remembers; the key
+ * compare settles a hash and pair read from different writes.
+ */
+struct rbdict_hot {
+    uint64_t hash;
+    uintptr_t pair;
+};
+
+#define HOT_HIT ((uintptr_t) 1)
+
+#ifdef __GNUC__
+#define HOT_LOAD(p) __atomic_load_n(&(p), __ATOMIC_RELAXED)
+#define HOT_STORE(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELAXED)
+#else
+#define HOT_LOAD(p) (p)
+#define HOT_STORE(p, v) ((p) = (v))
+#endif
+/*----------------------------------------------------------------*/
+
+static int _hot_alloc(struct rbdict* pRoot)
+{
+    size_t size = (pRoot->hot_mask + 1) * sizeof(pRoot->hot[0]);
+
+    if ((pRoot->hot = (struct rbdict_hot*) _rbdict_alloc(pRoot, size)) == NULL)
+        return -1;
+    memset(pRoot->hot, 0, size);
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+static void _hot_remove(struct rbdict* pRoot, struct rbdict_pair* pair)
+{
+    struct rbdict_hot* slot = &pRoot->hot[pRoot->ops.k_hash(pair->key) & pRoot->hot_mask];
+
+    if ((HOT_LOAD(slot->pair) & ~HOT_HIT) == (uintptr_t) pair)
+        HOT_STORE(slot->pair, 0);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * RBDICT_CONCURRENT. Readers and the in place counter updates share
+ * the dict's lock, everything that links or unlinks a pair takes it
+ * exclusively. Values may change under the shared lock, so they are
+ * read with relaxed atomics (VAL_LOAD).
+ */
+#ifndef _WIN32
+
+#define VAL_LOAD(p) __atomic_load_n(&(p), __ATOMIC_RELAXED)
+
+static void _conc_init(struct rbdict* pRoot)
+{
+    pthread_rwlockattr_t attr;
+
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    /* counters keep the lock shared nearly all the time */
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&pRoot->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * The dict whose rbdict_foreach this thread is in, holding its shared
+ * lock. Its visitor's reads go ahead without taking the lock again (a
+ * waiting writer would block them for good), its writes are refused
+ */
+static __thread const struct rbdict* conc_visiting;
+
+static __inline void _conc_rdlock(const struct rbdict* pRoot)
+{
+    if ((pRoot->flags & RBDICT_CONCURRENT) && conc_visiting != pRoot)
+        pthread_rwlock_rdlock((pthread_rwlock_t*) &pRoot->lock);
+}
+
+static __inline int _conc_wrlock(const struct rbdict* pRoot)
+{
+    if (!(pRoot->flags & RBDICT_CONCURRENT))
+        return 0;
+    if (conc_visiting == pRoot) {
+        errno = EDEADLK;
+        return -1;
+    }
+    pthread_rwlock_wrlock((pthread_rwlock_t*) &pRoot->lock);
+    return 0;
+}
+
+static __inline void _conc_unlock(const struct rbdict* pRoot)
+{
+    if ((pRoot->flags & RBDICT_CONCURRENT) && conc_visiting != pRoot)
+        pthread_rwlock_unlock((pthread_rwlock_t*) &pRoot->lock);
+}
+
+/* mark this thread as visiting PROOT, returns the dict it was visiting */
+static __inline const struct rbdict* _conc_visit(const struct rbdict* pRoot)
+{
+    const struct rbdict* outer = conc_visiting;
+
+    conc_visiting = pRoot;
+    return outer;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Change the value of an existing pair under the shared lock: one
+ * fetch-add, or a compare-exchange loop around UPDATER
+ */
+static void _conc_apply(struct rbdict_pair* pair, rbdict_iupdate_t updater, int64_t delta)
+{
+    uintptr_t* slot = (uintptr_t*) &pair->value;
+    uintptr_t old;
+
+    if (!updater) {
+        __atomic_fetch_add(slot, (uintptr_t) delta, __ATOMIC_RELAXED);
+        return;
+    }
+
+    old = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(slot, &old, (uintptr_t) updater((int64_t)(intptr_t) old),
+                                        1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+/*----------------------------------------------------------------*/
+
+#else /* _WIN32 */
+
+#define VAL_LOAD(p) (p)
+#define _conc_init(p) ((void)0)
+#define _conc_rdlock(p) ((void)0)
+#define _conc_wrlock(p) (0)
+#define _conc_unlock(p) ((void)0)
+
+static __inline const struct rbdict* _conc_visit(const struct rbdict* pRoot)
+{
+    return NULL;
+}
+#define _conc_apply(pair, updater, delta) ((void)0)
+
+#endif
+/*----------------------------------------------------------------*/
+
+/*
+ * Numeric keys mapped to unsigned integers with the same order.
+ * Signed keys flip the sign bit. Doubles flip the sign bit when
+ * positive and all bits when negative, which gives a total order
+ * (-NaN < -inf < ... < -0 < +0 < ... < +inf < NaN)
+ */
+
+static __inline uint64_t int_ord(const void* n)
+{
+    return (uint64_t)(uintptr_t)n ^ ((uint64_t)1 << 63);
+}
+
+static __inline uint64_t uint_ord(const void* n)
+{
+    return (uint64_t)(uintptr_t)n;
+}
+
+static __inline uint64_t double_ord(const void* n)
+{
+    uint64_t u = (uint64_t)(uintptr_t)n;
+    return u ^ ((uint64_t)((int64_t)u >> 63) | ((uint64_t)1 << 63));
+}
+
+static __inline int compare_ord(uint64_t n1, uint64_t n2)
+{
+    return (n1 > n2) - (n1 < n2);
+}
+/*----------------------------------------------------------------*/
+
+static int compare_int(const void* n1, const void* n2)
+{
+    return compare_ord(int_ord(n1), int_ord(n2));
+}
+/*----------------------------------------------------------------*/
+
+static int compare_uint(const void* n1, const void* n2)
+{
+    return compare_ord(uint_ord(n1), uint_ord(n2));
+}
+/*----------------------------------------------------------------*/
+
+static int compare_double(const void* n1, const void* n2)
+{
+    return compare_ord(double_ord(n1), double_ord(n2));
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Key hashes for the hash index
+ */
+static uint64_t hash_numeric(const void* n)
+{
+    /* splitmix64 finalizer */
+    uint64_t h = (uint64_t)(uintptr_t) n;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+/*----------------------------------------------------------------*/
+
+static uint64_t hash_str(const void* s)
+{
+    return _rbdict_hash_bytes(s, strlen((const char*) s));
+}
+/*----------------------------------------------------------------*/
+
+static uint64_t hash_blob(const void* p)
+{
+    const struct rbdict_blob* b = (const struct rbdict_blob*) p;
+    return _rbdict_hash_bytes(b->data, b->len);
+}
+/*----------------------------------------------------------------*/
+
+static uint64_t hash_interval(const void* p)
+{
+    return _rbdict_hash_bytes(p, sizeof(struct rbdict_interval));
+}
+/*----------------------------------------------------------------*/
+
+static __inline void destroy_int(void* n)
+{
+    return;
+}
+/*----------------------------------------------------------------*/
+
+static __inline void* clone_int(const void* n)
+{
+    return (void*)n;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Reset the contents of a dict that has its flags and ops set
+ */
+static void _rbdict_init_empty(struct rbdict* p)
+{
+    p->root  = RB_ROOT;
+    p->nelem = 0;
+    p->htab  = NULL;
+    p->hmask = 0;
+    p->snapshots = NULL;
+    p->cache.bytes = 0;
+    p->cache.hand = NULL;
+    p->expiry = RB_ROOT;
+    p->gen = 0;
+    p->head = NULL;
+    p->tail = NULL;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * create a new empty dictionary
+ */
+struct rbdict* rbdict_create_ex(const struct rbdict_operations* ops, int flags)
+{
+    return rbdict_create_opt(ops, flags, NULL);
+}
+/*----------------------------------------------------------------*/
+
+struct rbdict* rbdict_create_opt(const struct rbdict_operations* ops,
+                                 int flags,
+                                 const struct rbdict_options* opts)
+{
+    if (ops) {
+        if (!(ops->k_compare && ops->k_destroy && ops->k_clone)) {
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+
+    if (opts && opts->strpool && !(flags & RBDICT_STR_KEY)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* the hash index holds one pair per key */
+    if ((flags & RBDICT_MULTI) && (flags & RBDICT_HASH_INDEX)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ((flags & RBDICT_HOT_CACHE) && (flags & RBDICT_HASH_INDEX)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ((flags & RBDICT_AGGREGATE) && !(flags & RBDICT_INT_VAL)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (flags & RBDICT_CONCURRENT) {
+#ifdef _WIN32
+        errno = ENOSYS;
+        return NULL;
+#endif
+        /* TTL and cache bookkeeping are writes on every hit */
+        if (!(flags & RBDICT_INT_VAL) || (flags & RBDICT_TTL) ||
+            (opts && (opts->max_entries || opts->max_bytes))) {
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+
+    if (opts && opts->allocator && !(opts->allocator->alloc && opts->allocator->free)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    const struct rbdict_allocator* alloc = (opts && opts->allocator) ? opts->allocator : &default_allocator;
+    struct rbdict* p = (struct rbdict*) alloc->alloc(alloc->ctx, sizeof(struct rbdict));
+    if (!p) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    p->alloc = *alloc;
+    p->mem_used = sizeof(struct rbdict);
+    p->mem_limit = opts ? opts->mem_limit : 0;
+    p->mem_off = 0;
+    p->flags = flags;
+    p->strpool = NULL;
+    p->pair_size = sizeof(struct rbdict_pair);
+    p->cache_off = 0;
+    memset(&p->cache, 0, sizeof(p->cache));
+    p->ttl_off = 0;
+    p->now = INT64_MIN;
+    p->clock = NULL;
+    p->link_off = 0;
+    p->on_change = NULL;
+    p->change_user_data = NULL;
+    p->agg_off = 0;
+    p->ival_off = 0;
+    p->hot = NULL;
+    p->hot_mask = 0;
+    _rbdict_init_empty(p);
+
+    if (flags & RBDICT_THREADED)
+        p->link_off = _rbdict_reserve_ext(p, sizeof(struct pair_link));
+
+    if (flags & RBDICT_AGGREGATE)
+        p->agg_off = _rbdict_reserve_ext(p, sizeof(struct pair_agg));
+
+    if (flags & RBDICT_INTERVAL_KEY)
+        p->ival_off = _rbdict_reserve_ext(p, sizeof(struct pair_ival));
+
+    if (flags & RBDICT_TTL) {
+        p->ttl_off = _rbdict_reserve_ext(p, sizeof(struct pair_ttl));
+        p->clock = opts ? opts->clock : NULL;
+    }
+
+    if (opts && (opts->max_entries || opts->max_bytes)) {
+        p->cache_off = _rbdict_reserve_ext(p, sizeof(struct pair_cache));
+        p->cache.max_entries = opts->max_entries;
+        p->cache.max_bytes = opts->max_bytes;
+        p->cache.entry_size = opts->entry_size;
+        p->cache.on_evict = opts->on_evict;
+        p->cache.evict_user_data = opts->evict_user_data;
+    }
+
+    if (_own_value(p))
+        p->mem_off = _rbdict_reserve_ext(p, sizeof(struct pair_mem));
+
+    /*
+     *  Init key operations
+     */
+    if (p->flags & NUMERIC_KEY) {
+        if (p->flags & RBDICT_INT_KEY)
+            p->ops.k_compare = &compare_int;
+        else if (p->flags & RBDICT_UINT_KEY)
+            p->ops.k_compare = &compare_uint;
+        else
+            p->ops.k_compare = &compare_double;
+        p->ops.k_destroy = &destroy_int;
+        p->ops.k_clone   = &clone_int;
+        p->ops.k_hash    = &hash_numeric;
+    }
+    else if (p->flags & RBDICT_STR_KEY) {
+        p->ops.k_compare = (rbdict_compare_t) &strcmp;
+        p->ops.k_destroy = (rbdict_destroy_t) &free;
+        p->ops.k_clone   = (rbdict_clone_t) &mystrdup;
+        p->ops.k_hash    = &hash_str;
+    }
+    else if (p->flags & RBDICT_BLOB_KEY) {
+        p->ops.k_compare = &compare_blob;
+        p->ops.k_destroy = (rbdict_destroy_t) &free;
+        p->ops.k_clone   = &clone_blob;
+        p->ops.k_hash    = &hash_blob;
+    }
+    else if (p->flags & RBDICT_INTERVAL_KEY) {
+        p->ops.k_compare = &compare_interval;
+        p->ops.k_destroy = (rbdict_destroy_t) &free;
+        p->ops.k_clone   = &clone_interval;
+        p->ops.k_hash    = &hash_interval;
+    }
+    else {
+        if (!ops)
+            goto err_no_ops;
+        p->ops.k_compare = ops->k_compare;
+        p->ops.k_destroy = ops->k_destroy;
+        p->ops.k_clone = ops->k_clone;
+        p->ops.k_hash = ops->k_hash;
+    }
+
+    /* custom keys need a hash function to be indexed */
+    if ((p->flags & (RBDICT_HASH_INDEX | RBDICT_HOT_CACHE)) && !p->ops.k_hash)
+        goto err_no_ops;
+
+    /*
+     *  Init value operations
+     */
+    if (p->flags & RBDICT_INT_VAL) {
+        p->ops.v_destroy = &destroy_int;
+        p->ops.v_clone   = &clone_int;
+    }
+    else if (p->flags & RBDICT_STR_VAL) {
+        p->ops.v_destroy = (rbdict_destroy_t) &free;
+        p->ops.v_clone = (rbdict_clone_t) &mystrdup;
+    }
+    else if (p->flags & RBDICT_BLOB_VAL) {
+        p->ops.v_destroy = (rbdict_destroy_t) &free;
+        p->ops.v_clone = &clone_blob;
+    }
+    else {
+        if (!ops)
+            goto err_no_ops;
+        p->ops.v_destroy = ops->v_destroy;
+        p->ops.v_clone = ops->v_clone;
+    }
+
+    if (!p->ops.v_destroy) {
+        p->ops.v_destroy = p->ops.k_destroy;
+    }
+    if (!p->ops.v_clone) {
+        p->ops.v_clone = p->ops.k_clone;
+    }
+
+    if (p->flags & RBDICT_HOT_CACHE) {
+        size_t slots = (opts && opts->hot_slots) ? opts->hot_slots : 4096;
+
+        if (slots & (slots - 1))
+            goto err_no_ops;
+        p->hot_mask = slots - 1;
+        if (_hot_alloc(p) < 0) {
+            p->alloc.free(p->alloc.ctx, p, sizeof(struct rbdict));
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    /*
+     * Interned keys. k_clone still hands out private copies for
+     * rbdict_keys(), only the dict's own keys live in the pool
+     */
+    if (opts && opts->strpool) {
+        p->strpool = opts->strpool;
+        ++p->strpool->users;
+        p->ops.k_compare = &compare_interned;
+        p->ops.k_destroy = &_strpool_release;
+    }
+    if (flags & RBDICT_CONCURRENT)
+        _conc_init(p);
+    return p;
+
+err_no_ops:
+    p->alloc.free(p->alloc.ctx, p, sizeof(struct rbdict));
+    errno = EINVAL;
+    return NULL;
+}
+/*----------------------------------------------------------------*/
+
+static int _rbdict_clone_kv(const void* v,
+                            void** nv,
+                            rbdict_clone_t klone,
+                            int is_int)
+{
+    void* tmp;
+
+    if (is_int) {
+        *nv = (void*)v;
+        return 0;
+    }
+
+    if (!v) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((tmp = klone(v)) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    *nv = tmp;
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+static int _rbdict_clone_value(struct rbdict* pRoot, const void* v, void** nv)
+{
+    if (_own_value(pRoot)) {
+        if (!v) {
+            errno = EINVAL;
+            return -1;
+        }
+        *nv = _rbdict_copy_builtin(pRoot, v, pRoot->flags & RBDICT_STR_VAL);
+        return *nv ? 0 : -1;
+    }
+
+    return _rbdict_clone_kv(v,
+                            nv,
+                            pRoot->ops.v_clone,
+                            pRoot->flags & RBDICT_INT_VAL);
+}
+/*----------------------------------------------------------------*/
+
+static int _rbdict_clone_key(struct rbdict* pRoot, const void* k, void** nk)
+{
+    if (pRoot->strpool) {
+        *nk = _strpool_intern(pRoot->strpool, (const char*) k);
+        return *nk ? 0 : -1;
+    }
+
+    if (_own_key(pRoot)) {
+        if (!k) {
+            errno = EINVAL;
+            return -1;
+        }
+        *nk = _rbdict_copy_builtin(pRoot, k, pRoot->flags & RBDICT_STR_KEY);
+        return *nk ? 0 : -1;
+    }
+
+    return _rbdict_clone_kv(k,
+                            nk,
+                            pRoot->ops.k_clone,
+                            pRoot->flags & NUMERIC_KEY);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Copy a key that is already stored by the dict. Pooled keys are
+ * shared, not copied
+ */
+static int _rbdict_copy_stored_key(struct rbdict* pRoot, const void* k, void** nk)
+{
+    if (pRoot->strpool) {
+        *nk = _strpool_ref(k);
+        return 0;
+    }
+    return _rbdict_clone_key(pRoot, k, nk);
+}
+/*----------------------------------------------------------------*/
+
+static int _rbdict_insert(struct rbdict* pRoot, void* key, void* value, struct rbdict_pair** ppair);
+
+static void _rbdict_destroy_helper(struct rbdict* pDict, struct rb_node* n)
+{
+    if (!n)
+        return;
+
+    _rbdict_destroy_helper(pDict, n->rb_left);
+    _rbdict_destroy_helper(pDict, n->rb_right);
+
+    struct rbdict_pair* e = node_to_pair(n);
+    destroy_rbdict_pair(pDict, e);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Report a change to the change hook before it is made, once nothing
+ * else can fail: a hook failure fails the public call and the change
+ * is not made. Evictions and expiries are reported as they happen and
+ * cannot be refused
+ */
+static __inline int _rbdict_notify_kv(struct rbdict* pRoot, int op, const void* key, const void* value)
+{
+    if (!pRoot->on_change)
+        return 0;
+    return pRoot->on_change(op, key, value, pRoot->change_user_data) == 0 ? 0 : -1;
+}
+
+static __inline int _rbdict_notify(struct rbdict* pRoot, int op, const struct rbdict_pair* pair)
+{
+    return _rbdict_notify_kv(pRoot, op, pair->key, pair->value);
+}
+/*----------------------------------------------------------------*/
+
+static void _rbdict_detach_snapshots(struct rbdict* pRoot);
+static int _rbdict_insert_dup(struct rbdict* pRoot, void* key, void* value, struct rbdict_pair** ppair);
+static void _ttl_set(struct rbdict* pRoot, struct rbdict_pair* p, int64_t expire);
+
+/*
+ * destroy a dictionary
+ */
+/* what is left of a dict once its pairs are gone */
+static void _rbdict_destroy_shell(struct rbdict* pRoot)
+{
+    if (pRoot->strpool)
+        _strpool_unuse(pRoot->strpool);
+    if (pRoot->htab)
+        _rbdict_free(pRoot, pRoot->htab, (pRoot->hmask + 1) * sizeof(struct rbdict_hslot));
+    if (pRoot->hot)
+        _rbdict_free(pRoot, pRoot->hot, (pRoot->hot_mask + 1) * sizeof(pRoot->hot[0]));
+#ifndef _WIN32
+    if (pRoot->flags & RBDICT_CONCURRENT)
+        pthread_rwlock_destroy(&pRoot->lock);
+#endif
+    pRoot->alloc.free(pRoot->alloc.ctx, pRoot, sizeof(struct rbdict));
+}
+/*----------------------------------------------------------------*/
+
+void rbdict_destroy(struct rbdict* pRoot)
+{
+    struct rb_root* root = &pRoot->root;
+    struct rb_node* node = root->rb_node;
+
+    RBDICT_PROBE2(destroy__entry, 0, pRoot->nelem);
+    _rbdict_destroy_helper(pRoot, node);
+    _rbdict_detach_snapshots(pRoot);
+    _rbdict_destroy_shell(pRoot);
+    RBDICT_PROBE2(destroy__return, 0, 0);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * An empty dict with the settings of PSRC, without its change hook
+ */
+static struct rbdict* _rbdict_clone_empty(struct rbdict* pSrc)
+{
+    struct rbdict* pDest = (struct rbdict*) pSrc->alloc.alloc(pSrc->alloc.ctx, sizeof(struct rbdict));
+
+    if (!pDest) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    *pDest = *pSrc;
+    _rbdict_init_empty(pDest);
+    pDest->mem_used = sizeof(struct rbdict);
+    pDest->on_change = NULL;
+    pDest->change_user_data = NULL;
+    if (pDest->hot && _hot_alloc(pDest) < 0) {
+        pSrc->alloc.free(pSrc->alloc.ctx, pDest, sizeof(struct rbdict));
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (pDest->strpool)
+        ++pDest->strpool->users;
+    if (pDest->flags & RBDICT_CONCURRENT)
+        _conc_init(pDest);
+    return pDest;
+}
+/*----------------------------------------------------------------*/
+
+/* add a copy of a pair of another dict with the same settings */
+static int _rbdict_clone_pair(struct rbdict* pDest, const void* k, const void* v, int64_t expire)
+{
+    struct rbdict_pair* copy;
+    void* key;
+    void* value;
+
+    if (_rbdict_copy_stored_key(pDest, k, &key) < 0)
+        return -1;
+
+    if (_rbdict_clone_value(pDest, v, &value) < 0) {
+        _rbdict_destroy_key(pDest, key);
+        return -1;
+    }
+
+    if (_rbdict_insert(pDest, key, value, &copy) < 0) {
+        _rbdict_destroy_key(pDest, key);
+        _rbdict_destroy_value(pDest, value);
+        return -1;
+    }
+
+    if (pDest->ttl_off)
+        _ttl_set(pDest, copy, expire);
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+static struct rbdict* _rbdict_do_clone(struct rbdict* pSrc)
+{
+    struct rbdict* pDest;
+    struct rb_node* node;
+
+    if ((pDest = _rbdict_clone_empty(pSrc)) == NULL)
+        return NULL;
+
+    for (node = _rbdict_first(pSrc);
+         node != NULL;
+         node = _rbdict_next(pSrc, node))
+    {
+        struct rbdict_pair* e = node_to_pair(node);
+
+        if (_rbdict_clone_pair(pDest, e->key, e->value,
+                               pSrc->ttl_off ? PAIR_TTL(pSrc, e)->expire : RBDICT_NO_EXPIRY) < 0)
+            goto err_clone;
+    }
+
+    return pDest;
+
+err_clone:
+    rbdict_destroy(pDest);
+    errno = ENOMEM;
+    return NULL;
+}
+/*----------------------------------------------------------------*/
+
+struct rbdict* rbdict_clone(struct rbdict* pSrc)
+{
+    struct rbdict* pDest;
+
+    if (!pSrc) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    RBDICT_PROBE2(clone__entry, 0, pSrc->nelem);
+    pDest = _rbdict_do_clone(pSrc);
+    RBDICT_PROBE2(clone__return, pDest != NULL, pSrc->nelem);
+    return pDest;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * insert a new key-value pair into an existing dictionary.
+ * key and value will be stored as-is
+ * ownership of key and value buffers is transfered to dict
+ */
+static int _rbdict_do_insert_nodup(struct rbdict* pRoot, void* key, void* value)
+{
+    void* orig = key;
+    size_t size = 0;
+
+    /*
+     * keys of a pooled dict must come from the pool. The caller's key
+     * stays the caller's until the insert has succeeded
+     */
+    if (pRoot->strpool) {
+        void* pooled = _strpool_intern(pRoot->strpool, (const char*) key);
+        if (!pooled)
+            return -1;
+        key = pooled;
+    }
+
+    /*
+     * The caller's built-in keys and values come from malloc. Under a
+     * custom allocator the dict keeps its own copies; otherwise it
+     * takes them as they are and only counts them
+     */
+    if (_custom_alloc(pRoot) && (_own_key(pRoot) || _own_value(pRoot))) {
+        if (_rbdict_insert_dup(pRoot, key, value, NULL) < 0)
+            goto err_insert;
+        if (pRoot->strpool) {
+            _strpool_release(key);
+            free(orig);
+        }
+        else if (_own_key(pRoot))
+            free(key);
+        else
+            pRoot->ops.k_destroy(key);
+        if (_own_value(pRoot))
+            free(value);
+        else
+            pRoot->ops.v_destroy(value);
+        return 0;
+    }
+
+    if (_own_key(pRoot))
+        size += _builtin_size(key, pRoot->flags & RBDICT_STR_KEY, 1);
+    if (_own_value(pRoot) && value)
+        size += _builtin_size(value, pRoot->flags & RBDICT_STR_VAL, 1);
+
+    if (_mem_charge(pRoot, size) < 0)
+        goto err_insert;
+
+    if (_rbdict_insert(pRoot, key, value, NULL) < 0) {
+        pRoot->mem_used -= size;
+        goto err_insert;
+    }
+    if (pRoot->strpool)
+        free(orig);
+    return 0;
+
+err_insert:
+    if (pRoot->strpool) {
+        int err = errno;
+        _strpool_release(key);
+        errno = err;
+    }
+    return -1;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_insert_nodup(struct rbdict* pRoot, void* key, void* value)
+{
+    uint64_t t0 = _lat_begin();
+    int result;
+
+    RBDICT_PROBE2(insert__entry, _rbdict_key_size(pRoot, key), pRoot->nelem);
+    if ((result = _conc_wrlock(pRoot)) == 0) {
+        result = _rbdict_do_insert_nodup(pRoot, key, value);
+        _conc_unlock(pRoot);
+    }
+    RBDICT_PROBE2(insert__return, result, pRoot->nelem);
+    _lat_end(RBDICT_LAT_INSERT, t0);
+    return result;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Descend to KEY. Returns the matching pair, or NULL with *pparent and
+ * *plink set to where a new node for KEY must be linked.
+ *
+ * Numeric keys get their own loop with the compare inlined: keys are
+ * mapped to unsigned integers of the same order and the child link is
+ * selected without a data dependent branch.
+ */
+#define RBDICT_DESCEND_NUMERIC(ORD)                                     \
+    do {                                                                \
+        uint64_t k = ORD(key);                                          \
+        while (*link) {                                                 \
+            uint64_t o;                                                 \
+            parent = *link;                                             \
+            o = ORD(node_to_pair(parent)->key);                         \
+            if (k == o)                                                 \
+                return node_to_pair(parent);                            \
+            link = (k < o) ? &parent->rb_left : &parent->rb_right;      \
+        }                                                               \
+    } while (0)
+
+/*
+ * RBDICT_MULTI descent to the first (oldest) pair equal to KEY. Equal
+ * keys are adjacent, so a match keeps going left
+ */
+static struct rbdict_pair* _multi_find(const struct rbdict* pRoot,
+                                       const void* key,
+                                       struct rb_node** pparent,
+                                       struct rb_node*** plink)
+{
+    struct rb_node** link = (struct rb_node**) &pRoot->root.rb_node;
+    struct rb_node* parent = NULL;
+    struct rbdict_pair* found = NULL;
+
+    while (*link) {
+        int result;
+
+        parent = *link;
+        result = pRoot->ops.k_compare(key, node_to_pair(parent)->key);
+
+        if (result > 0) {
+            link = &parent->rb_right;
+        }
+        else {
+            if (result == 0)
+                found = node_to_pair(parent);
+            link = &parent->rb_left;
+        }
+    }
+
+    if (found)
+        return found;
+
+    *pparent = parent;
+    *plink = link;
+    return NULL;
+}
+/*----------------------------------------------------------------*/
+
+static __inline struct rbdict_pair* _rbdict_find(const struct rbdict* pRoot,
+                                                 const void* key,
+                                                 struct rb_node** pparent,
+                                                 struct rb_node*** plink)
+{
+    struct rb_node** link = (struct rb_node**) &pRoot->root.rb_node;
+    struct rb_node* parent = NULL;
+
+    if (pRoot->flags & RBDICT_MULTI)
+        return _multi_find(pRoot, key, pparent, plink);
+
+    switch (pRoot->flags & NUMERIC_KEY) {
+    case RBDICT_INT_KEY:
+        RBDICT_DESCEND_NUMERIC(int_ord);
+        break;
+    case RBDICT_UINT_KEY:
+        RBDICT_DESCEND_NUMERIC(uint_ord);
+        break;
+    case RBDICT_DOUBLE_KEY:
+        RBDICT_DESCEND_NUMERIC(double_ord);
+        break;
+    default:
+        while (*link) {
+            int result;
+
+            parent = *link;
+            result = pRoot->ops.k_compare(key, node_to_pair(parent)->key);
+
+            if (result < 0)
+                link = &parent->rb_left;
+            else if (result > 0)
+                link = &parent->rb_right;
+            else
+                return node_to_pair(parent);
+        }
+        break;
+    }
+
+    *pparent = parent;
+    *plink = link;
+    return NULL;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Three way key compare using the inlined numeric compares
+ */
+static __inline int _rbdict_compare(const struct rbdict* pRoot, const void* k1, const void* k2)
+{
+    switch (pRoot->flags & NUMERIC_KEY) {
+    case RBDICT_INT_KEY:
+        return compare_ord(int_ord(k1), int_ord(k2));
+    case RBDICT_UINT_KEY:
+        return compare_ord(uint_ord(k1), uint_ord(k2));
+    case RBDICT_DOUBLE_KEY:
+        return compare_ord(double_ord(k1), double_ord(k2));
+    default:
+        return pRoot->ops.k_compare(k1, k2);
+    }
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Hash index. Every pair of the tree has a slot keyed by the hash of
+ * its key, so point lookups skip the descent. The table is kept at
+ * most 3/4 full and deletes shift the following cluster back instead
+ * of leaving tombstones.
+ */
+static struct rbdict_pair* _hindex_lookup(const struct rbdict* pRoot, const void* key)
+{
+    uint64_t h;
+    size_t i;
+
+    if (!pRoot->htab)
+        return NULL;
+
+    h = pRoot->ops.k_hash(key);
+    for (i = h & pRoot->hmask; pRoot->htab[i].pair; i = (i + 1) & pRoot->hmask) {
+        struct rbdict_hslot* slot = &pRoot->htab[i];
+        if (slot->hash == h && _rbdict_compare(pRoot, key, slot->pair->key) == 0)
+            return slot->pair;
+    }
+    return NULL;
+}
+/*----------------------------------------------------------------*/
+
+static void _hindex_put(struct rbdict_hslot* htab, size_t hmask, uint64_t h, struct rbdict_pair* pair)
+{
+    size_t i = h & hmask;
+
+    while (htab[i].pair)
+        i = (i + 1) & hmask;
+
+    htab[i].hash = h;
+    htab[i].pair = pair;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Make room for one more entry
+ */
+static int _hindex_reserve(struct rbdict* pRoot)
+{
+    size_t cap = pRoot->htab ? pRoot->hmask + 1 : 0;
+    size_t newcap, i;
+    struct rbdict_hslot* htab;
+
+    if ((pRoot->nelem + 1) * 4 <= cap * 3)
+        return 0;
+
+    newcap = cap ? cap * 2 : 16;
+    htab = (struct rbdict_hslot*) _rbdict_alloc(pRoot, newcap * sizeof(htab[0]));
+    if (!htab)
+        return -1;
+    memset(htab, 0, newcap * sizeof(htab[0]));
+
+    for (i = 0; i < cap; ++i) {
+        if (pRoot->htab[i].pair)
+            _hindex_put(htab, newcap - 1, pRoot->htab[i].hash, pRoot->htab[i].pair);
+    }
+
+    if (pRoot->htab)
+        _rbdict_free(pRoot, pRoot->htab, cap * sizeof(htab[0]));
+    pRoot->htab = htab;
+    pRoot->hmask = newcap - 1;
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+static void _hindex_remove(struct rbdict* pRoot, struct rbdict_pair* pair)
+{
+    struct rbdict_hslot* htab = pRoot->htab;
+    size_t mask = pRoot->hmask;
+    size_t i = pRoot->ops.k_hash(pair->key) & mask;
+    size_t j;
+
+    while (htab[i].pair != pair)
+        i = (i + 1) & mask;
+
+    for (j = i; ; ) {
+        size_t home;
+
+        j = (j + 1) & mask;
+        if (!htab[j].pair)
+            break;
+
+        /* entries whose home lies cyclically in (i, j] stay put */
+        home = htab[j].hash & mask;
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        htab[i] = htab[j];
+        i = j;
+    }
+    htab[i].pair = NULL;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Expiry (RBDICT_TTL). Pairs with a deadline sit in a second tree
+ * ordered by deadline, so rbdict_expire pops the oldest ones in
+ * O(log n) each. Expired pairs read as misses until reclaimed.
+ */
+static __inline int64_t _ttl_now(const struct rbdict* pRoot)
+{
+    return pRoot->clock ? pRoot->clock() : pRoot->now;
+}
+/*----------------------------------------------------------------*/
+
+static __inline int _ttl_expired(const struct rbdict* pRoot, struct rbdict_pair* p)
+{
+    if (!pRoot->ttl_off)
+        return 0;
+    return PAIR_TTL(pRoot, p)->expire != RBDICT_NO_EXPIRY &&
+           PAIR_TTL(pRoot, p)->expire <= _ttl_now(pRoot);
+}
+/*----------------------------------------------------------------*/
+
+static void _ttl_clear(struct rbdict* pRoot, struct rbdict_pair* p)
+{
+    struct pair_ttl* t = PAIR_TTL(pRoot, p);
+
+    if (t->expire != RBDICT_NO_EXPIRY) {
+        rb_erase(&t->exp_node, &pRoot->expiry);
+        t->expire = RBDICT_NO_EXPIRY;
+    }
+}
+/*----------------------------------------------------------------*/
+
+static void _ttl_set(struct rbdict* pRoot, struct rbdict_pair* p, int64_t expire)
+{
+    struct pair_ttl* t = PAIR_TTL(pRoot, p);
+    struct rb_node** link = &pRoot->expiry.rb_node;
+    struct rb_node* parent = NULL;
+
+    _ttl_clear(pRoot, p);
+    if (expire == RBDICT_NO_EXPIRY)
+        return;
+
+    while (*link) {
+        struct pair_ttl* other;
+
+        parent = *link;
+        other = rb_entry(parent, struct pair_ttl, exp_node);
+        if (expire < other->expire || (expire == other->expire && t < other))
+            link = &parent->rb_left;
+        else
+            link = &parent->rb_right;
+    }
+
+    t->expire = expire;
+    rb_link_node(&t->exp_node, parent, link);
+    rb_insert_color(&t->exp_node, &pRoot->expiry);
+}
+/*----------------------------------------------------------------*/
+
+static int _rbdict_unlink(struct rbdict* pRoot, struct rbdict_pair* pair);
+
+/*
+ * Descend to KEY unless the hash index already has it. An expired
+ * pair found on the way is reclaimed and reported as a miss.
+ */
+static __inline struct rbdict_pair* _rbdict_lookup(struct rbdict* pRoot,
+                                                   const void* key,
+                                                   struct rb_node** pparent,
+                                                   struct rb_node*** plink)
+{
+    struct rbdict_pair* pThis = NULL;
+
+    if (pRoot->flags & RBDICT_HASH_INDEX) {
+        pThis = _hindex_lookup(pRoot, key);
+        if (!pThis)
+            return _rbdict_find(pRoot, key, pparent, plink);
+    }
+    else {
+        pThis = _rbdict_find(pRoot, key, pparent, plink);
+    }
+
+    if (pThis && _ttl_expired(pRoot, pThis) && _rbdict_unlink(pRoot, pThis) == 0) {
+        _rbdict_notify(pRoot, RBDICT_OP_EXPIRE, pThis);
+        destroy_rbdict_pair(pRoot, pThis);
+        return _rbdict_find(pRoot, key, pparent, plink);
+    }
+    return pThis;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Snapshots. A snapshot shares the live tree and keeps an undo log:
+ * the first change to a key after the snapshot was taken saves the
+ * old value (or the fact that the key was absent) in the snapshot's
+ * delta tree. Reads consult the delta first, then the live tree.
+ * Taking a snapshot is O(1), each write costs one delta descent per
+ * live snapshot the first time it touches a key, and releasing costs
+ * O(changed keys).
+ */
+struct snap_entry {
+    struct rb_node m_node;
+    void* key;
+    void* value;
+    int64_t expire;
+    int present;
+};
+
+struct rbdict_snapshot {
+    struct rbdict* dict;
+    struct rb_root delta;
+    size_t nelem;
+    struct rbdict_snapshot* next;
+};
+
+static __inline struct snap_entry* node_to_snap_entry(struct rb_node* node)
+{
+    return rb_entry(node, struct snap_entry, m_node);
+}
+/*----------------------------------------------------------------*/
+
+static struct snap_entry* _snap_find(const struct rbdict* pRoot,
+                                     const struct rbdict_snapshot* snap,
+                                     const void* key,
+                                     struct rb_node** pparent,
+                                     struct rb_node*** plink)
+{
+    struct rb_node** link = (struct rb_node**) &snap->delta.rb_node;
+    struct rb_node* parent = NULL;
+
+    while (*link) {
+        struct snap_entry* e;
+        int result;
+
+        parent = *link;
+        e = node_to_snap_entry(parent);
+        result = _rbdict_compare(pRoot, key, e->key);
+
+        if (result < 0)
+            link = &parent->rb_left;
+        else if (result > 0)
+            link = &parent->rb_right;
+        else
+            return e;
+    }
+
+    *pparent = parent;
+    *plink = link;
+    return NULL;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Save the state of KEY in every live snapshot that has not seen a
+ * change to it yet. PAIR is the current pair of KEY or NULL when KEY
+ * is about to be added. Must run before the change.
+ */
+static int _snap_record_slow(struct rbdict* pRoot, const void* key, struct rbdict_pair* pair)
+{
+    struct rbdict_snapshot* snap;
+
+    for (snap = pRoot->snapshots; snap; snap = snap->next) {
+        struct rb_node** link;
+        struct rb_node* parent;
+        struct snap_entry* e;
+
+        if (_snap_find(pRoot, snap, key, &parent, &link))
+            continue;
+
+        if ((e = (struct snap_entry*) _rbdict_alloc(pRoot, sizeof(*e))) == NULL)
+            return -1;
+
+        e->present = (pair != NULL);
+        e->value = NULL;
+        e->expire = (pair && pRoot->ttl_off) ? PAIR_TTL(pRoot, pair)->expire : RBDICT_NO_EXPIRY;
+        if (_rbdict_copy_stored_key(pRoot, key, &e->key) < 0) {
+            _rbdict_free(pRoot, e, sizeof(*e));
+            return -1;
+        }
+        if (pair && pair->value && _rbdict_clone_value(pRoot, pair->value, &e->value) < 0) {
+            _rbdict_destroy_key(pRoot, e->key);
+            _rbdict_free(pRoot, e, sizeof(*e));
+            return -1;
+        }
+
+        rb_link_node(&e->m_node, parent, link);
+        rb_insert_color(&e->m_node, &snap->delta);
+    }
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+static __inline int _snap_record(struct rbdict* pRoot, const void* key, struct rbdict_pair* pair)
+{
+    if (!pRoot->snapshots)
+        return 0;
+    return _snap_record_slow(pRoot, key, pair);
+}
+/*----------------------------------------------------------------*/
+
+static void _snap_free_delta(struct rbdict* pRoot, struct rb_node* n)
+{
+    struct snap_entry* e;
+
+    if (!n)
+        return;
+
+    _snap_free_delta(pRoot, n->rb_left);
+    _snap_free_delta(pRoot, n->rb_right);
+
+    e = node_to_snap_entry(n);
+    _rbdict_destroy_key(pRoot, e->key);
+    if (e->present && e->value)
+        _rbdict_destroy_value(pRoot, e->value);
+    _rbdict_free(pRoot, e, sizeof(*e));
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Bounded cache. Each pair has a CLOCK reference bit set by lookups;
+ * past the entry or byte budget the hand sweeps the tree in key order,
+ * clearing set bits and evicting the first pair found without one.
+ * A hit costs one store, and only when the bit was clear.
+ */
+static __inline int _cache_enabled(const struct rbdict* pRoot)
+{
+    return pRoot->cache_off != 0;
+}
+/*----------------------------------------------------------------*/
+
+static __inline void _cache_touch(const struct rbdict* pRoot, struct rbdict_pair* p)
+{
+    if (_cache_enabled(pRoot)) {
+        struct pair_cache* pc = PAIR_CACHE(pRoot, p);
+        if (!pc->referenced)
+            pc->referenced = 1;
+    }
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Bytes charged for a pair: the node plus the built-in key and value
+ * copies, or what entry_size says for custom types
+ */
+static size_t _cache_charge(const struct rbdict* pRoot, const struct rbdict_pair* p)
+{
+    size_t bytes = pRoot->pair_size;
+
+    if (pRoot->cache.entry_size)
+        return bytes + pRoot->cache.entry_size(p->key, p->value);
+
+    bytes += _builtin_size(p->key,
+                           pRoot->flags & RBDICT_STR_KEY,
+                           pRoot->flags & RBDICT_BLOB_KEY);
+    if (p->value) {
+        bytes += _builtin_size(p->value,
+                               pRoot->flags & RBDICT_STR_VAL,
+                               pRoot->flags & RBDICT_BLOB_VAL);
+    }
+    return bytes;
+}
+/*----------------------------------------------------------------*/
+
+static void _cache_recharge(struct rbdict* pRoot, struct rbdict_pair* p)
+{
+    struct pair_cache* pc = PAIR_CACHE(pRoot, p);
+
+    pRoot->cache.bytes -= pc->charge;
+    pc->charge = _cache_charge(pRoot, p);
+    pRoot->cache.bytes += pc->charge;
+}
+/*----------------------------------------------------------------*/
+
+static __inline int _cache_over(const struct rbdict* pRoot)
+{
+    return (pRoot->cache.max_entries && pRoot->nelem > pRoot->cache.max_entries) ||
+           (pRoot->cache.max_bytes && pRoot->cache.bytes > pRoot->cache.max_bytes);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Evict until the dict is within budget again. KEEP, the pair that
+ * pushed it over, is never evicted
+ */
+static void _cache_evict(struct rbdict* pRoot, struct rbdict_pair* keep)
+{
+    while (_cache_over(pRoot) && pRoot->nelem > 1) {
+        struct rb_node* node = pRoot->cache.hand ? pRoot->cache.hand : _rbdict_first(pRoot);
+        struct rbdict_pair* p = node_to_pair(node);
+        struct pair_cache* pc = PAIR_CACHE(pRoot, p);
+
+        pRoot->cache.hand = _rbdict_next(pRoot, node);
+
+        if (p == keep)
+            continue;
+
+        if (pc->referenced) {
+            pc->referenced = 0;
+            continue;
+        }
+
+        if (_rbdict_unlink(pRoot, p) < 0)
+            break;
+        _rbdict_notify(pRoot, RBDICT_OP_EVICT, p);
+        if (pRoot->cache.on_evict)
+            pRoot->cache.on_evict(p->key, p->value, pRoot->cache.evict_user_data);
+        destroy_rbdict_pair(pRoot, p);
+    }
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Make a node for KEY/VALUE and link it where _rbdict_find said.
+ * *PPAIR, when given, is set to the new pair (LINK may no longer
+ * point to it once the tree is rebalanced)
+ */
+static int _rbdict_link_new(struct rbdict* pRoot,
+                            void* key,
+                            void* value,
+                            struct rb_node* parent,
+                            struct rb_node** link,
+                            struct rbdict_pair** ppair)
+{
+    struct rbdict_pair* n;
+
+    if (_ival_bad_key(pRoot, key)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((pRoot->flags & RBDICT_HASH_INDEX) && _hindex_reserve(pRoot) < 0)
+        return -1;
+
+    if (_snap_record(pRoot, key, NULL) < 0)
+        return -1;
+
+    /* make new data object with node */
+    if ((n = make_rbdict_pair(pRoot, key, value)) == NULL) {
+        return -1;
+    }
+
+    if (pRoot->ttl_off)
+        PAIR_TTL(pRoot, n)->expire = RBDICT_NO_EXPIRY;
+
+    if (_rbdict_notify_kv(pRoot, RBDICT_OP_PUT, key, value) < 0) {
+        _rbdict_free(pRoot, n, pRoot->pair_size);
+        return -1;
+    }
+
+    /* Add new node and rebalance tree. */
+    rb_link_node(&n->m_node, parent, link);
+    if (pRoot->link_off)
+        _link_thread(pRoot, &n->m_node, parent, link);
+    rb_insert_color(&n->m_node, &pRoot->root);
+    if (_augmented(pRoot))
+        rb_augment_insert(&n->m_node, _augment_update, pRoot);
+    ++pRoot->nelem;
+    ++pRoot->gen;
+
+    if (pRoot->flags & RBDICT_HASH_INDEX)
+        _hindex_put(pRoot->htab, pRoot->hmask, pRoot->ops.k_hash(key), n);
+
+    if (_cache_enabled(pRoot)) {
+        /* new pairs start unreferenced: only a later lookup protects them */
+        struct pair_cache* pc = PAIR_CACHE(pRoot, n);
+        pc->referenced = 0;
+        pc->charge = _cache_charge(pRoot, n);
+        pRoot->cache.bytes += pc->charge;
+        _cache_evict(pRoot, n);
+    }
+
+    if (ppair)
+        *ppair = n;
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Take a pair out of the dict without destroying it. Fails only when
+ * a live snapshot cannot save the pair.
+ */
+static int _rbdict_unlink(struct rbdict* pRoot, struct rbdict_pair* pair)
+{
+    if (_snap_record(pRoot, pair->key, pair) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (pRoot->flags & RBDICT_HASH_INDEX)
+        _hindex_remove(pRoot, pair);
+
+    if (pRoot->hot)
+        _hot_remove(pRoot, pair);
+
+    if (pRoot->ttl_off)
+        _ttl_clear(pRoot, pair);
+
+    if (_cache_enabled(pRoot)) {
+        if (pRoot->cache.hand == &pair->m_node)
+            pRoot->cache.hand = _rbdict_next(pRoot, &pair->m_node);
+        pRoot->cache.bytes -= PAIR_CACHE(pRoot, pair)->charge;
+    }
+
+    if (pRoot->link_off)
+        _unlink_thread(pRoot, &pair->m_node);
+
+    if (_augmented(pRoot)) {
+        struct rb_node* deepest = rb_augment_erase_begin(&pair->m_node);
+        rb_erase(&pair->m_node, &pRoot->root);
+        rb_augment_erase_end(deepest, _augment_update, pRoot);
+    }
+    else {
+        rb_erase(&pair->m_node, &pRoot->root);
+    }
+    --pRoot->nelem;
+    ++pRoot->gen;
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Delete a pair, reporting it as OP first. Fails, leaving the pair,
+ * when the snapshots have no room to save it or the hook refuses
+ */
+static int _rbdict_remove(struct rbdict* pRoot, struct rbdict_pair* pair, int op)
+{
+    if (_snap_record(pRoot, pair->key, pair) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (_rbdict_notify(pRoot, op, pair) < 0)
+        return -1;
+
+    /* already saved above, this cannot fail */
+    _rbdict_unlink(pRoot, pair);
+    destroy_rbdict_pair(pRoot, pair);
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Bookkeeping after an insert gave the present pair PTHIS a new value
+ */
+static void _rbdict_value_replaced(struct rbdict* pRoot, struct rbdict_pair* pThis)
+{
+    if (pRoot->agg_off)
+        _agg_path(pRoot, &pThis->m_node);
+
+    /* a new value starts without a deadline */
+    if (pRoot->ttl_off)
+        _ttl_clear(pRoot, pThis);
+
+    if (_cache_enabled(pRoot)) {
+        _cache_touch(pRoot, pThis);
+        _cache_recharge(pRoot, pThis);
+        _cache_evict(pRoot, pThis);
+    }
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * insert KEY (already in the form the dict stores) and VALUE.
+ * *PPAIR, when given, is set to the pair holding them
+ */
+static int _rbdict_insert(struct rbdict* pRoot, void* key, void* value, struct rbdict_pair** ppair)
+{
+    struct rb_node** link;
+    struct rb_node*  parent;
+    struct rbdict_pair* pThis;
+
+    /* a new pair after the equal ones keeps them in insertion order */
+    if (pRoot->flags & RBDICT_MULTI) {
+        link = &pRoot->root.rb_node;
+        parent = NULL;
+        while (*link) {
+            parent = *link;
+            if (_rbdict_compare(pRoot, key, node_to_pair(parent)->key) < 0)
+                link = &parent->rb_left;
+            else
+                link = &parent->rb_right;
+        }
+        return _rbdict_link_new(pRoot, key, value, parent, link, ppair);
+    }
+
+    pThis = _rbdict_lookup(pRoot, key, &parent, &link);
+    if (pThis) {
+        if (_snap_record(pRoot, key, pThis) < 0)
+            return -1;
+        if (_rbdict_notify_kv(pRoot, RBDICT_OP_PUT, pThis->key, value) < 0)
+            return -1;
+
+        /*
+         * the dict owns KEY now but already holds an equal one. A
+         * pooled KEY is the same pointer, but still one more reference
+         */
+        if (key != pThis->key || pRoot->strpool)
+            _rbdict_destroy_key(pRoot, key);
+        _rbdict_destroy_pair_value(pRoot, pThis);
+        pThis->value = value;
+        if (pRoot->mem_off && value)
+            PAIR_MEM(pRoot, pThis)->value_size = _builtin_size(value, pRoot->flags & RBDICT_STR_VAL, 1);
+        _rbdict_value_replaced(pRoot, pThis);
+        if (ppair)
+            *ppair = pThis;
+        return 0;
+    }
+
+    return _rbdict_link_new(pRoot, key, value, parent, link, ppair);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * insert a new key-value pair into an existing dictionary
+ */
+static int _rbdict_do_insert_dup(struct rbdict* pRoot, void* key, void* value)
+{
+    return _rbdict_insert_dup(pRoot, key, value, NULL);
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_insert_dup(struct rbdict* pRoot, void* key, void* value)
+{
+    uint64_t t0 = _lat_begin();
+    int result;
+
+    RBDICT_PROBE2(insert__entry, _rbdict_key_size(pRoot, key), pRoot->nelem);
+    if ((result = _conc_wrlock(pRoot)) == 0) {
+        result = _rbdict_do_insert_dup(pRoot, key, value);
+        _conc_unlock(pRoot);
+    }
+    RBDICT_PROBE2(insert__return, result, pRoot->nelem);
+    _lat_end(RBDICT_LAT_INSERT, t0);
+    return result;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Whether the built-in VALUE lies in, or for a blob points into, the
+ * present value of P
+ */
+static int _rbdict_value_aliases(const struct rbdict* pRoot, const struct rbdict_pair* p, const void* value)
+{
+    uintptr_t lo = (uintptr_t) p->value;
+    uintptr_t hi = lo + PAIR_MEM(pRoot, p)->value_size;
+    uintptr_t v = (uintptr_t) value;
+
+    if (v >= lo && v < hi)
+        return 1;
+    if (!(pRoot->flags & RBDICT_STR_VAL)) {
+        v = (uintptr_t)((const struct rbdict_blob*) value)->data;
+        return v >= lo && v < hi;
+    }
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Copy the built-in VALUE over the present pair PTHIS's own copy,
+ * resizing that block with the allocator's realloc
+ */
+static int _rbdict_resize_value(struct rbdict* pRoot,
+                                struct rbdict_pair* pThis,
+                                const void* value,
+                                struct rbdict_pair** ppair)
+{
+    int is_str = pRoot->flags & RBDICT_STR_VAL;
+    size_t old_size = PAIR_MEM(pRoot, pThis)->value_size;
+    size_t size = _builtin_size(value, is_str, !is_str);
+    void* res;
+
+    if (_snap_record(pRoot, pThis->key, pThis) < 0)
+        return -1;
+
+    if ((res = _rbdict_realloc(pRoot, pThis->value, old_size, size)) == NULL)
+        return -1;
+
+    _builtin_fill(res, value, is_str, size);
+    pThis->value = res;
+    PAIR_MEM(pRoot, pThis)->value_size = size;
+    _rbdict_value_replaced(pRoot, pThis);
+    if (ppair)
+        *ppair = pThis;
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+static int _rbdict_insert_dup(struct rbdict* pRoot, void* key, void* value, struct rbdict_pair** ppair)
+{
+    struct rb_node** link = NULL;
+    struct rb_node* parent = NULL;
+    void* key_dup = 0;
+    void* val_dup = 0;
+    int result;
+
+    if (_ival_bad_key(pRoot, key)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /*
+     * Given a realloc hook, an own value over a present key is resized
+     * in place and the key is not copied at all. A change hook must see
+     * the new value before the old one is gone, so it takes a copy
+     */
+    if (pRoot->alloc.realloc && pRoot->mem_off && value && !pRoot->on_change &&
+        !(pRoot->flags & RBDICT_MULTI)) {
+        struct rbdict_pair* pThis = _rbdict_lookup(pRoot, key, &parent, &link);
+
+        if (pThis && pThis->value && !_rbdict_value_aliases(pRoot, pThis, value))
+            return _rbdict_resize_value(pRoot, pThis, value, ppair);
+        if (pThis)
+            link = NULL;
+    }
+
+    if (_rbdict_clone_key(pRoot, key, &key_dup) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (_rbdict_clone_value(pRoot, value, &val_dup) < 0) {
+        _rbdict_destroy_key(pRoot, key_dup);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* a miss above already found where the new pair goes */
+    if (link)
+        result = _rbdict_link_new(pRoot, key_dup, val_dup, parent, link, ppair);
+    else
+        result = _rbdict_insert(pRoot, key_dup, val_dup, ppair);
+
+    if (result < 0) {
+        _rbdict_destroy_key(pRoot, key_dup);
+        _rbdict_destroy_value(pRoot, val_dup);
+        return -1;
+    }
+
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * change a value
+ * Create key-value with default value if missing.
+ */
+static int _rbdict_do_int_update(struct rbdict* pRoot,
+                                 const void* key,
+                                 int64_t default_value,
+                                 rbdict_iupdate_t updater,
+                                 int64_t delta)
+{
+    struct rb_node** link;
+    struct rb_node*  parent;
+    struct rbdict_pair* pThis;
+
+    /* Must be int valued dict */
+    if ((pRoot->flags & RBDICT_INT_VAL) == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((pThis = _rbdict_lookup(pRoot, key, &parent, &link)) != NULL) {
+        void* value;
+
+        if (updater)
+            value = (void*)(updater((int64_t)pThis->value));
+        else
+            value = (void*)((uintptr_t) pThis->value + (uintptr_t) delta);
+        if (_snap_record(pRoot, key, pThis) < 0)
+            return -1;
+        if (_rbdict_notify_kv(pRoot, RBDICT_OP_PUT, pThis->key, value) < 0)
+            return -1;
+        pThis->value = value;
+        if (pRoot->agg_off)
+            _agg_path(pRoot, &pThis->m_node);
+        _cache_touch(pRoot, pThis);
+        return 0;
+    }
+
+    void* new_value = (void*) default_value;
+    void* new_key = 0;
+    if (_rbdict_clone_key(pRoot, key, &new_key) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (_rbdict_link_new(pRoot, new_key, new_value, parent, link, NULL) < 0) {
+        _rbdict_destroy_key(pRoot, new_key);
+        return -1;
+    }
+
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+static struct rbdict_pair* rbdict_search_aux(const struct rbdict* pRoot, const void* key);
+
+/*
+ * On a RBDICT_CONCURRENT dict an existing key is found and changed
+ * under the shared lock. Missing keys, and dicts whose updates also
+ * maintain aggregates, snapshots or a change feed, retry under the
+ * writer lock.
+ */
+static int _rbdict_int_change(struct rbdict* pRoot,
+                              const void* key,
+                              int64_t default_value,
+                              rbdict_iupdate_t updater,
+                              int64_t delta)
+{
+    struct rbdict_pair* pThis;
+    int result;
+
+    if (!(pRoot->flags & RBDICT_CONCURRENT))
+        return _rbdict_do_int_update(pRoot, key, default_value, updater, delta);
+
+    _conc_rdlock(pRoot);
+    if (!pRoot->agg_off && !pRoot->snapshots && !pRoot->on_change &&
+        (pThis = rbdict_search_aux(pRoot, key)) != NULL) {
+        _conc_apply(pThis, updater, delta);
+        _conc_unlock(pRoot);
+        return 0;
+    }
+    _conc_unlock(pRoot);
+
+    if (_conc_wrlock(pRoot) < 0)
+        return -1;
+    result = _rbdict_do_int_update(pRoot, key, default_value, updater, delta);
+    _conc_unlock(pRoot);
+    return result;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_int_update(struct rbdict* pRoot,
+                      const void* key,
+                      int64_t default_value,
+                      rbdict_iupdate_t updater)
+{
+    uint64_t t0 = _lat_begin();
+    int result;
+
+    RBDICT_PROBE2(update__entry, _rbdict_key_size(pRoot, key), pRoot->nelem);
+    result = _rbdict_int_change(pRoot, key, default_value, updater, 0);
+    RBDICT_PROBE2(update__return, result, pRoot->nelem);
+    _lat_end(RBDICT_LAT_UPDATE, t0);
+    return result;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_int_add(struct rbdict* pRoot, const void* key, int64_t delta)
+{
+    uint64_t t0 = _lat_begin();
+    int result;
+
+    RBDICT_PROBE2(update__entry, _rbdict_key_size(pRoot, key), pRoot->nelem);
+    result = _rbdict_int_change(pRoot, key, delta, NULL, delta);
+    RBDICT_PROBE2(update__return, result, pRoot->nelem);
+    _lat_end(RBDICT_LAT_UPDATE, t0);
+    return result;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Run UPDATER over a copy of PTHIS's value, so the change hook sees
+ * the result before it replaces the value
+ */
+static int _rbdict_update_copy(struct rbdict* pRoot,
+                               struct rbdict_pair* pThis,
+                               rbdict_update_t updater,
+                               void* user_data,
+                               int* result)
+{
+    void* value = 0;
+    size_t size = 0;
+
+    if (_rbdict_clone_value(pRoot, pThis->value, &value) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    /* charged as copied, whatever the updater does to it */
+    if (pRoot->mem_off && value)
+        size = _builtin_size(value, pRoot->flags & RBDICT_STR_VAL, 1);
+
+    *result = updater(value, user_data);
+    if (_rbdict_notify_kv(pRoot, RBDICT_OP_PUT, pThis->key, value) < 0) {
+        if (pRoot->mem_off)
+            _rbdict_free(pRoot, value, size);
+        else
+            _rbdict_destroy_value(pRoot, value);
+        return -1;
+    }
+
+    _rbdict_destroy_pair_value(pRoot, pThis);
+    pThis->value = value;
+    if (pRoot->mem_off && value)
+        PAIR_MEM(pRoot, pThis)->value_size = size;
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Update a value by an updater function.
+ * Create key-value with default value if missing.
+ * Updater function gets the address of the value object.
+ */
+static int _rbdict_do_update_ex(struct rbdict* pRoot,
+                                const void* key,
+                                const void* default_value,
+                                rbdict_update_t updater,
+                                void* user_data)
+{
+    struct rb_node** link;
+    struct rb_node*  parent;
+    struct rbdict_pair* pThis;
+
+    if (!updater) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((pThis = _rbdict_lookup(pRoot, key, &parent, &link)) != NULL) {
+        int result;
+
+        if (_snap_record(pRoot, key, pThis) < 0)
+            return -1;
+        if (!pRoot->on_change)
+            result = updater(pThis->value, user_data);
+        else if (_rbdict_update_copy(pRoot, pThis, updater, user_data, &result) < 0)
+            return -1;
+
+        if (_cache_enabled(pRoot)) {
+            _cache_touch(pRoot, pThis);
+            _cache_recharge(pRoot, pThis);
+            _cache_evict(pRoot, pThis);
+        }
+        return result;
+    }
+
+    void* new_key = 0;
+    void* new_value = 0;
+    if (_rbdict_clone_key(pRoot, key, &new_key) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (_rbdict_clone_value(pRoot, default_value, &new_value) < 0) {
+        _rbdict_destroy_key(pRoot, new_key);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (_rbdict_link_new(pRoot, new_key, new_value, parent, link, NULL) < 0) {
+        _rbdict_destroy_key(pRoot, new_key);
+        _rbdict_destroy_value(pRoot, new_value);
+        return -1;
+    }
+
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_update_ex(struct rbdict* pRoot,
+                     const void* key,
+                     const void* default_value,
+                     rbdict_update_t updater,
+                     void* user_data)
+{
+    uint64_t t0 = _lat_begin();
+    int result;
+
+    RBDICT_PROBE2(update__entry, _rbdict_key_size(pRoot, key), pRoot->nelem);
+    if ((result = _conc_wrlock(pRoot)) == 0) {
+        result = _rbdict_do_update_ex(pRoot, key, default_value, updater, user_data);
+        _conc_unlock(pRoot);
+    }
+    RBDICT_PROBE2(update__return, result, pRoot->nelem);
+    _lat_end(RBDICT_LAT_UPDATE, t0);
+    return result;
+}
+/*----------------------------------------------------------------*/
+
+static struct rbdict_pair* rbdict_search_aux(const struct rbdict* pRoot, const void* key)
+{
+    struct rb_node** link;
+    struct rb_node*  parent;
+
+    if (pRoot->flags & RBDICT_HASH_INDEX)
+        return _hindex_lookup(pRoot, key);
+
+    if (pRoot->hot) {
+        uint64_t h = pRoot->ops.k_hash(key);
+        struct rbdict_hot* slot = &pRoot->hot[h & pRoot->hot_mask];
+        uintptr_t v = HOT_LOAD(slot->pair);
+        struct rbdict_pair* pair = (struct rbdict_pair*)(v & ~HOT_HIT);
+
+        if (pair && HOT_LOAD(slot->hash) == h && _rbdict_compare(pRoot, key, pair->key) == 0) {
+            if (!(v & HOT_HIT))
+                HOT_STORE(slot->pair, v | HOT_HIT);
+            return pair;
+        }
+        if ((pair = _rbdict_find(pRoot, key, &parent, &link)) != NULL) {
+            if (v & HOT_HIT) {
+                HOT_STORE(slot->pair, v & ~HOT_HIT);
+            }
+            else {
+                HOT_STORE(slot->hash, h);
+                HOT_STORE(slot->pair, (uintptr_t) pair);
+            }
+        }
+        return pair;
+    }
+
+    return _rbdict_find(pRoot, key, &parent, &link);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * First node whose key is not less than KEY (or greater than KEY
+ * when STRICT), NULL if there is none
+ */
+static struct rb_node* _rbdict_bound(const struct rbdict* pRoot, const void* key, int strict)
+{
+    struct rb_node* node = pRoot->root.rb_node;
+    struct rb_node* result = NULL;
+
+    while (node) {
+        struct rbdict_pair *pThis = node_to_pair(node);
+        int cmp = _rbdict_compare(pRoot, pThis->key, key);
+
+        if (cmp < 0 || (strict && cmp == 0)) {
+            node = node->rb_right;
+        }
+        else {
+            result = node;
+            node = node->rb_left;
+        }
+    }
+    return result;
+}
+/*----------------------------------------------------------------*/
+
+static __inline struct rb_node* _rbdict_lower_bound(const struct rbdict* pRoot, const void* key)
+{
+    return _rbdict_bound(pRoot, key, 0);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * return the value associated with a key or NULL if no matching
+ */
+static void* _rbdict_do_search(const struct rbdict* pRoot, void* key)
+{
+    struct rbdict_pair* data = rbdict_search_aux(pRoot, key);
+
+    if (!data || _ttl_expired(pRoot, data))
+        return NULL;
+
+    _cache_touch(pRoot, data);
+    return VAL_LOAD(data->value);
+}
+/*----------------------------------------------------------------*/
+
+void* rbdict_search(const struct rbdict* pRoot, void* key)
+{
+    uint64_t t0 = _lat_begin();
+    void* result;
+
+    RBDICT_PROBE2(search__entry, _rbdict_key_size(pRoot, key), pRoot->nelem);
+    _conc_rdlock(pRoot);
+    result = _rbdict_do_search(pRoot, key);
+    _conc_unlock(pRoot);
+    RBDICT_PROBE2(search__return, result != NULL, pRoot->nelem);
+    _lat_end(RBDICT_LAT_SEARCH, t0);
+    return result;
+}
+/*----------------------------------------------------------------*/
+
+static size_t _rbdict_do_delete_all(struct rbdict* pRoot, const void* key);
+
+/*
+ * delete the entry with the given key
+ */
+static void _rbdict_do_delete(struct rbdict* pRoot, const void* key)
+{
+    struct rbdict_pair* data;
+
+    if (pRoot->flags & RBDICT_MULTI) {
+        _rbdict_do_delete_all(pRoot, key);
+        return;
+    }
+
+    /* a pair the snapshots have no room to save stays, errno says why */
+    data = rbdict_search_aux(pRoot, key);
+    if (data)
+        _rbdict_remove(pRoot, data, RBDICT_OP_DELETE);
+}
+/*----------------------------------------------------------------*/
+
+void rbdict_delete(struct rbdict* pRoot, const void* key)
+{
+    uint64_t t0 = _lat_begin();
+
+    RBDICT_PROBE2(delete__entry, _rbdict_key_size(pRoot, key), pRoot->nelem);
+    if (_conc_wrlock(pRoot) == 0) {
+        _rbdict_do_delete(pRoot, key);
+        _conc_unlock(pRoot);
+    }
+    RBDICT_PROBE2(delete__return, 0, pRoot->nelem);
+    _lat_end(RBDICT_LAT_DELETE, t0);
+}
+/*----------------------------------------------------------------*/
+
+size_t rbdict_equal_range(const struct rbdict* pRoot, const void* key, rbdict_visit_t f, void* user_data)
+{
+    struct rb_node* node;
+    const struct rbdict* outer;
+    size_t count = 0;
+
+    RBDICT_PROBE2(equal_range__entry, _rbdict_key_size(pRoot, key), pRoot->nelem);
+    _conc_rdlock(pRoot);
+    outer = _conc_visit(pRoot);
+    for (node = _rbdict_lower_bound(pRoot, key); node; node = _rbdict_next(pRoot, node)) {
+        struct rbdict_pair* e = node_to_pair(node);
+
+        if (_rbdict_compare(pRoot, e->key, key) != 0)
+            break;
+        if (_ttl_expired(pRoot, e))
+            continue;
+
+        ++count;
+        if (f && f(e->key, VAL_LOAD(e->value), user_data) != 0)
+            break;
+    }
+    _conc_visit(outer);
+    _conc_unlock(pRoot);
+    RBDICT_PROBE2(equal_range__return, count, pRoot->nelem);
+    return count;
+}
+/*----------------------------------------------------------------*/
+
+size_t rbdict_count(const struct rbdict* pRoot, const void* key)
+{
+    return rbdict_equal_range(pRoot, key, NULL, NULL);
+}
+/*----------------------------------------------------------------*/
+
+static int _rbdict_do_delete_one(struct rbdict* pRoot, const void* key)
+{
+    struct rbdict_pair* data = rbdict_search_aux(pRoot, key);
+
+    /* expired pairs are misses */
+    while (data && _ttl_expired(pRoot, data)) {
+        struct rb_node* next = _rbdict_next(pRoot, &data->m_node);
+
+        data = NULL;
+        if (next && _rbdict_compare(pRoot, node_to_pair(next)->key, key) == 0)
+            data = node_to_pair(next);
+    }
+
+    if (!data) {
+        errno = ENOENT;
+        return -1;
+    }
+    return _rbdict_remove(pRoot, data, RBDICT_OP_DELETE);
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_delete_one(struct rbdict* pRoot, const void* key)
+{
+    int result;
+
+    if ((result = _conc_wrlock(pRoot)) == 0) {
+        result = _rbdict_do_delete_one(pRoot, key);
+        _conc_unlock(pRoot);
+    }
+    return result;
+}
+/*----------------------------------------------------------------*/
+
+static size_t _rbdict_do_delete_all(struct rbdict* pRoot, const void* key)
+{
+    struct rbdict_pair* data = rbdict_search_aux(pRoot, key);
+    size_t count = 0;
+
+    while (data) {
+        struct rb_node* next = _rbdict_next(pRoot, &data->m_node);
+        struct rbdict_pair* following = NULL;
+
+        /* KEY may be the stored key of a pair about to go */
+        if (next && _rbdict_compare(pRoot, node_to_pair(next)->key, data->key) == 0)
+            following = node_to_pair(next);
+
+        /* expired pairs are misses, left to rbdict_expire */
+        if (!_ttl_expired(pRoot, data)) {
+            if (_rbdict_remove(pRoot, data, RBDICT_OP_DELETE) < 0)
+                break;
+            ++count;
+        }
+        data = following;
+    }
+    return count;
+}
+/*----------------------------------------------------------------*/
+
+size_t rbdict_delete_all(struct rbdict* pRoot, const void* key)
+{
+    size_t count = 0;
+
+    if (_conc_wrlock(pRoot) == 0) {
+        count = _rbdict_do_delete_all(pRoot, key);
+        _conc_unlock(pRoot);
+    }
+    return count;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Balanced tree over PAIRS[lo, hi). Nodes on the deepest level are
+ * red when that level is not full, all others black, which keeps the
+ * black height equal on every path
+ */
+static struct rb_node* _bulk_build(struct rbdict_pair** pairs,
+                                   size_t lo,
+                                   size_t hi,
+                                   struct rb_node* parent,
+                                   int depth,
+                                   int red_depth)
+{
+    size_t mid;
+    struct rb_node* node;
+
+    if (lo >= hi)
+        return NULL;
+
+    mid = lo + (hi - lo) / 2;
+    node = &pairs[mid]->m_node;
+    node->rb_parent = parent;
+    node->rb_color = (depth == red_depth) ? RB_RED : RB_BLACK;
+    node->rb_left = _bulk_build(pairs, lo, mid, node, depth + 1, red_depth);
+    node->rb_right = _bulk_build(pairs, mid + 1, hi, node, depth + 1, red_depth);
+    return node;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Fill an empty dict from N pairs in strictly ascending key order in
+ * O(n): the tree is built balanced instead of by N inserts
+ */
+int rbdict_load_sorted(struct rbdict* pRoot, void* keys[], void* values[], size_t n)
+{
+    struct rbdict_pair** pairs;
+    size_t i, made = 0;
+    int height = 0, err = ENOMEM;
+
+    if (pRoot->nelem || pRoot->snapshots) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (i = 1; i < n; ++i) {
+        int cmp = _rbdict_compare(pRoot, keys[i - 1], keys[i]);
+        if (cmp > 0 || (cmp == 0 && !(pRoot->flags & RBDICT_MULTI))) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    if (!n)
+        return 0;
+
+    pairs = (struct rbdict_pair**) malloc(n * sizeof(pairs[0]));
+    if (!pairs) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (made = 0; made < n; ++made) {
+        void* key;
+        void* value = NULL;
+
+        if (_rbdict_clone_key(pRoot, keys[made], &key) < 0)
+            goto err_load;
+        if (values[made] && _rbdict_clone_value(pRoot, values[made], &value) < 0) {
+            _rbdict_destroy_key(pRoot, key);
+            goto err_load;
+        }
+        if ((pairs[made] = make_rbdict_pair(pRoot, key, value)) == NULL) {
+            _rbdict_destroy_key(pRoot, key);
+            _rbdict_destroy_value(pRoot, value);
+            goto err_load;
+        }
+        if ((pRoot->flags & RBDICT_HASH_INDEX) && _hindex_reserve(pRoot) < 0) {
+            destroy_rbdict_pair(pRoot, pairs[made]);
+            goto err_load;
+        }
+        if (pRoot->flags & RBDICT_HASH_INDEX)
+            _hindex_put(pRoot->htab, pRoot->hmask, pRoot->ops.k_hash(key), pairs[made]);
+        ++pRoot->nelem;
+    }
+
+    /*
+     * Everything that can fail is done. A refused pair refuses the
+     * load: the hook is told the pairs it already saw are deleted
+     */
+    for (i = 0; i < n; ++i) {
+        if (_rbdict_notify(pRoot, RBDICT_OP_PUT, pairs[i]) < 0) {
+            err = errno;
+            while (i--)
+                _rbdict_notify(pRoot, RBDICT_OP_DELETE, pairs[i]);
+            goto err_load;
+        }
+    }
+
+    while (((size_t) 1 << height) <= n)
+        ++height;
+    pRoot->root.rb_node = _bulk_build(pairs, 0, n, NULL, 0,
+                                      n == ((size_t) 1 << height) - 1 ? -1 : height - 1);
+    if (_augmented(pRoot))
+        _augment_build(pRoot, pRoot->root.rb_node);
+
+    for (i = 0; i < n; ++i) {
+        struct rbdict_pair* p = pairs[i];
+
+        if (pRoot->ttl_off)
+            PAIR_TTL(pRoot, p)->expire = RBDICT_NO_EXPIRY;
+        if (pRoot->link_off) {
+            PAIR_LINK(pRoot, p)->prev = i ? &pairs[i - 1]->m_node : NULL;
+            PAIR_LINK(pRoot, p)->next = i + 1 < n ? &pairs[i + 1]->m_node : NULL;
+        }
+        if (_cache_enabled(pRoot)) {
+            PAIR_CACHE(pRoot, p)->charge = _cache_charge(pRoot, p);
+            pRoot->cache.bytes += PAIR_CACHE(pRoot, p)->charge;
+        }
+    }
+    if (pRoot->link_off) {
+        pRoot->head = &pairs[0]->m_node;
+        pRoot->tail = &pairs[n - 1]->m_node;
+    }
+    ++pRoot->gen;
+    free(pairs);
+
+    if (_cache_enabled(pRoot))
+        _cache_evict(pRoot, NULL);
+    return 0;
+
+err_load:
+    while (made--) {
+        if (pRoot->flags & RBDICT_HASH_INDEX)
+            _hindex_remove(pRoot, pairs[made]);
+        destroy_rbdict_pair(pRoot, pairs[made]);
+    }
+    pRoot->nelem = 0;
+    free(pairs);
+    errno = err;
+    return -1;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Install the change hook, NULL to remove it
+ */
+void rbdict_set_change_hook(struct rbdict* pRoot, rbdict_change_t f, void* user_data)
+{
+    if (_conc_wrlock(pRoot) < 0)
+        return;
+    pRoot->on_change = f;
+    pRoot->change_user_data = user_data;
+    _conc_unlock(pRoot);
+}
+/*----------------------------------------------------------------*/
+
+rbdict_change_t rbdict_get_change_hook(const struct rbdict* pRoot, void** user_data)
+{
+    if (user_data)
+        *user_data = pRoot->change_user_data;
+    return pRoot->on_change;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Number of elements in a dict
+ */
+size_t rbdict_size(const struct rbdict* pRoot)
+{
+    size_t n;
+
+    _conc_rdlock(pRoot);
+    n = pRoot->nelem;
+    _conc_unlock(pRoot);
+    return n;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_compare_keys(const struct rbdict* pRoot, const void* k1, const void* k2)
+{
+    return _rbdict_compare(pRoot, k1, k2);
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_keys(const struct rbdict* pRoot, void* buf[], size_t bufsize, int flags)
+{
+    unsigned int bufindex = 0;
+    int should_copy = (flags & RBDICT_KEYS_CLONE);
+    struct rb_node* node;
+
+    RBDICT_PROBE2(keys__entry, bufsize, pRoot->nelem);
+    _conc_rdlock(pRoot);
+    if (bufsize < pRoot->nelem) {
+        _conc_unlock(pRoot);
+        RBDICT_PROBE2(keys__return, -1, pRoot->nelem);
+        errno = EINVAL;
+        return -1;
+    }
+
+    node = _rbdict_first(pRoot);
+    for (; node; node = _rbdict_next(pRoot, node)) {
+        struct rbdict_pair* e = node_to_pair(node);
+        void* to_add;
+
+        if (_ttl_expired(pRoot, e))
+            continue;
+
+        if (should_copy)
+            to_add = pRoot->ops.k_clone(e->key);
+        else
+            to_add = e->key;
+
+        buf[bufindex] = to_add;
+
+        ++bufindex;
+    }
+
+    /* slots left over by expired pairs */
+    for (; bufindex < pRoot->nelem; ++bufindex)
+        buf[bufindex] = NULL;
+
+    _conc_unlock(pRoot);
+    RBDICT_PROBE2(keys__return, 0, pRoot->nelem);
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_values(const struct rbdict* pRoot, void* buf[], size_t bufsize, int flags)
+{
+    unsigned int bufindex = 0;
+    int should_copy = (flags & RBDICT_VALUES_CLONE);
+    struct rb_node* node;
+
+    RBDICT_PROBE2(values__entry, bufsize, pRoot->nelem);
+    _conc_rdlock(pRoot);
+    if (bufsize < pRoot->nelem) {
+        _conc_unlock(pRoot);
+        RBDICT_PROBE2(values__return, -1, pRoot->nelem);
+        errno = EINVAL;
+        return -1;
+    }
+
+    node = _rbdict_first(pRoot);
+    for (; node; node = _rbdict_next(pRoot, node)) {
+        struct rbdict_pair* e = node_to_pair(node);
+        void* to_add;
+
+        if (_ttl_expired(pRoot, e))
+            continue;
+
+        if (should_copy)
+            to_add = pRoot->ops.v_clone(e->value);
+        else
+            to_add = VAL_LOAD(e->value);
+
+        buf[bufindex] = to_add;
+
+        ++bufindex;
+    }
+
+    /* slots left over by expired pairs */
+    for (; bufindex < pRoot->nelem; ++bufindex)
+        buf[bufindex] = NULL;
+
+    _conc_unlock(pRoot);
+    RBDICT_PROBE2(values__return, 0, pRoot->nelem);
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Visit every live pair in key order, whatever F returns
+ */
+void rbdict_foreach(const struct rbdict* pRoot, rbdict_visit_t f, void* user_data)
+{
+    struct rb_node *node;
+    const struct rbdict* outer;
+
+    RBDICT_PROBE2(foreach__entry, 0, pRoot->nelem);
+    _conc_rdlock(pRoot);
+    outer = _conc_visit(pRoot);
+    for (node = _rbdict_first(pRoot); node; node = _rbdict_next(pRoot, node)) {
+        struct rbdict_pair* e = node_to_pair(node);
+        if (!_ttl_expired(pRoot, e))
+            f(e->key, VAL_LOAD(e->value), user_data);
+    }
+    _conc_visit(outer);
+    _conc_unlock(pRoot);
+    RBDICT_PROBE2(foreach__return, 0, pRoot->nelem);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Same as rbdict_foreach, largest key first. Stops when F returns
+ * non-zero
+ */
+void rbdict_foreach_reverse(const struct rbdict* pRoot, rbdict_visit_t f, void* user_data)
+{
+    struct rb_node *node;
+    const struct rbdict* outer;
+
+    RBDICT_PROBE2(foreach_reverse__entry, 0, pRoot->nelem);
+    _conc_rdlock(pRoot);
+    outer = _conc_visit(pRoot);
+    for (node = _rbdict_last(pRoot); node; node = _rbdict_prev(pRoot, node)) {
+        struct rbdict_pair* e = node_to_pair(node);
+        if (!_ttl_expired(pRoot, e) && f(e->key, VAL_LOAD(e->value), user_data) != 0)
+            break;
+    }
+    _conc_visit(outer);
+    _conc_unlock(pRoot);
+    RBDICT_PROBE2(foreach_reverse__return, 0, pRoot->nelem);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Smallest / largest live pair. O(1) for threaded dicts
+ */
+static int _rbdict_end(const struct rbdict* pRoot, int last, void** key, void** value)
+{
+    struct rb_node* node = last ? _rbdict_last(pRoot) : _rbdict_first(pRoot);
+
+    while (node && _ttl_expired(pRoot, node_to_pair(node)))
+        node = last ? _rbdict_prev(pRoot, node) : _rbdict_next(pRoot, node);
+
+    if (!node) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if (key)
+        *key = node_to_pair(node)->key;
+    if (value)
+        *value = node_to_pair(node)->value;
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_min(const struct rbdict* pRoot, void** key, void** value)
+{
+    return _rbdict_end(pRoot, 0, key, value);
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_max(const struct rbdict* pRoot, void** key, void** value)
+{
+    return _rbdict_end(pRoot, 1, key, value);
+}
+/*----------------------------------------------------------------*/
+
+static void _agg_add(struct rbdict_aggregate* agg, const struct pair_agg* a)
+{
+    agg->sum = (int64_t)((uint64_t) agg->sum + a->sum);
+    if (a->min < agg->min)
+        agg->min = a->min;
+    if (a->max > agg->max)
+        agg->max = a->max;
+    agg->count += a->count;
+}
+/*----------------------------------------------------------------*/
+
+static void _agg_add_one(struct rbdict_aggregate* agg, const struct rbdict_pair* e)
+{
+    struct pair_agg a;
+
+    a.sum = (uint64_t)(intptr_t) e->value;
+    a.min = a.max = (int64_t)(intptr_t) e->value;
+    a.count = 1;
+    _agg_add(agg, &a);
+}
+/*----------------------------------------------------------------*/
+
+static __inline void _agg_add_subtree(const struct rbdict* pRoot,
+                                      struct rbdict_aggregate* agg,
+                                      struct rb_node* node)
+{
+    if (node)
+        _agg_add(agg, PAIR_AGG(pRoot, node_to_pair(node)));
+}
+/*----------------------------------------------------------------*/
+
+static int _agg_start(const struct rbdict* pRoot, struct rbdict_aggregate* agg)
+{
+    if (!pRoot->agg_off) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    agg->sum = 0;
+    agg->min = INT64_MAX;
+    agg->max = INT64_MIN;
+    agg->count = 0;
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_aggregate(const struct rbdict* pRoot, struct rbdict_aggregate* agg)
+{
+    if (_agg_start(pRoot, agg) < 0)
+        return -1;
+    _agg_add_subtree(pRoot, agg, pRoot->root.rb_node);
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Descend until LO <= key < HI at the split node. Below it, the path
+ * towards LO adds each node >= LO with its right subtree, the path
+ * towards HI each node < HI with its left subtree: O(log n) subtrees
+ */
+int rbdict_range_aggregate(const struct rbdict* pRoot,
+                           const void* lo,
+                           const void* hi,
+                           struct rbdict_aggregate* agg)
+{
+    struct rb_node* node = pRoot->root.rb_node;
+    struct rb_node* n;
+
+    RBDICT_PROBE2(range__entry, _rbdict_key_size(pRoot, lo), pRoot->nelem);
+    if (_agg_start(pRoot, agg) < 0) {
+        RBDICT_PROBE2(range__return, -1, pRoot->nelem);
+        return -1;
+    }
+
+    while (node) {
+        struct rbdict_pair* e = node_to_pair(node);
+
+        if (_rbdict_compare(pRoot, e->key, lo) < 0) {
+            node = node->rb_right;
+        }
+        else if (_rbdict_compare(pRoot, e->key, hi) >= 0) {
+            node = node->rb_left;
+        }
+        else {
+            _agg_add_one(agg, e);
+
+            for (n = node->rb_left; n; ) {
+                if (_rbdict_compare(pRoot, node_to_pair(n)->key, lo) >= 0) {
+                    _agg_add_one(agg, node_to_pair(n));
+                    _agg_add_subtree(pRoot, agg, n->rb_right);
+                    n = n->rb_left;
+                }
+                else {
+                    n = n->rb_right;
+                }
+            }
+
+            for (n = node->rb_right; n; ) {
+                if (_rbdict_compare(pRoot, node_to_pair(n)->key, hi) < 0) {
+                    _agg_add_one(agg, node_to_pair(n));
+                    _agg_add_subtree(pRoot, agg, n->rb_left);
+                    n = n->rb_right;
+                }
+                else {
+                    n = n->rb_left;
+                }
+            }
+            break;
+        }
+    }
+    RBDICT_PROBE2(range__return, agg->count, pRoot->nelem);
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+int64_t rbdict_range_sum(const struct rbdict* pRoot, const void* lo, const void* hi)
+{
+    struct rbdict_aggregate agg;
+
+    if (rbdict_range_aggregate(pRoot, lo, hi, &agg) < 0)
+        return 0;
+    return agg.sum;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_range_min(const struct rbdict* pRoot, const void* lo, const void* hi, int64_t* min)
+{
+    struct rbdict_aggregate agg;
+
+    if (rbdict_range_aggregate(pRoot, lo, hi, &agg) < 0)
+        return -1;
+    if (!agg.count) {
+        errno = ENOENT;
+        return -1;
+    }
+    *min = agg.min;
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_range_max(const struct rbdict* pRoot, const void* lo, const void* hi, int64_t* max)
+{
+    struct rbdict_aggregate agg;
+
+    if (rbdict_range_aggregate(pRoot, lo, hi, &agg) < 0)
+        return -1;
+    if (!agg.count) {
+        errno = ENOENT;
+        return -1;
+    }
+    *max = agg.max;
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Interval overlap search. A subtree whose max_hi is below LO holds
+ * no overlap, and once a key starts past HI so does everything to its
+ * right. Returns non-zero when F stopped the walk.
+ */
+static int _overlap_walk(const struct rbdict* pRoot,
+                         struct rb_node* node,
+                         int64_t lo,
+                         int64_t hi,
+                         rbdict_visit_t f,
+                         void* user_data,
+                         size_t* count)
+{
+    while (node && PAIR_IVAL(pRoot, node_to_pair(node))->max_hi >= lo) {
+        struct rbdict_pair* e = node_to_pair(node);
+        const struct rbdict_interval* iv = (const struct rbdict_interval*) e->key;
+
+        if (_overlap_walk(pRoot, node->rb_left, lo, hi, f, user_data, count))
+            return 1;
+        if (iv->lo > hi)
+            break;
+        if (iv->hi >= lo && !_ttl_expired(pRoot, e)) {
+            ++*count;
+            if (f && f(e->key, e->value, user_data) != 0)
+                return 1;
+        }
+        node = node->rb_right;
+    }
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+size_t rbdict_foreach_overlap(const struct rbdict* pRoot,
+                              int64_t lo,
+                              int64_t hi,
+                              rbdict_visit_t f,
+                              void* user_data)
+{
+    size_t count = 0;
+
+    if (!pRoot->ival_off) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    _overlap_walk(pRoot, pRoot->root.rb_node, lo, hi, f, user_data, &count);
+    return count;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Parallel traversal. The top levels of the tree are cut into tasks:
+ * each node above depth PAR_DEPTH is a task of its own and each node
+ * at that depth is a task for its whole subtree. Workers pull tasks
+ * from a shared index until none are left, so a thread that drew
+ * small subtrees takes over more of them.
+ */
+struct par_task {
+    struct rb_node* node;
+    int subtree;
+};
+
+struct par_job {
+    struct rbdict* dict;
+    struct par_task* tasks;
+    size_t ntasks;
+    size_t next;
+    rbdict_visit_t visit;
+    rbdict_map_t map;
+    void** user_data;
+};
+
+struct par_worker {
+    struct par_job* job;
+    void* user_data;
+    ptrdiff_t mem_delta;
+};
+
+static size_t _par_cut(struct rb_node* node, int depth, struct par_task* tasks, size_t n)
+{
+    if (!node)
+        return n;
+
+    if (depth == 0 || (!node->rb_left && !node->rb_right)) {
+        tasks[n].node = node;
+        tasks[n].subtree = 1;
+        return n + 1;
+    }
+
+    n = _par_cut(node->rb_left, depth - 1, tasks, n);
+    tasks[n].node = node;
+    tasks[n].subtree = 0;
+    ++n;
+    return _par_cut(node->rb_right, depth - 1, tasks, n);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Built-in values returned by a map are the caller's malloc copies:
+ * swap them in directly and keep the mem_used change per worker
+ */
+static void _par_map_value(struct par_worker* w, struct rbdict_pair* e, void* value)
+{
+    struct rbdict* pRoot = w->job->dict;
+    int is_str = pRoot->flags & RBDICT_STR_VAL;
+
+    if (!_own_value(pRoot)) {
+        pRoot->ops.v_destroy(e->value);
+    }
+    else {
+        size_t size = value ? _builtin_size(value, is_str, !is_str) : 0;
+
+        w->mem_delta += size;
+        if (e->value)
+            w->mem_delta -= PAIR_MEM(pRoot, e)->value_size;
+        free(e->value);
+        PAIR_MEM(pRoot, e)->value_size = size;
+    }
+    e->value = value;
+}
+/*----------------------------------------------------------------*/
+
+static void _par_visit(struct par_worker* w, struct rb_node* node, int subtree)
+{
+    struct par_job* job = w->job;
+    struct rbdict* pRoot = job->dict;
+
+    while (node) {
+        struct rbdict_pair* e = node_to_pair(node);
+
+        if (subtree)
+            _par_visit(w, node->rb_left, 1);
+
+        if (!_ttl_expired(pRoot, e)) {
+            if (job->map) {
+                void* value = job->map(e->key, e->value, w->user_data);
+                if (value != e->value)
+                    _par_map_value(w, e, value);
+            }
+            else {
+                job->visit(e->key, e->value, w->user_data);
+            }
+        }
+
+        node = subtree ? node->rb_right : NULL;
+    }
+}
+/*----------------------------------------------------------------*/
+
+static size_t _par_take(struct par_job* job)
+{
+#ifdef _WIN32
+    return job->next++;
+#else
+    return __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+#endif
+}
+/*----------------------------------------------------------------*/
+
+static void* _par_worker(void* arg)
+{
+    struct par_worker* w = (struct par_worker*) arg;
+    struct par_job* job = w->job;
+    size_t i;
+
+    while ((i = _par_take(job)) < job->ntasks)
+        _par_visit(w, job->tasks[i].node, job->tasks[i].subtree);
+
+    return NULL;
+}
+/*----------------------------------------------------------------*/
+
+#define PAR_TASKS_PER_THREAD 8
+#define PAR_MAX_DEPTH 16
+
+static int _rbdict_parallel(struct par_job* job, unsigned nthreads)
+{
+    struct par_worker* workers;
+    int depth = 0;
+    unsigned i;
+
+#ifdef _WIN32
+    nthreads = 1;
+#endif
+    if (nthreads == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (depth < PAR_MAX_DEPTH && ((size_t) 1 << depth) < (size_t) nthreads * PAR_TASKS_PER_THREAD)
+        ++depth;
+    if (nthreads == 1)
+        depth = 0;
+
+    job->tasks = (struct par_task*) malloc((((size_t) 2 << depth) - 1) * sizeof(struct par_task));
+    workers = (struct par_worker*) malloc(nthreads * sizeof(struct par_worker));
+    if (!job->tasks || !workers) {
+        free(job->tasks);
+        free(workers);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    job->ntasks = _par_cut(job->dict->root.rb_node, depth, job->tasks, 0);
+    job->next = 0;
+
+    for (i = 0; i < nthreads; ++i) {
+        workers[i].job = job;
+        workers[i].user_data = job->user_data ? job->user_data[i] : NULL;
+        workers[i].mem_delta = 0;
+    }
+
+#ifdef _WIN32
+    _par_worker(&workers[0]);
+#else
+    {
+        pthread_t* tids = (pthread_t*) malloc(nthreads * sizeof(pthread_t));
+        unsigned started = 0;
+
+        /* threads that fail to start just leave more tasks to the others */
+        if (tids) {
+            for (i = 1; i < nthreads; ++i) {
+                if (pthread_create(&tids[started], NULL, _par_worker, &workers[i]) == 0)
+                    ++started;
+            }
+        }
+
+        _par_worker(&workers[0]);
+
+        for (i = 0; i < started; ++i)
+            pthread_join(tids[i], NULL);
+        free(tids);
+    }
+#endif
+
+    for (i = 0; i < nthreads; ++i)
+        job->dict->mem_used += workers[i].mem_delta;
+
+    free(workers);
+    free(job->tasks);
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_parallel_foreach(const struct rbdict* pRoot,
+                            unsigned nthreads,
+                            rbdict_visit_t f,
+                            void* user_data[])
+{
+    struct par_job job;
+
+    memset(&job, 0, sizeof(job));
+    job.dict = (struct rbdict*) pRoot;
+    job.visit = f;
+    job.user_data = user_data;
+    return _rbdict_parallel(&job, nthreads);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Replace each value by F's result in parallel. Snapshots would need
+ * every old value saved under a lock and the change hook every new
+ * one reported before it is set, so both are refused, as are
+ * built-in values kept by a custom allocator (F returns malloc
+ * copies). A bounded cache is recharged afterwards in one serial pass.
+ */
+static int _rbdict_do_parallel_map_values(struct rbdict* pRoot,
+                                          unsigned nthreads,
+                                          rbdict_map_t f,
+                                          void* user_data[])
+{
+    struct par_job job;
+    struct rb_node* node;
+
+    if (pRoot->snapshots || pRoot->on_change) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if (_own_value(pRoot) && _custom_alloc(pRoot)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.dict = pRoot;
+    job.map = f;
+    job.user_data = user_data;
+    if (_rbdict_parallel(&job, nthreads) < 0)
+        return -1;
+
+    if (pRoot->agg_off)
+        _augment_build(pRoot, pRoot->root.rb_node);
+
+    if (_cache_enabled(pRoot)) {
+        for (node = _rbdict_first(pRoot); node; node = _rbdict_next(pRoot, node))
+            _cache_recharge(pRoot, node_to_pair(node));
+        _cache_evict(pRoot, NULL);
+    }
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_parallel_map_values(struct rbdict* pRoot,
+                               unsigned nthreads,
+                               rbdict_map_t f,
+                               void* user_data[])
+{
+    int result;
+
+    if ((result = _conc_wrlock(pRoot)) == 0) {
+        result = _rbdict_do_parallel_map_values(pRoot, nthreads, f, user_data);
+        _conc_unlock(pRoot);
+    }
+    return result;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Prefix scan of a string keyed dict. Seek to the first key not less
+ * than PREFIX and walk in order while keys still start with it.
+ * The prefix length is computed once; each step is a bounded compare
+ * of at most that many bytes. Stops after LIMIT matches (0 means no
+ * limit) or when the visitor returns non-zero. Returns the number of
+ * pairs visited.
+ */
+size_t rbdict_foreach_prefix(const struct rbdict* pRoot,
+                             const char* prefix,
+                             size_t limit,
+                             rbdict_visit_t f,
+                             void* user_data)
+{
+    struct rb_node* node;
+    const struct rbdict* outer;
+    size_t plen;
+    size_t count = 0;
+
+    if (!(pRoot->flags & RBDICT_STR_KEY) || !prefix) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    plen = strlen(prefix);
+    RBDICT_PROBE2(prefix__entry, plen + 1, pRoot->nelem);
+
+    _conc_rdlock(pRoot);
+    outer = _conc_visit(pRoot);
+    for (node = _rbdict_lower_bound(pRoot, prefix); node; node = _rbdict_next(pRoot, node)) {
+        struct rbdict_pair* e = node_to_pair(node);
+
+        if (strncmp((const char*) e->key, prefix, plen) != 0)
+            break;
+        if (_ttl_expired(pRoot, e))
+            continue;
+
+        ++count;
+
+        if (f && f(e->key, VAL_LOAD(e->value), user_data) != 0)
+            break;
+
+        if (count == limit)
+            break;
+    }
+    _conc_visit(outer);
+    _conc_unlock(pRoot);
+    RBDICT_PROBE2(prefix__return, count, pRoot->nelem);
+
+    return count;
+}
+/*----------------------------------------------------------------*/
+
+size_t rbdict_count_prefix(const struct rbdict* pRoot, const char* prefix, size_t limit)
+{
+    return rbdict_foreach_prefix(pRoot, prefix, limit, NULL, NULL);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Take an O(1) snapshot of the current contents
+ */
+static struct rbdict_snapshot* _rbdict_do_snapshot(struct rbdict* pRoot)
+{
+    struct rbdict_snapshot* snap;
+
+    /* the undo log has one entry per key */
+    if (pRoot->flags & RBDICT_MULTI) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    snap = (struct rbdict_snapshot*) malloc(sizeof(*snap));
+    if (!snap) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (_conc_wrlock(pRoot) < 0) {
+        free(snap);
+        return NULL;
+    }
+    snap->dict = pRoot;
+    snap->delta = RB_ROOT;
+    snap->nelem = pRoot->nelem;
+    snap->next = pRoot->snapshots;
+    pRoot->snapshots = snap;
+    _conc_unlock(pRoot);
+
+    return snap;
+}
+/*----------------------------------------------------------------*/
+
+struct rbdict_snapshot* rbdict_snapshot(struct rbdict* pRoot)
+{
+    struct rbdict_snapshot* snap;
+
+    RBDICT_PROBE2(snapshot__entry, 0, pRoot->nelem);
+    snap = _rbdict_do_snapshot(pRoot);
+    RBDICT_PROBE2(snapshot__return, snap != NULL, pRoot->nelem);
+    return snap;
+}
+/*----------------------------------------------------------------*/
+
+void rbdict_snapshot_release(struct rbdict_snapshot* snap)
+{
+    struct rbdict* pRoot = snap->dict;
+
+    if (pRoot) {
+        struct rbdict_snapshot** link = &pRoot->snapshots;
+        /* a foreach visitor's shared lock keeps the writers out too */
+        int locked = _conc_wrlock(pRoot) == 0;
+
+        while (*link != snap)
+            link = &(*link)->next;
+        *link = snap->next;
+
+        _snap_free_delta(pRoot, snap->delta.rb_node);
+        if (locked)
+            _conc_unlock(pRoot);
+    }
+    free(snap);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * The dict goes away first: drop the deltas, the handles stay valid
+ * for rbdict_snapshot_release only
+ */
+static void _rbdict_detach_snapshots(struct rbdict* pRoot)
+{
+    struct rbdict_snapshot* snap = pRoot->snapshots;
+
+    while (snap) {
+        struct rbdict_snapshot* next = snap->next;
+        _snap_free_delta(pRoot, snap->delta.rb_node);
+        snap->delta = RB_ROOT;
+        snap->dict = NULL;
+        snap->nelem = 0;
+        snap = next;
+    }
+    pRoot->snapshots = NULL;
+}
+/*----------------------------------------------------------------*/
+
+size_t rbdict_snapshot_size(const struct rbdict_snapshot* snap)
+{
+    return snap->nelem;
+}
+/*----------------------------------------------------------------*/
+
+void* rbdict_snapshot_search(const struct rbdict_snapshot* snap, const void* key)
+{
+    struct rb_node** link;
+    struct rb_node* parent;
+    struct snap_entry* e;
+    struct rbdict_pair* data;
+
+    void* result;
+
+    if (!snap->dict)
+        return NULL;
+
+    _conc_rdlock(snap->dict);
+    if ((e = _snap_find(snap->dict, snap, key, &parent, &link)) != NULL) {
+        result = e->present ? e->value : NULL;
+    }
+    else {
+        data = rbdict_search_aux(snap->dict, key);
+        result = data ? VAL_LOAD(data->value) : NULL;
+    }
+    _conc_unlock(snap->dict);
+    return result;
+}
+/*----------------------------------------------------------------*/
+
+static struct rb_node* _snap_after(const struct rbdict* pRoot,
+                                   const struct rbdict_snapshot* snap,
+                                   const void* key);
+
+/*
+ * Merge walk of the live tree and the delta. Live keys found in the
+ * delta were changed after the snapshot, the delta has their old state.
+ * Visits at most LIMIT pairs (0 = all) of the snapshot, from the first
+ * one or after KEY, under the dict's shared lock
+ */
+static size_t _snap_foreach(const struct rbdict_snapshot* snap,
+                            int after,
+                            const void* key,
+                            size_t limit,
+                            rbdict_visit_t f,
+                            void* user_data)
+{
+    const struct rbdict* pRoot = snap->dict;
+    const struct rbdict* outer;
+    struct rb_node* live;
+    struct rb_node* saved;
+    size_t count = 0;
+
+    if (!pRoot)
+        return 0;
+
+    RBDICT_PROBE2(snapshot_foreach__entry, limit, pRoot->nelem);
+    _conc_rdlock(pRoot);
+    outer = _conc_visit(pRoot);
+    if (after) {
+        live = _rbdict_bound(pRoot, key, 1);
+        saved = _snap_after(pRoot, snap, key);
+    }
+    else {
+        live = _rbdict_first(pRoot);
+        saved = rb_first((struct rb_root*) &snap->delta);
+    }
+
+    while ((live || saved) && (!limit || count < limit)) {
+        struct rbdict_pair* p = live ? node_to_pair(live) : NULL;
+        struct snap_entry* e = saved ? node_to_snap_entry(saved) : NULL;
+        int cmp = !e ? -1 : !p ? 1 : _rbdict_compare(pRoot, p->key, e->key);
+
+        if (cmp < 0) {
+            f(p->key, VAL_LOAD(p->value), user_data);
+            ++count;
+            live = _rbdict_next(pRoot, live);
+            continue;
+        }
+
+        if (e->present) {
+            f(e->key, e->value, user_data);
+            ++count;
+        }
+        saved = rb_next(saved);
+        if (cmp == 0)
+            live = _rbdict_next(pRoot, live);
+    }
+    _conc_visit(outer);
+    _conc_unlock(pRoot);
+    RBDICT_PROBE2(snapshot_foreach__return, count, pRoot->nelem);
+    return count;
+}
+/*----------------------------------------------------------------*/
+
+void rbdict_snapshot_foreach(const struct rbdict_snapshot* snap, rbdict_visit_t f, void* user_data)
+{
+    _snap_foreach(snap, 0, NULL, 0, f, user_data);
+}
+/*----------------------------------------------------------------*/
+
+size_t rbdict_snapshot_foreach_n(const struct rbdict_snapshot* snap,
+                                 size_t limit,
+                                 rbdict_visit_t f,
+                                 void* user_data)
+{
+    return _snap_foreach(snap, 0, NULL, limit, f, user_data);
+}
+/*----------------------------------------------------------------*/
+
+size_t rbdict_snapshot_foreach_after(const struct rbdict_snapshot* snap,
+                                     const void* key,
+                                     size_t limit,
+                                     rbdict_visit_t f,
+                                     void* user_data)
+{
+    return _snap_foreach(snap, 1, key, limit, f, user_data);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Diffs. Values of the built in types are compared by content, others
+ * by pointer
+ */
+#define KEY_TYPES (NUMERIC_KEY | RBDICT_STR_KEY | RBDICT_BLOB_KEY | RBDICT_INTERVAL_KEY)
+#define VAL_TYPES (RBDICT_INT_VAL | RBDICT_STR_VAL | RBDICT_BLOB_VAL)
+
+static int _rbdict_value_equal(const struct rbdict* pRoot, const void* v1, const void* v2)
+{
+    if (v1 == v2)
+        return 1;
+    if ((pRoot->flags & RBDICT_INT_VAL) || !v1 || !v2)
+        return 0;
+    if (pRoot->flags & RBDICT_STR_VAL)
+        return strcmp((const char*) v1, (const char*) v2) == 0;
+    if (pRoot->flags & RBDICT_BLOB_VAL)
+        return compare_blob(v1, v2) == 0;
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Report KEY to F unless its two states are the same. HAD tells if it
+ * was there before (with OLD_VALUE), NOW is its pair now
+ */
+static int _rbdict_diff_key(const struct rbdict* pRoot,
+                            const void* key,
+                            int had,
+                            const void* old_value,
+                            const struct rbdict_pair* now,
+                            rbdict_diff_t f,
+                            void* user_data)
+{
+    if (!had)
+        return now ? f(RBDICT_DIFF_ADDED, key, NULL, now->value, user_data) : 0;
+    if (!now)
+        return f(RBDICT_DIFF_REMOVED, key, old_value, NULL, user_data);
+    if (_rbdict_value_equal(pRoot, old_value, now->value))
+        return 0;
+    return f(RBDICT_DIFF_CHANGED, key, old_value, now->value, user_data);
+}
+/*----------------------------------------------------------------*/
+
+static __inline struct rb_node* _rbdict_next_live(const struct rbdict* pRoot, struct rb_node* node)
+{
+    while (node && _ttl_expired(pRoot, node_to_pair(node)))
+        node = _rbdict_next(pRoot, node);
+    return node;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Merge walk of both dicts in key order, O(n + m)
+ */
+static int _rbdict_do_diff(const struct rbdict* a, const struct rbdict* b, rbdict_diff_t f, void* user_data)
+{
+    struct rb_node* na;
+    struct rb_node* nb;
+    int result;
 
-    if (!s) {
+    if ((a->flags & KEY_TYPES) != (b->flags & KEY_TYPES) ||
+        (a->flags & VAL_TYPES) != (b->flags & VAL_TYPES) ||
+        (!(a->flags & KEY_TYPES) && a->ops.k_compare != b->ops.k_compare) ||
+        ((a->flags | b->flags) & RBDICT_MULTI)) {
         errno = EINVAL;
-        return NULL;
+        return -1;
     }
+    if (a == b)
+        return 0;
 
-    len = strlen(s) + 1;
+    na = _rbdict_next_live(a, _rbdict_first(a));
+    nb = _rbdict_next_live(b, _rbdict_first(b));
+    while (na || nb) {
+        struct rbdict_pair* pa = na ? node_to_pair(na) : NULL;
+        struct rbdict_pair* pb = nb ? node_to_pair(nb) : NULL;
+        int cmp = !pb ? -1 : !pa ? 1 : _rbdict_compare(a, pa->key, pb->key);
 
-    res = (char*) malloc(len);
-    if (!res) {
-        errno = ENOMEM;
-        return NULL;
-    }
+        if (cmp < 0)
+            result = _rbdict_diff_key(a, pa->key, 1, pa->value, NULL, f, user_data);
+        else
+            result = _rbdict_diff_key(a, pb->key, cmp == 0, cmp == 0 ? pa->value : NULL, pb, f, user_data);
+        if (result)
+            return result;
 
-    memcpy(res, s, len);
-    return res;
+        if (cmp <= 0)
+            na = _rbdict_next_live(a, _rbdict_next(a, na));
+        if (cmp >= 0)
+            nb = _rbdict_next_live(b, _rbdict_next(b, nb));
+    }
+    return 0;
 }
-/*------------------------------------------------------------*/
-
-struct rbdict {
-    struct rb_root root;
-    struct rbdict_operations ops;
-    size_t nelem;
-    int flags;
-};
 /*----------------------------------------------------------------*/
 
-struct rbdict_pair {
-    struct rb_node m_node;
-    void* key;
-    void* value;
-};
-
-inline struct rbdict_pair* node_to_pair(struct rb_node* node)
+int rbdict_diff(const struct rbdict* a, const struct rbdict* b, rbdict_diff_t f, void* user_data)
 {
-    return rb_entry(node, struct rbdict_pair, m_node);
+    int result;
+
+    RBDICT_PROBE2(diff__entry, a->nelem, b->nelem);
+    result = _rbdict_do_diff(a, b, f, user_data);
+    RBDICT_PROBE2(diff__return, result, b->nelem);
+    return result;
 }
 /*----------------------------------------------------------------*/
 
-static struct rbdict_pair* make_rbdict_pair(void* k, void* v)
+/*
+ * Only the keys in the delta can differ: O(k log n) for k keys
+ * written since the snapshot
+ */
+int rbdict_snapshot_diff(const struct rbdict_snapshot* snap, rbdict_diff_t f, void* user_data)
 {
-    struct rbdict_pair* n = (struct rbdict_pair*) malloc(sizeof(*n));
+    const struct rbdict* pRoot = snap->dict;
+    const struct rbdict* outer;
+    struct rb_node* saved;
+    int result = 0;
 
-    if (!n) {
-        errno = ENOMEM;
-        return NULL;
+    if (!pRoot || (pRoot->flags & RBDICT_MULTI)) {
+        errno = EINVAL;
+        return -1;
     }
 
-    memset(&n->m_node, 0, sizeof(n->m_node));
-    n->key = k;
-    n->value = v;
+    RBDICT_PROBE2(snapshot_diff__entry, 0, pRoot->nelem);
+    _conc_rdlock(pRoot);
+    outer = _conc_visit(pRoot);
+    for (saved = rb_first((struct rb_root*) &snap->delta); saved; saved = rb_next(saved)) {
+        struct snap_entry* e = node_to_snap_entry(saved);
+        struct rbdict_pair* now = rbdict_search_aux(pRoot, e->key);
 
-    return n;
+        if (now && _ttl_expired(pRoot, now))
+            now = NULL;
+        if ((result = _rbdict_diff_key(pRoot, e->key, e->present, e->value, now, f, user_data)) != 0)
+            break;
+    }
+    _conc_visit(outer);
+    _conc_unlock(pRoot);
+    RBDICT_PROBE2(snapshot_diff__return, result, pRoot->nelem);
+    return result;
 }
 /*----------------------------------------------------------------*/
 
-static void destroy_rbdict_pair(struct rbdict* pDict, struct rbdict_pair* p)
+/*
+ * Incremental destroy and clone. A job does at most BUDGET units of
+ * work per rbdict_step call.
+ *
+ * A destroy job takes the tree away from the dict at once and frees
+ * it in the post order of rbdict_destroy, following parent links
+ * instead of recursing, so a step can stop anywhere.
+ *
+ * A clone job reads the source through a private snapshot, so the
+ * source can change between steps and the clone still has its
+ * contents at the start. Each step resumes the merge walk of
+ * rbdict_snapshot_foreach after the last key it copied, which the
+ * job keeps a copy of (a bounded clone may have evicted it).
+ */
+enum { JOB_DESTROY = 1, JOB_CLONE };
+
+struct rbdict_job {
+    int kind;
+    int done;
+    int error;
+    struct rbdict* dict;            /* going away, or being built */
+    struct rb_node* node;           /* destroy: what is left of the tree */
+    struct rbdict_snapshot* snap;   /* clone: the source as it was */
+    void* resume;                   /* clone: last key copied */
+    int has_resume;
+};
+/*----------------------------------------------------------------*/
+
+/* first node of N's subtree in post order */
+static struct rb_node* _postorder_first(struct rb_node* n)
 {
-    if (p) {
-        pDict->ops.k_destroy(p->key);
-        pDict->ops.v_destroy(p->value);
-        free(p);
+    for (;;) {
+        if (n->rb_left)
+            n = n->rb_left;
+        else if (n->rb_right)
+            n = n->rb_right;
+        else
+            return n;
     }
 }
 /*----------------------------------------------------------------*/
 
-static __inline int compare_int(const void* n1, const void* n2)
+static int _job_destroy_step(struct rbdict_job* job, size_t budget)
 {
-    return (int64_t)n1 - (int64_t)n2;
+    struct rb_node* n = job->node;
+
+    while (n && budget--) {
+        struct rb_node* parent = n->rb_parent;
+        struct rb_node* next = parent;
+
+        if (parent && parent->rb_left == n && parent->rb_right)
+            next = _postorder_first(parent->rb_right);
+        destroy_rbdict_pair(job->dict, node_to_pair(n));
+        n = next;
+    }
+
+    job->node = n;
+    return n != NULL;
 }
 /*----------------------------------------------------------------*/
 
-static __inline void destroy_int(void* n)
+struct rbdict_job* rbdict_destroy_async(struct rbdict* pRoot)
 {
-    return;
+    struct rbdict_job* job = (struct rbdict_job*) calloc(1, sizeof(*job));
+
+    if (!job) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    job->kind = JOB_DESTROY;
+    job->dict = pRoot;
+    job->node = pRoot->root.rb_node ? _postorder_first(pRoot->root.rb_node) : NULL;
+    pRoot->root = RB_ROOT;
+    _rbdict_detach_snapshots(pRoot);
+    return job;
 }
 /*----------------------------------------------------------------*/
 
-static __inline void* clone_int(const void* n)
+struct rbdict_job* rbdict_clone_incremental(struct rbdict* pSrc)
 {
-    return (void*)n;
+    struct rbdict_job* job = (struct rbdict_job*) calloc(1, sizeof(*job));
+
+    if (!job) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    job->kind = JOB_CLONE;
+    if ((job->snap = rbdict_snapshot(pSrc)) == NULL) {
+        free(job);
+        return NULL;
+    }
+    if ((job->dict = _rbdict_clone_empty(pSrc)) == NULL) {
+        rbdict_snapshot_release(job->snap);
+        free(job);
+        return NULL;
+    }
+    return job;
 }
 /*----------------------------------------------------------------*/
 
-/*
- * create a new empty dictionary
- */
-struct rbdict* rbdict_create_ex(const struct rbdict_operations* ops, int flags)
+/* first delta entry after KEY */
+static struct rb_node* _snap_after(const struct rbdict* pRoot,
+                                   const struct rbdict_snapshot* snap,
+                                   const void* key)
 {
-    if (ops) {
-        if (!(ops->k_compare && ops->k_destroy && ops->k_clone)) {
-            errno = EINVAL;
-            return NULL;
+    struct rb_node* node = snap->delta.rb_node;
+    struct rb_node* result = NULL;
+
+    while (node) {
+        if (_rbdict_compare(pRoot, node_to_snap_entry(node)->key, key) <= 0) {
+            node = node->rb_right;
+        }
+        else {
+            result = node;
+            node = node->rb_left;
         }
     }
+    return result;
+}
+/*----------------------------------------------------------------*/
 
-    struct rbdict* p = (struct rbdict*) malloc(sizeof(struct rbdict));
-    if (!p)
-        return NULL;
-
-    p->root  = RB_ROOT;
-    p->nelem = 0;
-    p->flags = flags;
+static int _job_clone_step(struct rbdict_job* job, size_t budget)
+{
+    const struct rbdict* pSrc = job->snap->dict;
+    struct rbdict* pDest = job->dict;
+    const void* last = NULL;
+    struct rb_node* live;
+    struct rb_node* saved;
+    void* resume;
 
-    /*
-     *  Init key operations
-     */
-    if (p->flags & RBDICT_INT_KEY) {
-        p->ops.k_compare = &compare_int;
-        p->ops.k_destroy = &destroy_int;
-        p->ops.k_clone   = &clone_int;
-    }
-    else if (p->flags & RBDICT_STR_KEY) {
-        p->ops.k_compare = (rbdict_compare_t) &strcmp;
-        p->ops.k_destroy = (rbdict_destroy_t) &free;
-        p->ops.k_clone   = (rbdict_clone_t) &mystrdup;
-    }
-    else {
-        if (!ops)
-            goto err_no_ops;
-        p->ops.k_compare = ops->k_compare;
-        p->ops.k_destroy = ops->k_destroy;
-        p->ops.k_clone = ops->k_clone;
+    /* the source was destroyed */
+    if (!pSrc) {
+        errno = EINVAL;
+        return -1;
     }
 
-    /*
-     *  Init value operations
-     */
-    if (p->flags & RBDICT_INT_VAL) {
-        p->ops.v_destroy = &destroy_int;
-        p->ops.v_clone   = &clone_int;
-    }
-    else if (p->flags & RBDICT_STR_VAL) {
-        p->ops.v_destroy = (rbdict_destroy_t) &free;
-        p->ops.v_clone = (rbdict_clone_t) &mystrdup;
+    if (job->has_resume) {
+        live = _rbdict_bound(pSrc, job->resume, 1);
+        saved = _snap_after(pSrc, job->snap, job->resume);
     }
     else {
-        if (!ops)
-            goto err_no_ops;
-        p->ops.v_destroy = ops->v_destroy;
-        p->ops.v_clone = ops->v_clone;
+        live = _rbdict_first(pSrc);
+        saved = rb_first(&job->snap->delta);
     }
 
-    if (!p->ops.v_destroy) {
-        p->ops.v_destroy = p->ops.k_destroy;
-    }
-    if (!p->ops.v_clone) {
-        p->ops.v_clone = p->ops.k_clone;
+    while ((live || saved) && budget--) {
+        struct rbdict_pair* p = live ? node_to_pair(live) : NULL;
+        struct snap_entry* e = saved ? node_to_snap_entry(saved) : NULL;
+        int cmp = !e ? -1 : !p ? 1 : _rbdict_compare(pSrc, p->key, e->key);
+
+        if (cmp < 0) {
+            if (_rbdict_clone_pair(pDest, p->key, p->value,
+                                   pSrc->ttl_off ? PAIR_TTL(pSrc, p)->expire : RBDICT_NO_EXPIRY) < 0)
+                return -1;
+            last = p->key;
+            live = _rbdict_next(pSrc, live);
+            continue;
+        }
+
+        if (e->present && _rbdict_clone_pair(pDest, e->key, e->value, e->expire) < 0)
+            return -1;
+        last = e->key;
+        saved = rb_next(saved);
+        if (cmp == 0)
+            live = _rbdict_next(pSrc, live);
     }
-    return p;
 
-err_no_ops:
-    free(p);
-    errno = EINVAL;
-    return NULL;
+    if (!live && !saved)
+        return 0;
+
+    if (last) {
+        if (_rbdict_copy_stored_key(pDest, last, &resume) < 0)
+            return -1;
+        if (job->has_resume)
+            _rbdict_destroy_key(pDest, job->resume);
+        job->resume = resume;
+        job->has_resume = 1;
+    }
+    return 1;
 }
 /*----------------------------------------------------------------*/
 
-static int _rbdict_clone_kv(const void* v,
-                            void** nv,
-                            rbdict_clone_t klone,
-                            int is_int)
+/*
+ * Returns 1 while work is left, 0 when the job is done and -1 when a
+ * clone failed (the error sticks)
+ */
+int rbdict_step(struct rbdict_job* job, size_t budget)
 {
-    void* tmp;
-
-    if (is_int) {
-        *nv = (void*)v;
-        return 0;
-    }
+    int result;
 
-    if (!v) {
-        errno = EINVAL;
+    if (job->error) {
+        errno = job->error;
         return -1;
     }
+    if (job->done)
+        return 0;
 
-    if ((tmp = klone(v)) == NULL) {
-        errno = ENOMEM;
-        return -1;
-    }
+    if (job->kind == JOB_DESTROY)
+        result = _job_destroy_step(job, budget);
+    else
+        result = _job_clone_step(job, budget);
 
-    *nv = tmp;
-    return 0;
+    if (result < 0)
+        job->error = errno ? errno : ENOMEM;
+    else if (result == 0)
+        job->done = 1;
+    return result;
 }
 /*----------------------------------------------------------------*/
 
-static int _rbdict_clone_value(struct rbdict* pRoot, const void* v, void** nv)
+struct rbdict* rbdict_job_finish(struct rbdict_job* job)
 {
-    return _rbdict_clone_kv(v,
-                            nv,
-                            pRoot->ops.v_clone,
-                            pRoot->flags & RBDICT_INT_VAL);
+    struct rbdict* result = NULL;
+
+    while (rbdict_step(job, (size_t) -1) > 0)
+        ;
+
+    if (job->kind == JOB_DESTROY) {
+        _rbdict_destroy_shell(job->dict);
+    }
+    else {
+        rbdict_snapshot_release(job->snap);
+        if (job->has_resume)
+            _rbdict_destroy_key(job->dict, job->resume);
+        if (job->error) {
+            rbdict_destroy(job->dict);
+            errno = job->error;
+        }
+        else {
+            result = job->dict;
+        }
+    }
+
+    free(job);
+    return result;
 }
 /*----------------------------------------------------------------*/
 
-static int _rbdict_clone_key(struct rbdict* pRoot, const void* k, void** nk)
+#ifndef _WIN32
+static void* _job_worker(void* arg)
 {
-    return _rbdict_clone_kv(k,
-                            nk,
-                            pRoot->ops.k_clone,
-                            pRoot->flags & RBDICT_INT_KEY);
+    rbdict_job_finish((struct rbdict_job*) arg);
+    return NULL;
 }
+#endif
 /*----------------------------------------------------------------*/
 
-static void _rbdict_destroy_helper(struct rbdict* pDict, struct rb_node* n)
+int rbdict_job_background(struct rbdict_job* job)
 {
-    if (!n)
-        return;
+    /* a clone reads the caller's dict; pooled keys touch a shared pool */
+    if (job->kind != JOB_DESTROY || job->dict->strpool) {
+        errno = EINVAL;
+        return -1;
+    }
 
-    _rbdict_destroy_helper(pDict, n->rb_left);
-    _rbdict_destroy_helper(pDict, n->rb_right);
+#ifdef _WIN32
+    rbdict_job_finish(job);
+#else
+    {
+        pthread_attr_t attr;
+        pthread_t tid;
+        int rc;
 
-    struct rbdict_pair* e = node_to_pair(n);
-    destroy_rbdict_pair(pDict, e);
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        rc = pthread_create(&tid, &attr, _job_worker, job);
+        pthread_attr_destroy(&attr);
+        if (rc != 0) {
+            errno = rc;
+            return -1;
+        }
+    }
+#endif
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+size_t rbdict_mem_used(const struct rbdict* pRoot)
+{
+    return pRoot->mem_used;
 }
 /*----------------------------------------------------------------*/
 
 /*
- * destroy a dictionary
+ * Bytes currently charged against a bounded cache's byte budget
  */
-void rbdict_destroy(struct rbdict* pRoot)
+size_t rbdict_cache_bytes(const struct rbdict* pRoot)
 {
-    struct rb_root* root = &pRoot->root;
-    struct rb_node* node = root->rb_node;
-    _rbdict_destroy_helper(pRoot, node);
-    free(pRoot);
+    return pRoot->cache.bytes;
 }
 /*----------------------------------------------------------------*/
 
-struct rbdict* rbdict_clone(struct rbdict* pSrc)
+/*
+ * Insert a copy of KEY and VALUE that expires at EXPIRE_AT
+ */
+static int _rbdict_do_insert_ttl(struct rbdict* pRoot, void* key, void* value, int64_t expire_at)
 {
-    struct rb_root* src_root = (struct rb_root*) &pSrc->root;
-    struct rbdict* pDest;
-    struct rb_node* node;
+    struct rbdict_pair* pair;
 
-    if (!pSrc) {
-        errno = EINVAL;
-        return NULL;
-    }
+    if (_rbdict_insert_dup(pRoot, key, value, &pair) < 0)
+        return -1;
 
-    pDest = (struct rbdict*) malloc(sizeof(struct rbdict));
-    if (!pDest)
-        return NULL;
+    /* the pair is in: a refused deadline leaves it without one */
+    if (_rbdict_notify_kv(pRoot, RBDICT_OP_TOUCH, pair->key, &expire_at) < 0)
+        return -1;
+    _ttl_set(pRoot, pair, expire_at);
+    return 0;
+}
+/*----------------------------------------------------------------*/
 
-    pDest->root = RB_ROOT;
-    pDest->nelem = 0;
-    pDest->ops = pSrc->ops;
-    pDest->flags = pSrc->flags;
+int rbdict_insert_ttl(struct rbdict* pRoot, void* key, void* value, int64_t expire_at)
+{
+    int result;
 
-    for (node = rb_first(src_root);
-         node != NULL;
-         node = rb_next(node))
-    {
-        struct rbdict_pair* e = node_to_pair(node);
-        if (rbdict_insert_dup(pDest, e->key, e->value) != 0) {
-            int err = errno;
-            rbdict_destroy(pDest);
-            errno = err;
-            return NULL;
-        }
+    if (!pRoot->ttl_off) {
+        errno = EINVAL;
+        return -1;
     }
 
-    return pDest;
+    if ((result = _conc_wrlock(pRoot)) == 0) {
+        result = _rbdict_do_insert_ttl(pRoot, key, value, expire_at);
+        _conc_unlock(pRoot);
+    }
+    return result;
 }
 /*----------------------------------------------------------------*/
 
 /*
- * insert a new key-value pair into an existing dictionary.
- * key and value will be stored as-is
- * ownership of key and value buffers is transfered to dict
+ * Move the deadline of a live pair
  */
-int rbdict_insert_nodup(struct rbdict* pRoot, void* key, void* value)
+static int _rbdict_do_touch(struct rbdict* pRoot, const void* key, int64_t expire_at)
 {
-    struct rb_root* root = &pRoot->root;
-    struct rb_node** new_node = &root->rb_node;
-    struct rb_node*  parent = NULL;
-    struct rbdict_pair* n = NULL;
-    int int_key = (pRoot->flags & RBDICT_INT_KEY);
-
-    /* Figure out where to put new node */
-    while (*new_node) {
-        struct rbdict_pair* pThis;
-        int result;
+    struct rbdict_pair* pair;
 
-        parent = *new_node;
-        pThis = node_to_pair(parent);
-
-        result = int_key ?
-            compare_int(key, pThis->key) :
-            pRoot->ops.k_compare(key, pThis->key);
-
-        if (result < 0)
-            new_node = &parent->rb_left;
-        else if (result > 0)
-            new_node = &parent->rb_right;
-        else {
-            pRoot->ops.v_destroy(pThis->value);
-            pThis->value = value;
-            return 0;
-        }
+    pair = rbdict_search_aux(pRoot, key);
+    if (!pair || _ttl_expired(pRoot, pair)) {
+        errno = ENOENT;
+        return -1;
     }
 
-    /* make new data object with node */
-    if ((n = make_rbdict_pair(key, value)) == NULL) {
+    if (_rbdict_notify_kv(pRoot, RBDICT_OP_TOUCH, pair->key, &expire_at) < 0)
+        return -1;
+    _ttl_set(pRoot, pair, expire_at);
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_touch(struct rbdict* pRoot, const void* key, int64_t expire_at)
+{
+    int result;
+
+    if (!pRoot->ttl_off) {
+        errno = EINVAL;
         return -1;
     }
 
-    /* Add new node and rebalance tree. */
-    rb_link_node(&n->m_node, parent, new_node);
-    rb_insert_color(&n->m_node, root);
-    ++pRoot->nelem;
-
-    return 0;
+    if ((result = _conc_wrlock(pRoot)) == 0) {
+        result = _rbdict_do_touch(pRoot, key, expire_at);
+        _conc_unlock(pRoot);
+    }
+    return result;
 }
 /*----------------------------------------------------------------*/
 
 /*
- * insert a new key-value pair into an existing dictionary
+ * Deadline of a live pair
  */
-int rbdict_insert_dup(struct rbdict* pRoot, void* key, void* value)
+int rbdict_get_expiry(const struct rbdict* pRoot, const void* key, int64_t* expire_at)
 {
-    void* key_dup = 0;
-    void* val_dup = 0;
-
-    if (_rbdict_clone_key(pRoot, key, &key_dup) < 0) {
-        errno = ENOMEM;
-        return -1;
-    }
+    struct rbdict_pair* pair;
 
-    if (_rbdict_clone_value(pRoot, value, &val_dup) < 0) {
-        pRoot->ops.k_destroy(key_dup);
-        errno = ENOMEM;
+    if (!pRoot->ttl_off) {
+        errno = EINVAL;
         return -1;
     }
 
-    if (rbdict_insert_nodup(pRoot, key_dup, val_dup) < 0) {
-        pRoot->ops.k_destroy(key_dup);
-        pRoot->ops.v_destroy(val_dup);
-        errno = ENOMEM;
+    pair = rbdict_search_aux(pRoot, key);
+    if (!pair || _ttl_expired(pRoot, pair)) {
+        errno = ENOENT;
         return -1;
     }
 
+    *expire_at = PAIR_TTL(pRoot, pair)->expire;
     return 0;
 }
 /*----------------------------------------------------------------*/
 
 /*
- * change a value
- * Create key-value with default value if missing.
+ * Reclaim at most BUDGET pairs whose deadline is NOW or earlier,
+ * oldest first. Without a clock NOW also becomes the dict's time.
  */
-int rbdict_int_update(struct rbdict* pRoot,
-                      const void* key,
-                      int64_t default_value,
-                      rbdict_iupdate_t updater)
+size_t rbdict_expire(struct rbdict* pRoot, int64_t now, size_t budget)
 {
-    /* Must be int valued dict */
-    if ((pRoot->flags & RBDICT_INT_VAL) == 0) {
-        errno = EINVAL;
-        return -1;
+    size_t count = 0;
+
+    RBDICT_PROBE2(expire__entry, budget, pRoot->nelem);
+    if (!pRoot->ttl_off) {
+        RBDICT_PROBE2(expire__return, 0, pRoot->nelem);
+        return 0;
     }
 
-    int int_key = (pRoot->flags & RBDICT_INT_KEY);
+    if (!pRoot->clock && now > pRoot->now)
+        pRoot->now = now;
 
-    struct rb_root* root = &pRoot->root;
-    struct rb_node** new_node = &root->rb_node;
-    struct rb_node*  parent = NULL;
-    struct rbdict_pair* n = NULL;
+    while (count < budget) {
+        struct rb_node* node = rb_first(&pRoot->expiry);
+        struct rbdict_pair* pair;
 
-    /* Figure out where to put new node */
-    while (*new_node) {
-        struct rbdict_pair* pThis;
-        int result;
+        if (!node || rb_entry(node, struct pair_ttl, exp_node)->expire > now)
+            break;
 
-        parent = *new_node;
-        pThis = node_to_pair(parent);
+        pair = (struct rbdict_pair*)((char*) rb_entry(node, struct pair_ttl, exp_node) - pRoot->ttl_off);
+        if (_rbdict_unlink(pRoot, pair) < 0)
+            break;
+        _rbdict_notify(pRoot, RBDICT_OP_EXPIRE, pair);
+        destroy_rbdict_pair(pRoot, pair);
+        ++count;
+    }
 
-        result = int_key ?
-            compare_int(key, pThis->key) :
-            pRoot->ops.k_compare(key, pThis->key);
+    RBDICT_PROBE2(expire__return, count, pRoot->nelem);
+    return count;
+}
+/*----------------------------------------------------------------*/
 
-        if (result < 0)
-            new_node = &parent->rb_left;
-        else if (result > 0)
-            new_node = &parent->rb_right;
-        else {
-            pThis->value = (void*)(updater((int64_t)pThis->value));
-            return 0;
-        }
-    }
+/*
+ * Cursors and chunked export
+ */
+static void _cursor_set(const struct rbdict* pRoot, struct rbdict_cursor* cur, struct rb_node* node)
+{
+    cur->dict = pRoot;
+    cur->node = node;
+    cur->gen = pRoot->gen;
+}
+/*----------------------------------------------------------------*/
 
-    void* new_value = (void*) default_value;
-    void* new_key = 0;
-    if (_rbdict_clone_key(pRoot, key, &new_key) < 0) {
-        errno = ENOMEM;
-        return -1;
-    }
+void rbdict_cursor_first(const struct rbdict* pRoot, struct rbdict_cursor* cur)
+{
+    _cursor_set(pRoot, cur, _rbdict_first(pRoot));
+}
+/*----------------------------------------------------------------*/
 
-    /* make new data object with node */
-    if ((n = make_rbdict_pair(new_key, new_value)) == NULL) {
-        pRoot->ops.k_destroy(new_key);
-        errno = ENOMEM;
-        return -1;
-    }
+void rbdict_cursor_seek(const struct rbdict* pRoot, struct rbdict_cursor* cur, const void* key)
+{
+    _cursor_set(pRoot, cur, _rbdict_bound(pRoot, key, 0));
+}
+/*----------------------------------------------------------------*/
 
-    /* Add new node and rebalance tree. */
-    rb_link_node(&n->m_node, parent, new_node);
-    rb_insert_color(&n->m_node, root);
-    ++pRoot->nelem;
+void rbdict_cursor_seek_after(const struct rbdict* pRoot, struct rbdict_cursor* cur, const void* key)
+{
+    _cursor_set(pRoot, cur, _rbdict_bound(pRoot, key, 1));
+}
+/*----------------------------------------------------------------*/
 
-    return 0;
+/*
+ * Free a key copy made by k_clone for the caller. A pooled dict's
+ * k_destroy releases pool references, not such copies
+ */
+static void _user_key_destroy(const struct rbdict* pRoot, void* k)
+{
+    if (pRoot->strpool)
+        free(k);
+    else
+        pRoot->ops.k_destroy(k);
 }
 /*----------------------------------------------------------------*/
 
 /*
- * Update a value by an updater function.
- * Create key-value with default value if missing.
- * Updater function gets the address of the value object.
+ * Fill up to BUFSIZE keys and/or values (either buffer may be NULL)
+ * from the cursor position in one in-order walk and advance the
+ * cursor. On a clone failure the copies made by this call are
+ * released and the cursor does not move.
  */
-int rbdict_update_ex(struct rbdict* pRoot,
-                     const void* key,
-                     const void* default_value,
-                     rbdict_update_t updater,
-                     void* user_data)
+static int _rbdict_do_export(struct rbdict_cursor* cur, void* keys[], void* values[], size_t bufsize, int flags)
 {
-    struct rb_root* root = &pRoot->root;
-    struct rb_node** new_node = &root->rb_node;
-    struct rb_node*  parent = NULL;
-    struct rbdict_pair* n = NULL;
-    int int_key = (pRoot->flags & RBDICT_INT_KEY);
+    const struct rbdict* pRoot = cur->dict;
+    struct rb_node* node = (struct rb_node*) cur->node;
+    int clone_keys = keys && (flags & RBDICT_KEYS_CLONE);
+    int clone_values = values && (flags & RBDICT_VALUES_CLONE);
+    size_t count = 0;
 
-    if (!updater) {
-        errno = EINVAL;
+    if (cur->gen != pRoot->gen) {
+        errno = EAGAIN;
         return -1;
     }
 
-    /* Figure out where to put new node */
-    while (*new_node) {
-        struct rbdict_pair* pThis;
-        int result;
-
-        parent = *new_node;
-        pThis = node_to_pair(parent);
+    while (node && count < bufsize) {
+        struct rbdict_pair* e = node_to_pair(node);
+        void* k = e->key;
+        void* v = e->value;
 
-        result = int_key ?
-            compare_int(key, pThis->key) :
-            pRoot->ops.k_compare(key, pThis->key);
+        if (_ttl_expired(pRoot, e)) {
+            node = _rbdict_next(pRoot, node);
+            continue;
+        }
 
-        if (result < 0)
-            new_node = &parent->rb_left;
-        else if (result > 0)
-            new_node = &parent->rb_right;
-        else {
-            return updater(pThis->value, user_data);
+        /* numeric keys and values are copied as they are, 0 included */
+        if (clone_keys &&
+            _rbdict_clone_kv(e->key, &k, pRoot->ops.k_clone, pRoot->flags & NUMERIC_KEY) < 0)
+            goto err_clone;
+        if (clone_values && v &&
+            _rbdict_clone_kv(e->value, &v, pRoot->ops.v_clone, pRoot->flags & RBDICT_INT_VAL) < 0) {
+            if (clone_keys)
+                _user_key_destroy(pRoot, k);
+            goto err_clone;
         }
-    }
 
-    void* new_key = 0;
-    void* new_value = 0;
-    if (_rbdict_clone_key(pRoot, key, &new_key) < 0) {
-        errno = ENOMEM;
-        return -1;
-    }
+        if (keys)
+            keys[count] = k;
+        if (values)
+            values[count] = v;
 
-    if (_rbdict_clone_value(pRoot, default_value, &new_value) < 0) {
-        pRoot->ops.k_destroy(new_key);
-        errno = ENOMEM;
-        return -1;
+        ++count;
+        node = _rbdict_next(pRoot, node);
     }
 
-    /* make new data object with node */
-    if ((n = make_rbdict_pair(new_key, new_value)) == NULL) {
-        pRoot->ops.k_destroy(new_key);
-        pRoot->ops.v_destroy(new_value);
-        errno = ENOMEM;
-        return -1;
+    cur->node = node;
+    return (int) count;
+
+err_clone:
+    while (count--) {
+        if (clone_keys)
+            _user_key_destroy(pRoot, keys[count]);
+        if (clone_values && values[count])
+            pRoot->ops.v_destroy(values[count]);
     }
+    errno = ENOMEM;
+    return -1;
+}
+/*----------------------------------------------------------------*/
 
-    /* Add new node and rebalance tree. */
-    rb_link_node(&n->m_node, parent, new_node);
-    rb_insert_color(&n->m_node, root);
-    ++pRoot->nelem;
+int rbdict_export(struct rbdict_cursor* cur, void* keys[], void* values[], size_t bufsize, int flags)
+{
+    int result;
 
-    return 0;
+    RBDICT_PROBE2(export__entry, bufsize, cur->dict->nelem);
+    result = _rbdict_do_export(cur, keys, values, bufsize, flags);
+    RBDICT_PROBE2(export__return, result, cur->dict->nelem);
+    return result;
 }
 /*----------------------------------------------------------------*/
 
-static struct rbdict_pair* rbdict_search_aux(const struct rbdict* pRoot, const void* key)
+/*
+ * Frozen dicts. The live pairs are laid out in two arrays, keys and
+ * values, in Eytzinger order: the root of an implicit complete tree
+ * at index 1 and the children of i at 2i and 2i+1. A search walks
+ * down with one compare and no branch on its result, and the nodes
+ * a few levels ahead share cache lines so they can be prefetched.
+ * Numeric keys are stored already mapped to unsigned order; string
+ * and blob copies are packed in one buffer. Index 0 is unused.
+ */
+struct rbdict_frozen {
+    int flags;
+    size_t n;
+    uint64_t* ord;
+    void** keys;
+    void** values;
+    char* pack;
+    size_t pack_size;
+    struct rbdict_operations ops;
+};
+/*----------------------------------------------------------------*/
+
+static __inline uint64_t _key_ord(int flags, const void* k)
 {
-    struct rb_node* node = pRoot->root.rb_node;
-    int int_key = (pRoot->flags & RBDICT_INT_KEY);
+    switch (flags & NUMERIC_KEY) {
+    case RBDICT_INT_KEY:
+        return int_ord(k);
+    case RBDICT_DOUBLE_KEY:
+        return double_ord(k);
+    default:
+        return uint_ord(k);
+    }
+}
+/*----------------------------------------------------------------*/
 
-    while (node) {
-        struct rbdict_pair *pThis = node_to_pair(node);
-        int result = int_key ?
-            compare_int(key, pThis->key) :
-            pRoot->ops.k_compare(key, pThis->key);
+static __inline void* _ord_key(int flags, uint64_t u)
+{
+    switch (flags & NUMERIC_KEY) {
+    case RBDICT_INT_KEY:
+        return (void*)(uintptr_t)(u ^ ((uint64_t)1 << 63));
+    case RBDICT_DOUBLE_KEY:
+        return (void*)(uintptr_t)((u >> 63) ? u ^ ((uint64_t)1 << 63) : ~u);
+    default:
+        return (void*)(uintptr_t) u;
+    }
+}
+/*----------------------------------------------------------------*/
 
-        if (result < 0)
-            node = node->rb_left;
-        else if (result > 0)
-            node = node->rb_right;
-        else
-            return pThis;
+/* in-order neighbours in an Eytzinger array of N, 0 past the ends */
+static size_t _eytz_first(size_t n)
+{
+    size_t i = 1;
+
+    if (!n)
+        return 0;
+    while (2 * i <= n)
+        i *= 2;
+    return i;
+}
+/*----------------------------------------------------------------*/
+
+static size_t _eytz_next(size_t i, size_t n)
+{
+    if (2 * i + 1 <= n) {
+        i = 2 * i + 1;
+        while (2 * i <= n)
+            i *= 2;
+        return i;
     }
-    return NULL;
+
+    /* up past every right child, then once more */
+    while (i & 1)
+        i >>= 1;
+    return i >> 1;
 }
 /*----------------------------------------------------------------*/
 
 /*
- * return the value associated with a key or NULL if no matching
+ * Descent that ends below a leaf. The path taken is encoded in K's
+ * bits: dropping the trailing right turns and the last left turn
+ * gives the first element not less than the key
  */
-void* rbdict_search(const struct rbdict* pRoot, void* key)
+static __inline size_t _eytz_resolve(size_t k)
 {
-    struct rbdict_pair* data = rbdict_search_aux(pRoot, key);
-    return data ? data->value : NULL;
+#ifdef __GNUC__
+    return k >> (__builtin_ctzll(~(unsigned long long) k) + 1);
+#else
+    while (k & 1)
+        k >>= 1;
+    return k >> 1;
+#endif
 }
 /*----------------------------------------------------------------*/
 
-/*
- * delete the entry with the given key
- */
-void rbdict_delete(struct rbdict* pRoot, const void* key)
+#ifdef __GNUC__
+#define FROZEN_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define FROZEN_PREFETCH(p) ((void)0)
+#endif
+
+static size_t _frozen_lower_bound(const struct rbdict_frozen* fz, const void* key)
 {
-    struct rbdict_pair* data = rbdict_search_aux(pRoot, key);
-    if (data) {
-        rb_erase(&data->m_node, &pRoot->root);
-        --pRoot->nelem;
-        destroy_rbdict_pair(pRoot, data);
+    size_t k = 1;
+    size_t n = fz->n;
+
+    if (fz->ord) {
+        const uint64_t* ord = fz->ord;
+        uint64_t x = _key_ord(fz->flags, key);
+
+        /* the 16 descendants of k four levels down share two lines */
+        while (k <= n) {
+            FROZEN_PREFETCH(ord + 16 * k);
+            k = 2 * k + (ord[k] < x);
+        }
+    }
+    else {
+        while (k <= n)
+            k = 2 * k + (fz->ops.k_compare(fz->keys[k], key) < 0);
     }
+
+    return _eytz_resolve(k);
 }
 /*----------------------------------------------------------------*/
 
-/*
- * Number of elements in a dict
- */
-size_t rbdict_size(const struct rbdict* pRoot)
+static __inline void* _frozen_key(const struct rbdict_frozen* fz, size_t i)
 {
-    return pRoot->nelem;
+    return fz->ord ? _ord_key(fz->flags, fz->ord[i]) : fz->keys[i];
 }
 /*----------------------------------------------------------------*/
 
-int rbdict_keys(const struct rbdict* pRoot, void* buf[], size_t bufsize, int flags)
+static __inline int _frozen_compare(const struct rbdict_frozen* fz, const void* k1, const void* k2)
 {
-    unsigned int bufindex = 0;
-    int should_copy = (flags & RBDICT_KEYS_CLONE);
-    struct rb_root* root = (struct rb_root*) &pRoot->root;
-    struct rb_node* node = rb_first(root);
+    if (fz->ord)
+        return compare_ord(_key_ord(fz->flags, k1), _key_ord(fz->flags, k2));
+    return fz->ops.k_compare(k1, k2);
+}
+/*----------------------------------------------------------------*/
 
-    if (bufsize < rbdict_size(pRoot)) {
-        errno = EINVAL;
-        return -1;
+static __inline int _frozen_own_key(int flags)
+{
+    return !(flags & NUMERIC_KEY) && (flags & (RBDICT_STR_KEY | RBDICT_BLOB_KEY));
+}
+
+static __inline int _frozen_own_value(int flags)
+{
+    return !(flags & RBDICT_INT_VAL) && (flags & (RBDICT_STR_VAL | RBDICT_BLOB_VAL));
+}
+/*----------------------------------------------------------------*/
+
+/* copy a built-in string or blob to the pack at *POS */
+static void* _frozen_pack(struct rbdict_frozen* fz, size_t* pos, const void* p, int is_str)
+{
+    char* dst = fz->pack + *pos;
+    size_t size = _builtin_size(p, is_str, !is_str);
+
+    if (is_str) {
+        memcpy(dst, p, size);
     }
+    else {
+        const struct rbdict_blob* b = (const struct rbdict_blob*) p;
+        struct rbdict_blob* copy = (struct rbdict_blob*) dst;
 
-    while (node) {
-        struct rbdict_pair* e = node_to_pair(node);
-        void* to_add;
+        copy->len = b->len;
+        copy->data = copy + 1;
+        if (b->len)
+            memcpy(copy + 1, b->data, b->len);
+    }
 
-        if (should_copy)
-            to_add = pRoot->ops.k_clone(e->key);
-        else
-            to_add = e->key;
+    /* keep the blob descriptors aligned */
+    *pos += (size + 7) & ~(size_t)7;
+    return dst;
+}
+/*----------------------------------------------------------------*/
 
-        buf[bufindex] = to_add;
+static void _frozen_release(struct rbdict_frozen* fz, size_t filled)
+{
+    size_t i;
 
-        ++bufindex;
-        node = rb_next(node);
+    for (i = _eytz_first(fz->n); i && filled; i = _eytz_next(i, fz->n), --filled) {
+        if (!fz->ord && !_frozen_own_key(fz->flags))
+            fz->ops.k_destroy(fz->keys[i]);
+        if (!_frozen_own_value(fz->flags) && fz->values[i])
+            fz->ops.v_destroy(fz->values[i]);
     }
 
-    return 0;
+    free(fz->ord);
+    free(fz->keys);
+    free(fz->values);
+    free(fz->pack);
+    free(fz);
 }
 /*----------------------------------------------------------------*/
 
-int rbdict_values(const struct rbdict* pRoot, void* buf[], size_t bufsize, int flags)
+/*
+ * Build an immutable copy of the live pairs of PROOT
+ */
+struct rbdict_frozen* rbdict_freeze(const struct rbdict* pRoot)
 {
-    unsigned int bufindex = 0;
-    int should_copy = (flags & RBDICT_VALUES_CLONE);
-    struct rb_root* root = (struct rb_root*) &pRoot->root;
-    struct rb_node* node = rb_first(root);
+    struct rbdict_frozen* fz;
+    struct rb_node* node;
+    size_t n = 0, pack = 0, pos = 0, filled = 0, i;
+    int is_str_key = pRoot->flags & RBDICT_STR_KEY;
+    int is_str_val = pRoot->flags & RBDICT_STR_VAL;
 
-    if (bufsize < rbdict_size(pRoot)) {
-        errno = EINVAL;
-        return -1;
+    fz = (struct rbdict_frozen*) calloc(1, sizeof(*fz));
+    if (!fz) {
+        errno = ENOMEM;
+        return NULL;
     }
 
-    while (node) {
+    fz->flags = pRoot->flags;
+    fz->ops = pRoot->ops;
+    if (_frozen_own_key(fz->flags))
+        fz->ops.k_compare = is_str_key ? (rbdict_compare_t) &strcmp : &compare_blob;
+
+    for (node = _rbdict_first(pRoot); node; node = _rbdict_next(pRoot, node)) {
         struct rbdict_pair* e = node_to_pair(node);
-        void* to_add;
 
-        if (should_copy)
-            to_add = pRoot->ops.v_clone(e->value);
-        else
-            to_add = e->value;
+        if (_ttl_expired(pRoot, e))
+            continue;
+        ++n;
+        if (_frozen_own_key(fz->flags))
+            pack += (_builtin_size(e->key, is_str_key, !is_str_key) + 7) & ~(size_t)7;
+        if (_frozen_own_value(fz->flags) && e->value)
+            pack += (_builtin_size(e->value, is_str_val, !is_str_val) + 7) & ~(size_t)7;
+    }
 
-        buf[bufindex] = to_add;
+    fz->n = n;
+    fz->pack_size = pack;
+    if (fz->flags & NUMERIC_KEY)
+        fz->ord = (uint64_t*) malloc((n + 1) * sizeof(uint64_t));
+    else
+        fz->keys = (void**) malloc((n + 1) * sizeof(void*));
+    fz->values = (void**) malloc((n + 1) * sizeof(void*));
+    fz->pack = pack ? (char*) malloc(pack) : NULL;
 
-        ++bufindex;
-        node = rb_next(node);
+    if (!(fz->ord || fz->keys) || !fz->values || (pack && !fz->pack))
+        goto err_freeze;
+
+    i = _eytz_first(n);
+    for (node = _rbdict_first(pRoot); node; node = _rbdict_next(pRoot, node)) {
+        struct rbdict_pair* e = node_to_pair(node);
+        void* value = e->value;
+
+        if (_ttl_expired(pRoot, e))
+            continue;
+
+        if (fz->ord)
+            fz->ord[i] = _key_ord(fz->flags, e->key);
+        else if (_frozen_own_key(fz->flags))
+            fz->keys[i] = _frozen_pack(fz, &pos, e->key, is_str_key);
+        else if (_rbdict_clone_kv(e->key, &fz->keys[i], fz->ops.k_clone, 0) < 0)
+            goto err_freeze;
+
+        if (_frozen_own_value(fz->flags)) {
+            if (value)
+                value = _frozen_pack(fz, &pos, value, is_str_val);
+        }
+        else if (value && _rbdict_clone_kv(e->value, &value, fz->ops.v_clone,
+                                           fz->flags & RBDICT_INT_VAL) < 0) {
+            if (!fz->ord && !_frozen_own_key(fz->flags))
+                fz->ops.k_destroy(fz->keys[i]);
+            goto err_freeze;
+        }
+        fz->values[i] = value;
+
+        ++filled;
+        i = _eytz_next(i, n);
     }
 
-    return 0;
+    return fz;
+
+err_freeze:
+    _frozen_release(fz, filled);
+    errno = ENOMEM;
+    return NULL;
 }
 /*----------------------------------------------------------------*/
 
-void rbdict_foreach(const struct rbdict* pRoot, rbdict_visit_t f, void* user_data)
+void rbdict_frozen_destroy(struct rbdict_frozen* fz)
 {
-    struct rb_root* root = (struct rb_root*) &pRoot->root;
-    struct rb_node *node;
+    if (fz)
+        _frozen_release(fz, fz->n);
+}
+/*----------------------------------------------------------------*/
 
-    for (node = rb_first(root); node; node = rb_next(node)) {
-        struct rbdict_pair* e = node_to_pair(node);
-        f(e->key, e->value, user_data);
+size_t rbdict_frozen_size(const struct rbdict_frozen* fz)
+{
+    return fz->n;
+}
+/*----------------------------------------------------------------*/
+
+size_t rbdict_frozen_mem_used(const struct rbdict_frozen* fz)
+{
+    return sizeof(*fz) +
+           (fz->n + 1) * ((fz->ord ? sizeof(uint64_t) : sizeof(void*)) + sizeof(void*)) +
+           fz->pack_size;
+}
+/*----------------------------------------------------------------*/
+
+void* rbdict_frozen_search(const struct rbdict_frozen* fz, const void* key)
+{
+    size_t i = _frozen_lower_bound(fz, key);
+
+    if (!i || _frozen_compare(fz, _frozen_key(fz, i), key) != 0)
+        return NULL;
+    return fz->values[i];
+}
+/*----------------------------------------------------------------*/
+
+void rbdict_frozen_foreach(const struct rbdict_frozen* fz, rbdict_visit_t f, void* user_data)
+{
+    size_t i;
+
+    for (i = _eytz_first(fz->n); i; i = _eytz_next(i, fz->n))
+        f(_frozen_key(fz, i), fz->values[i], user_data);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Visit keys in [LO, HI) in order until F returns non-zero. Returns
+ * the number of pairs visited
+ */
+size_t rbdict_frozen_foreach_range(const struct rbdict_frozen* fz,
+                                   const void* lo,
+                                   const void* hi,
+                                   rbdict_visit_t f,
+                                   void* user_data)
+{
+    size_t i, end;
+    size_t count = 0;
+
+    if (_frozen_compare(fz, lo, hi) >= 0)
+        return 0;
+
+    i = _frozen_lower_bound(fz, lo);
+    end = _frozen_lower_bound(fz, hi);
+
+    for (; i && i != end; i = _eytz_next(i, fz->n)) {
+        ++count;
+        if (f && f(_frozen_key(fz, i), fz->values[i], user_data) != 0)
+            break;
     }
+    return count;
 }
 /*----------------------------------------------------------------*/
@@ -22,6 +22,14 @@ typedef void*   (*rbdict_clone_t)  (const void*);
 typedef int     (*rbdict_visit_t)(const void*, const void*, void* user_data);
 typedef int     (*rbdict_update_t)(void* value, void* user_data);
 typedef int64_t (*rbdict_iupdate_t)(int64_t n);
+typedef uint64_t (*rbdict_hash_t)(const void*);
+typedef size_t  (*rbdict_sizeof_t)(const void* key, const void* value);
+typedef void    (*rbdict_evict_t)(const void* key, const void* value, void* user_data);
+typedef int64_t (*rbdict_clock_t)(void);
+typedef void*   (*rbdict_map_t)(const void* key, void* value, void* user_data);
+typedef int     (*rbdict_change_t)(int op, const void* key, const void* value, void* user_data);
+typedef int     (*rbdict_diff_t)(int change, const void* key, const void* old_value,
+                                 const void* new_value, void* user_data);
 
 /*
  *  Operations needed for each dictionary
@@ -42,6 +50,9 @@ struct rbdict_operations
 
     /* value copy */
     rbdict_clone_t   v_clone;
+
+    /* key hash, only needed for RBDICT_HASH_INDEX with custom keys */
+    rbdict_hash_t    k_hash;
 };
 
 /* rbdict creation flags */
@@ -54,7 +65,248 @@ enum {
     RBDICT_STR_STR = (RBDICT_STR_KEY | RBDICT_STR_VAL),
     RBDICT_STR_INT = (RBDICT_STR_KEY | RBDICT_INT_VAL),
     RBDICT_INT_STR = (RBDICT_INT_KEY | RBDICT_STR_VAL),
-    RBDICT_INT_INT = (RBDICT_INT_KEY | RBDICT_INT_VAL)
+    RBDICT_INT_INT = (RBDICT_INT_KEY | RBDICT_INT_VAL),
+    RBDICT_BLOB_KEY = (1<<4),
+    RBDICT_BLOB_VAL = (1<<5),
+    RBDICT_BLOB_BLOB = (RBDICT_BLOB_KEY | RBDICT_BLOB_VAL),
+    RBDICT_BLOB_INT = (RBDICT_BLOB_KEY | RBDICT_INT_VAL),
+    RBDICT_BLOB_STR = (RBDICT_BLOB_KEY | RBDICT_STR_VAL),
+    RBDICT_UINT_KEY = (1<<6),
+    RBDICT_DOUBLE_KEY = (1<<7),
+    RBDICT_UINT_INT = (RBDICT_UINT_KEY | RBDICT_INT_VAL),
+    RBDICT_DOUBLE_INT = (RBDICT_DOUBLE_KEY | RBDICT_INT_VAL),
+
+    /*
+     * Keep a hash index next to the tree. rbdict_search and the hit
+     * path of the update functions become O(1); ordered operations
+     * still use the tree.
+     */
+    RBDICT_HASH_INDEX = (1<<8),
+
+    /*
+     * Allow per-pair deadlines (rbdict_insert_ttl, rbdict_touch)
+     */
+    RBDICT_TTL = (1<<9),
+
+    /*
+     * Keep every pair linked to its in-order neighbours. Each
+     * iteration step is a single pointer load instead of a tree walk
+     * and min/max are O(1), for two pointers per pair.
+     */
+    RBDICT_THREADED = (1<<10),
+
+    /*
+     * Multimap: inserts never replace, equal keys are kept as separate
+     * pairs, adjacent and in insertion order. Lookups and updates see
+     * the first (oldest) of them, rbdict_delete removes them all. Not
+     * with RBDICT_HASH_INDEX, snapshots or journals.
+     */
+    RBDICT_MULTI = (1<<11),
+
+    /*
+     * Keep the sum, min, max and count of the int values of every
+     * subtree (RBDICT_INT_VAL only), for O(log n) range aggregates
+     */
+    RBDICT_AGGREGATE = (1<<12),
+
+    /*
+     * Closed interval keys (struct rbdict_interval), ordered by lo then
+     * hi. Every subtree keeps its largest hi for rbdict_foreach_overlap.
+     */
+    RBDICT_INTERVAL_KEY = (1<<13),
+    RBDICT_INTERVAL_INT = (RBDICT_INTERVAL_KEY | RBDICT_INT_VAL),
+    RBDICT_INTERVAL_STR = (RBDICT_INTERVAL_KEY | RBDICT_STR_VAL),
+
+    /*
+     * Keep the pairs last found by rbdict_search in a small direct
+     * mapped table (rbdict_options.hot_slots) in front of the tree. A
+     * hit costs one hash and one compare instead of a descent, which
+     * pays off when a few keys get most lookups. Custom keys need
+     * k_hash. Not with RBDICT_HASH_INDEX.
+     */
+    RBDICT_HOT_CACHE = (1<<14),
+
+    /*
+     * Thread safe counters (RBDICT_INT_VAL only, not with RBDICT_TTL or
+     * a bounded cache). The point operations, rbdict_foreach,
+     * rbdict_size, the range and prefix scans, rbdict_keys and
+     * rbdict_values, the TTL calls, rbdict_set_change_hook and
+     * rbdict_parallel_map_values take the dict's reader/writer lock;
+     * the scans' visitors run like rbdict_foreach's. rbdict_int_add
+     * and rbdict_int_update find an existing key under the shared lock
+     * and change its value atomically; only new keys (or dicts with
+     * aggregates, snapshots or a change hook) take the writer lock.
+     * rbdict_foreach holds the shared lock while its visitor runs: the
+     * visitor may read the dict and add to existing counters, but its
+     * writer locked calls fail with EDEADLK.
+     * Other functions must be kept apart from writers by the caller.
+     * Not on Windows.
+     */
+    RBDICT_CONCURRENT = (1<<15)
+};
+
+/*
+ * RBDICT_DOUBLE_KEY keys travel in the key pointer as their bit
+ * pattern. They are totally ordered, -0.0 sorts before +0.0 and
+ * NaNs sort at the ends.
+ */
+static inline void* rbdict_double_key(double d)
+{
+    union { double d; uint64_t u; } x;
+    x.d = d;
+    return (void*)(uintptr_t) x.u;
+}
+
+static inline double rbdict_key_double(const void* k)
+{
+    union { double d; uint64_t u; } x;
+    x.u = (uint64_t)(uintptr_t) k;
+    return x.d;
+}
+
+/*
+ * RBDICT_INTERVAL_KEY keys, the closed range [lo, hi]. Copying inserts
+ * fail with EINVAL when hi < lo; rbdict_insert_nodup takes a malloc'ed
+ * key.
+ */
+struct rbdict_interval
+{
+    int64_t lo;
+    int64_t hi;
+};
+
+/*
+ * Binary key or value with explicit length for RBDICT_BLOB_KEY and
+ * RBDICT_BLOB_VAL dicts. May hold zero bytes. Keys are ordered by
+ * memcmp on the common prefix, then by length.
+ * Lookups may pass a descriptor pointing to any buffer; copies stored
+ * by the dict keep the bytes in the same allocation as the descriptor.
+ */
+struct rbdict_blob {
+    size_t len;
+    const void* data;
+};
+
+static inline struct rbdict_blob rbdict_blob_make(const void* data, size_t len)
+{
+    struct rbdict_blob b;
+    b.len = len;
+    b.data = data;
+    return b;
+}
+
+/*
+ * Allocate a self contained blob (release with free). Suitable for
+ * rbdict_insert_nodup
+ */
+struct rbdict_blob* rbdict_blob_new(const void* data, size_t len);
+
+/*
+ * String interning pool shared by RBDICT_STR_KEY dicts. Identical keys
+ * of all dicts created against a pool are stored once and refcounted,
+ * keys compare by pointer before strcmp and rbdict_clone shares them
+ * without copying. A pool is not thread safe. rbdict_strpool_destroy
+ * drops the creator's reference; the memory goes away once the last
+ * dict using the pool is destroyed.
+ */
+struct rbdict_strpool;
+
+struct rbdict_strpool* rbdict_strpool_create(void);
+void rbdict_strpool_destroy(struct rbdict_strpool*);
+
+/* number of distinct strings currently held */
+size_t rbdict_strpool_size(const struct rbdict_strpool*);
+
+/*
+ * Memory of a dict: its header, nodes, hash index, snapshot records
+ * and the copies it makes of built-in string and blob keys/values.
+ * FREE gets back the size that was allocated. REALLOC is optional:
+ * when given, inserting over a present key resizes the dict's copy of
+ * a built-in value in place instead of allocating a new one. Copies
+ * handed to the caller (RBDICT_KEYS_CLONE, ...) and custom key/value
+ * types still use malloc / the clone callbacks.
+ */
+struct rbdict_allocator
+{
+    void* (*alloc)(void* ctx, size_t size);
+    void  (*free)(void* ctx, void* p, size_t size);
+    void* ctx;
+    void* (*realloc)(void* ctx, void* p, size_t old_size, size_t size);
+};
+
+/*
+ * Node arena: an allocator that packs dict memory into 2MB chunks,
+ * backed by huge pages (MAP_HUGETLB, else transparent huge pages) and
+ * optionally placed by NUMA policy. Fewer, larger pages cut TLB misses
+ * on big dicts. Without huge pages or NUMA the arena falls back to
+ * normal pages and default placement. One arena may serve several
+ * dicts; it is not thread safe and must outlive them.
+ */
+enum {
+    RBDICT_NUMA_DEFAULT = 0,
+    RBDICT_NUMA_INTERLEAVE,     /* spread pages over all online nodes */
+    RBDICT_NUMA_BIND            /* keep pages on numa_node */
+};
+
+struct rbdict_arena_options
+{
+    int huge_pages;
+    int numa_policy;
+    int numa_node;
+};
+
+struct rbdict_arena_stats
+{
+    size_t chunk_bytes;         /* mapped by the arena */
+    size_t huge_page_bytes;     /* of which explicit huge pages */
+    size_t numa_bytes;          /* of which placed by the NUMA policy */
+    int numa_nodes;             /* online nodes seen */
+};
+
+struct rbdict_arena;
+
+struct rbdict_arena* rbdict_arena_create(const struct rbdict_arena_options* opts);
+void rbdict_arena_destroy(struct rbdict_arena* arena);
+const struct rbdict_allocator* rbdict_arena_allocator(struct rbdict_arena* arena);
+void rbdict_arena_get_stats(const struct rbdict_arena* arena, struct rbdict_arena_stats* stats);
+
+/*
+ * Optional creation settings. Zero / NULL members keep the default.
+ */
+struct rbdict_options
+{
+    /* intern keys in this pool (RBDICT_STR_KEY only) */
+    struct rbdict_strpool* strpool;
+
+    /*
+     * Bounded cache. Past MAX_ENTRIES pairs or MAX_BYTES bytes inserts
+     * evict pairs not looked up recently (CLOCK), calling ON_EVICT
+     * before the pair is destroyed. Bytes are the node plus built-in
+     * key and value copies; ENTRY_SIZE reports them for custom types.
+     */
+    size_t max_entries;
+    size_t max_bytes;
+    rbdict_sizeof_t entry_size;
+    rbdict_evict_t on_evict;
+    void* evict_user_data;
+
+    /*
+     * Time source of a RBDICT_TTL dict, in the caller's units. Without
+     * one the dict's time is the latest NOW given to rbdict_expire.
+     */
+    rbdict_clock_t clock;
+
+    /* allocator for the dict's memory, copied at creation */
+    const struct rbdict_allocator* allocator;
+
+    /*
+     * Fail inserts with ENOMEM rather than let the dict's memory
+     * (see rbdict_mem_used) grow past MEM_LIMIT bytes
+     */
+    size_t mem_limit;
+
+    /* slots of the RBDICT_HOT_CACHE table, a power of 2 (default 4096) */
+    size_t hot_slots;
 };
 
 /*
@@ -64,6 +316,13 @@ enum {
  */
 struct rbdict* rbdict_create_ex(const struct rbdict_operations* ops, int flags);
 
+/*
+ * Same as rbdict_create_ex with extra settings. OPTS may be NULL
+ */
+struct rbdict* rbdict_create_opt(const struct rbdict_operations* ops,
+                                 int flags,
+                                 const struct rbdict_options* opts);
+
 inline struct rbdict* rbdict_create(const struct rbdict_operations* ops)
 {
     return rbdict_create_ex(ops, RBDICT_CUSTOM);
@@ -84,6 +343,30 @@ void rbdict_destroy(struct rbdict*);
  */
 struct rbdict* rbdict_clone(struct rbdict*);
 
+/*
+ * Incremental destroy and clone, for callers that cannot stall.
+ * rbdict_destroy_async takes the dict away in O(1) (plus dropping its
+ * snapshots' deltas); the dict must not be used afterwards.
+ * rbdict_clone_incremental copies the dict as it is now, through a
+ * private snapshot, so the source may change between steps (not for
+ * RBDICT_MULTI). Destroying the source fails the clone with EINVAL.
+ *
+ * rbdict_step does at most BUDGET pairs worth of work and returns 1
+ * while work is left, 0 when done and -1 when a clone failed.
+ * rbdict_job_finish completes what is left, frees the job and
+ * returns the clone (NULL for a destroy or a failed clone).
+ * rbdict_job_background hands a destroy job to a detached thread,
+ * which finishes and frees it; the dict's allocator and destructors
+ * then run on that thread. Not for dicts with a string pool.
+ */
+struct rbdict_job;
+
+struct rbdict_job* rbdict_destroy_async(struct rbdict* pRoot);
+struct rbdict_job* rbdict_clone_incremental(struct rbdict* pSrc);
+int rbdict_step(struct rbdict_job* job, size_t budget);
+struct rbdict* rbdict_job_finish(struct rbdict_job* job);
+int rbdict_job_background(struct rbdict_job* job);
+
 /*
  * insert a new key-value pair into an existing dictionary
  * A clone of key and value will be stored in the dict
@@ -124,23 +407,91 @@ int rbdict_update_ex(struct rbdict*,
  */
 int rbdict_int_update(struct rbdict* pRoot, const void* key, int64_t default_value, rbdict_iupdate_t f);
 
+/*
+ * Add DELTA to the value of KEY, or insert KEY with DELTA when missing.
+ * Sums wrap around. Same as rbdict_int_update without the call through
+ * F; on a RBDICT_CONCURRENT dict F may run more than once per call
+ * while rbdict_int_add is a single atomic add.
+ */
+int rbdict_int_add(struct rbdict* pRoot, const void* key, int64_t delta);
+
 /*
  * Return the value associated with a key or NULL if no match
  */
 void* rbdict_search(const struct rbdict* pRoot, void* key);
 
 /*
- * delete the entry with the given key
+ * delete the entry with the given key. While the dict has snapshots a
+ * delete first saves the pair for them; if that runs out of memory the
+ * pair stays and errno is set to ENOMEM. Clear errno before the call
+ * to tell, or use rbdict_delete_one, which returns -1 then.
  */
 void rbdict_delete(struct rbdict* pRoot, const void *key);
 
+/*
+ * Equal keys (RBDICT_MULTI). rbdict_equal_range visits the pairs with
+ * KEY in insertion order until F returns non-zero, and returns how
+ * many it visited; F may be NULL to count them. All O(log n + k).
+ */
+size_t rbdict_equal_range(const struct rbdict* pRoot, const void* key, rbdict_visit_t f, void* user_data);
+size_t rbdict_count(const struct rbdict* pRoot, const void* key);
+
+/*
+ * remove the oldest live pair with KEY (-1/ENOENT if none), or all of
+ * them; expired pairs are left to rbdict_expire
+ */
+int rbdict_delete_one(struct rbdict* pRoot, const void* key);
+size_t rbdict_delete_all(struct rbdict* pRoot, const void* key);
+
+/*
+ * Fill an empty dict with copies of N pairs whose keys are in strictly
+ * ascending order (or non-descending for RBDICT_MULTI), building the
+ * tree in O(n). -1/EINVAL if the dict is not empty or the keys are
+ * not sorted. The change hook sees a put per pair; when it refuses
+ * one the load fails and the pairs put before it are reported deleted
+ */
+int rbdict_load_sorted(struct rbdict* pRoot, void* keys[], void* values[], size_t n);
+
+/*
+ * Change hook, called before each change to the dict with the key and
+ * the value about to be stored (PUT) or destroyed. A non-zero return
+ * makes the insert / update / delete call that caused it fail, and the
+ * change is not made. Evictions and expiries are reported as they
+ * happen and cannot be refused; rbdict_parallel_map_values is
+ * refused while a hook is set. Clones do not inherit the hook.
+ *
+ * A new TTL deadline is a TOUCH with a const int64_t* value.
+ * rbdict_insert_ttl reports a PUT and then a TOUCH: if the TOUCH is
+ * refused the pair stays, without a deadline.
+ */
+enum {
+    RBDICT_OP_PUT = 1,
+    RBDICT_OP_DELETE,
+    RBDICT_OP_EVICT,            /* bounded cache eviction */
+    RBDICT_OP_EXPIRE,           /* expired pair reclaimed */
+    RBDICT_OP_TOUCH             /* new deadline */
+};
+
+void rbdict_set_change_hook(struct rbdict* pRoot, rbdict_change_t f, void* user_data);
+
+/* the installed hook (NULL if none), and its user data in *USER_DATA if given */
+rbdict_change_t rbdict_get_change_hook(const struct rbdict* pRoot, void** user_data);
+
 /*
  * Number of elements in a dict
  */
 size_t rbdict_size(const struct rbdict* pRoot);
 
 /*
- *  Fill in the keys in the supplied buffer.
+ * Three way compare of two keys in the dict's order
+ */
+int rbdict_compare_keys(const struct rbdict* pRoot, const void* k1, const void* k2);
+
+/*
+ *  Fill in the keys (values) in the supplied buffer, which must hold
+ *  rbdict_size() entries. Expired pairs of a RBDICT_TTL dict are
+ *  skipped as rbdict_foreach skips them, and the entries they leave
+ *  at the end are NULL; rbdict_export returns the count.
  */
 enum {
     RBDICT_KEYS_SORTED = 1,
@@ -152,10 +503,486 @@ int rbdict_keys(const struct rbdict* pRoot, void* buf[], size_t bufsize, int fla
 int rbdict_values(const struct rbdict* pRoot, void* buf[], size_t bufsize, int flags);
 
 /*
- * foreach calls the provided function for each pair in the dict
+ * Resumable, chunked export. A cursor marks the next pair to export;
+ * rbdict_export fills caller sized KEYS and/or VALUES buffers (either
+ * may be NULL) in key order in a single walk and advances the cursor,
+ * returning the number filled, 0 at the end. RBDICT_KEYS_CLONE and
+ * RBDICT_VALUES_CLONE make it hand out copies.
+ * After an insert or delete the cursor is stale and rbdict_export
+ * fails with EAGAIN: resume with rbdict_cursor_seek_after on the last
+ * key received.
+ */
+struct rbdict_cursor {
+    const struct rbdict* dict;
+    void* node;
+    size_t gen;
+};
+
+void rbdict_cursor_first(const struct rbdict* pRoot, struct rbdict_cursor* cur);
+
+/* position on the first key >= KEY, or > KEY */
+void rbdict_cursor_seek(const struct rbdict* pRoot, struct rbdict_cursor* cur, const void* key);
+void rbdict_cursor_seek_after(const struct rbdict* pRoot, struct rbdict_cursor* cur, const void* key);
+
+int rbdict_export(struct rbdict_cursor* cur, void* keys[], void* values[], size_t bufsize, int flags);
+
+/*
+ * foreach calls the provided function for each pair in the dict, in
+ * ascending key order. On a RBDICT_CONCURRENT dict the function must
+ * not insert or delete
  */
 void rbdict_foreach(const struct rbdict* pRoot, rbdict_visit_t f, void* user_data);
 
+/*
+ * foreach in descending key order, stopping when F returns non-zero
+ */
+void rbdict_foreach_reverse(const struct rbdict* pRoot, rbdict_visit_t f, void* user_data);
+
+/*
+ * Smallest / largest key and its value (either pointer may be NULL).
+ * -1/ENOENT when the dict is empty
+ */
+int rbdict_min(const struct rbdict* pRoot, void** key, void** value);
+int rbdict_max(const struct rbdict* pRoot, void** key, void** value);
+
+/*
+ * Aggregates of the values of a RBDICT_AGGREGATE dict, over all pairs
+ * or over the keys in [LO, HI), in O(log n). Sums wrap on overflow.
+ * An empty range has count 0, min INT64_MAX and max INT64_MIN.
+ * Pairs past their TTL deadline count until reclaimed. -1/EINVAL for
+ * other dicts; rbdict_range_min / max fail with ENOENT on an empty
+ * range and rbdict_range_sum returns 0 on errors.
+ */
+struct rbdict_aggregate
+{
+    int64_t sum;
+    int64_t min;
+    int64_t max;
+    size_t count;
+};
+
+int rbdict_aggregate(const struct rbdict* pRoot, struct rbdict_aggregate* agg);
+int rbdict_range_aggregate(const struct rbdict* pRoot,
+                           const void* lo,
+                           const void* hi,
+                           struct rbdict_aggregate* agg);
+int64_t rbdict_range_sum(const struct rbdict* pRoot, const void* lo, const void* hi);
+int rbdict_range_min(const struct rbdict* pRoot, const void* lo, const void* hi, int64_t* min);
+int rbdict_range_max(const struct rbdict* pRoot, const void* lo, const void* hi, int64_t* max);
+
+/*
+ * Call F (which may be NULL) on every pair of a RBDICT_INTERVAL_KEY
+ * dict whose key overlaps [LO, HI], in key order, in O(log n + k)
+ * for k matches. Stops early when F returns non-zero. Returns the
+ * number of pairs visited, 0 with EINVAL for other dicts.
+ */
+size_t rbdict_foreach_overlap(const struct rbdict* pRoot,
+                              int64_t lo,
+                              int64_t hi,
+                              rbdict_visit_t f,
+                              void* user_data);
+
+/*
+ * Visit all pairs with NTHREADS threads (the caller being one of
+ * them), in no particular order. Thread i passes USER_DATA[i] to F,
+ * so reductions can keep per-thread state; USER_DATA may be NULL.
+ * The dict must not be written meanwhile. Single threaded on Windows.
+ */
+int rbdict_parallel_foreach(const struct rbdict* pRoot,
+                            unsigned nthreads,
+                            rbdict_visit_t f,
+                            void* user_data[]);
+
+/*
+ * Same, F returns the new value of each pair. When it differs from
+ * the old one the old value is destroyed. -1/EBUSY while the dict
+ * has live snapshots or a change hook
+ */
+int rbdict_parallel_map_values(struct rbdict* pRoot,
+                               unsigned nthreads,
+                               rbdict_map_t f,
+                               void* user_data[]);
+
+/*
+ * Expiring entries (RBDICT_TTL dicts). Deadlines are absolute times
+ * in the units of the dict's clock. A pair whose deadline has passed
+ * is a miss for rbdict_search, rbdict_touch, rbdict_foreach and the
+ * update functions, but still counts in rbdict_size until
+ * rbdict_expire (or a write to its key) reclaims it.
+ */
+#define RBDICT_NO_EXPIRY INT64_MAX
+
+/* like rbdict_insert_dup, the pair expires at EXPIRE_AT */
+int rbdict_insert_ttl(struct rbdict* pRoot, void* key, void* value, int64_t expire_at);
+
+/* set a new deadline (RBDICT_NO_EXPIRY to keep forever), -1/ENOENT if missing */
+int rbdict_touch(struct rbdict* pRoot, const void* key, int64_t expire_at);
+
+/* the deadline of a live pair, -1/ENOENT if missing */
+int rbdict_get_expiry(const struct rbdict* pRoot, const void* key, int64_t* expire_at);
+
+/* reclaim at most BUDGET expired pairs, oldest deadline first; returns the count */
+size_t rbdict_expire(struct rbdict* pRoot, int64_t now, size_t budget);
+
+/*
+ * Bytes of memory the dict currently holds
+ */
+size_t rbdict_mem_used(const struct rbdict* pRoot);
+
+/*
+ * Bytes charged against the byte budget of a bounded cache
+ */
+size_t rbdict_cache_bytes(const struct rbdict* pRoot);
+
+/*
+ * Prefix scan for RBDICT_STR_KEY dicts. Calls F (which may be NULL)
+ * in sorted order for each key starting with PREFIX, stopping after
+ * LIMIT matches (0 = unlimited) or when F returns non-zero.
+ * Runs in O(log n + k). Returns the number of pairs visited.
+ */
+size_t rbdict_foreach_prefix(const struct rbdict* pRoot,
+                             const char* prefix,
+                             size_t limit,
+                             rbdict_visit_t f,
+                             void* user_data);
+
+/*
+ * Number of keys starting with PREFIX, counting at most LIMIT (0 = unlimited)
+ */
+size_t rbdict_count_prefix(const struct rbdict* pRoot, const char* prefix, size_t limit);
+
+/*
+ * Snapshots. rbdict_snapshot returns in O(1) a read only view of the
+ * dict as it is now. Later writes save the previous state of the keys
+ * they touch in every live snapshot, so the view stays consistent.
+ * Release snapshots when done, each one costs a little on every write.
+ * Destroying the dict leaves its snapshots empty; they still have to
+ * be released.
+ *
+ * NOTE: a snapshot read walks the live tree and the snapshot's saved
+ * pairs, both of which writes change. On a RBDICT_CONCURRENT dict the
+ * reads take the dict's shared lock (taking and releasing a snapshot
+ * the writer lock); elsewhere they must be serialized with writes by
+ * the caller. rbdict_snapshot_foreach holds the lock for the whole
+ * walk. A long reader walks in chunks instead: rbdict_snapshot_foreach_n
+ * visits at most LIMIT pairs (0 = all) from the first one and
+ * rbdict_snapshot_foreach_after those after KEY, returning how many
+ * were visited, fewer than LIMIT at the end. Writers get in between
+ * chunks and the view stays the same; F keeps a copy of the last key
+ * it saw to resume after.
+ */
+struct rbdict_snapshot;
+
+struct rbdict_snapshot* rbdict_snapshot(struct rbdict* pRoot);
+void rbdict_snapshot_release(struct rbdict_snapshot* snap);
+
+void* rbdict_snapshot_search(const struct rbdict_snapshot* snap, const void* key);
+size_t rbdict_snapshot_size(const struct rbdict_snapshot* snap);
+void rbdict_snapshot_foreach(const struct rbdict_snapshot* snap, rbdict_visit_t f, void* user_data);
+size_t rbdict_snapshot_foreach_n(const struct rbdict_snapshot* snap,
+                                 size_t limit,
+                                 rbdict_visit_t f,
+                                 void* user_data);
+size_t rbdict_snapshot_foreach_after(const struct rbdict_snapshot* snap,
+                                     const void* key,
+                                     size_t limit,
+                                     rbdict_visit_t f,
+                                     void* user_data);
+
+/*
+ * Differences between two dicts. F gets each key added, removed or
+ * changed going from A to B, in key order, with the value in A and
+ * in B (NULL for the side that lacks the key). Values of the built in
+ * types are compared by content, others by pointer. rbdict_diff walks
+ * both dicts in O(n + m); rbdict_snapshot_diff compares a snapshot
+ * with its dict as it is now, looking only at the keys written since
+ * the snapshot was taken. Pairs past their TTL deadline count as
+ * missing. Returns 0, the non-zero value of F that stopped the walk,
+ * or -1/EINVAL for dicts of different key or value types and for
+ * RBDICT_MULTI dicts.
+ */
+enum {
+    RBDICT_DIFF_ADDED = 1,
+    RBDICT_DIFF_REMOVED,
+    RBDICT_DIFF_CHANGED
+};
+
+int rbdict_diff(const struct rbdict* a, const struct rbdict* b, rbdict_diff_t f, void* user_data);
+int rbdict_snapshot_diff(const struct rbdict_snapshot* snap, rbdict_diff_t f, void* user_data);
+
+/*
+ * Frozen dicts. rbdict_freeze copies the live pairs of a dict into an
+ * immutable, compact form laid out for cache friendly binary search
+ * (no per-pair node; numeric keys take 8 bytes, string and blob copies
+ * are packed together). It is independent of the source dict, which
+ * may change or go away. Reads are safe from any number of threads.
+ */
+struct rbdict_frozen;
+
+struct rbdict_frozen* rbdict_freeze(const struct rbdict* pRoot);
+void rbdict_frozen_destroy(struct rbdict_frozen* fz);
+
+size_t rbdict_frozen_size(const struct rbdict_frozen* fz);
+
+/* bytes held, for comparison with rbdict_mem_used */
+size_t rbdict_frozen_mem_used(const struct rbdict_frozen* fz);
+
+void* rbdict_frozen_search(const struct rbdict_frozen* fz, const void* key);
+void rbdict_frozen_foreach(const struct rbdict_frozen* fz, rbdict_visit_t f, void* user_data);
+
+/*
+ * Visit the keys in [LO, HI) in order, stopping when F (which may be
+ * NULL) returns non-zero. Returns the number of pairs visited
+ */
+size_t rbdict_frozen_foreach_range(const struct rbdict_frozen* fz,
+                                   const void* lo,
+                                   const void* hi,
+                                   rbdict_visit_t f,
+                                   void* user_data);
+
+/*
+ * Latency histograms of the point operations, for all dicts of the
+ * process: rbdict_search, rbdict_insert_dup / nodup, rbdict_delete and
+ * rbdict_update_ex / int_update. Off until rbdict_latency_enable(1).
+ * Each thread records into its own buckets without locking; values
+ * are kept within 1/16 and reported in ns at the upper end of their
+ * bucket. Timing uses the TSC on x86, CLOCK_MONOTONIC elsewhere.
+ * rbdict_latency_reset starts a new interval. -1/ENOSYS on Windows.
+ */
+enum rbdict_latency_op
+{
+    RBDICT_LAT_SEARCH = 0,
+    RBDICT_LAT_INSERT,
+    RBDICT_LAT_DELETE,
+    RBDICT_LAT_UPDATE,
+    RBDICT_LAT_NOPS
+};
+
+struct rbdict_latency
+{
+    uint64_t count;
+    uint64_t mean_ns;
+    uint64_t min_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+};
+
+int rbdict_latency_enable(int on);
+void rbdict_latency_reset(void);
+int rbdict_latency_get(int op, struct rbdict_latency* lat);
+
+/*
+ * Write-ahead journal. rbdict_journal_open attaches a log at PATH to a
+ * dict through its change hook (NULL/EBUSY if that is taken); every insert, update and delete is
+ * appended as a checksummed binary record (evictions and expiries are
+ * logged as deletes, and TTL deadlines as they are set). FLAGS are the
+ * dict's creation flags, built in key and value types only. An
+ * existing log is kept, minus a torn last record; a record damaged
+ * before that fails with EIO.
+ *
+ * RBDICT_JOURNAL_NOSYNC leaves writes to the OS, SYNC_INTERVAL syncs
+ * at most every SYNC_INTERVAL_MS and SYNC_COMMIT syncs before each
+ * change returns. Threads sharing a dict under a lock can take
+ * rbdict_journal_lsn before unlocking and rbdict_journal_commit after
+ * it: commits waiting at the same time share one fsync. Records are
+ * buffered up to BUFFER_SIZE bytes (default 64KB).
+ * A record is appended before its change is made: a failed write
+ * makes this and later changes return -1 without making them.
+ */
+enum {
+    RBDICT_JOURNAL_NOSYNC = 0,
+    RBDICT_JOURNAL_SYNC_INTERVAL,
+    RBDICT_JOURNAL_SYNC_COMMIT
+};
+
+struct rbdict_journal_options
+{
+    int sync;
+    unsigned sync_interval_ms;
+    size_t buffer_size;
+};
+
+struct rbdict_journal;
+
+struct rbdict_journal* rbdict_journal_open(struct rbdict* pRoot,
+                                           int flags,
+                                           const char* path,
+                                           const struct rbdict_journal_options* opts);
+
+/* sync, and remove the hook if it is still the journal's */
+int rbdict_journal_close(struct rbdict_journal* j);
+
+/* sequence number of the last logged change, and wait for it to be synced */
+uint64_t rbdict_journal_lsn(struct rbdict_journal* j);
+int rbdict_journal_commit(struct rbdict_journal* j, uint64_t lsn);
+
+/*
+ * Write the dict to PATH.snap and empty the log. The dict must not be
+ * written meanwhile
+ */
+int rbdict_journal_compact(struct rbdict_journal* j);
+
+/*
+ * Rebuild a dict from PATH.snap (bulk loaded) and the log at PATH.
+ * Deadlines are restored when FLAGS have RBDICT_TTL. NULL/EIO if the
+ * snapshot is damaged at all or the log before its last record
+ */
+struct rbdict* rbdict_journal_recover(const char* path, int flags, const struct rbdict_options* opts);
+
+/*
+ * Change feed for replication. rbdict_feed_open takes the dict's change
+ * hook (like the journal, one of them per dict; -1/EBUSY if it is
+ * taken) and appends each put and delete (evictions and expiries as
+ * deletes, TTL deadlines are not carried) as a record to a ring of
+ * CAPACITY bytes, a power of 2 (default 1MB). FLAGS are the dict's
+ * creation flags, built in key and value types only. rbdict_feed_close
+ * removes the hook if it is still the feed's.
+ *
+ * One thread, which need not be the dict's writer, drains the ring
+ * with rbdict_feed_read: it moves whole records into BUF (SIZE bytes)
+ * and sets *LEN to their length, 0 when there is nothing new.
+ * -1/ENOBUFS with the size of the next record in *LEN if that does
+ * not fit. A feed that is not drained does not hold the dict back: a
+ * record that does not fit is dropped with every later one until
+ * the next read, which empties the ring and fails with EOVERFLOW. The
+ * replica then needs a full copy (or rbdict_diff against one).
+ *
+ * rbdict_feed_apply plays records from BUF on a replica dict with the
+ * same FLAGS; -1/EINVAL on a malformed record.
+ */
+struct rbdict_feed;
+
+struct rbdict_feed* rbdict_feed_open(struct rbdict* pRoot, int flags, size_t capacity);
+void rbdict_feed_close(struct rbdict_feed* feed);
+int rbdict_feed_read(struct rbdict_feed* feed, void* buf, size_t size, size_t* len);
+int rbdict_feed_apply(struct rbdict* replica, int flags, const void* buf, size_t len);
+
+/*
+ * LSM dict for data larger than memory. Changes go to an in-memory
+ * dict; past MEMTABLE_BYTES (default 64MB) it is written to DIR
+ * (default ".") as a sorted run file. Lookups check the memory dict,
+ * then the runs newest first, skipping runs by their Bloom filters.
+ * A background thread merges the runs into one when there are more
+ * than MAX_RUNS (default 4). Run files are scratch files, deleted
+ * when the process ends. FLAGS name built in key and value types.
+ *
+ * With RBDICT_LSM_SUM (integer values) rbdict_lsm_int_update writes
+ * a delta the merges and lookups add to the older records. F must add
+ * a constant, as in word counting. A missing key takes DEFAULT_VALUE;
+ * unless that equals f(0) a key not changed since the last flush
+ * takes a lookup first. rbdict_lsm_put sets the sum.
+ * With RBDICT_LSM_REPLACE the newest record wins and int_update
+ * reads the current value, as rbdict_int_update does.
+ *
+ * One thread uses the dict at a time; the merges run beside it.
+ */
+enum {
+    RBDICT_LSM_REPLACE = 0,
+    RBDICT_LSM_SUM
+};
+
+struct rbdict_lsm_options
+{
+    const char* dir;
+    size_t memtable_bytes;
+    unsigned max_runs;
+    int merge;
+};
+
+struct rbdict_lsm_stats
+{
+    size_t runs;
+    uint64_t run_bytes;
+    size_t memtable_bytes;
+    size_t flushes;
+    size_t compactions;
+    size_t bloom_skips;             /* run lookups the filter saved */
+};
+
+struct rbdict_lsm;
+
+struct rbdict_lsm* rbdict_lsm_create(int flags, const struct rbdict_lsm_options* opts);
+void rbdict_lsm_destroy(struct rbdict_lsm* lsm);
+
+/* keys and values are copied */
+int rbdict_lsm_put(struct rbdict_lsm* lsm, const void* key, const void* value);
+int rbdict_lsm_delete(struct rbdict_lsm* lsm, const void* key);
+int rbdict_lsm_int_update(struct rbdict_lsm* lsm,
+                          const void* key,
+                          int64_t default_value,
+                          rbdict_iupdate_t f);
+
+/*
+ * 0 and the value in *VALUE, -1/ENOENT when missing. STR and BLOB
+ * values are copies the caller frees
+ */
+int rbdict_lsm_get(struct rbdict_lsm* lsm, const void* key, void** value);
+
+/* write the memory dict as a run; merge all runs into one */
+int rbdict_lsm_flush(struct rbdict_lsm* lsm);
+int rbdict_lsm_compact(struct rbdict_lsm* lsm);
+
+/*
+ * Visit all pairs in key order. Compacts first. F may get and put in
+ * LSM, but not flush, compact or start another foreach on it
+ */
+int rbdict_lsm_foreach(struct rbdict_lsm* lsm, rbdict_visit_t f, void* user_data);
+
+void rbdict_lsm_get_stats(struct rbdict_lsm* lsm, struct rbdict_lsm_stats* stats);
+
+/*
+ * Shared memory dicts, one copy per host for several processes. The
+ * pairs live in a segment of fixed SIZE bytes (default 64MB, backed as
+ * it fills) that links nodes, keys and values by offset, so each
+ * process may map it anywhere. rbdict_shm_create makes the segment
+ * (shm_open NAME, or an anonymous memfd when NAME is NULL) and returns
+ * the handle of its one writer. Other processes attach read only with
+ * rbdict_shm_open, or rbdict_shm_open_fd on a descriptor inherited or
+ * passed from the writer (rbdict_shm_fd). FLAGS name built in key and
+ * value types, as for the journal; rbdict_shm_load copies a dict of
+ * the same types.
+ *
+ * Readers take no lock and never block the writer: a lookup that a
+ * change overlapped is retried. Changes fail with ENOMEM when the
+ * segment is full and EBADF on a reader's handle. The segment of NAME
+ * stays until shm_unlink(NAME). Not on Windows.
+ */
+struct rbdict_shm_options
+{
+    size_t size;
+};
+
+struct rbdict_shm;
+
+struct rbdict_shm* rbdict_shm_create(const char* name, int flags, const struct rbdict_shm_options* opts);
+struct rbdict_shm* rbdict_shm_open(const char* name);
+struct rbdict_shm* rbdict_shm_open_fd(int fd);
+void rbdict_shm_close(struct rbdict_shm* shm);
+
+/* the writer's descriptor of the segment, -1 for readers */
+int rbdict_shm_fd(const struct rbdict_shm* shm);
+
+/* keys and values are copied */
+int rbdict_shm_put(struct rbdict_shm* shm, const void* key, const void* value);
+int rbdict_shm_delete(struct rbdict_shm* shm, const void* key);
+int rbdict_shm_load(struct rbdict_shm* shm, const struct rbdict* pRoot);
+
+/*
+ * 0 and the value in *VALUE, -1/ENOENT when missing. STR and BLOB
+ * values are copies the caller frees. -1/EAGAIN when a change has been
+ * in progress for a second: the writer stalled, or died in it and the
+ * segment will not settle again
+ */
+int rbdict_shm_get(const struct rbdict_shm* shm, const void* key, void** value);
+
+size_t rbdict_shm_size(const struct rbdict_shm* shm);
+
+/* bytes of the segment in use, for comparison with rbdict_mem_used */
+size_t rbdict_shm_mem_used(const struct rbdict_shm* shm);
+
 #ifdef __cplusplus
 }
 #endif
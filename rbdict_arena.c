@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "rbdict.h"
+
+/*
+ * Node arena. Small blocks are carved from 2MB chunks, one free list
+ * per 16 byte size class; larger ones go to malloc. Chunks are taken
+ * from explicit huge pages when the system has them reserved, else
+ * from 2MB aligned anonymous memory marked for transparent huge pages.
+ * Memory returns to the system only when the arena is destroyed.
+ */
+#define ARENA_CHUNK     ((size_t) 2 << 20)
+#define ARENA_GRAIN     16
+#define ARENA_MAX_SMALL 512
+#define ARENA_CLASSES   (ARENA_MAX_SMALL / ARENA_GRAIN)
+
+/* mbind(2) modes */
+#define ARENA_MPOL_BIND       2
+#define ARENA_MPOL_INTERLEAVE 3
+
+#define ARENA_MAX_NODES 64
+
+struct arena_free {
+    struct arena_free* next;
+};
+
+struct arena_chunk {
+    struct arena_chunk* next;
+    void* mem;
+    size_t size;
+    int huge;
+};
+
+struct rbdict_arena {
+    struct rbdict_allocator allocator;
+    struct rbdict_arena_options opts;
+    struct arena_free* free_list[ARENA_CLASSES];
+    struct arena_chunk* chunks;
+    char* bump;
+    char* bump_end;
+    unsigned long nodemask;
+    int nnodes;
+    struct rbdict_arena_stats stats;
+};
+/*----------------------------------------------------------------*/
+
+/*
+ * Online NUMA nodes from sysfs ("0-1,3"). No sysfs means one node
+ */
+static int _arena_online_nodes(unsigned long* mask)
+{
+    int count = 0;
+#ifndef _WIN32
+    FILE* fp = fopen("/sys/devices/system/node/online", "r");
+    int lo, hi;
+
+    *mask = 0;
+    if (fp) {
+        while (fscanf(fp, "%d", &lo) == 1) {
+            hi = lo;
+            if (fscanf(fp, "-%d", &hi) != 1)
+                hi = lo;
+            for (; lo <= hi && lo < ARENA_MAX_NODES; ++lo) {
+                *mask |= 1UL << lo;
+                ++count;
+            }
+            if (fgetc(fp) != ',')
+                break;
+        }
+        fclose(fp);
+    }
+#endif
+    if (count == 0) {
+        *mask = 1;
+        count = 1;
+    }
+    return count;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Apply the NUMA policy to a new chunk. Single node machines and
+ * kernels without mbind keep the default (first touch) placement
+ */
+static void _arena_place(struct rbdict_arena* arena, void* mem, size_t size)
+{
+#if !defined(_WIN32) && defined(SYS_mbind)
+    unsigned long mask;
+    int mode;
+
+    if (arena->opts.numa_policy == RBDICT_NUMA_INTERLEAVE && arena->nnodes > 1) {
+        mode = ARENA_MPOL_INTERLEAVE;
+        mask = arena->nodemask;
+    }
+    else if (arena->opts.numa_policy == RBDICT_NUMA_BIND && arena->nnodes > 1 &&
+             arena->opts.numa_node >= 0 && arena->opts.numa_node < ARENA_MAX_NODES &&
+             (arena->nodemask & (1UL << arena->opts.numa_node))) {
+        mode = ARENA_MPOL_BIND;
+        mask = 1UL << arena->opts.numa_node;
+    }
+    else {
+        return;
+    }
+
+    if (syscall(SYS_mbind, mem, size, mode, &mask, (unsigned long) ARENA_MAX_NODES + 1, 0) == 0)
+        arena->stats.numa_bytes += size;
+#endif
+}
+/*----------------------------------------------------------------*/
+
+static void* _arena_map(struct rbdict_arena* arena, int* huge)
+{
+#ifdef _WIN32
+    *huge = 0;
+    return malloc(ARENA_CHUNK);
+#else
+    char* mem;
+    size_t lead;
+
+#ifdef MAP_HUGETLB
+    if (arena->opts.huge_pages) {
+        mem = (char*) mmap(NULL, ARENA_CHUNK, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            *huge = 1;
+            return mem;
+        }
+    }
+#endif
+
+    /* over-map and trim so the chunk is 2MB aligned for THP */
+    *huge = 0;
+    mem = (char*) mmap(NULL, 2 * ARENA_CHUNK, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    lead = (ARENA_CHUNK - ((size_t) mem & (ARENA_CHUNK - 1))) & (ARENA_CHUNK - 1);
+    if (lead)
+        munmap(mem, lead);
+    munmap(mem + lead + ARENA_CHUNK, ARENA_CHUNK - lead);
+    mem += lead;
+
+#ifdef MADV_HUGEPAGE
+    if (arena->opts.huge_pages)
+        madvise(mem, ARENA_CHUNK, MADV_HUGEPAGE);
+#endif
+    return mem;
+#endif
+}
+/*----------------------------------------------------------------*/
+
+static void _arena_unmap(struct arena_chunk* c)
+{
+#ifdef _WIN32
+    free(c->mem);
+#else
+    munmap(c->mem, c->size);
+#endif
+}
+/*----------------------------------------------------------------*/
+
+static int _arena_grow(struct rbdict_arena* arena)
+{
+    struct arena_chunk* c = (struct arena_chunk*) malloc(sizeof(*c));
+
+    if (!c) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if ((c->mem = _arena_map(arena, &c->huge)) == NULL) {
+        free(c);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    c->size = ARENA_CHUNK;
+    c->next = arena->chunks;
+    arena->chunks = c;
+
+    _arena_place(arena, c->mem, c->size);
+
+    arena->bump = (char*) c->mem;
+    arena->bump_end = arena->bump + c->size;
+    arena->stats.chunk_bytes += c->size;
+    if (c->huge)
+        arena->stats.huge_page_bytes += c->size;
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+static void* _arena_alloc(void* ctx, size_t size)
+{
+    struct rbdict_arena* arena = (struct rbdict_arena*) ctx;
+    size_t cls;
+    void* p;
+
+    if (size == 0 || size > ARENA_MAX_SMALL)
+        return malloc(size);
+
+    cls = (size - 1) / ARENA_GRAIN;
+    if (arena->free_list[cls]) {
+        p = arena->free_list[cls];
+        arena->free_list[cls] = arena->free_list[cls]->next;
+        return p;
+    }
+
+    size = (cls + 1) * ARENA_GRAIN;
+    if ((size_t)(arena->bump_end - arena->bump) < size && _arena_grow(arena) < 0)
+        return NULL;
+
+    p = arena->bump;
+    arena->bump += size;
+    return p;
+}
+/*----------------------------------------------------------------*/
+
+static void _arena_free(void* ctx, void* p, size_t size)
+{
+    struct rbdict_arena* arena = (struct rbdict_arena*) ctx;
+    struct arena_free* f = (struct arena_free*) p;
+    size_t cls;
+
+    if (size == 0 || size > ARENA_MAX_SMALL) {
+        free(p);
+        return;
+    }
+
+    cls = (size - 1) / ARENA_GRAIN;
+    f->next = arena->free_list[cls];
+    arena->free_list[cls] = f;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * A block keeps its place while the size class is unchanged. Large
+ * blocks are malloc's to resize
+ */
+static void* _arena_realloc(void* ctx, void* p, size_t old_size, size_t size)
+{
+    void* res;
+
+    if (old_size > ARENA_MAX_SMALL && size > ARENA_MAX_SMALL)
+        return realloc(p, size);
+    if (old_size && size && old_size <= ARENA_MAX_SMALL && size <= ARENA_MAX_SMALL &&
+        (old_size - 1) / ARENA_GRAIN == (size - 1) / ARENA_GRAIN)
+        return p;
+
+    if ((res = _arena_alloc(ctx, size)) == NULL)
+        return NULL;
+    memcpy(res, p, old_size < size ? old_size : size);
+    _arena_free(ctx, p, old_size);
+    return res;
+}
+/*----------------------------------------------------------------*/
+
+struct rbdict_arena* rbdict_arena_create(const struct rbdict_arena_options* opts)
+{
+    struct rbdict_arena* arena = (struct rbdict_arena*) calloc(1, sizeof(*arena));
+
+    if (!arena) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (opts)
+        arena->opts = *opts;
+    arena->nnodes = _arena_online_nodes(&arena->nodemask);
+    arena->allocator.alloc = _arena_alloc;
+    arena->allocator.free = _arena_free;
+    arena->allocator.realloc = _arena_realloc;
+    arena->allocator.ctx = arena;
+    return arena;
+}
+/*----------------------------------------------------------------*/
+
+void rbdict_arena_destroy(struct rbdict_arena* arena)
+{
+    struct arena_chunk* c = arena->chunks;
+
+    while (c) {
+        struct arena_chunk* next = c->next;
+        _arena_unmap(c);
+        free(c);
+        c = next;
+    }
+    free(arena);
+}
+/*----------------------------------------------------------------*/
+
+const struct rbdict_allocator* rbdict_arena_allocator(struct rbdict_arena* arena)
+{
+    return &arena->allocator;
+}
+/*----------------------------------------------------------------*/
+
+void rbdict_arena_get_stats(const struct rbdict_arena* arena, struct rbdict_arena_stats* stats)
+{
+    *stats = arena->stats;
+    stats->numa_nodes = arena->nnodes;
+}
+/*----------------------------------------------------------------*/
@@ -0,0 +1,1099 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "rbdict.h"
+
+/*
+ * Micro benchmarks. Usage: rbbench [name [count]]
+ */
+
+static double now_sec()
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, t;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (double) t.QuadPart / (double) freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng_next()
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static void report(const char* what, size_t n, double secs)
+{
+    printf("  %-32s %10.1f ns/op\n", what, secs * 1e9 / (double) n);
+}
+
+/*----------------------------------------------------------------*/
+
+static int generic_compare_int(const void* a, const void* b)
+{
+    int64_t x = (int64_t)(intptr_t) a;
+    int64_t y = (int64_t)(intptr_t) b;
+    return (x > y) - (x < y);
+}
+
+static void generic_destroy(void* p)
+{
+}
+
+static void* generic_clone(const void* p)
+{
+    return (void*) p;
+}
+
+static int64_t generic_inc(int64_t n)
+{
+    return n + 1;
+}
+
+static void bench_int_keys_run(const char* name, struct rbdict* dict, int64_t* keys, size_t n)
+{
+    size_t i;
+    double t;
+    uintptr_t sum = 0;
+
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        rbdict_insert(dict, keys[i], i);
+    report("insert", n, now_sec() - t);
+
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        sum += (uintptr_t) rbdict_search(dict, (void*)(intptr_t) keys[i]);
+    report("search", n, now_sec() - t);
+
+    if (sum == 42)
+        printf("%s\n", name);
+
+    rbdict_destroy(dict);
+}
+
+/*
+ * Random 64 bit keys: RBDICT_INT_KEY inlined descent versus the same
+ * keys through the generic k_compare callback
+ */
+static void bench_int_keys(size_t n)
+{
+    struct rbdict_operations ops = {
+        generic_compare_int, generic_destroy, generic_clone,
+        generic_destroy, generic_clone, NULL
+    };
+    int64_t* keys = (int64_t*) malloc(n * sizeof(int64_t));
+    size_t i;
+
+    for (i = 0; i < n; ++i)
+        keys[i] = (int64_t) rng_next();
+
+    printf(" RBDICT_INT_KEY\n");
+    bench_int_keys_run("int", rbdict_create_predefined(RBDICT_INT_INT), keys, n);
+
+    printf(" generic compare callback\n");
+    bench_int_keys_run("generic", rbdict_create(&ops), keys, n);
+
+    free(keys);
+}
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Point lookups on string keys: plain tree versus RBDICT_HASH_INDEX
+ */
+static void bench_point_lookup_run(int flags, char** keys, size_t n)
+{
+    struct rbdict* dict = rbdict_create_predefined(flags);
+    size_t i;
+    double t;
+    int64_t sum = 0;
+
+    for (i = 0; i < n; ++i)
+        rbdict_insert_dup(dict, keys[i], (void*)(uintptr_t) i);
+
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        sum += (int64_t) rbdict_search(dict, keys[(i * 7919) % n]);
+    report("search", n, now_sec() - t);
+
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        rbdict_int_update(dict, keys[i], 0, generic_inc);
+    report("int_update (hit)", n, now_sec() - t);
+
+    if (sum == -1)
+        printf("\n");
+    rbdict_destroy(dict);
+}
+
+static void bench_point_lookup(size_t n)
+{
+    char** keys = (char**) malloc(n * sizeof(char*));
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        char buf[64];
+        sprintf(buf, "user:%016" PRIx64, rng_next());
+        keys[i] = strdup(buf);
+    }
+
+    printf(" tree only\n");
+    bench_point_lookup_run(RBDICT_STR_INT, keys, n);
+    printf(" RBDICT_HASH_INDEX\n");
+    bench_point_lookup_run(RBDICT_STR_INT | RBDICT_HASH_INDEX, keys, n);
+
+    for (i = 0; i < n; ++i)
+        free(keys[i]);
+    free(keys);
+}
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Full scans: rb_next tree walk versus RBDICT_THREADED links
+ */
+static int bench_sum_visit(const void* k, const void* v, void* user_data)
+{
+    *(uintptr_t*) user_data += (uintptr_t) v;
+    return 0;
+}
+
+static void bench_iterate_run(int flags, size_t n)
+{
+    struct rbdict* dict = rbdict_create_predefined(flags);
+    size_t i;
+    double t;
+    uintptr_t sum = 0;
+    void* key;
+
+    for (i = 0; i < n; ++i)
+        rbdict_insert(dict, rng_next(), i);
+
+    t = now_sec();
+    for (i = 0; i < 10; ++i)
+        rbdict_foreach(dict, bench_sum_visit, &sum);
+    report("foreach step", 10 * rbdict_size(dict), now_sec() - t);
+
+    t = now_sec();
+    for (i = 0; i < 10; ++i)
+        rbdict_foreach_reverse(dict, bench_sum_visit, &sum);
+    report("foreach_reverse step", 10 * rbdict_size(dict), now_sec() - t);
+
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        sum += rbdict_min(dict, &key, NULL);
+    report("min", n, now_sec() - t);
+
+    if (sum == 42)
+        printf("\n");
+    rbdict_destroy(dict);
+}
+
+static void bench_iterate(size_t n)
+{
+    printf(" tree walk\n");
+    bench_iterate_run(RBDICT_INT_INT, n);
+    printf(" RBDICT_THREADED\n");
+    bench_iterate_run(RBDICT_INT_INT | RBDICT_THREADED, n);
+}
+
+/*----------------------------------------------------------------*/
+
+/*
+ * rbdict_parallel_foreach scaling, 1 thread up to the core count
+ */
+static void bench_parallel(size_t n)
+{
+    struct rbdict* dict = rbdict_create_predefined(RBDICT_INT_INT);
+    uintptr_t sums[64];
+    void* user_data[64];
+    unsigned ncpu = 1;
+    unsigned nthreads;
+    size_t i;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    ncpu = (unsigned) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (ncpu > 64)
+        ncpu = 64;
+
+    for (i = 0; i < n; ++i)
+        rbdict_insert(dict, rng_next(), i);
+
+    for (i = 0; i < 64; ++i)
+        user_data[i] = &sums[i];
+
+    for (nthreads = 1; ; nthreads *= 2) {
+        char what[64];
+        double t;
+
+        if (nthreads > ncpu)
+            nthreads = ncpu;
+
+        t = now_sec();
+        rbdict_parallel_foreach(dict, nthreads, bench_sum_visit, user_data);
+        t = now_sec() - t;
+        sprintf(what, "%u threads (%.2fs)", nthreads, t);
+        report(what, rbdict_size(dict), t);
+
+        if (nthreads == ncpu)
+            break;
+    }
+
+    rbdict_destroy(dict);
+}
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Data TLB load misses of this thread, -1 where perf events are not
+ * available (other systems, perf_event_paranoid, containers)
+ */
+static int tlb_counter_open()
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static uint64_t tlb_counter_read(int fd)
+{
+    uint64_t count = 0;
+#ifdef __linux__
+    if (fd >= 0 && read(fd, &count, sizeof(count)) != sizeof(count))
+        count = 0;
+#endif
+    return count;
+}
+
+/*
+ * Random lookups in a large dict: malloc'ed nodes versus the node
+ * arena with huge pages, default and interleaved NUMA placement
+ */
+static void bench_arena_run(struct rbdict_arena* arena, size_t n)
+{
+    struct rbdict_options opts;
+    struct rbdict* dict;
+    uint64_t seed = rng_state;
+    uint64_t misses;
+    uintptr_t sum = 0;
+    int fd;
+    size_t i;
+    double t;
+
+    memset(&opts, 0, sizeof(opts));
+    if (arena)
+        opts.allocator = rbdict_arena_allocator(arena);
+    dict = rbdict_create_opt(NULL, RBDICT_INT_INT, &opts);
+
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        rbdict_insert(dict, rng_next(), i);
+    report("insert", n, now_sec() - t);
+
+    /* look up the same keys again */
+    rng_state = seed;
+    fd = tlb_counter_open();
+    misses = tlb_counter_read(fd);
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        sum += (uintptr_t) rbdict_search(dict, (void*)(uintptr_t) rng_next());
+    report("search", n, now_sec() - t);
+    misses = tlb_counter_read(fd) - misses;
+    if (fd >= 0) {
+        printf("  %-32s %10.2f /op\n", "dTLB load misses", (double) misses / (double) n);
+        close(fd);
+    }
+
+    if (arena) {
+        struct rbdict_arena_stats stats;
+        rbdict_arena_get_stats(arena, &stats);
+        printf("  %zu MB mapped, %zu MB huge pages, %zu MB NUMA placed (%d nodes)\n",
+               stats.chunk_bytes >> 20, stats.huge_page_bytes >> 20,
+               stats.numa_bytes >> 20, stats.numa_nodes);
+    }
+
+    if (sum == 42)
+        printf("\n");
+    rbdict_destroy(dict);
+}
+
+static void bench_arena(size_t n)
+{
+    struct rbdict_arena_options huge = { 1, RBDICT_NUMA_DEFAULT, 0 };
+    struct rbdict_arena_options interleave = { 1, RBDICT_NUMA_INTERLEAVE, 0 };
+    struct rbdict_arena* arena;
+    uint64_t seed = rng_state;
+
+    printf(" malloc\n");
+    bench_arena_run(NULL, n);
+
+    printf(" arena, huge pages\n");
+    rng_state = seed;
+    arena = rbdict_arena_create(&huge);
+    bench_arena_run(arena, n);
+    rbdict_arena_destroy(arena);
+
+    printf(" arena, huge pages, NUMA interleave\n");
+    rng_state = seed;
+    arena = rbdict_arena_create(&interleave);
+    bench_arena_run(arena, n);
+    rbdict_arena_destroy(arena);
+}
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Frozen Eytzinger arrays versus the live tree: the words of
+ * words.txt and N random int keys
+ */
+static void bench_frozen_run(struct rbdict* dict, void** keys, size_t nkeys, size_t n)
+{
+    struct rbdict_frozen* fz = rbdict_freeze(dict);
+    size_t i;
+    double t;
+    uintptr_t sum = 0;
+
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        sum += (uintptr_t) rbdict_search(dict, keys[(i * 7919) % nkeys]);
+    report("live search", n, now_sec() - t);
+
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        sum += (uintptr_t) rbdict_frozen_search(fz, keys[(i * 7919) % nkeys]);
+    report("frozen search", n, now_sec() - t);
+
+    printf("  %-32s %10zu / %zu\n", "bytes live / frozen",
+           rbdict_mem_used(dict), rbdict_frozen_mem_used(fz));
+
+    if (sum == 42)
+        printf("\n");
+    rbdict_frozen_destroy(fz);
+}
+
+static void bench_frozen(size_t n)
+{
+    struct rbdict* dict = rbdict_create_predefined(RBDICT_STR_INT);
+    void** keys = (void**) malloc(n * sizeof(void*));
+    FILE* fp = fopen("words.txt", "r");
+    char word[256];
+    size_t i, nwords;
+
+    while (fp && fscanf(fp, "%255s", word) == 1)
+        rbdict_insert_dup(dict, word, (void*) 1);
+    if (fp)
+        fclose(fp);
+
+    nwords = rbdict_size(dict);
+    if (nwords && nwords <= n) {
+        rbdict_keys(dict, keys, n, 0);
+        printf(" words.txt (%zu words)\n", nwords);
+        bench_frozen_run(dict, keys, nwords, n);
+    }
+    rbdict_destroy(dict);
+
+    dict = rbdict_create_predefined(RBDICT_INT_INT);
+    for (i = 0; i < n; ++i) {
+        keys[i] = (void*)(uintptr_t) rng_next();
+        rbdict_insert(dict, keys[i], i);
+    }
+    printf(" random int keys\n");
+    bench_frozen_run(dict, keys, n, n);
+    rbdict_destroy(dict);
+    free(keys);
+}
+
+/*
+ * Journaled inserts of N random int keys for each sync policy against
+ * plain in-memory inserts, then recovery. SYNC_COMMIT syncs every
+ * insert so it runs on N / 1000 keys
+ */
+static void bench_journal_run(const char* what, int sync, size_t n)
+{
+    struct rbdict_journal_options opts = { sync, 10, 0 };
+    struct rbdict* dict = rbdict_create_predefined(RBDICT_INT_INT);
+    struct rbdict_journal* j = NULL;
+    size_t i;
+    double t;
+
+    remove("rbbench.journal");
+    remove("rbbench.journal.snap");
+    if (sync >= 0)
+        j = rbdict_journal_open(dict, RBDICT_INT_INT, "rbbench.journal", &opts);
+
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        rbdict_insert(dict, rng_next(), i);
+    if (j)
+        rbdict_journal_close(j);
+    report(what, n, now_sec() - t);
+    rbdict_destroy(dict);
+}
+
+static void bench_journal(size_t n)
+{
+    struct rbdict* dict;
+    struct rbdict_journal* j;
+    double t;
+
+    bench_journal_run("in memory insert", -1, n);
+    bench_journal_run("journal nosync", RBDICT_JOURNAL_NOSYNC, n);
+    bench_journal_run("journal sync 10ms", RBDICT_JOURNAL_SYNC_INTERVAL, n);
+    bench_journal_run("journal sync commit", RBDICT_JOURNAL_SYNC_COMMIT, n / 1000 + 1);
+
+    bench_journal_run("journal (for replay)", RBDICT_JOURNAL_NOSYNC, n);
+    t = now_sec();
+    dict = rbdict_journal_recover("rbbench.journal", RBDICT_INT_INT, NULL);
+    report("replay log", n, now_sec() - t);
+    j = rbdict_journal_open(dict, RBDICT_INT_INT, "rbbench.journal", NULL);
+    rbdict_journal_compact(j);
+    rbdict_journal_close(j);
+    rbdict_destroy(dict);
+    t = now_sec();
+    dict = rbdict_journal_recover("rbbench.journal", RBDICT_INT_INT, NULL);
+    report("recover snapshot", n, now_sec() - t);
+    rbdict_destroy(dict);
+
+    remove("rbbench.journal");
+    remove("rbbench.journal.snap");
+}
+
+/*
+ * Counting N increments over N / 4 random int keys: in memory against
+ * an LSM dict with a 16MB memtable, then point lookups
+ */
+static int64_t bench_inc(int64_t n)
+{
+    return n + 1;
+}
+
+static void bench_lsm(size_t n)
+{
+    struct rbdict_lsm_options opts = { NULL, 16 << 20, 4, RBDICT_LSM_SUM };
+    struct rbdict_lsm_stats stats;
+    struct rbdict* dict = rbdict_create_predefined(RBDICT_INT_INT);
+    struct rbdict_lsm* lsm = rbdict_lsm_create(RBDICT_INT_INT, &opts);
+    size_t i, nkeys = n / 4 + 1;
+    uint64_t seed = rng_state;
+    uintptr_t sum = 0;
+    void* v;
+    double t;
+
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        rbdict_int_update(dict, (void*)(uintptr_t)(rng_next() % nkeys), 1, bench_inc);
+    report("in memory int_update", n, now_sec() - t);
+
+    rng_state = seed;
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        rbdict_lsm_int_update(lsm, (void*)(uintptr_t)(rng_next() % nkeys), 1, bench_inc);
+    report("lsm int_update", n, now_sec() - t);
+
+    t = now_sec();
+    for (i = 0; i < n / 10; ++i)
+        if (rbdict_lsm_get(lsm, (void*)(uintptr_t)(rng_next() % nkeys), &v) == 0)
+            sum += (uintptr_t) v;
+    report("lsm get", n / 10, now_sec() - t);
+
+    rbdict_lsm_get_stats(lsm, &stats);
+    printf("  %-32s %10zu / %zu / %zu MB\n", "flushes / runs / run bytes",
+           stats.flushes, stats.runs, (size_t)(stats.run_bytes >> 20));
+
+    t = now_sec();
+    rbdict_lsm_compact(lsm);
+    report("compact (per update)", n, now_sec() - t);
+
+    if (sum == 42)
+        printf("\n");
+    rbdict_lsm_destroy(lsm);
+    rbdict_destroy(dict);
+}
+
+/*
+ * Range sums over 10% of N int keys: subtree aggregates against a
+ * cursor walk, and the insert cost of keeping the aggregates
+ */
+static void bench_aggregate(size_t n)
+{
+    struct rbdict* plain = rbdict_create_predefined(RBDICT_INT_INT);
+    struct rbdict* dict = rbdict_create_predefined(RBDICT_INT_INT | RBDICT_AGGREGATE);
+    size_t i, nq = 1000, span = n / 10;
+    void* values[256];
+    int64_t sum = 0;
+    double t;
+
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        rbdict_insert(plain, rng_next() % n, i % 100);
+    report("insert", n, now_sec() - t);
+
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        rbdict_insert(dict, rng_next() % n, i % 100);
+    report("insert with aggregates", n, now_sec() - t);
+
+    t = now_sec();
+    for (i = 0; i < nq; ++i) {
+        struct rbdict_cursor cur;
+        size_t lo = rng_next() % (n - span);
+        void* keys[256];
+        int k, filled;
+
+        rbdict_cursor_seek(plain, &cur, (void*)(uintptr_t) lo);
+        while ((filled = rbdict_export(&cur, keys, values, 256, 0)) > 0) {
+            for (k = 0; k < filled && (size_t)(uintptr_t) keys[k] < lo + span; ++k)
+                sum += (int64_t)(intptr_t) values[k];
+            if (k < filled)
+                break;
+        }
+    }
+    report("range sum by walk", nq, now_sec() - t);
+
+    t = now_sec();
+    for (i = 0; i < nq; ++i) {
+        size_t lo = rng_next() % (n - span);
+        sum += rbdict_range_sum(dict, (void*)(uintptr_t) lo, (void*)(uintptr_t)(lo + span));
+    }
+    report("range sum by aggregates", nq, now_sec() - t);
+
+    if (sum == 42)
+        printf("\n");
+    rbdict_destroy(plain);
+    rbdict_destroy(dict);
+}
+
+/*----------------------------------------------------------------*/
+
+struct stab {
+    int64_t at;
+    size_t hits;
+};
+
+static int stab_scan(const void* k, const void* v, void* user_data)
+{
+    const struct rbdict_interval* iv = (const struct rbdict_interval*) k;
+    struct stab* s = (struct stab*) user_data;
+
+    s->hits += iv->lo <= s->at && iv->hi >= s->at;
+    return 0;
+}
+
+static void bench_interval(size_t n)
+{
+    struct rbdict* dict = rbdict_create_predefined(RBDICT_INTERVAL_INT);
+    struct rbdict_interval iv;
+    struct stab s = { 0, 0 };
+    size_t i, nq = 100;
+    double t;
+
+    t = now_sec();
+    for (i = 0; i < n; ++i) {
+        iv.lo = rng_next() % n;
+        iv.hi = iv.lo + rng_next() % 100;
+        rbdict_insert_dup(dict, &iv, (void*)(uintptr_t) i);
+    }
+    report("insert intervals", n, now_sec() - t);
+
+    t = now_sec();
+    for (i = 0; i < nq; ++i) {
+        s.at = rng_next() % n;
+        rbdict_foreach(dict, stab_scan, &s);
+    }
+    report("stabbing query by scan", nq, now_sec() - t);
+
+    t = now_sec();
+    for (i = 0; i < nq * 1000; ++i) {
+        s.at = rng_next() % n;
+        s.hits += rbdict_foreach_overlap(dict, s.at, s.at, NULL, NULL);
+    }
+    report("stabbing query by max end", nq * 1000, now_sec() - t);
+
+    if (s.hits == 42)
+        printf("\n");
+    rbdict_destroy(dict);
+}
+
+/*----------------------------------------------------------------*/
+
+static void bench_latency(size_t n)
+{
+    struct rbdict* dict = rbdict_create_predefined(RBDICT_INT_INT);
+    struct rbdict_latency lat;
+    int64_t sum = 0;
+    size_t i;
+    double t;
+
+    for (i = 0; i < n; ++i)
+        rbdict_insert(dict, i, i);
+
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        sum += (int64_t) rbdict_search(dict, (void*)(uintptr_t)(rng_next() % n));
+    report("search", n, now_sec() - t);
+
+    rbdict_latency_enable(1);
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        sum += (int64_t) rbdict_search(dict, (void*)(uintptr_t)(rng_next() % n));
+    report("search with histograms", n, now_sec() - t);
+    rbdict_latency_enable(0);
+
+    if (rbdict_latency_get(RBDICT_LAT_SEARCH, &lat) == 0)
+        printf("  p50 %" PRIu64 " p99 %" PRIu64 " p99.9 %" PRIu64 " max %" PRIu64 " ns\n",
+               lat.p50_ns, lat.p99_ns, lat.p999_ns, lat.max_ns);
+
+    if (sum == -1)
+        printf("\n");
+    rbdict_destroy(dict);
+}
+
+/*----------------------------------------------------------------*/
+
+/* run JOB in steps of BUDGET pairs, returning the longest step */
+static double bench_job_steps(struct rbdict_job* job, size_t budget)
+{
+    double longest = 0;
+    int more;
+
+    do {
+        double t = now_sec();
+        more = rbdict_step(job, budget);
+        t = now_sec() - t;
+        if (t > longest)
+            longest = t;
+    } while (more > 0);
+    return longest;
+}
+
+static void bench_incremental(size_t n)
+{
+    struct rbdict* dict = rbdict_create_predefined(RBDICT_INT_INT);
+    struct rbdict* copy;
+    struct rbdict* copy2;
+    struct rbdict_job* job;
+    double t, pause;
+    size_t i;
+
+    for (i = 0; i < n; ++i)
+        rbdict_insert(dict, rng_next(), i);
+
+    t = now_sec();
+    copy = rbdict_clone(dict);
+    t = now_sec() - t;
+    report("clone", n, t);
+    printf("  %-32s %10.1f ms\n", "clone pause", t * 1e3);
+
+    t = now_sec();
+    job = rbdict_clone_incremental(dict);
+    pause = bench_job_steps(job, 1000);
+    copy2 = rbdict_job_finish(job);
+    report("incremental clone", n, now_sec() - t);
+    printf("  %-32s %10.1f ms\n", "longest clone step", pause * 1e3);
+
+    /* both copies were built in key order */
+    t = now_sec();
+    rbdict_destroy(copy);
+    t = now_sec() - t;
+    report("destroy", n, t);
+    printf("  %-32s %10.1f ms\n", "destroy pause", t * 1e3);
+
+    t = now_sec();
+    job = rbdict_destroy_async(copy2);
+    pause = bench_job_steps(job, 1000);
+    rbdict_job_finish(job);
+    report("incremental destroy", n, now_sec() - t);
+    printf("  %-32s %10.1f ms\n", "longest destroy step", pause * 1e3);
+
+    rbdict_destroy(dict);
+}
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Zipf (s = 1) draws over N ranks by binary search of the cumulative
+ * weights. Rank r maps to a scattered key so hot keys are spread over
+ * the tree.
+ */
+static void zipf_queries(size_t* queries, size_t nq, size_t n)
+{
+    double* cdf = (double*) malloc(n * sizeof(double));
+    double total = 0;
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        total += 1.0 / (double)(i + 1);
+        cdf[i] = total;
+    }
+
+    for (i = 0; i < nq; ++i) {
+        double u = (double)(rng_next() >> 11) / 9007199254740992.0 * total;
+        size_t lo = 0, hi = n - 1;
+
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (cdf[mid] < u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        queries[i] = (size_t)((lo * 0x9E3779B97F4A7C15ULL) % n);
+    }
+    free(cdf);
+}
+
+static void bench_zipf_run(const char* what, int flags, void** keys, size_t* queries, size_t n)
+{
+    struct rbdict* dict = rbdict_create_predefined(flags);
+    int64_t sum = 0;
+    size_t i;
+    double t;
+
+    for (i = 0; i < n; ++i)
+        rbdict_insert_dup(dict, keys[i], (void*)(uintptr_t) i);
+
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        sum += (int64_t) rbdict_search(dict, keys[queries[i]]);
+    report(what, n, now_sec() - t);
+
+    if (sum == -1)
+        printf("\n");
+    rbdict_destroy(dict);
+}
+
+static void bench_zipf(size_t n)
+{
+    size_t* queries = (size_t*) malloc(n * sizeof(size_t));
+    void** ints = (void**) malloc(n * sizeof(void*));
+    void** strs = (void**) malloc(n * sizeof(void*));
+    size_t i;
+
+    for (i = 0; i < n; ++i) {
+        char buf[64];
+        sprintf(buf, "user:%016" PRIx64, (uint64_t)(i * 0x9E3779B97F4A7C15ULL));
+        strs[i] = strdup(buf);
+        ints[i] = (void*)(uintptr_t) i;
+    }
+
+    zipf_queries(queries, n, n);
+    printf(" zipf, int keys\n");
+    bench_zipf_run("search", RBDICT_INT_INT, ints, queries, n);
+    bench_zipf_run("search RBDICT_HOT_CACHE", RBDICT_INT_INT | RBDICT_HOT_CACHE, ints, queries, n);
+    bench_zipf_run("search RBDICT_HASH_INDEX", RBDICT_INT_INT | RBDICT_HASH_INDEX, ints, queries, n);
+    printf(" zipf, string keys\n");
+    bench_zipf_run("search", RBDICT_STR_INT, strs, queries, n);
+    bench_zipf_run("search RBDICT_HOT_CACHE", RBDICT_STR_INT | RBDICT_HOT_CACHE, strs, queries, n);
+
+    for (i = 0; i < n; ++i)
+        queries[i] = rng_next() % n;
+    printf(" uniform, int keys\n");
+    bench_zipf_run("search", RBDICT_INT_INT, ints, queries, n);
+    bench_zipf_run("search RBDICT_HOT_CACHE", RBDICT_INT_INT | RBDICT_HOT_CACHE, ints, queries, n);
+
+    for (i = 0; i < n; ++i)
+        free(strs[i]);
+    free(strs);
+    free(ints);
+    free(queries);
+}
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Metrics counters: increments on existing keys, the usual case.
+ * Threads share one dict either behind a mutex around
+ * rbdict_int_update or as a RBDICT_CONCURRENT dict with rbdict_int_add
+ */
+#define COUNTER_KEYS 1024
+
+#ifndef _WIN32
+static pthread_mutex_t counter_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int counter_locked(const void* k, const void* v, void* user_data)
+{
+    pthread_mutex_lock(&counter_lock);
+    rbdict_int_update((struct rbdict*) user_data, (void*)((uintptr_t) v % COUNTER_KEYS), 1, bench_inc);
+    pthread_mutex_unlock(&counter_lock);
+    return 0;
+}
+#endif
+
+static int counter_add(const void* k, const void* v, void* user_data)
+{
+    rbdict_int_add((struct rbdict*) user_data, (void*)((uintptr_t) v % COUNTER_KEYS), 1);
+    return 0;
+}
+
+static void bench_counters_run(const char* what, struct rbdict* work, int flags, rbdict_visit_t f, unsigned nthreads)
+{
+    struct rbdict* dict = rbdict_create_predefined(RBDICT_INT_INT | flags);
+    void* user_data[64];
+    char name[64];
+    double t;
+    size_t i;
+
+    if (!dict)
+        return;
+    for (i = 0; i < COUNTER_KEYS; ++i)
+        rbdict_insert(dict, i, 0);
+    for (i = 0; i < nthreads; ++i)
+        user_data[i] = dict;
+
+    t = now_sec();
+    rbdict_parallel_foreach(work, nthreads, f, user_data);
+    t = now_sec() - t;
+    sprintf(name, "%s, %u threads", what, nthreads);
+    report(name, rbdict_size(work), t);
+    rbdict_destroy(dict);
+}
+
+static void bench_counters(size_t n)
+{
+    struct rbdict* dict = rbdict_create_predefined(RBDICT_INT_INT);
+    struct rbdict* work = rbdict_create_predefined(RBDICT_INT_INT);
+    unsigned ncpu = 1;
+    unsigned nthreads;
+    double t;
+    size_t i;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    ncpu = (unsigned) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (ncpu > 64)
+        ncpu = 64;
+
+    for (i = 0; i < COUNTER_KEYS; ++i)
+        rbdict_insert(dict, i, 0);
+    for (i = 0; i < n; ++i)
+        rbdict_insert(work, i, rng_next());
+
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        rbdict_int_update(dict, (void*)(uintptr_t)(i * 7919 % COUNTER_KEYS), 1, bench_inc);
+    report("int_update", n, now_sec() - t);
+
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        rbdict_int_add(dict, (void*)(uintptr_t)(i * 7919 % COUNTER_KEYS), 1);
+    report("int_add", n, now_sec() - t);
+
+    for (nthreads = 1; ; nthreads *= 2) {
+        if (nthreads > ncpu)
+            nthreads = ncpu;
+#ifndef _WIN32
+        bench_counters_run("mutex int_update", work, 0, counter_locked, nthreads);
+#endif
+        bench_counters_run("CONCURRENT int_add", work, RBDICT_CONCURRENT, counter_add, nthreads);
+        if (nthreads == ncpu)
+            break;
+    }
+
+    rbdict_destroy(work);
+    rbdict_destroy(dict);
+}
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Shared memory dict against a private one: lookups (the shared one
+ * copies string values out) and the memory each process would hold
+ */
+static void bench_shm(size_t n)
+{
+    struct rbdict* dict = rbdict_create_predefined(RBDICT_STR_STR);
+    struct rbdict_shm_options opts;
+    struct rbdict_shm* shm;
+    char** keys = (char**) malloc(n * sizeof(char*));
+    double t;
+    size_t i;
+    void* v;
+
+    for (i = 0; i < n; ++i) {
+        char buf[64];
+        sprintf(buf, "user:%016" PRIx64, (uint64_t)(i * 0x9E3779B97F4A7C15ULL));
+        keys[i] = strdup(buf);
+        sprintf(buf, "session:%zu", i);
+        rbdict_insert_dup(dict, keys[i], buf);
+    }
+
+    memset(&opts, 0, sizeof(opts));
+    opts.size = n * 256 + (1 << 20);
+    if ((shm = rbdict_shm_create(NULL, RBDICT_STR_STR, &opts)) == NULL) {
+        printf("  shared memory not available\n");
+        goto out;
+    }
+
+    t = now_sec();
+    rbdict_shm_load(shm, dict);
+    report("rbdict_shm_load", n, now_sec() - t);
+
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        rbdict_search(dict, keys[rng_next() % n]);
+    report("rbdict_search", n, now_sec() - t);
+
+    t = now_sec();
+    for (i = 0; i < n; ++i) {
+        if (rbdict_shm_get(shm, keys[rng_next() % n], &v) == 0)
+            free(v);
+    }
+    report("rbdict_shm_get", n, now_sec() - t);
+
+    printf("  %-32s %10.1f MB\n", "rbdict_mem_used", rbdict_mem_used(dict) / 1048576.0);
+    printf("  %-32s %10.1f MB\n", "rbdict_shm_mem_used", rbdict_shm_mem_used(shm) / 1048576.0);
+    rbdict_shm_close(shm);
+
+out:
+    for (i = 0; i < n; ++i)
+        free(keys[i]);
+    free(keys);
+    rbdict_destroy(dict);
+}
+
+/*----------------------------------------------------------------*/
+
+/*
+ * Shipping the changes of 1% of the keys to a replica: full diff,
+ * snapshot diff, and the cost of a change feed on the writes
+ */
+static int bench_count_diff(int change, const void* key, const void* old_value, const void* new_value, void* user_data)
+{
+    ++*(size_t*) user_data;
+    return 0;
+}
+
+static void bench_diff(size_t n)
+{
+    struct rbdict* dict = rbdict_create_predefined(RBDICT_INT_INT);
+    struct rbdict* copy;
+    struct rbdict_snapshot* snap;
+    struct rbdict_feed* feed;
+    size_t i, changes = 0;
+    char* buf = (char*) malloc(1 << 20);
+    size_t len;
+    double t;
+
+    for (i = 0; i < n; ++i)
+        rbdict_insert(dict, i, i);
+    copy = rbdict_clone(dict);
+    snap = rbdict_snapshot(dict);
+    for (i = 0; i < n / 100; ++i)
+        rbdict_insert_dup(dict, (void*)(uintptr_t)(rng_next() % n), (void*) 0);
+
+    t = now_sec();
+    rbdict_diff(copy, dict, bench_count_diff, &changes);
+    t = now_sec() - t;
+    printf("  %-32s %10.2f ms (%zu changes)\n", "rbdict_diff", t * 1e3, changes);
+
+    changes = 0;
+    t = now_sec();
+    rbdict_snapshot_diff(snap, bench_count_diff, &changes);
+    t = now_sec() - t;
+    printf("  %-32s %10.2f ms (%zu changes)\n", "rbdict_snapshot_diff", t * 1e3, changes);
+    rbdict_snapshot_release(snap);
+
+    t = now_sec();
+    for (i = 0; i < n; ++i)
+        rbdict_insert_dup(dict, (void*)(uintptr_t)(rng_next() % n), (void*)(uintptr_t) i);
+    report("insert_dup", n, now_sec() - t);
+
+    feed = rbdict_feed_open(dict, RBDICT_INT_INT, 1 << 20);
+    t = now_sec();
+    for (i = 0; i < n; ++i) {
+        rbdict_insert_dup(dict, (void*)(uintptr_t)(rng_next() % n), (void*)(uintptr_t) i);
+        if (i % 4096 == 0)
+            rbdict_feed_read(feed, buf, 1 << 20, &len);
+    }
+    report("insert_dup with feed", n, now_sec() - t);
+    rbdict_feed_close(feed);
+
+    free(buf);
+    rbdict_destroy(copy);
+    rbdict_destroy(dict);
+}
+
+/*----------------------------------------------------------------*/
+
+struct bench {
+    const char* name;
+    void (*run)(size_t n);
+    size_t default_n;
+};
+
+static const struct bench benches[] = {
+    { "int_keys", bench_int_keys, 1000000 },
+    { "point_lookup", bench_point_lookup, 1000000 },
+    { "iterate", bench_iterate, 1000000 },
+    { "parallel", bench_parallel, 10000000 },
+    { "arena", bench_arena, 10000000 },
+    { "frozen", bench_frozen, 10000000 },
+    { "journal", bench_journal, 1000000 },
+    { "lsm", bench_lsm, 10000000 },
+    { "aggregate", bench_aggregate, 1000000 },
+    { "interval", bench_interval, 1000000 },
+    { "latency", bench_latency, 1000000 },
+    { "incremental", bench_incremental, 1000000 },
+    { "zipf", bench_zipf, 1000000 },
+    { "counters", bench_counters, 1000000 },
+    { "shm", bench_shm, 1000000 },
+    { "diff", bench_diff, 1000000 },
+};
+
+int main(int argc, char* argv[])
+{
+    size_t i;
+    size_t nbench = sizeof(benches) / sizeof(benches[0]);
+
+    for (i = 0; i < nbench; ++i) {
+        size_t n = benches[i].default_n;
+
+        if (argc > 1 && strcmp(argv[1], benches[i].name) != 0)
+            continue;
+        if (argc > 2)
+            n = (size_t) strtoull(argv[2], NULL, 10);
+
+        printf("%s (n = %zu)\n", benches[i].name, n);
+        benches[i].run(n);
+    }
+
+    return 0;
+}
@@ -0,0 +1,257 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "rbdict.h"
+#include "rbdict_record.h"
+
+/*
+ * Change feed. The dict's change hook appends each change to a byte
+ * ring as one record:
+ *
+ *   u32 payload length, u8 op (PUT / DEL), key, value (PUT only)
+ *
+ * with the key and value encoded as in rbdict_record.h, as in the
+ * journal less the checksum. The hook is the only producer and one
+ * consumer drains the ring: HEAD and TAIL are free running byte
+ * counts, each written by one side only.
+ *
+ * A record that does not fit sets LOST and is dropped, as is every
+ * later one until the consumer has seen LOST, emptied the ring and
+ * cleared it; a replica applying the records that made it would
+ * silently diverge.
+ */
+enum { FEED_PUT = 1, FEED_DEL = 2 };
+
+struct rbdict_feed {
+    struct rbdict* dict;
+    int keytype;
+    int valtype;
+    char* ring;
+    uint64_t mask;
+    uint64_t head;                  /* producer */
+    uint64_t tail;                  /* consumer */
+    int lost;
+    char* scratch;                  /* the record being encoded */
+    size_t scratch_cap;
+};
+
+#ifdef __GNUC__
+#define FEED_LOAD(p)        __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define FEED_STORE(p, v)    __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#else
+#define FEED_LOAD(p)        (p)
+#define FEED_STORE(p, v)    ((p) = (v))
+#endif
+/*----------------------------------------------------------------*/
+
+/* copy LEN bytes between the ring at byte count POS and P */
+static void _ring_put(struct rbdict_feed* feed, uint64_t pos, const char* p, size_t len)
+{
+    size_t at = (size_t)(pos & feed->mask);
+    size_t first = (size_t)(feed->mask + 1) - at;
+
+    if (first > len)
+        first = len;
+    memcpy(feed->ring + at, p, first);
+    memcpy(feed->ring, p + first, len - first);
+}
+
+static void _ring_get(const struct rbdict_feed* feed, uint64_t pos, char* p, size_t len)
+{
+    size_t at = (size_t)(pos & feed->mask);
+    size_t first = (size_t)(feed->mask + 1) - at;
+
+    if (first > len)
+        first = len;
+    memcpy(p, feed->ring + at, first);
+    memcpy(p + first, feed->ring, len - first);
+}
+/*----------------------------------------------------------------*/
+
+static int _feed_hook(int op, const void* key, const void* value, void* user_data)
+{
+    struct rbdict_feed* feed = (struct rbdict_feed*) user_data;
+    size_t size = 4 + 1 + _rec_item_size(feed->keytype, 1, key);
+    char* out;
+
+    if (op == RBDICT_OP_TOUCH)
+        return 0;
+    if (op == RBDICT_OP_PUT)
+        size += _rec_item_size(feed->valtype, 0, value);
+
+    /* a slow replica must not fail the dict's writes */
+    if (FEED_LOAD(feed->lost))
+        return 0;
+    if (size > (feed->mask + 1) - (feed->head - FEED_LOAD(feed->tail))) {
+        FEED_STORE(feed->lost, 1);
+        return 0;
+    }
+
+    if (size > feed->scratch_cap) {
+        char* nbuf = (char*) realloc(feed->scratch, size);
+
+        if (!nbuf) {
+            FEED_STORE(feed->lost, 1);
+            return 0;
+        }
+        feed->scratch = nbuf;
+        feed->scratch_cap = size;
+    }
+
+    out = feed->scratch;
+    _rec_put_u32(out, (uint32_t)(size - 4));
+    out[4] = (char)(op == RBDICT_OP_PUT ? FEED_PUT : FEED_DEL);
+    out = _rec_item_put(out + 5, feed->keytype, 1, key);
+    if (op == RBDICT_OP_PUT)
+        _rec_item_put(out, feed->valtype, 0, value);
+
+    _ring_put(feed, feed->head, feed->scratch, size);
+    FEED_STORE(feed->head, feed->head + size);
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+struct rbdict_feed* rbdict_feed_open(struct rbdict* pRoot, int flags, size_t capacity)
+{
+    struct rbdict_feed* feed;
+
+    if (!capacity)
+        capacity = 1 << 20;
+    if (capacity & (capacity - 1)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* the dict has one hook, and something else has it */
+    if (rbdict_get_change_hook(pRoot, NULL)) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    if ((feed = (struct rbdict_feed*) calloc(1, sizeof(*feed))) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* applying a delete must remove what the reported one did */
+    if (_rec_types(flags, &feed->keytype, &feed->valtype) < 0 || (flags & RBDICT_MULTI)) {
+        free(feed);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ((feed->ring = (char*) malloc(capacity)) == NULL) {
+        free(feed);
+        errno = ENOMEM;
+        return NULL;
+    }
+    feed->dict = pRoot;
+    feed->mask = capacity - 1;
+    rbdict_set_change_hook(pRoot, _feed_hook, feed);
+    return feed;
+}
+/*----------------------------------------------------------------*/
+
+void rbdict_feed_close(struct rbdict_feed* feed)
+{
+    void* user_data;
+
+    if (rbdict_get_change_hook(feed->dict, &user_data) == _feed_hook && user_data == feed)
+        rbdict_set_change_hook(feed->dict, NULL, NULL);
+    free(feed->ring);
+    free(feed->scratch);
+    free(feed);
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_feed_read(struct rbdict_feed* feed, void* buf, size_t size, size_t* len)
+{
+    uint64_t head;
+    uint64_t tail = feed->tail;
+    char* out = (char*) buf;
+    size_t n = 0;
+
+    *len = 0;
+    if (FEED_LOAD(feed->lost)) {
+        /*
+         * the producer stays off the ring until LOST is cleared. HEAD
+         * is loaded after LOST, so it covers every record written
+         * before the loss and none of them is read after the resync
+         */
+        FEED_STORE(feed->tail, FEED_LOAD(feed->head));
+        FEED_STORE(feed->lost, 0);
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    head = FEED_LOAD(feed->head);
+
+    while (tail + n < head) {
+        char hdr[4];
+        size_t rec;
+
+        _ring_get(feed, tail + n, hdr, 4);
+        rec = 4 + (size_t) _rec_get_u32(hdr);
+        if (rec > size - n) {
+            if (n)
+                break;
+            *len = rec;
+            errno = ENOBUFS;
+            return -1;
+        }
+        _ring_get(feed, tail + n, out + n, rec);
+        n += rec;
+    }
+
+    FEED_STORE(feed->tail, tail + n);
+    *len = n;
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_feed_apply(struct rbdict* replica, int flags, const void* buf, size_t len)
+{
+    const char* p = (const char*) buf;
+    const char* end = p + len;
+    int keytype, valtype;
+
+    if (_rec_types(flags, &keytype, &valtype) < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (p < end) {
+        const char* rec_end;
+        struct rbdict_blob kb, vb;
+        void* key;
+        void* value = NULL;
+        uint32_t rec;
+        int op;
+
+        if (end - p < 5 || (rec = _rec_get_u32(p)) == 0 || (size_t)(end - p - 4) < rec) {
+            errno = EINVAL;
+            return -1;
+        }
+        rec_end = p + 4 + rec;
+        p += 4;
+        op = *p++;
+        if ((op != FEED_PUT && op != FEED_DEL) ||
+            _rec_item_get(&p, rec_end, keytype, 1, &key, &kb) < 0 ||
+            (op == FEED_PUT && _rec_item_get(&p, rec_end, valtype, 0, &value, &vb) < 0) ||
+            p != rec_end) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        if (op == FEED_PUT) {
+            if (rbdict_insert_dup(replica, key, value) < 0)
+                return -1;
+        }
+        else {
+            rbdict_delete(replica, key);
+        }
+    }
+    return 0;
+}
+/*----------------------------------------------------------------*/
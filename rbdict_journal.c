@@ -0,0 +1,832 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define open        _open
+#define read        _read
+#define write       _write
+#define close       _close
+#define lseek       _lseek
+#define fsync       _commit
+#define ftruncate   _chsize
+#else
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#include "rbdict.h"
+#include "rbdict_record.h"
+
+/*
+ * Write-ahead journal. Every change reported by the dict's change
+ * hook is appended as one record:
+ *
+ *   u32 payload length, u32 crc32 of the payload,
+ *   u8 op (PUT / DEL / TTL), key, value (PUT) or i64 deadline (TTL)
+ *
+ * with the key and value encoded as in rbdict_record.h. The log and
+ * the snapshot written by compaction start with a small header naming
+ * the key and value types.
+ *
+ * Records are buffered in memory. Writers that need durability wait
+ * for a log sequence number (LSN): the first waiter becomes the
+ * leader and writes and syncs everything buffered so far, the others
+ * wait for it, so concurrent commits share one fsync.
+ */
+#define JOURNAL_MAGIC   0x4a444252u     /* "RBDJ" */
+#define SNAPSHOT_MAGIC  0x53444252u     /* "RBDS" */
+#define JOURNAL_VERSION 1
+#define JOURNAL_HEADER  12
+
+enum { JREC_PUT = 1, JREC_DEL = 2, JREC_TTL = 3 };
+struct rbdict_journal {
+    struct rbdict* dict;
+    char* path;
+    int fd;
+    int keytype;
+    int valtype;
+    int sync;
+    unsigned sync_interval_ms;
+    size_t buffer_size;
+
+#ifndef _WIN32
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+#endif
+    char* buf;
+    size_t len;
+    size_t cap;
+    char* spare;
+    size_t spare_cap;
+
+    uint64_t lsn;               /* last appended */
+    uint64_t written_lsn;       /* handed to the OS */
+    uint64_t durable_lsn;       /* synced */
+    int busy;                   /* a leader is writing */
+    int error;                  /* sticky errno of a failed write */
+    int64_t last_sync_ms;
+};
+
+#ifdef _WIN32
+#define JLOCK(j)        ((void)0)
+#define JUNLOCK(j)      ((void)0)
+#define JWAIT(j)        ((void)0)
+#define JWAKE(j)        ((void)0)
+#else
+#define JLOCK(j)        pthread_mutex_lock(&(j)->lock)
+#define JUNLOCK(j)      pthread_mutex_unlock(&(j)->lock)
+#define JWAIT(j)        pthread_cond_wait(&(j)->cond, &(j)->lock)
+#define JWAKE(j)        pthread_cond_broadcast(&(j)->cond)
+#endif
+/*----------------------------------------------------------------*/
+
+static uint32_t crc_table[256];
+
+static void _crc_init(void)
+{
+    uint32_t i, j, c;
+
+    if (crc_table[1])
+        return;
+
+    for (i = 0; i < 256; ++i) {
+        c = i;
+        for (j = 0; j < 8; ++j)
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+/*----------------------------------------------------------------*/
+
+static uint32_t _crc32(const void* p, size_t len)
+{
+    const unsigned char* s = (const unsigned char*) p;
+    uint32_t c = 0xffffffffu;
+
+    while (len--)
+        c = crc_table[(c ^ *s++) & 0xff] ^ (c >> 8);
+    return c ^ 0xffffffffu;
+}
+/*----------------------------------------------------------------*/
+
+static int64_t _now_ms(void)
+{
+#ifdef _WIN32
+    return (int64_t) clock() * 1000 / CLOCKS_PER_SEC;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+/*----------------------------------------------------------------*/
+
+static int _sync_fd(int fd)
+{
+#if defined(__linux__)
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Sync the directory holding PATH, making a rename into it durable
+ */
+static int _sync_dir(const char* path)
+{
+#ifdef _WIN32
+    return 0;
+#else
+    const char* slash = strrchr(path, '/');
+    char* dir;
+    int fd, result;
+
+    if (!slash)
+        return _sync_dir("./");
+    if ((dir = (char*) malloc((size_t)(slash - path) + 2)) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(dir, path, (size_t)(slash - path) + 1);
+    dir[slash - path + 1] = '\0';
+
+    fd = open(dir, O_RDONLY);
+    free(dir);
+    if (fd < 0)
+        return -1;
+    result = fsync(fd);
+    close(fd);
+    return result;
+#endif
+}
+/*----------------------------------------------------------------*/
+
+static int _write_all(int fd, const char* p, size_t len)
+{
+    while (len) {
+        int n = (int) write(fd, p, (unsigned) (len > (1u << 30) ? (1u << 30) : len));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+static void _file_header(char* p, uint32_t magic, int keytype, int valtype)
+{
+    _rec_put_u32(p, magic);
+    _rec_put_u32(p + 4, JOURNAL_VERSION);
+    _rec_put_u32(p + 8, (uint32_t)(keytype << 8 | valtype));
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Append one record to BUF (grown as needed)
+ */
+static int _record_put(char** buf, size_t* len, size_t* cap,
+                       int keytype, int valtype,
+                       int op, const void* key, const void* value)
+{
+    size_t size = 1 + _rec_item_size(keytype, 1, key);
+    char* out;
+
+    if (op == JREC_PUT)
+        size += _rec_item_size(valtype, 0, value);
+    else if (op == JREC_TTL)
+        size += 8;
+
+    if (*len + 8 + size > *cap) {
+        size_t ncap = *cap ? *cap : 4096;
+        char* nbuf;
+
+        while (*len + 8 + size > ncap)
+            ncap *= 2;
+        if ((nbuf = (char*) realloc(*buf, ncap)) == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        *buf = nbuf;
+        *cap = ncap;
+    }
+
+    out = *buf + *len + 8;
+    *out = (char) op;
+    out = _rec_item_put(out + 1, keytype, 1, key);
+    if (op == JREC_PUT)
+        out = _rec_item_put(out, valtype, 0, value);
+    else if (op == JREC_TTL)
+        memcpy(out, value, 8);
+
+    _rec_put_u32(*buf + *len, (uint32_t) size);
+    _rec_put_u32(*buf + *len + 4, _crc32(*buf + *len + 8, size));
+    *len += 8 + size;
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Wait until every record up to LSN has been written (and synced
+ * when DURABLE). The first thread to get here writes the whole
+ * buffer on behalf of the others
+ */
+static int _journal_flush(struct rbdict_journal* j, uint64_t lsn, int durable)
+{
+    int result = 0;
+
+    JLOCK(j);
+    while (!j->error && (durable ? j->durable_lsn : j->written_lsn) < lsn) {
+        char* wbuf;
+        size_t wlen, wcap;
+        uint64_t upto;
+        int err = 0;
+
+        if (j->busy) {
+            JWAIT(j);
+            continue;
+        }
+
+        j->busy = 1;
+        wbuf = j->buf;
+        wlen = j->len;
+        wcap = j->cap;
+        upto = j->lsn;
+        j->buf = j->spare;
+        j->cap = j->spare_cap;
+        j->len = 0;
+        j->spare = NULL;
+        j->spare_cap = 0;
+        JUNLOCK(j);
+
+        if (wlen && _write_all(j->fd, wbuf, wlen) < 0)
+            err = errno;
+        if (!err && durable && _sync_fd(j->fd) < 0)
+            err = errno;
+
+        JLOCK(j);
+        j->spare = wbuf;
+        j->spare_cap = wcap;
+        j->busy = 0;
+        if (err) {
+            j->error = err;
+        }
+        else {
+            j->written_lsn = upto;
+            if (durable) {
+                j->durable_lsn = upto;
+                j->last_sync_ms = _now_ms();
+            }
+        }
+        JWAKE(j);
+    }
+
+    if (j->error) {
+        errno = j->error;
+        result = -1;
+    }
+    JUNLOCK(j);
+    return result;
+}
+/*----------------------------------------------------------------*/
+
+static int _journal_hook(int op, const void* key, const void* value, void* user_data)
+{
+    struct rbdict_journal* j = (struct rbdict_journal*) user_data;
+    uint64_t lsn;
+    size_t len;
+    int sync_now;
+    int rec = op == RBDICT_OP_PUT ? JREC_PUT : op == RBDICT_OP_TOUCH ? JREC_TTL : JREC_DEL;
+
+    JLOCK(j);
+    if (j->error) {
+        errno = j->error;
+        JUNLOCK(j);
+        return -1;
+    }
+    if (_record_put(&j->buf, &j->len, &j->cap, j->keytype, j->valtype, rec, key, value) < 0) {
+        JUNLOCK(j);
+        return -1;
+    }
+    lsn = ++j->lsn;
+    len = j->len;
+    sync_now = j->sync == RBDICT_JOURNAL_SYNC_COMMIT ||
+               (j->sync == RBDICT_JOURNAL_SYNC_INTERVAL &&
+                _now_ms() - j->last_sync_ms >= (int64_t) j->sync_interval_ms);
+    JUNLOCK(j);
+
+    if (sync_now)
+        return _journal_flush(j, lsn, 1);
+    if (len >= j->buffer_size)
+        return _journal_flush(j, lsn, 0);
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Read a whole file. *PSIZE gets its size
+ */
+static char* _read_file(const char* path, size_t* psize)
+{
+    int fd = open(path, O_RDONLY | O_BINARY);
+    struct stat st;
+    char* data;
+    size_t got = 0;
+
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) < 0 || (data = (char*) malloc((size_t) st.st_size + 1)) == NULL) {
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    while (got < (size_t) st.st_size) {
+        int n = (int) read(fd, data + got, (unsigned) ((size_t) st.st_size - got));
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        got += (size_t) n;
+    }
+    close(fd);
+
+    *psize = got;
+    return data;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Whether the bad record at POS is a torn tail: a write cut short by a
+ * crash, which only the last record can be. It runs up to or past the
+ * end of the image, or nothing but zeros follow
+ */
+static int _torn_tail(const char* data, size_t size, size_t pos)
+{
+    if (size - pos < 8 || (size - pos - 8) <= _rec_get_u32(data + pos))
+        return 1;
+    while (pos < size && data[pos] == 0)
+        ++pos;
+    return pos == size;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Walk the records of a log or snapshot image, calling F for each
+ * valid one. *PVALID gets the length of the valid prefix, which a torn
+ * last record ends. -1/EINVAL if the image is not of this dict type,
+ * EIO if a record before the end is corrupt, or F's errno if it fails
+ */
+typedef int (*record_visit_t)(int op, void* key, void* value, void* user_data);
+
+static int _scan_records(const char* data, size_t size, uint32_t magic,
+                         int keytype, int valtype,
+                         record_visit_t f, void* user_data, size_t* pvalid)
+{
+    size_t pos = JOURNAL_HEADER;
+
+    /* a header cut short by a crash leaves nothing to keep */
+    *pvalid = 0;
+    if (size < JOURNAL_HEADER)
+        return 0;
+    if (_rec_get_u32(data) != magic ||
+        _rec_get_u32(data + 4) != JOURNAL_VERSION ||
+        _rec_get_u32(data + 8) != (uint32_t)(keytype << 8 | valtype)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (size - pos >= 8) {
+        uint32_t len = _rec_get_u32(data + pos);
+        const char* p = data + pos + 8;
+        const char* end = p + len;
+        struct rbdict_blob kb, vb;
+        void* key;
+        void* value = NULL;
+        int64_t expire;
+        int op;
+
+        if (len == 0 || size - pos - 8 < len || _crc32(p, len) != _rec_get_u32(data + pos + 4))
+            break;
+
+        op = *p++;
+        if ((op != JREC_PUT && op != JREC_DEL && op != JREC_TTL) ||
+            _rec_item_get(&p, end, keytype, 1, &key, &kb) < 0 ||
+            (op == JREC_PUT && _rec_item_get(&p, end, valtype, 0, &value, &vb) < 0))
+            break;
+        if (op == JREC_TTL) {
+            if (end - p < 8)
+                break;
+            memcpy(&expire, p, 8);
+            value = &expire;
+            p += 8;
+        }
+        if (p != end)
+            break;
+
+        if (f && f(op, key, value, user_data) < 0) {
+            *pvalid = pos;
+            return -1;
+        }
+        pos += 8 + len;
+    }
+
+    *pvalid = pos;
+    if (pos < size && !_torn_tail(data, size, pos)) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+struct rbdict_journal* rbdict_journal_open(struct rbdict* dict,
+                                           int flags,
+                                           const char* path,
+                                           const struct rbdict_journal_options* opts)
+{
+    struct rbdict_journal* j;
+    char header[JOURNAL_HEADER];
+    char* data;
+    size_t size = 0, valid;
+
+    /* the dict has one hook, and something else has it */
+    if (rbdict_get_change_hook(dict, NULL)) {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    j = (struct rbdict_journal*) calloc(1, sizeof(*j));
+    if (!j) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    /* replaying a delete must remove what the logged one did */
+    if (_rec_types(flags, &j->keytype, &j->valtype) < 0 || (flags & RBDICT_MULTI)) {
+        free(j);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    _crc_init();
+    j->dict = dict;
+    j->sync = opts ? opts->sync : RBDICT_JOURNAL_NOSYNC;
+    j->sync_interval_ms = opts ? opts->sync_interval_ms : 0;
+    j->buffer_size = (opts && opts->buffer_size) ? opts->buffer_size : 64 * 1024;
+    j->last_sync_ms = _now_ms();
+    if ((j->path = (char*) malloc(strlen(path) + 1)) == NULL) {
+        free(j);
+        errno = ENOMEM;
+        return NULL;
+    }
+    strcpy(j->path, path);
+
+    /* keep the valid prefix of an existing log, drop a torn tail */
+    valid = 0;
+    if ((data = _read_file(path, &size)) != NULL) {
+        int bad = _scan_records(data, size, JOURNAL_MAGIC, j->keytype, j->valtype, NULL, NULL, &valid);
+
+        free(data);
+        if (bad) {
+            free(j->path);
+            free(j);
+            return NULL;
+        }
+    }
+
+    j->fd = open(path, O_WRONLY | O_CREAT | O_BINARY, 0644);
+    if (j->fd < 0)
+        goto err_open;
+
+    if (!valid) {
+        _file_header(header, JOURNAL_MAGIC, j->keytype, j->valtype);
+        if (ftruncate(j->fd, 0) < 0 || _write_all(j->fd, header, JOURNAL_HEADER) < 0)
+            goto err_open;
+        valid = JOURNAL_HEADER;
+    }
+    if (ftruncate(j->fd, (long) valid) < 0 || lseek(j->fd, (long) valid, SEEK_SET) < 0)
+        goto err_open;
+
+#ifndef _WIN32
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->cond, NULL);
+#endif
+
+    rbdict_set_change_hook(dict, _journal_hook, j);
+    return j;
+
+err_open:
+    if (j->fd >= 0)
+        close(j->fd);
+    free(j->path);
+    free(j);
+    return NULL;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_journal_close(struct rbdict_journal* j)
+{
+    int result = _journal_flush(j, j->lsn, 1);
+    void* user_data;
+
+    if (rbdict_get_change_hook(j->dict, &user_data) == _journal_hook && user_data == j)
+        rbdict_set_change_hook(j->dict, NULL, NULL);
+    if (close(j->fd) < 0)
+        result = -1;
+#ifndef _WIN32
+    pthread_mutex_destroy(&j->lock);
+    pthread_cond_destroy(&j->cond);
+#endif
+    free(j->buf);
+    free(j->spare);
+    free(j->path);
+    free(j);
+    return result;
+}
+/*----------------------------------------------------------------*/
+
+uint64_t rbdict_journal_lsn(struct rbdict_journal* j)
+{
+    uint64_t lsn;
+
+    JLOCK(j);
+    lsn = j->lsn;
+    JUNLOCK(j);
+    return lsn;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_journal_commit(struct rbdict_journal* j, uint64_t lsn)
+{
+    return _journal_flush(j, lsn, 1);
+}
+/*----------------------------------------------------------------*/
+
+struct snapshot_writer {
+    const struct rbdict* dict;
+    char* buf;
+    size_t len;
+    size_t cap;
+    int keytype;
+    int valtype;
+    int fd;
+    int failed;
+};
+
+static int _snapshot_pair(const void* key, const void* value, void* user_data)
+{
+    struct snapshot_writer* w = (struct snapshot_writer*) user_data;
+    int64_t expire;
+
+    if (w->failed)
+        return 0;
+
+    if (_record_put(&w->buf, &w->len, &w->cap, w->keytype, w->valtype, JREC_PUT, key, value) < 0 ||
+        (rbdict_get_expiry(w->dict, key, &expire) == 0 && expire != RBDICT_NO_EXPIRY &&
+         _record_put(&w->buf, &w->len, &w->cap, w->keytype, w->valtype, JREC_TTL, key, &expire) < 0) ||
+        (w->len >= 1024 * 1024 && (_write_all(w->fd, w->buf, w->len) < 0 || (w->len = 0)))) {
+        w->failed = errno ? errno : EIO;
+    }
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Write the dict's contents as a snapshot next to the log and start
+ * the log over. The snapshot replaces the old one atomically, and the
+ * rename is synced before the log is cut; a crash before that replays
+ * records the snapshot already has, which is harmless
+ */
+int rbdict_journal_compact(struct rbdict_journal* j)
+{
+    struct snapshot_writer w;
+    char header[JOURNAL_HEADER];
+    size_t plen = strlen(j->path);
+    char* snap = (char*) malloc(plen + 6);
+    char* tmp = (char*) malloc(plen + 10);
+    int result = -1;
+
+    memset(&w, 0, sizeof(w));
+    w.fd = -1;
+
+    if (!snap || !tmp) {
+        errno = ENOMEM;
+        goto out;
+    }
+    sprintf(snap, "%s.snap", j->path);
+    sprintf(tmp, "%s.snap.tmp", j->path);
+
+    if (_journal_flush(j, j->lsn, 1) < 0)
+        goto out;
+
+    if ((w.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644)) < 0)
+        goto out;
+
+    w.dict = j->dict;
+    w.keytype = j->keytype;
+    w.valtype = j->valtype;
+    _file_header(header, SNAPSHOT_MAGIC, j->keytype, j->valtype);
+    if (_write_all(w.fd, header, JOURNAL_HEADER) < 0)
+        goto out;
+
+    rbdict_foreach(j->dict, _snapshot_pair, &w);
+    if (w.failed) {
+        errno = w.failed;
+        goto out;
+    }
+    if (_write_all(w.fd, w.buf, w.len) < 0 || fsync(w.fd) < 0)
+        goto out;
+    close(w.fd);
+    w.fd = -1;
+
+#ifdef _WIN32
+    remove(snap);
+#endif
+    if (rename(tmp, snap) < 0 || _sync_dir(snap) < 0)
+        goto out;
+
+    /* everything logged so far is in the snapshot */
+    JLOCK(j);
+    if (ftruncate(j->fd, JOURNAL_HEADER) < 0 ||
+        lseek(j->fd, JOURNAL_HEADER, SEEK_SET) < 0 ||
+        fsync(j->fd) < 0) {
+        j->error = errno;
+        JUNLOCK(j);
+        goto out;
+    }
+    JUNLOCK(j);
+    result = 0;
+
+out:
+    if (w.fd >= 0) {
+        close(w.fd);
+        remove(tmp);
+    }
+    free(w.buf);
+    free(snap);
+    free(tmp);
+    return result;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Recovery: the snapshot holds sorted unique keys and is bulk loaded,
+ * the log is replayed on top of it
+ */
+struct snapshot_reader {
+    void** keys;
+    void** values;
+    struct rbdict_blob* kblobs;
+    struct rbdict_blob* vblobs;
+    size_t n;
+    size_t cap;
+};
+
+static int _snapshot_collect(int op, void* key, void* value, void* user_data)
+{
+    struct snapshot_reader* r = (struct snapshot_reader*) user_data;
+
+    /* deadlines go on once the pairs are loaded */
+    if (op == JREC_TTL)
+        return 0;
+    if (r->n == r->cap)
+        return -1;
+
+    if (r->kblobs && key) {
+        r->kblobs[r->n] = *(struct rbdict_blob*) key;
+        key = &r->kblobs[r->n];
+    }
+    if (r->vblobs && value) {
+        r->vblobs[r->n] = *(struct rbdict_blob*) value;
+        value = &r->vblobs[r->n];
+    }
+    r->keys[r->n] = key;
+    r->values[r->n] = value;
+    ++r->n;
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/* a dict without RBDICT_TTL drops deadlines, as does a pair since gone */
+static int _replay_ttl(int op, void* key, void* value, void* user_data)
+{
+    if (op == JREC_TTL)
+        rbdict_touch((struct rbdict*) user_data, key, *(int64_t*) value);
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+static int _replay_record(int op, void* key, void* value, void* user_data)
+{
+    struct rbdict* dict = (struct rbdict*) user_data;
+
+    if (op == JREC_TTL)
+        return _replay_ttl(op, key, value, dict);
+    if (op == JREC_DEL) {
+        rbdict_delete(dict, key);
+        return 0;
+    }
+    return rbdict_insert_dup(dict, key, value);
+}
+/*----------------------------------------------------------------*/
+
+struct rbdict* rbdict_journal_recover(const char* path, int flags, const struct rbdict_options* opts)
+{
+    struct rbdict* dict;
+    struct snapshot_reader r;
+    char* snap = (char*) malloc(strlen(path) + 6);
+    char* data;
+    size_t size = 0, valid;
+    int keytype, valtype, err;
+
+    if (!snap) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (_rec_types(flags, &keytype, &valtype) < 0 || (flags & RBDICT_MULTI) ||
+        (dict = rbdict_create_opt(NULL, flags, opts)) == NULL) {
+        free(snap);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    _crc_init();
+    sprintf(snap, "%s.snap", path);
+    memset(&r, 0, sizeof(r));
+
+    if ((data = _read_file(snap, &size)) != NULL) {
+        /* every record takes at least 13 bytes */
+        r.cap = size / 13 + 1;
+        r.keys = (void**) malloc(r.cap * sizeof(void*));
+        r.values = (void**) malloc(r.cap * sizeof(void*));
+        if (keytype == REC_KEY_BLOB)
+            r.kblobs = (struct rbdict_blob*) malloc(r.cap * sizeof(struct rbdict_blob));
+        if (valtype == REC_VAL_BLOB)
+            r.vblobs = (struct rbdict_blob*) malloc(r.cap * sizeof(struct rbdict_blob));
+
+        if (!r.keys || !r.values ||
+            (keytype == REC_KEY_BLOB && !r.kblobs) || (valtype == REC_VAL_BLOB && !r.vblobs)) {
+            errno = ENOMEM;
+            goto err_recover;
+        }
+
+        /* a snapshot is renamed into place whole: any damage is an error */
+        if (_scan_records(data, size, SNAPSHOT_MAGIC, keytype, valtype, _snapshot_collect, &r, &valid) < 0)
+            goto err_recover;
+        if (valid < size || size < JOURNAL_HEADER) {
+            errno = EIO;
+            goto err_recover;
+        }
+        if (rbdict_load_sorted(dict, r.keys, r.values, r.n) < 0)
+            goto err_recover;
+        if (flags & RBDICT_TTL)
+            _scan_records(data, size, SNAPSHOT_MAGIC, keytype, valtype, _replay_ttl, dict, &valid);
+
+        free(r.keys);
+        free(r.values);
+        free(r.kblobs);
+        free(r.vblobs);
+        free(data);
+        memset(&r, 0, sizeof(r));
+    }
+
+    if ((data = _read_file(path, &size)) != NULL &&
+        _scan_records(data, size, JOURNAL_MAGIC, keytype, valtype, _replay_record, dict, &valid) < 0)
+        goto err_recover;
+    free(data);
+
+    free(snap);
+    return dict;
+
+err_recover:
+    err = errno;
+    free(r.keys);
+    free(r.values);
+    free(r.kblobs);
+    free(r.vblobs);
+    free(data);
+    free(snap);
+    rbdict_destroy(dict);
+    errno = err;
+    return NULL;
+}
+/*----------------------------------------------------------------*/
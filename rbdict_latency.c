@@ -0,0 +1,349 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <time.h>
+#include <pthread.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define LAT_TSC 1
+#endif
+
+#include "rbdict.h"
+#include "rbdict_trace.h"
+
+/*
+ * Latency histograms. Each thread counts into its own block with
+ * plain relaxed stores, so recording takes no lock and no shared
+ * cache line. Blocks are chained for the readers; a thread's counts
+ * are folded into the retired block when it exits. The registry lock
+ * is only taken on a thread's first operation, at thread exit and by
+ * the readers.
+ *
+ * Buckets are log-linear in clock ticks: values below LAT_SUB are
+ * exact, larger ones keep LAT_SUB_BITS bits below the leading one,
+ * which bounds the error to 1/16 of the value.
+ */
+#define LAT_SUB_BITS 4
+#define LAT_SUB      (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS  ((64 - LAT_SUB_BITS + 1) * LAT_SUB)
+
+struct lat_counts {
+    uint64_t count[RBDICT_LAT_NOPS][LAT_BUCKETS];
+    uint64_t ticks[RBDICT_LAT_NOPS];
+};
+
+struct lat_thread {
+    struct lat_counts c;
+    struct lat_thread* next;
+    struct lat_thread** pprev;
+};
+
+int _rbdict_lat_on;
+
+#ifndef _WIN32
+
+static pthread_mutex_t lat_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t lat_once = PTHREAD_ONCE_INIT;
+static pthread_key_t lat_key;
+static __thread struct lat_thread* lat_self;
+static struct lat_thread* lat_threads;
+static struct lat_counts lat_retired;
+static struct lat_counts lat_base;
+
+/* tick / nanosecond pair taken at enable time, for the TSC rate */
+static uint64_t lat_tick0;
+static uint64_t lat_ns0;
+/*----------------------------------------------------------------*/
+
+static uint64_t _lat_mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+/*----------------------------------------------------------------*/
+
+uint64_t _rbdict_lat_now(void)
+{
+#ifdef LAT_TSC
+    return __rdtsc();
+#else
+    return _lat_mono_ns();
+#endif
+}
+/*----------------------------------------------------------------*/
+
+static __inline size_t _lat_bucket(uint64_t v)
+{
+    int e;
+
+    if (v < LAT_SUB)
+        return (size_t) v;
+    e = 63 - __builtin_clzll(v);
+    return (size_t)(e - LAT_SUB_BITS + 1) * LAT_SUB + ((v >> (e - LAT_SUB_BITS)) & (LAT_SUB - 1));
+}
+/*----------------------------------------------------------------*/
+
+/* smallest and largest tick values that fall in bucket B */
+static uint64_t _lat_bucket_low(size_t b)
+{
+    size_t e = b / LAT_SUB;
+
+    if (e == 0)
+        return b;
+    return (uint64_t)(LAT_SUB + b % LAT_SUB) << (e - 1);
+}
+
+static uint64_t _lat_bucket_high(size_t b)
+{
+    size_t e = b / LAT_SUB;
+
+    if (e == 0)
+        return b;
+    return _lat_bucket_low(b) + ((uint64_t) 1 << (e - 1)) - 1;
+}
+/*----------------------------------------------------------------*/
+
+static void _lat_fold(struct lat_counts* dst, const struct lat_counts* src)
+{
+    int op;
+    size_t b;
+
+    for (op = 0; op < RBDICT_LAT_NOPS; ++op) {
+        for (b = 0; b < LAT_BUCKETS; ++b)
+            dst->count[op][b] += __atomic_load_n(&src->count[op][b], __ATOMIC_RELAXED);
+        dst->ticks[op] += __atomic_load_n(&src->ticks[op], __ATOMIC_RELAXED);
+    }
+}
+/*----------------------------------------------------------------*/
+
+static void _lat_thread_exit(void* arg)
+{
+    struct lat_thread* t = (struct lat_thread*) arg;
+
+    pthread_mutex_lock(&lat_lock);
+    _lat_fold(&lat_retired, &t->c);
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    pthread_mutex_unlock(&lat_lock);
+    free(t);
+}
+/*----------------------------------------------------------------*/
+
+static void _lat_init(void)
+{
+    pthread_key_create(&lat_key, _lat_thread_exit);
+}
+/*----------------------------------------------------------------*/
+
+static struct lat_thread* _lat_register(void)
+{
+    struct lat_thread* t = (struct lat_thread*) calloc(1, sizeof(*t));
+
+    if (!t)
+        return NULL;
+
+    pthread_once(&lat_once, _lat_init);
+    pthread_mutex_lock(&lat_lock);
+    t->next = lat_threads;
+    t->pprev = &lat_threads;
+    if (lat_threads)
+        lat_threads->pprev = &t->next;
+    lat_threads = t;
+    pthread_mutex_unlock(&lat_lock);
+    pthread_setspecific(lat_key, t);
+    return t;
+}
+/*----------------------------------------------------------------*/
+
+void _rbdict_lat_record(int op, uint64_t start)
+{
+    struct lat_thread* t = lat_self;
+    uint64_t d = _rbdict_lat_now() - start;
+    size_t b;
+
+    if (!t && (t = lat_self = _lat_register()) == NULL)
+        return;
+
+    /* the only writer of its block: no read-modify-write needed */
+    b = _lat_bucket(d);
+    __atomic_store_n(&t->c.count[op][b], t->c.count[op][b] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&t->c.ticks[op], t->c.ticks[op] + d, __ATOMIC_RELAXED);
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_latency_enable(int on)
+{
+    pthread_mutex_lock(&lat_lock);
+    if (on && !_rbdict_lat_on) {
+        lat_ns0 = _lat_mono_ns();
+        lat_tick0 = _rbdict_lat_now();
+    }
+    __atomic_store_n(&_rbdict_lat_on, on != 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&lat_lock);
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/* current totals of every thread, minus the last reset */
+static void _lat_totals(struct lat_counts* total)
+{
+    struct lat_thread* t;
+    int op;
+    size_t b;
+
+    memcpy(total, &lat_retired, sizeof(*total));
+    for (t = lat_threads; t; t = t->next)
+        _lat_fold(total, &t->c);
+
+    for (op = 0; op < RBDICT_LAT_NOPS; ++op) {
+        for (b = 0; b < LAT_BUCKETS; ++b)
+            total->count[op][b] -= lat_base.count[op][b];
+        total->ticks[op] -= lat_base.ticks[op];
+    }
+}
+/*----------------------------------------------------------------*/
+
+void rbdict_latency_reset(void)
+{
+    struct lat_counts* total = (struct lat_counts*) malloc(sizeof(*total));
+
+    if (!total)
+        return;
+
+    pthread_mutex_lock(&lat_lock);
+    _lat_totals(total);
+    _lat_fold(&lat_base, total);
+    pthread_mutex_unlock(&lat_lock);
+    free(total);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Nanoseconds per tick. The TSC rate comes from the ticks and the
+ * monotonic time elapsed since NS0 and TICK0 (taken at enable), over
+ * at least 10ms. Runs without lat_lock: the wait must not hold up
+ * threads registering or exiting
+ */
+static double _lat_ns_per_tick(uint64_t ns0, uint64_t tick0)
+{
+#ifdef LAT_TSC
+    uint64_t ns, ticks;
+
+    while ((ns = _lat_mono_ns()) - ns0 < 10000000u)
+        ;
+    ticks = _rbdict_lat_now() - tick0;
+    return ticks ? (double)(ns - ns0) / (double) ticks : 1.0;
+#else
+    return 1.0;
+#endif
+}
+/*----------------------------------------------------------------*/
+
+/* upper end of the bucket holding the q-th fraction of the samples */
+static uint64_t _lat_quantile(const uint64_t* count, uint64_t n, double q)
+{
+    uint64_t rank = (uint64_t)(q * (double) n + 0.5);
+    uint64_t seen = 0;
+    size_t b;
+
+    if (rank < 1)
+        rank = 1;
+    for (b = 0; b < LAT_BUCKETS; ++b) {
+        seen += count[b];
+        if (seen >= rank)
+            return _lat_bucket_high(b);
+    }
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_latency_get(int op, struct rbdict_latency* lat)
+{
+    struct lat_counts* total;
+    const uint64_t* count;
+    double scale;
+    uint64_t ns0, tick0, n = 0;
+    size_t b, lo = 0, hi = 0;
+
+    if (op < 0 || op >= RBDICT_LAT_NOPS) {
+        errno = EINVAL;
+        return -1;
+    }
+    if ((total = (struct lat_counts*) malloc(sizeof(*total))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pthread_mutex_lock(&lat_lock);
+    _lat_totals(total);
+    if (!lat_tick0) {
+        lat_ns0 = _lat_mono_ns();
+        lat_tick0 = _rbdict_lat_now();
+    }
+    ns0 = lat_ns0;
+    tick0 = lat_tick0;
+    pthread_mutex_unlock(&lat_lock);
+    scale = _lat_ns_per_tick(ns0, tick0);
+
+    memset(lat, 0, sizeof(*lat));
+    count = total->count[op];
+    for (b = 0; b < LAT_BUCKETS; ++b) {
+        if (count[b]) {
+            if (!n)
+                lo = b;
+            hi = b;
+            n += count[b];
+        }
+    }
+
+    if (n) {
+        lat->count = n;
+        lat->mean_ns = (uint64_t)((double) total->ticks[op] * scale / (double) n);
+        lat->min_ns = (uint64_t)((double) _lat_bucket_low(lo) * scale);
+        lat->p50_ns = (uint64_t)((double) _lat_quantile(count, n, 0.50) * scale);
+        lat->p90_ns = (uint64_t)((double) _lat_quantile(count, n, 0.90) * scale);
+        lat->p99_ns = (uint64_t)((double) _lat_quantile(count, n, 0.99) * scale);
+        lat->p999_ns = (uint64_t)((double) _lat_quantile(count, n, 0.999) * scale);
+        lat->max_ns = (uint64_t)((double) _lat_bucket_high(hi) * scale);
+    }
+    free(total);
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+#else /* _WIN32 */
+
+uint64_t _rbdict_lat_now(void)
+{
+    return 0;
+}
+
+void _rbdict_lat_record(int op, uint64_t start)
+{
+}
+
+int rbdict_latency_enable(int on)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void rbdict_latency_reset(void)
+{
+}
+
+int rbdict_latency_get(int op, struct rbdict_latency* lat)
+{
+    errno = ENOSYS;
+    return -1;
+}
+/*----------------------------------------------------------------*/
+
+#endif
@@ -0,0 +1,1159 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define read        _read
+#define write       _write
+#define close       _close
+#define lseek       _lseek
+#else
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#include "rbdict.h"
+#include "rbdict_record.h"
+
+/*
+ * LSM dict. Changes go to an in-memory rbdict (the memtable); past a
+ * size threshold it is written out as an immutable sorted run file and
+ * started over. Lookups try the memtable, then the runs from newest to
+ * oldest. A background thread merges all runs into one when there are
+ * more than MAX_RUNS.
+ *
+ * A run record is a u32 length, a flags byte, the key and, with
+ * LSM_VALUE, the value (encoded as in rbdict_record.h). LSM_MASK
+ * hides the key's records in older runs: a put is VALUE | MASK, a
+ * delete MASK alone. In RBDICT_LSM_SUM dicts integer updates write
+ * VALUE alone, a delta added to the older records.
+ *
+ * Each run keeps a Bloom filter (10 bits per key) and every 32nd key
+ * in memory, so a lookup costs at most one read per run. Run files are
+ * scratch files unlinked once opened.
+ */
+#define LSM_VALUE           1
+#define LSM_MASK            2
+
+#define LSM_INDEX_STRIDE    32
+#define LSM_BLOOM_BITS      10
+#define LSM_BLOOM_HASHES    7
+#define LSM_WRITE_BUFFER    (1024 * 1024)
+#define LSM_READ_BUFFER     (64 * 1024)
+
+struct lsm_run {
+    struct lsm_run* next;           /* older */
+    int fd;
+    char* path;                     /* until unlinked */
+    uint64_t size;
+    size_t count;
+    uint64_t* bloom;
+    uint64_t bloom_mask;
+    size_t nindex;
+    uint64_t* index_off;
+    void** index_key;
+    size_t max_block;
+};
+
+struct rbdict_lsm {
+    int flags;
+    int keytype;
+    int valtype;
+    struct rbdict_lsm_options opts;
+    char* dir;
+
+    struct rbdict* mem;
+    struct rbdict* mask;            /* keys whose older records are hidden */
+    struct rbdict* order;           /* empty, compares keys for the merger */
+
+#ifndef _WIN32
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t compactor;
+#endif
+    struct lsm_run* runs;           /* newest first */
+    size_t nruns;
+    int compacting;
+    int stop;
+    int error;
+    unsigned seq;
+
+    char* scratch;
+    size_t scratch_cap;
+    struct rbdict_lsm_stats stats;
+};
+
+/* a decoded record. KEY / VALUE may point into KB / VB */
+struct lsm_rec {
+    int flags;
+    void* key;
+    void* value;
+    struct rbdict_blob kb;
+    struct rbdict_blob vb;
+};
+
+#ifdef _WIN32
+#define LLOCK(l)        ((void)0)
+#define LUNLOCK(l)      ((void)0)
+#define LWAIT(l)        ((void)0)
+#define LWAKE(l)        ((void)0)
+#else
+#define LLOCK(l)        pthread_mutex_lock(&(l)->lock)
+#define LUNLOCK(l)      pthread_mutex_unlock(&(l)->lock)
+#define LWAIT(l)        pthread_cond_wait(&(l)->cond, &(l)->lock)
+#define LWAKE(l)        pthread_cond_broadcast(&(l)->cond)
+#endif
+/*----------------------------------------------------------------*/
+
+static int _pread_all(int fd, char* p, size_t len, uint64_t off)
+{
+#ifdef _WIN32
+    if (lseek(fd, (long) off, SEEK_SET) < 0)
+        return -1;
+#endif
+    while (len) {
+#ifdef _WIN32
+        int n = read(fd, p, (unsigned) len);
+#else
+        ssize_t n = pread(fd, p, len, (off_t) off);
+#endif
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n == 0)
+                errno = EIO;
+            return -1;
+        }
+        p += n;
+        off += (uint64_t) n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+static int _write_all(int fd, const char* p, size_t len)
+{
+    while (len) {
+        int n = (int) write(fd, p, (unsigned) (len > (1u << 30) ? (1u << 30) : len));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+static int _grow(char** buf, size_t* cap, size_t need)
+{
+    size_t ncap = *cap ? *cap : 4096;
+    char* nbuf;
+
+    if (need <= *cap)
+        return 0;
+    while (ncap < need)
+        ncap *= 2;
+    if ((nbuf = (char*) realloc(*buf, ncap)) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    *buf = nbuf;
+    *cap = ncap;
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+static __inline uint64_t _mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+/*----------------------------------------------------------------*/
+
+static uint64_t _key_hash(const struct rbdict_lsm* lsm, const void* key)
+{
+    const unsigned char* s;
+    size_t len;
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    if (lsm->keytype == REC_KEY_NUM)
+        return _mix64((uint64_t)(uintptr_t) key);
+
+    if (lsm->keytype == REC_KEY_STR) {
+        s = (const unsigned char*) key;
+        len = strlen((const char*) key);
+    }
+    else {
+        s = (const unsigned char*) ((const struct rbdict_blob*) key)->data;
+        len = ((const struct rbdict_blob*) key)->len;
+    }
+
+    while (len--)
+        h = (h ^ *s++) * 0x100000001b3ULL;
+    return _mix64(h);
+}
+/*----------------------------------------------------------------*/
+
+static __inline void _bloom_add(struct lsm_run* run, uint64_t h)
+{
+    uint64_t step = (h >> 32) | 1;
+    int i;
+
+    for (i = 0; i < LSM_BLOOM_HASHES; ++i, h += step)
+        run->bloom[(h & run->bloom_mask) >> 6] |= 1ULL << (h & 63);
+}
+
+static __inline int _bloom_test(const struct lsm_run* run, uint64_t h)
+{
+    uint64_t step = (h >> 32) | 1;
+    int i;
+
+    for (i = 0; i < LSM_BLOOM_HASHES; ++i, h += step)
+        if ((run->bloom[(h & run->bloom_mask) >> 6] & (1ULL << (h & 63))) == 0)
+            return 0;
+    return 1;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Owned copies of keys (run index) and values (handed to callers)
+ */
+static void* _copy_item(int type, const void* p)
+{
+    void* res;
+
+    if (type == REC_KEY_NUM || !p)      /* REC_KEY_NUM == REC_VAL_INT */
+        return (void*) p;
+
+    if (type == REC_KEY_STR) {
+        if ((res = malloc(strlen((const char*) p) + 1)) != NULL)
+            strcpy((char*) res, (const char*) p);
+        return res;
+    }
+
+    return rbdict_blob_new(((const struct rbdict_blob*) p)->data,
+                           ((const struct rbdict_blob*) p)->len);
+}
+/*----------------------------------------------------------------*/
+
+static int _decode(const struct rbdict_lsm* lsm, const char* p, const char* end, struct lsm_rec* rec)
+{
+    if (p >= end)
+        return -1;
+
+    rec->flags = *p++;
+    rec->value = NULL;
+    if (_rec_item_get(&p, end, lsm->keytype, 1, &rec->key, &rec->kb) < 0)
+        return -1;
+    if ((rec->flags & LSM_VALUE) &&
+        _rec_item_get(&p, end, lsm->valtype, 0, &rec->value, &rec->vb) < 0)
+        return -1;
+    return p == end ? 0 : -1;
+}
+/*----------------------------------------------------------------*/
+
+static void _run_free(struct rbdict_lsm* lsm, struct lsm_run* run)
+{
+    size_t i;
+
+    if (run->fd >= 0)
+        close(run->fd);
+    if (run->path) {
+        remove(run->path);
+        free(run->path);
+    }
+    if (lsm->keytype != REC_KEY_NUM)
+        for (i = 0; i < run->nindex; ++i)
+            free(run->index_key[i]);
+    free(run->index_key);
+    free(run->index_off);
+    free(run->bloom);
+    free(run);
+}
+/*----------------------------------------------------------------*/
+
+struct run_writer {
+    struct rbdict_lsm* lsm;
+    struct lsm_run* run;
+    char* buf;
+    size_t len;
+    size_t cap;
+    size_t index_cap;
+    uint64_t block_start;
+};
+
+static int _run_begin(struct rbdict_lsm* lsm, size_t expect, struct run_writer* w)
+{
+    struct lsm_run* run = (struct lsm_run*) calloc(1, sizeof(*run));
+    uint64_t nbits = 64;
+
+    memset(w, 0, sizeof(*w));
+    w->lsm = lsm;
+    w->run = run;
+    if (!run) {
+        errno = ENOMEM;
+        return -1;
+    }
+    run->fd = -1;
+
+    while (nbits < (uint64_t) expect * LSM_BLOOM_BITS)
+        nbits *= 2;
+    run->bloom_mask = nbits - 1;
+    run->bloom = (uint64_t*) calloc((size_t)(nbits / 64), sizeof(uint64_t));
+    run->path = (char*) malloc(strlen(lsm->dir) + 40);
+    if (!run->bloom || !run->path) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    LLOCK(lsm);
+    sprintf(run->path, "%s/rbdict-lsm-%p-%u.run", lsm->dir, (void*) lsm, lsm->seq++);
+    LUNLOCK(lsm);
+
+    run->fd = open(run->path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0600);
+    if (run->fd < 0)
+        return -1;
+#ifndef _WIN32
+    /* gone with the process, however it ends */
+    unlink(run->path);
+    free(run->path);
+    run->path = NULL;
+#endif
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+static int _run_add(struct run_writer* w, int flags, const void* key, const void* value)
+{
+    struct rbdict_lsm* lsm = w->lsm;
+    struct lsm_run* run = w->run;
+    size_t size = 1 + _rec_item_size(lsm->keytype, 1, key);
+    uint64_t off = run->size + w->len;
+    char* out;
+
+    if (flags & LSM_VALUE)
+        size += _rec_item_size(lsm->valtype, 0, value);
+
+    if (run->count % LSM_INDEX_STRIDE == 0) {
+        if (run->nindex == w->index_cap) {
+            size_t ncap = w->index_cap ? 2 * w->index_cap : 64;
+            uint64_t* noff = (uint64_t*) realloc(run->index_off, ncap * sizeof(uint64_t));
+            void** nkey;
+
+            if (noff)
+                run->index_off = noff;
+            nkey = (void**) realloc(run->index_key, ncap * sizeof(void*));
+            if (nkey)
+                run->index_key = nkey;
+            if (!noff || !nkey) {
+                errno = ENOMEM;
+                return -1;
+            }
+            w->index_cap = ncap;
+        }
+        if ((run->index_key[run->nindex] = _copy_item(lsm->keytype, key)) == NULL && key) {
+            errno = ENOMEM;
+            return -1;
+        }
+        run->index_off[run->nindex++] = off;
+        if (off - w->block_start > run->max_block)
+            run->max_block = (size_t)(off - w->block_start);
+        w->block_start = off;
+    }
+
+    if (_grow(&w->buf, &w->cap, w->len + 4 + size) < 0)
+        return -1;
+
+    out = w->buf + w->len;
+    _rec_put_u32(out, (uint32_t) size);
+    out[4] = (char) flags;
+    out = _rec_item_put(out + 5, lsm->keytype, 1, key);
+    if (flags & LSM_VALUE)
+        _rec_item_put(out, lsm->valtype, 0, value);
+    w->len += 4 + size;
+
+    _bloom_add(run, _key_hash(lsm, key));
+    ++run->count;
+
+    if (w->len >= LSM_WRITE_BUFFER) {
+        if (_write_all(run->fd, w->buf, w->len) < 0)
+            return -1;
+        run->size += w->len;
+        w->len = 0;
+    }
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Finish the run. On failure (or FAILED) the run is freed
+ */
+static struct lsm_run* _run_end(struct run_writer* w, int failed)
+{
+    struct lsm_run* run = w->run;
+
+    if (!failed && w->len && _write_all(run->fd, w->buf, w->len) < 0)
+        failed = 1;
+    free(w->buf);
+
+    if (failed) {
+        int err = errno;
+        if (run)
+            _run_free(w->lsm, run);
+        errno = err;
+        return NULL;
+    }
+
+    run->size += w->len;
+    if (run->size - w->block_start > run->max_block)
+        run->max_block = (size_t)(run->size - w->block_start);
+    return run;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Sequential run reader for merges and foreach
+ */
+struct run_reader {
+    const struct rbdict_lsm* lsm;
+    struct lsm_run* run;
+    char* buf;
+    size_t cap;
+    size_t pos;
+    size_t len;
+    uint64_t off;
+    struct lsm_rec rec;
+};
+
+/*
+ * Step to the next record: 1, 0 at the end, -1 on error
+ */
+static int _reader_next(struct run_reader* r)
+{
+    uint32_t size;
+
+    for (;;) {
+        if (r->len - r->pos >= 4) {
+            size = _rec_get_u32(r->buf + r->pos);
+            if (r->len - r->pos >= 4 + (size_t) size)
+                break;
+        }
+        else {
+            size = 0;
+        }
+
+        if (r->off == r->run->size) {
+            if (r->pos == r->len)
+                return 0;
+            errno = EIO;
+            return -1;
+        }
+
+        /* keep the partial record, read more behind it */
+        if (r->pos)
+            memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+        if (_grow(&r->buf, &r->cap, r->len + 4 + (size_t) size) < 0 ||
+            _grow(&r->buf, &r->cap, LSM_READ_BUFFER) < 0)
+            return -1;
+        {
+            size_t want = r->cap - r->len;
+            if (want > r->run->size - r->off)
+                want = (size_t)(r->run->size - r->off);
+            if (_pread_all(r->run->fd, r->buf + r->len, want, r->off) < 0)
+                return -1;
+            r->len += want;
+            r->off += want;
+        }
+    }
+
+    if (_decode(r->lsm, r->buf + r->pos + 4, r->buf + r->pos + 4 + size, &r->rec) < 0) {
+        errno = EIO;
+        return -1;
+    }
+    r->pos += 4 + size;
+    return 1;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Point lookup in one run. REC may point into the lsm scratch buffer
+ */
+static int _run_lookup(struct rbdict_lsm* lsm, struct lsm_run* run,
+                       const void* key, uint64_t h, struct lsm_rec* rec)
+{
+    size_t lo = 0, hi = run->nindex, mid;
+    uint64_t start, end;
+    const char* p;
+    const char* bend;
+
+    if (run->count == 0)
+        return 0;
+
+    if (!_bloom_test(run, h)) {
+        ++lsm->stats.bloom_skips;
+        return 0;
+    }
+
+    /* last sampled key <= KEY */
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (rbdict_compare_keys(lsm->order, run->index_key[mid], key) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return 0;
+
+    start = run->index_off[lo - 1];
+    end = lo < run->nindex ? run->index_off[lo] : run->size;
+    if (_grow(&lsm->scratch, &lsm->scratch_cap, (size_t)(end - start)) < 0 ||
+        _pread_all(run->fd, lsm->scratch, (size_t)(end - start), start) < 0)
+        return -1;
+
+    p = lsm->scratch;
+    bend = p + (end - start);
+    while (bend - p >= 4) {
+        uint32_t size = _rec_get_u32(p);
+        int c;
+
+        if ((size_t)(bend - p - 4) < size || _decode(lsm, p + 4, p + 4 + size, rec) < 0) {
+            errno = EIO;
+            return -1;
+        }
+        c = rbdict_compare_keys(lsm->order, rec->key, key);
+        if (c == 0)
+            return 1;
+        if (c > 0)
+            return 0;
+        p += 4 + size;
+    }
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Merge the N runs starting at FIRST (newest first, down to the
+ * oldest) into one. All older records are seen, so tombstones are
+ * dropped and sums become plain values
+ */
+static struct lsm_run* _merge_runs(struct rbdict_lsm* lsm, struct lsm_run* first, size_t n)
+{
+    struct run_reader* r = (struct run_reader*) calloc(n, sizeof(*r));
+    struct run_writer w;
+    struct lsm_run* run = first;
+    size_t i, expect = 0;
+    int failed = 0, rc;
+
+    if (!r) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (i = 0; i < n; ++i, run = run->next) {
+        r[i].lsm = lsm;
+        r[i].run = run;
+        expect += run->count;
+    }
+
+    if (_run_begin(lsm, expect, &w) < 0)
+        failed = 1;
+
+    for (i = 0; i < n && !failed; ++i)
+        if ((rc = _reader_next(&r[i])) <= 0) {
+            r[i].run = NULL;
+            failed = rc < 0;
+        }
+
+    while (!failed) {
+        struct run_reader* min = NULL;
+        void* value = NULL;
+        int64_t sum = 0;
+        int have = 0, masked = 0;
+
+        for (i = 0; i < n; ++i)
+            if (r[i].run && (!min || rbdict_compare_keys(lsm->order, r[i].rec.key, min->rec.key) < 0))
+                min = &r[i];
+        if (!min)
+            break;
+
+        /* newest to oldest, until a record hides the rest */
+        for (i = 0; i < n; ++i) {
+            if (!r[i].run || rbdict_compare_keys(lsm->order, r[i].rec.key, min->rec.key) != 0)
+                continue;
+            if (!masked && (r[i].rec.flags & LSM_VALUE)) {
+                if (lsm->opts.merge == RBDICT_LSM_SUM)
+                    sum += (int64_t)(intptr_t) r[i].rec.value;
+                else if (!have)
+                    value = r[i].rec.value;
+                have = 1;
+            }
+            if (r[i].rec.flags & LSM_MASK)
+                masked = 1;
+        }
+
+        if (lsm->opts.merge == RBDICT_LSM_SUM)
+            value = (void*)(intptr_t) sum;
+        if (have && _run_add(&w, LSM_VALUE | LSM_MASK, min->rec.key, value) < 0) {
+            failed = 1;
+            break;
+        }
+
+        /* advance the others before MIN, whose key the compares use */
+        for (i = n; i-- > 0 && !failed; ) {
+            if (!r[i].run || &r[i] == min || rbdict_compare_keys(lsm->order, r[i].rec.key, min->rec.key) != 0)
+                continue;
+            if ((rc = _reader_next(&r[i])) <= 0) {
+                r[i].run = NULL;
+                failed = rc < 0;
+            }
+        }
+        if (min->run && !failed && (rc = _reader_next(min)) <= 0) {
+            min->run = NULL;
+            failed = rc < 0;
+        }
+    }
+
+    for (i = 0; i < n; ++i)
+        free(r[i].buf);
+    free(r);
+    return _run_end(&w, failed);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Replace all runs by their merge. Waits for a merge in progress
+ */
+static int _lsm_compact_all(struct rbdict_lsm* lsm)
+{
+    struct lsm_run* first;
+    struct lsm_run* merged;
+    struct lsm_run** pp;
+    size_t n;
+
+    LLOCK(lsm);
+    while (lsm->compacting)
+        LWAIT(lsm);
+    if (lsm->nruns < 2) {
+        LUNLOCK(lsm);
+        return 0;
+    }
+    lsm->compacting = 1;
+    first = lsm->runs;
+    n = lsm->nruns;
+    LUNLOCK(lsm);
+
+    /* runs flushed meanwhile go in front of FIRST, the rest is fixed */
+    merged = _merge_runs(lsm, first, n);
+
+    LLOCK(lsm);
+    if (merged) {
+        for (pp = &lsm->runs; *pp != first; pp = &(*pp)->next)
+            ;
+        *pp = merged;
+        lsm->nruns -= n - 1;
+        ++lsm->stats.compactions;
+    }
+    else {
+        lsm->error = errno;
+    }
+    lsm->compacting = 0;
+    LWAKE(lsm);
+    LUNLOCK(lsm);
+
+    if (!merged)
+        return -1;
+
+    while (n--) {
+        struct lsm_run* next = first->next;
+        _run_free(lsm, first);
+        first = next;
+    }
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+#ifndef _WIN32
+static void* _compactor(void* arg)
+{
+    struct rbdict_lsm* lsm = (struct rbdict_lsm*) arg;
+
+    LLOCK(lsm);
+    while (!lsm->stop) {
+        if (lsm->nruns > lsm->opts.max_runs && !lsm->compacting && !lsm->error) {
+            LUNLOCK(lsm);
+            _lsm_compact_all(lsm);
+            LLOCK(lsm);
+            continue;
+        }
+        LWAIT(lsm);
+    }
+    LUNLOCK(lsm);
+    return NULL;
+}
+#endif
+/*----------------------------------------------------------------*/
+
+/*
+ * Exported in key order in chunks, for merging the memtable with its
+ * mask
+ */
+struct mem_stream {
+    struct rbdict_cursor cur;
+    void* keys[256];
+    void* values[256];
+    int n;
+    int i;
+};
+
+static int _stream_next(struct mem_stream* s)
+{
+    if (s->i < s->n)
+        return 1;
+    s->i = 0;
+    s->n = rbdict_export(&s->cur, s->keys, s->values, 256, 0);
+    return s->n > 0;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_lsm_flush(struct rbdict_lsm* lsm)
+{
+    struct mem_stream* m;
+    struct mem_stream* k;
+    struct run_writer w;
+    struct lsm_run* run;
+    struct rbdict* mem;
+    struct rbdict* mask;
+    int failed = 0, hm, hk, c;
+
+    /* a failed background merge shows here */
+    LLOCK(lsm);
+    if (lsm->error) {
+        errno = lsm->error;
+        LUNLOCK(lsm);
+        return -1;
+    }
+    LUNLOCK(lsm);
+
+    if (rbdict_size(lsm->mem) == 0 && rbdict_size(lsm->mask) == 0)
+        return 0;
+
+    m = (struct mem_stream*) calloc(2, sizeof(*m));
+    if (!m) {
+        errno = ENOMEM;
+        return -1;
+    }
+    k = m + 1;
+    rbdict_cursor_first(lsm->mem, &m->cur);
+    rbdict_cursor_first(lsm->mask, &k->cur);
+
+    if (_run_begin(lsm, rbdict_size(lsm->mem) + rbdict_size(lsm->mask), &w) < 0)
+        failed = 1;
+
+    while (!failed) {
+        hm = _stream_next(m);
+        hk = _stream_next(k);
+        if (!hm && !hk)
+            break;
+
+        c = !hm ? 1 : !hk ? -1 : rbdict_compare_keys(lsm->order, m->keys[m->i], k->keys[k->i]);
+        if (c <= 0) {
+            int flags = LSM_VALUE;
+            if (lsm->opts.merge != RBDICT_LSM_SUM || c == 0)
+                flags |= LSM_MASK;
+            failed = _run_add(&w, flags, m->keys[m->i], m->values[m->i]) < 0;
+            ++m->i;
+            if (c == 0)
+                ++k->i;
+        }
+        else {
+            failed = _run_add(&w, LSM_MASK, k->keys[k->i], NULL) < 0;
+            ++k->i;
+        }
+    }
+    free(m);
+
+    if ((run = _run_end(&w, failed)) == NULL)
+        return -1;
+
+    mem = rbdict_create_predefined(lsm->flags);
+    mask = rbdict_create_predefined((lsm->flags & ~(RBDICT_STR_VAL | RBDICT_BLOB_VAL)) | RBDICT_INT_VAL);
+    if (!mem || !mask) {
+        if (mem)
+            rbdict_destroy(mem);
+        if (mask)
+            rbdict_destroy(mask);
+        _run_free(lsm, run);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    LLOCK(lsm);
+    run->next = lsm->runs;
+    lsm->runs = run;
+    ++lsm->nruns;
+    ++lsm->stats.flushes;
+    LWAKE(lsm);
+    LUNLOCK(lsm);
+
+    rbdict_destroy(lsm->mem);
+    rbdict_destroy(lsm->mask);
+    lsm->mem = mem;
+    lsm->mask = mask;
+
+#ifdef _WIN32
+    if (lsm->nruns > lsm->opts.max_runs && !lsm->compacting)
+        return _lsm_compact_all(lsm);
+#endif
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+static int _lsm_changed(struct rbdict_lsm* lsm)
+{
+    if (rbdict_mem_used(lsm->mem) + rbdict_mem_used(lsm->mask) >= lsm->opts.memtable_bytes)
+        return rbdict_lsm_flush(lsm);
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Exact match in an in-memory dict (rbdict_search can't tell a 0
+ * value from a miss)
+ */
+static int _mem_find(const struct rbdict_lsm* lsm, const struct rbdict* dict, const void* key, void** value)
+{
+    struct rbdict_cursor cur;
+    void* k;
+
+    rbdict_cursor_seek(dict, &cur, key);
+    if (rbdict_export(&cur, &k, value, 1, 0) != 1)
+        return 0;
+    return rbdict_compare_keys(lsm->order, k, key) == 0;
+}
+/*----------------------------------------------------------------*/
+
+struct rbdict_lsm* rbdict_lsm_create(int flags, const struct rbdict_lsm_options* opts)
+{
+    struct rbdict_lsm* lsm = (struct rbdict_lsm*) calloc(1, sizeof(*lsm));
+    const char* dir;
+    int key_flags;
+
+    if (!lsm) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (_rec_types(flags, &lsm->keytype, &lsm->valtype) < 0 || (flags & RBDICT_MULTI) ||
+        (opts && opts->merge == RBDICT_LSM_SUM && lsm->valtype != REC_VAL_INT)) {
+        free(lsm);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* just the types, the memtable needs none of the extras */
+    flags &= RBDICT_INT_KEY | RBDICT_UINT_KEY | RBDICT_DOUBLE_KEY | RBDICT_STR_KEY |
+             RBDICT_BLOB_KEY | RBDICT_INT_VAL | RBDICT_STR_VAL | RBDICT_BLOB_VAL;
+    key_flags = flags & ~(RBDICT_INT_VAL | RBDICT_STR_VAL | RBDICT_BLOB_VAL);
+
+    if (opts)
+        lsm->opts = *opts;
+    if (!lsm->opts.memtable_bytes)
+        lsm->opts.memtable_bytes = 64 << 20;
+    if (!lsm->opts.max_runs)
+        lsm->opts.max_runs = 4;
+    dir = lsm->opts.dir ? lsm->opts.dir : ".";
+
+    lsm->flags = flags;
+    lsm->dir = (char*) malloc(strlen(dir) + 1);
+    lsm->mem = rbdict_create_predefined(flags);
+    lsm->mask = rbdict_create_predefined(key_flags | RBDICT_INT_VAL);
+    lsm->order = rbdict_create_predefined(key_flags | RBDICT_INT_VAL);
+    if (!lsm->dir || !lsm->mem || !lsm->mask || !lsm->order)
+        goto err_create;
+    strcpy(lsm->dir, dir);
+    lsm->opts.dir = lsm->dir;
+
+#ifndef _WIN32
+    pthread_mutex_init(&lsm->lock, NULL);
+    pthread_cond_init(&lsm->cond, NULL);
+    if (pthread_create(&lsm->compactor, NULL, _compactor, lsm) != 0) {
+        pthread_mutex_destroy(&lsm->lock);
+        pthread_cond_destroy(&lsm->cond);
+        goto err_create;
+    }
+#endif
+    return lsm;
+
+err_create:
+    if (lsm->mem)
+        rbdict_destroy(lsm->mem);
+    if (lsm->mask)
+        rbdict_destroy(lsm->mask);
+    if (lsm->order)
+        rbdict_destroy(lsm->order);
+    free(lsm->dir);
+    free(lsm);
+    errno = ENOMEM;
+    return NULL;
+}
+/*----------------------------------------------------------------*/
+
+void rbdict_lsm_destroy(struct rbdict_lsm* lsm)
+{
+#ifndef _WIN32
+    LLOCK(lsm);
+    lsm->stop = 1;
+    LWAKE(lsm);
+    LUNLOCK(lsm);
+    pthread_join(lsm->compactor, NULL);
+    pthread_mutex_destroy(&lsm->lock);
+    pthread_cond_destroy(&lsm->cond);
+#endif
+
+    while (lsm->runs) {
+        struct lsm_run* next = lsm->runs->next;
+        _run_free(lsm, lsm->runs);
+        lsm->runs = next;
+    }
+    rbdict_destroy(lsm->mem);
+    rbdict_destroy(lsm->mask);
+    rbdict_destroy(lsm->order);
+    free(lsm->scratch);
+    free(lsm->dir);
+    free(lsm);
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_lsm_put(struct rbdict_lsm* lsm, const void* key, const void* value)
+{
+    if (rbdict_insert_dup(lsm->mem, (void*) key, (void*) value) < 0)
+        return -1;
+
+    /* a sum set to a value hides the older deltas */
+    if (lsm->opts.merge == RBDICT_LSM_SUM) {
+        if (rbdict_insert_dup(lsm->mask, (void*) key, (void*) 1) < 0)
+            return -1;
+    }
+    else {
+        rbdict_delete(lsm->mask, key);
+    }
+    return _lsm_changed(lsm);
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_lsm_delete(struct rbdict_lsm* lsm, const void* key)
+{
+    rbdict_delete(lsm->mem, key);
+    if (rbdict_insert_dup(lsm->mask, (void*) key, (void*) 1) < 0)
+        return -1;
+    return _lsm_changed(lsm);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Lookup through the memtable and the runs. Sums are added up, else
+ * the newest record wins. STR / BLOB values come back as copies
+ */
+static int _lsm_get(struct rbdict_lsm* lsm, const void* key, void** value, int copy)
+{
+    struct lsm_run* run;
+    struct lsm_rec rec;
+    void* v;
+    int64_t sum = 0;
+    int found = 0, rc = 0;
+    uint64_t h;
+
+    if (_mem_find(lsm, lsm->mem, key, &v)) {
+        if (lsm->opts.merge != RBDICT_LSM_SUM) {
+            *value = copy ? _copy_item(lsm->valtype, v) : v;
+            if (copy && !*value && v) {
+                errno = ENOMEM;
+                return -1;
+            }
+            return 0;
+        }
+        sum = (int64_t)(intptr_t) v;
+        found = 1;
+    }
+    if (_mem_find(lsm, lsm->mask, key, &v)) {
+        if (!found) {
+            errno = ENOENT;
+            return -1;
+        }
+        *value = (void*)(intptr_t) sum;
+        return 0;
+    }
+
+    h = _key_hash(lsm, key);
+    LLOCK(lsm);
+    for (run = lsm->runs; run; run = run->next) {
+        if ((rc = _run_lookup(lsm, run, key, h, &rec)) < 0)
+            break;
+        if (rc == 0)
+            continue;
+
+        if (rec.flags & LSM_VALUE) {
+            if (lsm->opts.merge == RBDICT_LSM_SUM) {
+                sum += (int64_t)(intptr_t) rec.value;
+            }
+            else {
+                *value = copy ? _copy_item(lsm->valtype, rec.value) : rec.value;
+                if (copy && !*value && rec.value) {
+                    errno = ENOMEM;
+                    rc = -1;
+                }
+                found = 1;
+                break;
+            }
+            found = 1;
+        }
+        if (rec.flags & LSM_MASK)
+            break;
+    }
+    LUNLOCK(lsm);
+
+    if (rc < 0)
+        return -1;
+    if (!found) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (lsm->opts.merge == RBDICT_LSM_SUM)
+        *value = (void*)(intptr_t) sum;
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_lsm_get(struct rbdict_lsm* lsm, const void* key, void** value)
+{
+    return _lsm_get(lsm, key, value, 1);
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_lsm_int_update(struct rbdict_lsm* lsm,
+                          const void* key,
+                          int64_t default_value,
+                          rbdict_iupdate_t f)
+{
+    void* v;
+
+    if (lsm->valtype != REC_VAL_INT) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /*
+     * blind write of a delta, the merges add it to the older ones. F
+     * adds a constant, f(0): a key new to the memory dict writes that
+     * if older records hold the key and DEFAULT_VALUE if none does, so
+     * only when the two differ does it take a lookup
+     */
+    if (lsm->opts.merge == RBDICT_LSM_SUM) {
+        int64_t delta = f(0);
+
+        if (delta != default_value && !_mem_find(lsm, lsm->mem, key, &v)) {
+            if (_lsm_get(lsm, key, &v, 0) == 0)
+                default_value = delta;
+            else if (errno != ENOENT)
+                return -1;
+        }
+        if (rbdict_int_update(lsm->mem, key, default_value, f) < 0)
+            return -1;
+        return _lsm_changed(lsm);
+    }
+
+    if (_mem_find(lsm, lsm->mem, key, &v)) {
+        if (rbdict_int_update(lsm->mem, key, default_value, f) < 0)
+            return -1;
+        return _lsm_changed(lsm);
+    }
+
+    if (_lsm_get(lsm, key, &v, 0) == 0)
+        v = (void*)(intptr_t) f((int64_t)(intptr_t) v);
+    else if (errno == ENOENT)
+        v = (void*)(intptr_t) default_value;
+    else
+        return -1;
+    return rbdict_lsm_put(lsm, key, v);
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_lsm_compact(struct rbdict_lsm* lsm)
+{
+    if (rbdict_lsm_flush(lsm) < 0)
+        return -1;
+    return _lsm_compact_all(lsm);
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_lsm_foreach(struct rbdict_lsm* lsm, rbdict_visit_t f, void* user_data)
+{
+    struct run_reader r;
+    int rc = 0;
+
+    if (rbdict_lsm_compact(lsm) < 0)
+        return -1;
+
+    /*
+     * One run left, with nothing older: a delta is the whole value and
+     * a tombstone hides nothing. Holding off compactions keeps the run
+     * alive without the lock, so F may call the lsm's get and put
+     */
+    memset(&r, 0, sizeof(r));
+    r.lsm = lsm;
+    LLOCK(lsm);
+    while (lsm->compacting)
+        LWAIT(lsm);
+    lsm->compacting = 1;
+    /* the oldest: runs flushed since the compaction go in front */
+    for (r.run = lsm->runs; r.run && r.run->next; r.run = r.run->next)
+        ;
+    LUNLOCK(lsm);
+
+    while (r.run && (rc = _reader_next(&r)) > 0)
+        if (r.rec.flags & LSM_VALUE)
+            f(r.rec.key, r.rec.value, user_data);
+    free(r.buf);
+
+    LLOCK(lsm);
+    lsm->compacting = 0;
+    LWAKE(lsm);
+    LUNLOCK(lsm);
+
+    return r.run && rc < 0 ? -1 : 0;
+}
+/*----------------------------------------------------------------*/
+
+void rbdict_lsm_get_stats(struct rbdict_lsm* lsm, struct rbdict_lsm_stats* stats)
+{
+    struct lsm_run* run;
+
+    LLOCK(lsm);
+    *stats = lsm->stats;
+    stats->runs = lsm->nruns;
+    stats->run_bytes = 0;
+    for (run = lsm->runs; run; run = run->next)
+        stats->run_bytes += run->size;
+    stats->memtable_bytes = rbdict_mem_used(lsm->mem) + rbdict_mem_used(lsm->mask);
+    LUNLOCK(lsm);
+}
+/*----------------------------------------------------------------*/
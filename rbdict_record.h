@@ -0,0 +1,155 @@
+#ifndef RBDICT_RECORD_H
+#define RBDICT_RECORD_H
+
+/*
+ * Binary encoding of built-in keys and values, shared by the journal
+ * and the LSM run files. Numeric keys and integer values take 8
+ * bytes. Strings (with their terminating NUL) and blobs take a u32
+ * length and the bytes; a value length of 0 stands for a NULL value.
+ * All in host byte order.
+ */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "rbdict.h"
+
+enum { REC_KEY_NUM = 1, REC_KEY_STR, REC_KEY_BLOB };
+enum { REC_VAL_INT = 1, REC_VAL_STR, REC_VAL_BLOB };
+
+/*
+ * Key and value types of a dict, -1 for the ones that cannot be
+ * encoded. Same precedence as rbdict_create_ex
+ */
+static __inline int _rec_types(int flags, int* keytype, int* valtype)
+{
+    if (flags & (RBDICT_INT_KEY | RBDICT_UINT_KEY | RBDICT_DOUBLE_KEY))
+        *keytype = REC_KEY_NUM;
+    else if (flags & RBDICT_STR_KEY)
+        *keytype = REC_KEY_STR;
+    else if (flags & RBDICT_BLOB_KEY)
+        *keytype = REC_KEY_BLOB;
+    else
+        return -1;
+
+    if (flags & RBDICT_INT_VAL)
+        *valtype = REC_VAL_INT;
+    else if (flags & RBDICT_STR_VAL)
+        *valtype = REC_VAL_STR;
+    else if (flags & RBDICT_BLOB_VAL)
+        *valtype = REC_VAL_BLOB;
+    else
+        return -1;
+
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+static __inline void _rec_put_u32(char* p, uint32_t v)
+{
+    memcpy(p, &v, 4);
+}
+
+static __inline uint32_t _rec_get_u32(const char* p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Encoded size of a key or value
+ */
+static __inline size_t _rec_item_size(int type, int is_key, const void* p)
+{
+    if (is_key ? type == REC_KEY_NUM : type == REC_VAL_INT)
+        return 8;
+    if (!p)
+        return 4;
+    if (type == REC_KEY_STR)   /* REC_KEY_STR == REC_VAL_STR */
+        return 4 + strlen((const char*) p) + 1;
+    return 4 + ((const struct rbdict_blob*) p)->len;
+}
+/*----------------------------------------------------------------*/
+
+static __inline char* _rec_item_put(char* out, int type, int is_key, const void* p)
+{
+    uint32_t len;
+
+    if (is_key ? type == REC_KEY_NUM : type == REC_VAL_INT) {
+        uint64_t v = (uint64_t)(uintptr_t) p;
+        memcpy(out, &v, 8);
+        return out + 8;
+    }
+
+    if (!p) {
+        _rec_put_u32(out, 0);
+        return out + 4;
+    }
+
+    if (type == REC_KEY_STR) {
+        len = (uint32_t) strlen((const char*) p) + 1;
+        _rec_put_u32(out, len);
+        memcpy(out + 4, p, len);
+    }
+    else {
+        const struct rbdict_blob* b = (const struct rbdict_blob*) p;
+        len = (uint32_t) b->len;
+        /* a blob value of length 0 must not read back as NULL */
+        _rec_put_u32(out, is_key ? len : len + 1);
+        if (len)
+            memcpy(out + 4, b->data, len);
+    }
+    return out + 4 + len;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Decode one item at *P (END bounds it). Strings point into the
+ * buffer, blobs are described in *BLOB
+ */
+static __inline int _rec_item_get(const char** p, const char* end, int type, int is_key,
+                     void** item, struct rbdict_blob* blob)
+{
+    uint32_t len;
+
+    if (is_key ? type == REC_KEY_NUM : type == REC_VAL_INT) {
+        uint64_t v;
+        if (end - *p < 8)
+            return -1;
+        memcpy(&v, *p, 8);
+        *item = (void*)(uintptr_t) v;
+        *p += 8;
+        return 0;
+    }
+
+    if (end - *p < 4)
+        return -1;
+    len = _rec_get_u32(*p);
+    *p += 4;
+
+    if (!is_key && len == 0) {
+        *item = NULL;
+        return 0;
+    }
+
+    if (type == REC_KEY_STR) {
+        if ((size_t)(end - *p) < len || len == 0 || (*p)[len - 1] != '\0')
+            return -1;
+        *item = (void*) *p;
+    }
+    else {
+        if (!is_key)
+            --len;
+        if ((size_t)(end - *p) < len)
+            return -1;
+        blob->len = len;
+        blob->data = *p;
+        *item = blob;
+    }
+    *p += len;
+    return 0;
+}
+
+#endif
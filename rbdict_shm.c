@@ -0,0 +1,868 @@
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "rbdict.h"
+#include "rbdict_record.h"
+
+/*
+ * Shared memory dict. The segment starts with a header and holds a
+ * left leaning red-black tree whose links are offsets from the start
+ * of the segment, so it reads the same at any mapping address. A node
+ * is followed by its key bytes (8 for numeric keys, the string with
+ * its NUL, the blob bytes); integer values sit in the node, others
+ * in a block of their own encoded as in rbdict_record.h.
+ *
+ * One writer, any number of readers. The writer makes every change
+ * between two increments of SEQ, so SEQ is odd meanwhile. A reader
+ * notes an even SEQ, descends and copies the value out, and starts
+ * over if SEQ moved. A reader racing the writer can see torn links,
+ * so every offset is checked against the mapping before use and the
+ * descent is bounded in depth: a torn read costs a retry, never a
+ * fault. A writer that dies inside a change leaves SEQ odd for good,
+ * so readers give up on one change after SHM_STUCK_MS.
+ *
+ * Blocks come from a bump pointer and are recycled through free lists
+ * of four size classes per power of two (32, 40, 48, 56, 64, 80 ...
+ * bytes). A freed block is unreachable from the tree by the time a
+ * reader could see its new contents.
+ */
+#define SHM_MAGIC       0x314d48534442524fULL   /* "ORBDSHM1" */
+#define SHM_MIN_BLOCK   32
+#define SHM_CLASSES     240
+#define SHM_MAX_DEPTH   128
+#define SHM_STUCK_MS    1000            /* a change taking longer is abandoned */
+
+struct shm_header {
+    uint64_t magic;
+    uint64_t size;
+    int32_t flags;
+    uint32_t unused;
+    uint64_t seq;
+    uint64_t root;
+    uint64_t count;
+    uint64_t top;                   /* start of the never used space */
+    uint64_t used;                  /* bytes in live blocks */
+    uint64_t free[SHM_CLASSES];
+};
+
+struct shm_node {
+    uint64_t left;
+    uint64_t right;
+    uint64_t value;                 /* the integer, or the value block */
+    uint32_t klen;
+    uint32_t red;
+};
+
+struct rbdict_shm {
+    char* base;
+    uint64_t size;                  /* bytes mapped */
+    struct shm_header* hdr;
+    int fd;                         /* writer's descriptor, -1 for readers */
+    int keytype;
+    int valtype;
+    struct rbdict* order;           /* empty, compares numeric keys */
+};
+
+/* a key to look for, in the stored form */
+struct shm_key {
+    const void* key;
+    const char* data;
+    uint64_t len;
+    uint64_t num;
+};
+
+#define NODE(shm, off)  ((struct shm_node*)((shm)->base + (off)))
+
+#ifndef _WIN32
+
+#define SHM_LOAD(p)     __atomic_load_n(&(p), __ATOMIC_RELAXED)
+/*----------------------------------------------------------------*/
+
+/* size class of a block of SIZE bytes, and the bytes it really takes */
+static size_t _shm_class(uint64_t size, uint64_t* csize)
+{
+    uint64_t step, n;
+    int e;
+
+    if (size <= SHM_MIN_BLOCK) {
+        *csize = SHM_MIN_BLOCK;
+        return 0;
+    }
+    e = 63 - __builtin_clzll(size - 1);         /* 2^e < size <= 2^(e+1) */
+    step = (uint64_t) 1 << (e - 2);
+    n = (size + step - 1) / step;               /* 5 .. 8 */
+    *csize = n * step;
+    return (size_t)(e - 5) * 4 + (size_t)(n - 5) + 1;
+}
+/*----------------------------------------------------------------*/
+
+static uint64_t _shm_alloc(struct rbdict_shm* shm, uint64_t size)
+{
+    struct shm_header* hdr = shm->hdr;
+    uint64_t csize;
+    size_t c = _shm_class(size, &csize);
+    uint64_t off = hdr->free[c];
+
+    if (off) {
+        memcpy(&hdr->free[c], shm->base + off, 8);
+    }
+    else {
+        if (csize > shm->size - hdr->top) {
+            errno = ENOMEM;
+            return 0;
+        }
+        off = hdr->top;
+        hdr->top += csize;
+    }
+    hdr->used += csize;
+    return off;
+}
+/*----------------------------------------------------------------*/
+
+static void _shm_free(struct rbdict_shm* shm, uint64_t off, uint64_t size)
+{
+    struct shm_header* hdr = shm->hdr;
+    uint64_t csize;
+    size_t c = _shm_class(size, &csize);
+
+    memcpy(shm->base + off, &hdr->free[c], 8);
+    hdr->free[c] = off;
+    hdr->used -= csize;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * The writer's side of the sequence count
+ */
+static __inline void _shm_write_begin(struct rbdict_shm* shm)
+{
+    __atomic_store_n(&shm->hdr->seq, shm->hdr->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static __inline void _shm_write_end(struct rbdict_shm* shm)
+{
+    __atomic_store_n(&shm->hdr->seq, shm->hdr->seq + 1, __ATOMIC_RELEASE);
+}
+/*----------------------------------------------------------------*/
+
+static int _shm_make_key(const struct rbdict_shm* shm, const void* key, struct shm_key* q)
+{
+    q->key = key;
+    if (shm->keytype == REC_KEY_NUM) {
+        q->num = (uint64_t)(uintptr_t) key;
+        q->data = (const char*) &q->num;
+        q->len = 8;
+        return 0;
+    }
+    if (!key) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (shm->keytype == REC_KEY_STR) {
+        q->data = (const char*) key;
+        q->len = strlen((const char*) key) + 1;
+    }
+    else {
+        q->data = (const char*)((const struct rbdict_blob*) key)->data;
+        q->len = ((const struct rbdict_blob*) key)->len;
+    }
+    if (q->len > UINT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/* Q against the KLEN key bytes of node N */
+static int _shm_compare(const struct rbdict_shm* shm,
+                        const struct shm_key* q,
+                        const struct shm_node* n,
+                        uint64_t klen)
+{
+    const char* k = (const char*)(n + 1);
+    uint64_t len = q->len < klen ? q->len : klen;
+    int result;
+
+    if (shm->keytype == REC_KEY_NUM) {
+        uint64_t v;
+        memcpy(&v, k, 8);
+        return rbdict_compare_keys(shm->order, q->key, (void*)(uintptr_t) v);
+    }
+
+    /* strings keep their NUL, so this orders them as strcmp does */
+    if ((result = len ? memcmp(q->data, k, (size_t) len) : 0) != 0)
+        return result;
+    return (q->len > klen) - (q->len < klen);
+}
+/*----------------------------------------------------------------*/
+
+/* LEN bytes at OFF lie within the mapping, past the header */
+static __inline int _shm_valid(const struct rbdict_shm* shm, uint64_t off, uint64_t len)
+{
+    return off >= sizeof(struct shm_header) && (off & 7) == 0 &&
+           off < shm->size && len <= shm->size - off;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Descend to Q. 0 with the node's value field in *PV, 1 when missing,
+ * -1 on a torn read (an offset out of bounds or a cycle)
+ */
+static int _shm_find(const struct rbdict_shm* shm, const struct shm_key* q, uint64_t* pv)
+{
+    uint64_t off = SHM_LOAD(shm->hdr->root);
+    int depth;
+
+    for (depth = 0; off && depth < SHM_MAX_DEPTH; ++depth) {
+        const struct shm_node* n = NODE(shm, off);
+        uint32_t klen;
+        int cmp;
+
+        if (!_shm_valid(shm, off, sizeof(*n)))
+            return -1;
+        klen = SHM_LOAD(n->klen);
+        if (!_shm_valid(shm, off, sizeof(*n) + (uint64_t) klen) ||
+            (shm->keytype == REC_KEY_NUM && klen != 8))
+            return -1;
+
+        if ((cmp = _shm_compare(shm, q, n, klen)) == 0) {
+            *pv = SHM_LOAD(n->value);
+            return 0;
+        }
+        off = cmp < 0 ? SHM_LOAD(n->left) : SHM_LOAD(n->right);
+    }
+    return off ? -1 : 1;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Private copy of the value block at OFF. -1 on a torn read, -2 when
+ * out of memory
+ */
+static int _shm_copy_value(const struct rbdict_shm* shm, uint64_t off, void** copy)
+{
+    const char* p = shm->base + off;
+    const char* start;
+    struct rbdict_blob blob;
+    void* item;
+
+    if (!_shm_valid(shm, off, 4))
+        return -1;
+    if (_rec_item_get(&p, shm->base + shm->size, shm->valtype, 0, &item, &blob) < 0)
+        return -1;
+
+    if (!item) {
+        *copy = NULL;
+        return 0;
+    }
+    if (shm->valtype == REC_VAL_STR) {
+        size_t len;
+
+        start = (const char*) item;
+        len = (size_t)(p - start);
+        if ((*copy = malloc(len)) == NULL)
+            return -2;
+        memcpy(*copy, start, len);
+        ((char*) *copy)[len - 1] = '\0';
+    }
+    else if ((*copy = rbdict_blob_new(blob.data, blob.len)) == NULL) {
+        return -2;
+    }
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Left leaning red-black tree (Sedgewick), on offsets. The writer is
+ * the only one to run these
+ */
+static __inline int _is_red(const struct rbdict_shm* shm, uint64_t h)
+{
+    return h && NODE(shm, h)->red;
+}
+
+static uint64_t _rotate_left(struct rbdict_shm* shm, uint64_t h)
+{
+    struct shm_node* n = NODE(shm, h);
+    uint64_t x = n->right;
+    struct shm_node* xn = NODE(shm, x);
+
+    n->right = xn->left;
+    xn->left = h;
+    xn->red = n->red;
+    n->red = 1;
+    return x;
+}
+
+static uint64_t _rotate_right(struct rbdict_shm* shm, uint64_t h)
+{
+    struct shm_node* n = NODE(shm, h);
+    uint64_t x = n->left;
+    struct shm_node* xn = NODE(shm, x);
+
+    n->left = xn->right;
+    xn->right = h;
+    xn->red = n->red;
+    n->red = 1;
+    return x;
+}
+
+static void _flip_colors(struct rbdict_shm* shm, uint64_t h)
+{
+    struct shm_node* n = NODE(shm, h);
+
+    n->red = !n->red;
+    NODE(shm, n->left)->red = !NODE(shm, n->left)->red;
+    NODE(shm, n->right)->red = !NODE(shm, n->right)->red;
+}
+/*----------------------------------------------------------------*/
+
+static uint64_t _balance(struct rbdict_shm* shm, uint64_t h)
+{
+    if (_is_red(shm, NODE(shm, h)->right) && !_is_red(shm, NODE(shm, h)->left))
+        h = _rotate_left(shm, h);
+    if (_is_red(shm, NODE(shm, h)->left) && _is_red(shm, NODE(shm, NODE(shm, h)->left)->left))
+        h = _rotate_right(shm, h);
+    if (_is_red(shm, NODE(shm, h)->left) && _is_red(shm, NODE(shm, h)->right))
+        _flip_colors(shm, h);
+    return h;
+}
+
+static uint64_t _move_red_left(struct rbdict_shm* shm, uint64_t h)
+{
+    _flip_colors(shm, h);
+    if (_is_red(shm, NODE(shm, NODE(shm, h)->right)->left)) {
+        NODE(shm, h)->right = _rotate_right(shm, NODE(shm, h)->right);
+        h = _rotate_left(shm, h);
+        _flip_colors(shm, h);
+    }
+    return h;
+}
+
+static uint64_t _move_red_right(struct rbdict_shm* shm, uint64_t h)
+{
+    _flip_colors(shm, h);
+    if (_is_red(shm, NODE(shm, NODE(shm, h)->left)->left)) {
+        h = _rotate_right(shm, h);
+        _flip_colors(shm, h);
+    }
+    return h;
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Link NODE (red, key Q) under H, or when Q is there move NODE's value
+ * into that node and return the replaced one in *OLD
+ */
+static uint64_t _llrb_put(struct rbdict_shm* shm,
+                          uint64_t h,
+                          const struct shm_key* q,
+                          uint64_t node,
+                          int* found,
+                          uint64_t* old)
+{
+    struct shm_node* n;
+    int cmp;
+
+    if (!h)
+        return node;
+
+    n = NODE(shm, h);
+    cmp = _shm_compare(shm, q, n, n->klen);
+    if (cmp < 0) {
+        n->left = _llrb_put(shm, n->left, q, node, found, old);
+    }
+    else if (cmp > 0) {
+        n->right = _llrb_put(shm, n->right, q, node, found, old);
+    }
+    else {
+        *found = 1;
+        *old = n->value;
+        n->value = NODE(shm, node)->value;
+    }
+    return _balance(shm, h);
+}
+/*----------------------------------------------------------------*/
+
+/* unlink the smallest node under H into *MIN */
+static uint64_t _llrb_delete_min(struct rbdict_shm* shm, uint64_t h, uint64_t* min)
+{
+    if (!NODE(shm, h)->left) {
+        *min = h;
+        return 0;
+    }
+    if (!_is_red(shm, NODE(shm, h)->left) && !_is_red(shm, NODE(shm, NODE(shm, h)->left)->left))
+        h = _move_red_left(shm, h);
+    NODE(shm, h)->left = _llrb_delete_min(shm, NODE(shm, h)->left, min);
+    return _balance(shm, h);
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Unlink the node of Q, which must be in the tree, into *GONE. Nodes
+ * carry their keys, so the successor takes the place of a node with
+ * two children rather than its key
+ */
+static uint64_t _llrb_delete(struct rbdict_shm* shm, uint64_t h, const struct shm_key* q, uint64_t* gone)
+{
+    struct shm_node* n = NODE(shm, h);
+
+    if (_shm_compare(shm, q, n, n->klen) < 0) {
+        if (!_is_red(shm, n->left) && !_is_red(shm, NODE(shm, n->left)->left))
+            n = NODE(shm, h = _move_red_left(shm, h));
+        n->left = _llrb_delete(shm, n->left, q, gone);
+    }
+    else {
+        if (_is_red(shm, n->left))
+            n = NODE(shm, h = _rotate_right(shm, h));
+        if (_shm_compare(shm, q, n, n->klen) == 0 && !n->right) {
+            *gone = h;
+            return 0;
+        }
+        if (!_is_red(shm, n->right) && !_is_red(shm, NODE(shm, n->right)->left))
+            n = NODE(shm, h = _move_red_right(shm, h));
+        if (_shm_compare(shm, q, n, n->klen) == 0) {
+            uint64_t x;
+            struct shm_node* xn;
+
+            n->right = _llrb_delete_min(shm, n->right, &x);
+            xn = NODE(shm, x);
+            xn->left = n->left;
+            xn->right = n->right;
+            xn->red = n->red;
+            *gone = h;
+            h = x;
+        }
+        else {
+            n->right = _llrb_delete(shm, n->right, q, gone);
+        }
+    }
+    return _balance(shm, h);
+}
+/*----------------------------------------------------------------*/
+
+static void _shm_free_value(struct rbdict_shm* shm, uint64_t v)
+{
+    const char* p;
+    void* item;
+    struct rbdict_blob blob;
+
+    if (shm->valtype == REC_VAL_INT)
+        return;
+    p = shm->base + v;
+    _rec_item_get(&p, shm->base + shm->size, shm->valtype, 0, &item, &blob);
+    _shm_free(shm, v, (uint64_t)(p - (shm->base + v)));
+}
+/*----------------------------------------------------------------*/
+
+/*
+ * Map FD. The writer initializes the header of its new segment
+ */
+static struct rbdict_shm* _shm_map(int fd, uint64_t size, int flags, int writer)
+{
+    struct rbdict_shm* shm = (struct rbdict_shm*) calloc(1, sizeof(*shm));
+    void* base;
+    int key_flags;
+
+    if (!shm) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    base = mmap(NULL, (size_t) size, writer ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        free(shm);
+        return NULL;
+    }
+    shm->base = (char*) base;
+    shm->size = size;
+    shm->hdr = (struct shm_header*) base;
+    shm->fd = writer ? fd : -1;
+
+    if (writer) {
+        shm->hdr->size = size;
+        shm->hdr->flags = flags;
+        shm->hdr->top = sizeof(struct shm_header);
+        __atomic_store_n(&shm->hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    }
+    else if (__atomic_load_n(&shm->hdr->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+        munmap(base, (size_t) size);
+        free(shm);
+        errno = EINVAL;
+        return NULL;
+    }
+    else {
+        flags = shm->hdr->flags;
+    }
+
+    key_flags = flags & (RBDICT_INT_KEY | RBDICT_UINT_KEY | RBDICT_DOUBLE_KEY | RBDICT_STR_KEY | RBDICT_BLOB_KEY);
+    if (_rec_types(flags, &shm->keytype, &shm->valtype) < 0 ||
+        (shm->order = rbdict_create_predefined(key_flags | RBDICT_INT_VAL)) == NULL) {
+        munmap(base, (size_t) size);
+        free(shm);
+        errno = writer ? ENOMEM : EINVAL;
+        return NULL;
+    }
+    return shm;
+}
+/*----------------------------------------------------------------*/
+
+struct rbdict_shm* rbdict_shm_create(const char* name, int flags, const struct rbdict_shm_options* opts)
+{
+    uint64_t size = (opts && opts->size) ? opts->size : (64 << 20);
+    struct rbdict_shm* shm;
+    int keytype, valtype;
+    int fd, err;
+
+    if (_rec_types(flags, &keytype, &valtype) < 0 || (flags & RBDICT_MULTI) ||
+        size < sizeof(struct shm_header) + SHM_MIN_BLOCK) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (name) {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    }
+    else {
+#ifdef MFD_CLOEXEC
+        fd = memfd_create("rbdict", MFD_CLOEXEC);
+#else
+        errno = ENOSYS;
+        fd = -1;
+#endif
+    }
+    if (fd < 0)
+        return NULL;
+
+    /* sparse: pages are allocated as blocks first touch them */
+    if (ftruncate(fd, (off_t) size) < 0 || (shm = _shm_map(fd, size, flags, 1)) == NULL) {
+        err = errno;
+        if (name)
+            shm_unlink(name);
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+    return shm;
+}
+/*----------------------------------------------------------------*/
+
+struct rbdict_shm* rbdict_shm_open_fd(int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) < 0)
+        return NULL;
+    if ((uint64_t) st.st_size < sizeof(struct shm_header)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return _shm_map(fd, (uint64_t) st.st_size, 0, 0);
+}
+/*----------------------------------------------------------------*/
+
+struct rbdict_shm* rbdict_shm_open(const char* name)
+{
+    struct rbdict_shm* shm;
+    int fd = shm_open(name, O_RDONLY, 0);
+    int err;
+
+    if (fd < 0)
+        return NULL;
+    shm = rbdict_shm_open_fd(fd);
+    err = errno;
+    close(fd);
+    errno = err;
+    return shm;
+}
+/*----------------------------------------------------------------*/
+
+void rbdict_shm_close(struct rbdict_shm* shm)
+{
+    munmap(shm->base, (size_t) shm->size);
+    if (shm->fd >= 0)
+        close(shm->fd);
+    rbdict_destroy(shm->order);
+    free(shm);
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_shm_fd(const struct rbdict_shm* shm)
+{
+    return shm->fd;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_shm_put(struct rbdict_shm* shm, const void* key, const void* value)
+{
+    struct shm_key q;
+    struct shm_node* n;
+    uint64_t node, v, old = 0;
+    int found = 0;
+
+    if (shm->fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    if (_shm_make_key(shm, key, &q) < 0)
+        return -1;
+
+    /* the new blocks are out of the readers' reach until linked */
+    if (shm->valtype == REC_VAL_INT) {
+        v = (uint64_t)(uintptr_t) value;
+    }
+    else {
+        uint64_t vsize = _rec_item_size(shm->valtype, 0, value);
+
+        if (vsize > UINT32_MAX) {
+            errno = EINVAL;
+            return -1;
+        }
+        if ((v = _shm_alloc(shm, vsize)) == 0)
+            return -1;
+        _rec_item_put(shm->base + v, shm->valtype, 0, value);
+    }
+    if ((node = _shm_alloc(shm, sizeof(*n) + q.len)) == 0) {
+        _shm_free_value(shm, v);
+        return -1;
+    }
+    n = NODE(shm, node);
+    n->left = n->right = 0;
+    n->value = v;
+    n->klen = (uint32_t) q.len;
+    n->red = 1;
+    memcpy(n + 1, q.data, (size_t) q.len);
+
+    _shm_write_begin(shm);
+    shm->hdr->root = _llrb_put(shm, shm->hdr->root, &q, node, &found, &old);
+    NODE(shm, shm->hdr->root)->red = 0;
+    if (found) {
+        _shm_free(shm, node, sizeof(*n) + q.len);
+        _shm_free_value(shm, old);
+    }
+    else {
+        ++shm->hdr->count;
+    }
+    _shm_write_end(shm);
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_shm_delete(struct rbdict_shm* shm, const void* key)
+{
+    struct shm_key q;
+    struct shm_node* n;
+    uint64_t root, gone, v;
+
+    if (shm->fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    if (_shm_make_key(shm, key, &q) < 0)
+        return -1;
+    if (_shm_find(shm, &q, &v) != 0) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    _shm_write_begin(shm);
+    root = shm->hdr->root;
+    if (!_is_red(shm, NODE(shm, root)->left) && !_is_red(shm, NODE(shm, root)->right))
+        NODE(shm, root)->red = 1;
+    if ((root = shm->hdr->root = _llrb_delete(shm, root, &q, &gone)) != 0)
+        NODE(shm, root)->red = 0;
+    n = NODE(shm, gone);
+    _shm_free_value(shm, n->value);
+    _shm_free(shm, gone, sizeof(*n) + n->klen);
+    --shm->hdr->count;
+    _shm_write_end(shm);
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+struct shm_load {
+    struct rbdict_shm* shm;
+    int error;
+};
+
+static int _shm_load_pair(const void* key, const void* value, void* user_data)
+{
+    struct shm_load* ld = (struct shm_load*) user_data;
+
+    if (!ld->error && rbdict_shm_put(ld->shm, key, value) < 0)
+        ld->error = errno;
+    return 0;
+}
+
+int rbdict_shm_load(struct rbdict_shm* shm, const struct rbdict* pRoot)
+{
+    struct shm_load ld;
+
+    ld.shm = shm;
+    ld.error = shm->fd < 0 ? EBADF : 0;
+    if (!ld.error)
+        rbdict_foreach(pRoot, _shm_load_pair, &ld);
+    if (ld.error) {
+        errno = ld.error;
+        return -1;
+    }
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+static int64_t _shm_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+/*----------------------------------------------------------------*/
+
+int rbdict_shm_get(const struct rbdict_shm* shm, const void* key, void** value)
+{
+    struct shm_key q;
+    uint64_t busy_seq = 0;
+    int64_t busy_since = 0;
+
+    if (_shm_make_key(shm, key, &q) < 0)
+        return -1;
+
+    for (;;) {
+        uint64_t seq = __atomic_load_n(&shm->hdr->seq, __ATOMIC_ACQUIRE);
+        void* copy = NULL;
+        uint64_t v = 0;
+        int rc;
+
+        /* wait out the writer's change, but not one it never ends */
+        if (seq & 1) {
+            if (seq != busy_seq) {
+                busy_seq = seq;
+                busy_since = _shm_now_ms();
+            }
+            else if (_shm_now_ms() - busy_since >= SHM_STUCK_MS) {
+                errno = EAGAIN;
+                return -1;
+            }
+            sched_yield();
+            continue;
+        }
+
+        rc = _shm_find(shm, &q, &v);
+        if (rc == 0 && shm->valtype != REC_VAL_INT)
+            rc = _shm_copy_value(shm, v, &copy);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (SHM_LOAD(shm->hdr->seq) != seq) {
+            free(copy);
+            continue;
+        }
+
+        switch (rc) {
+        case 0:
+            *value = shm->valtype == REC_VAL_INT ? (void*)(uintptr_t) v : copy;
+            return 0;
+        case 1:
+            errno = ENOENT;
+            return -1;
+        case -2:
+            errno = ENOMEM;
+            return -1;
+        default:
+            /* a consistent read that does not make sense */
+            errno = EIO;
+            return -1;
+        }
+    }
+}
+/*----------------------------------------------------------------*/
+
+size_t rbdict_shm_size(const struct rbdict_shm* shm)
+{
+    return (size_t) SHM_LOAD(shm->hdr->count);
+}
+/*----------------------------------------------------------------*/
+
+size_t rbdict_shm_mem_used(const struct rbdict_shm* shm)
+{
+    return (size_t)(sizeof(struct shm_header) + SHM_LOAD(shm->hdr->used));
+}
+/*----------------------------------------------------------------*/
+
+#else /* _WIN32 */
+
+struct rbdict_shm* rbdict_shm_create(const char* name, int flags, const struct rbdict_shm_options* opts)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+struct rbdict_shm* rbdict_shm_open(const char* name)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+struct rbdict_shm* rbdict_shm_open_fd(int fd)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void rbdict_shm_close(struct rbdict_shm* shm)
+{
+}
+
+int rbdict_shm_fd(const struct rbdict_shm* shm)
+{
+    return -1;
+}
+
+int rbdict_shm_put(struct rbdict_shm* shm, const void* key, const void* value)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int rbdict_shm_delete(struct rbdict_shm* shm, const void* key)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int rbdict_shm_load(struct rbdict_shm* shm, const struct rbdict* pRoot)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int rbdict_shm_get(const struct rbdict_shm* shm, const void* key, void** value)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+size_t rbdict_shm_size(const struct rbdict_shm* shm)
+{
+    return 0;
+}
+
+size_t rbdict_shm_mem_used(const struct rbdict_shm* shm)
+{
+    return 0;
+}
+/*----------------------------------------------------------------*/
+
+#endif
@@ -6,6 +6,12 @@
 #include <inttypes.h>
 #include <ctype.h>
 
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
+
 #include "rbdict.h"
 
 const char* word_file = "words.txt";
@@ -15,6 +21,14 @@ static int64_t incint(int64_t n)
     return n + 1;
 }
 
+static void check(int cond, const char* what)
+{
+    if (!cond) {
+        fprintf(stderr, "FAILED: %s\n", what);
+        exit(1);
+    }
+}
+
 struct rbdict* build_hash_from_words_str_str()
 {
     char word[1000];
@@ -193,12 +207,2357 @@ void test_rbdict_int_int()
     rbdict_destroy(htab2);
 }
 
+struct prefix_ctx {
+    const char* prefix;
+    size_t count;
+};
+
+int count_prefix_elem(const char* k, const char* v, void* user_data)
+{
+    struct prefix_ctx* ctx = (struct prefix_ctx*) user_data;
+
+    if (strncmp(k, ctx->prefix, strlen(ctx->prefix)) == 0)
+        ++ctx->count;
+    return 0;
+}
+
+void test_rbdict_prefix()
+{
+    static const char* prefixes[] = { "a", "ab", "amoeb", "be", "zz", "" };
+    size_t index;
+
+    struct rbdict* htab = build_hash_from_words_str_str();
+
+    for (index = 0; index < sizeof(prefixes) / sizeof(prefixes[0]); ++index) {
+        struct prefix_ctx ctx = { prefixes[index], 0 };
+        size_t n;
+
+        rbdict_foreach(htab, (rbdict_visit_t) count_prefix_elem, &ctx);
+        n = rbdict_count_prefix(htab, prefixes[index], 0);
+        printf("prefix '%s' count = %zu\n", prefixes[index], n);
+        check(n == ctx.count, "prefix count matches full scan");
+
+        if (ctx.count > 3)
+            check(rbdict_count_prefix(htab, prefixes[index], 3) == 3, "prefix limit");
+    }
+
+    rbdict_foreach_prefix(htab, "amoeb", 0, (rbdict_visit_t) print_elem, NULL);
+    rbdict_destroy(htab);
+}
+
+void test_rbdict_blob()
+{
+    static const unsigned char k1[] = { 0, 1, 2 };
+    static const unsigned char k2[] = { 0, 1, 2, 0 };
+    static const unsigned char k3[] = { 0, 1, 3 };
+    static const unsigned char k4[] = { 0 };
+    struct rbdict_blob* keys[4];
+    struct rbdict_blob b;
+    size_t index;
+
+    struct rbdict* htab = rbdict_create_predefined(RBDICT_BLOB_INT);
+
+    b = rbdict_blob_make(k2, sizeof k2);
+    rbdict_insert_dup(htab, &b, (void*) 2);
+    b = rbdict_blob_make(k1, sizeof k1);
+    rbdict_insert_dup(htab, &b, (void*) 1);
+    b = rbdict_blob_make(k3, sizeof k3);
+    rbdict_insert_dup(htab, &b, (void*) 3);
+    rbdict_insert_nodup(htab, rbdict_blob_new(k4, sizeof k4), (void*) 4);
+    rbdict_insert_nodup(htab, rbdict_blob_new(k4, sizeof k4), (void*) 0);
+
+    check(rbdict_size(htab) == 4, "blob keys with embedded zeros are distinct");
+
+    b = rbdict_blob_make(k2, sizeof k2);
+    check((int64_t) rbdict_search(htab, &b) == 2, "blob search");
+    b = rbdict_blob_make(k2, 2);
+    check(rbdict_search(htab, &b) == NULL, "blob search miss");
+
+    rbdict_keys(htab, (void**) keys, 4, 0);
+    for (index = 0; index < 4; ++index) {
+        printf("blob key length %zu => %" PRId64 "\n",
+               keys[index]->len, (int64_t) rbdict_search(htab, keys[index]));
+    }
+    check(keys[0]->len == 1 && keys[1]->len == 3 && keys[2]->len == 4, "blob order");
+
+    struct rbdict* htab2 = rbdict_clone(htab);
+    b = rbdict_blob_make(k3, sizeof k3);
+    check((int64_t) rbdict_search(htab2, &b) == 3, "blob clone");
+
+    rbdict_destroy(htab);
+    rbdict_destroy(htab2);
+}
+
+void test_rbdict_strpool()
+{
+    struct rbdict_options opts;
+    struct rbdict_strpool* pool = rbdict_strpool_create();
+    struct rbdict* words = build_hash_from_words_str_str();
+    size_t dsize = rbdict_size(words);
+    char** keys = (char**) malloc(dsize * sizeof(char*));
+    char** keys2 = (char**) malloc(dsize * sizeof(char*));
+    size_t index;
+
+    memset(&opts, 0, sizeof opts);
+    opts.strpool = pool;
+
+    struct rbdict* str_str = rbdict_create_opt(NULL, RBDICT_STR_STR, &opts);
+    struct rbdict* str_int = rbdict_create_opt(NULL, RBDICT_STR_INT, &opts);
+    check(rbdict_create_opt(NULL, RBDICT_INT_INT, &opts) == NULL, "pool needs string keys");
+
+    rbdict_keys(words, (void**) keys, dsize, 0);
+    for (index = 0; index < dsize; ++index) {
+        rbdict_insert_dup(str_str, keys[index], keys[index]);
+        rbdict_int_update(str_int, keys[index], 1, incint);
+    }
+    rbdict_insert_nodup(str_str, strdup(keys[0]), strdup("replaced"));
+
+    printf("Pooled strings = %zu\n", rbdict_strpool_size(pool));
+    check(rbdict_strpool_size(pool) == dsize, "one pooled copy per word");
+
+    rbdict_keys(str_str, (void**) keys, dsize, 0);
+    rbdict_keys(str_int, (void**) keys2, dsize, 0);
+    for (index = 0; index < dsize; ++index)
+        check(keys[index] == keys2[index], "dicts share key storage");
+    check(strcmp((char*) rbdict_search(str_str, keys[0]), "replaced") == 0, "nodup into pool");
+
+    struct rbdict* clone = rbdict_clone(str_int);
+    rbdict_keys(clone, (void**) keys2, dsize, 0);
+    check(keys[0] == keys2[0], "clone shares key storage");
+
+    rbdict_strpool_destroy(pool);
+    rbdict_delete(str_str, keys[1]);
+    rbdict_delete(str_int, keys[1]);
+    rbdict_delete(clone, keys[1]);
+    check(rbdict_strpool_size(pool) == dsize - 1, "last reference releases string");
+
+    /* overwriting a pooled key must not keep the incoming reference */
+    rbdict_insert_dup(str_str, "not-a-word", "1");
+    rbdict_insert_dup(str_str, "not-a-word", "2");
+    rbdict_insert_nodup(str_str, strdup("not-a-word"), strdup("3"));
+    rbdict_delete(str_str, "not-a-word");
+    check(rbdict_strpool_size(pool) == dsize - 1, "overwrite releases pooled key");
+
+    /* a refused nodup insert leaves the key with the caller */
+    opts.mem_limit = 1;
+    struct rbdict* tiny = rbdict_create_opt(NULL, RBDICT_STR_STR, &opts);
+    char* k = strdup("not-a-word");
+    char* v = strdup("4");
+    check(rbdict_insert_nodup(tiny, k, v) == -1 && errno == ENOMEM, "nodup over limit");
+    check(strcmp(k, "not-a-word") == 0, "refused key still the caller's");
+    check(rbdict_strpool_size(pool) == dsize - 1, "refused insert releases pooled key");
+    free(k);
+    free(v);
+    rbdict_destroy(tiny);
+
+    rbdict_destroy(str_str);
+    rbdict_destroy(str_int);
+    rbdict_destroy(clone);
+    rbdict_destroy(words);
+    free(keys);
+    free(keys2);
+}
+
+void test_rbdict_numeric_keys()
+{
+    static const int64_t ikeys[] = {
+        INT64_MIN, -5000000000LL, -1, 0, 1, 4294967296LL, INT64_MAX
+    };
+    static const double dkeys[] = { -1e300, -2.5, -0.0, 0.0, 1e-300, 3.0, 1e300 };
+    void* keys[7];
+    size_t index;
+
+    struct rbdict* ints = rbdict_create_predefined(RBDICT_INT_INT);
+    struct rbdict* uints = rbdict_create_predefined(RBDICT_UINT_INT);
+    struct rbdict* doubles = rbdict_create_predefined(RBDICT_DOUBLE_INT);
+
+    for (index = 7; index-- > 0; ) {
+        rbdict_insert(ints, ikeys[index], index);
+        rbdict_insert(uints, ikeys[index], index);
+        rbdict_insert_nodup(doubles, rbdict_double_key(dkeys[index]), (void*)(uintptr_t) index);
+    }
+
+    rbdict_keys(ints, keys, 7, 0);
+    for (index = 0; index < 7; ++index) {
+        check((int64_t) keys[index] == ikeys[index], "int64 key order");
+        check((size_t)(uintptr_t) rbdict_search(ints, (void*)(intptr_t) ikeys[index]) == index,
+              "int64 key search");
+    }
+
+    rbdict_keys(uints, keys, 7, 0);
+    for (index = 1; index < 7; ++index)
+        check((uint64_t)(uintptr_t) keys[index - 1] < (uint64_t)(uintptr_t) keys[index], "uint64 key order");
+
+    rbdict_keys(doubles, keys, 7, 0);
+    for (index = 0; index < 7; ++index) {
+        printf("%g ", rbdict_key_double(keys[index]));
+        check(memcmp(&dkeys[index], &keys[index], sizeof(double)) == 0, "double key order");
+    }
+    printf("\n");
+
+    rbdict_destroy(ints);
+    rbdict_destroy(uints);
+    rbdict_destroy(doubles);
+}
+
+void test_rbdict_hash_index()
+{
+    struct rbdict* words = build_hash_from_words_str_str();
+    size_t dsize = rbdict_size(words);
+    char** keys = (char**) malloc(dsize * sizeof(char*));
+    size_t index;
+
+    struct rbdict* htab = rbdict_create_predefined(RBDICT_STR_INT | RBDICT_HASH_INDEX);
+    struct rbdict* ints = rbdict_create_predefined(RBDICT_INT_INT | RBDICT_HASH_INDEX);
+    check(rbdict_create_ex(NULL, RBDICT_CUSTOM | RBDICT_HASH_INDEX) == NULL, "custom keys need k_hash");
+
+    rbdict_keys(words, (void**) keys, dsize, 0);
+    for (index = 0; index < dsize; ++index) {
+        rbdict_insert_dup(htab, keys[index], (void*)(uintptr_t) index);
+        rbdict_int_update(htab, keys[index], 0, incint);
+        rbdict_insert(ints, index * 1000003, index);
+    }
+
+    for (index = 0; index < dsize; index += 2) {
+        rbdict_delete(htab, keys[index]);
+        rbdict_delete(ints, (void*)(uintptr_t)(index * 1000003));
+    }
+    check(rbdict_size(htab) == dsize / 2, "hash index delete");
+
+    struct rbdict* clone = rbdict_clone(htab);
+
+    for (index = 0; index < dsize; ++index) {
+        int64_t expect = (index % 2) ? (int64_t) index + 1 : 0;
+        check((int64_t) rbdict_search(htab, keys[index]) == expect, "hash index search");
+        check((int64_t) rbdict_search(clone, keys[index]) == expect, "hash index clone");
+        check((int64_t) rbdict_search(ints, (void*)(uintptr_t)(index * 1000003)) == ((index % 2) ? (int64_t) index : 0),
+              "hash index int keys");
+    }
+    check(rbdict_count_prefix(htab, "a", 0) == rbdict_count_prefix(clone, "a", 0), "ordered ops unaffected");
+    printf("Hash indexed entries = %zu\n", rbdict_size(clone));
+
+    rbdict_destroy(htab);
+    rbdict_destroy(clone);
+    rbdict_destroy(ints);
+    rbdict_destroy(words);
+    free(keys);
+}
+
+struct snap_check {
+    const struct rbdict* expect;
+    size_t count;
+};
+
+int check_snap_elem(const char* k, const char* v, void* user_data)
+{
+    struct snap_check* ctx = (struct snap_check*) user_data;
+
+    check(rbdict_search(ctx->expect, (void*) k) == v, "snapshot foreach value");
+    ++ctx->count;
+    return 0;
+}
+
+void check_snapshot(const struct rbdict_snapshot* snap, const struct rbdict* expect)
+{
+    struct snap_check ctx = { expect, 0 };
+
+    rbdict_snapshot_foreach(snap, (rbdict_visit_t) check_snap_elem, &ctx);
+    check(ctx.count == rbdict_size(expect), "snapshot foreach count");
+    check(rbdict_snapshot_size(snap) == rbdict_size(expect), "snapshot size");
+}
+
+/* a chunk of a snapshot walk keeps the last key to resume after */
+struct snap_chunk {
+    struct snap_check check;
+    char* last;
+};
+
+int check_snap_chunk(const char* k, const char* v, void* user_data)
+{
+    struct snap_chunk* ctx = (struct snap_chunk*) user_data;
+
+    check(!ctx->last || strcmp(ctx->last, k) < 0, "snapshot chunks in order");
+    check_snap_elem(k, v, &ctx->check);
+    free(ctx->last);
+    ctx->last = strdup(k);
+    return 0;
+}
+
+void test_rbdict_snapshot()
+{
+    struct rbdict* htab = build_hash_from_words_str_int();
+    size_t dsize = rbdict_size(htab);
+    char** keys = (char**) malloc(dsize * sizeof(char*));
+    size_t index;
+
+    struct rbdict* before = rbdict_clone(htab);
+    struct rbdict_snapshot* snap1 = rbdict_snapshot(htab);
+
+    rbdict_keys(before, (void**) keys, dsize, 0);
+    for (index = 0; index < dsize; index += 3)
+        rbdict_delete(htab, keys[index]);
+    for (index = 1; index < dsize; index += 3)
+        rbdict_int_update(htab, keys[index], 0, incint);
+    rbdict_insert_dup(htab, "aaa-new", (void*) 7);
+    rbdict_insert_dup(htab, "zzz-new", (void*) 8);
+
+    struct rbdict* middle = rbdict_clone(htab);
+    struct rbdict_snapshot* snap2 = rbdict_snapshot(htab);
+
+    for (index = 1; index < dsize; index += 3)
+        rbdict_delete(htab, keys[index]);
+    rbdict_delete(htab, "aaa-new");
+    rbdict_insert_dup(htab, keys[0], (void*) 9);
+
+    check_snapshot(snap1, before);
+    check_snapshot(snap2, middle);
+    check(rbdict_snapshot_search(snap1, "aaa-new") == NULL, "snapshot hides later insert");
+    check(rbdict_snapshot_search(snap2, "aaa-new") == (void*) 7, "snapshot keeps deleted key");
+    check(rbdict_snapshot_search(snap1, keys[1]) == rbdict_search(before, keys[1]), "snapshot keeps old value");
+
+    rbdict_snapshot_release(snap1);
+    check_snapshot(snap2, middle);
+
+    /* chunked walk with writes in between */
+    {
+        struct snap_chunk ctx = { { middle, 0 }, NULL };
+        size_t n = rbdict_snapshot_foreach_n(snap2, 100, (rbdict_visit_t) check_snap_chunk, &ctx);
+
+        for (index = 0; n == 100; ++index) {
+            rbdict_delete(htab, keys[index * 3 + 2]);
+            rbdict_insert_dup(htab, ctx.last, (void*) 10);
+            n = rbdict_snapshot_foreach_after(snap2, ctx.last, 100, (rbdict_visit_t) check_snap_chunk, &ctx);
+        }
+        check(ctx.check.count == rbdict_size(middle), "snapshot chunks count");
+        free(ctx.last);
+    }
+    printf("Snapshot sizes %zu, %zu, live %zu\n", rbdict_size(before), rbdict_size(middle), rbdict_size(htab));
+
+    rbdict_destroy(htab);
+    check(rbdict_snapshot_search(snap2, keys[2]) == NULL, "detached snapshot is empty");
+    rbdict_snapshot_release(snap2);
+
+    rbdict_destroy(before);
+    rbdict_destroy(middle);
+    free(keys);
+}
+
+void count_evicted(const void* k, const void* v, void* user_data)
+{
+    ++*(size_t*) user_data;
+}
+
+void test_rbdict_cache()
+{
+    struct rbdict* words = build_hash_from_words_str_str();
+    size_t dsize = rbdict_size(words);
+    char** keys = (char**) malloc(dsize * sizeof(char*));
+    struct rbdict_options opts;
+    size_t evicted = 0;
+    size_t index, hot;
+
+    rbdict_keys(words, (void**) keys, dsize, 0);
+
+    memset(&opts, 0, sizeof opts);
+    opts.max_entries = 100;
+    opts.on_evict = count_evicted;
+    opts.evict_user_data = &evicted;
+    struct rbdict* cache = rbdict_create_opt(NULL, RBDICT_STR_STR, &opts);
+
+    /* keep the first ten words hot while streaming the rest through */
+    for (index = 0; index < dsize; ++index) {
+        rbdict_insert_dup(cache, keys[index], keys[index]);
+        for (hot = 0; hot < 10 && hot <= index; ++hot)
+            rbdict_search(cache, keys[hot]);
+        check(rbdict_size(cache) <= 100, "cache entry budget");
+    }
+    for (hot = 0; hot < 10; ++hot)
+        check(rbdict_search(cache, keys[hot]) != NULL, "hot keys survive eviction");
+    check(evicted == dsize - 100, "evict callback");
+    printf("Cache size %zu, evicted %zu\n", rbdict_size(cache), evicted);
+
+    rbdict_destroy(cache);
+
+    memset(&opts, 0, sizeof opts);
+    opts.max_bytes = 4096;
+    cache = rbdict_create_opt(NULL, RBDICT_STR_STR, &opts);
+    for (index = 0; index < dsize; ++index) {
+        rbdict_insert_dup(cache, keys[index], keys[index]);
+        check(rbdict_cache_bytes(cache) <= 4096, "cache byte budget");
+    }
+    printf("Cache bytes %zu in %zu entries\n", rbdict_cache_bytes(cache), rbdict_size(cache));
+    while (rbdict_size(cache)) {
+        rbdict_keys(cache, (void**) keys, dsize, 0);
+        rbdict_delete(cache, keys[0]);
+    }
+    check(rbdict_cache_bytes(cache) == 0, "cache bytes released");
+
+    rbdict_destroy(cache);
+    rbdict_destroy(words);
+    free(keys);
+}
+
+static int64_t test_clock_now;
+
+static int64_t test_clock()
+{
+    return test_clock_now;
+}
+
+int count_elem(const void* k, const void* v, void* user_data)
+{
+    ++*(size_t*) user_data;
+    return 0;
+}
+
+void test_rbdict_ttl()
+{
+    struct rbdict_options opts;
+    struct rbdict* clone;
+    size_t index, count = 0;
+
+    struct rbdict* sessions = rbdict_create_predefined(RBDICT_INT_INT | RBDICT_TTL);
+    for (index = 0; index < 1000; ++index)
+        rbdict_insert_ttl(sessions, (void*)(uintptr_t) index, (void*)(uintptr_t) index, (int64_t) index);
+    rbdict_insert(sessions, 5000, 1);
+    rbdict_touch(sessions, (void*) 10, RBDICT_NO_EXPIRY);
+
+    check(rbdict_expire(sessions, 99, 30) == 30, "expire honours budget");
+    check(rbdict_size(sessions) == 971, "expire reclaims");
+    check(rbdict_search(sessions, (void*) 50) == NULL, "expired pair is a miss");
+    check(rbdict_search(sessions, (void*) 10) == (void*) 10, "touched pair stays");
+    check(rbdict_touch(sessions, (void*) 60, 2000) == -1, "cannot touch expired pair");
+
+    rbdict_foreach(sessions, count_elem, &count);
+    check(count == 902, "foreach skips expired pairs");
+    void** live = (void**) malloc(rbdict_size(sessions) * sizeof(void*));
+    check(rbdict_keys(sessions, live, rbdict_size(sessions), 0) == 0 && live[901] && !live[902],
+          "keys skip expired pairs");
+    check(rbdict_values(sessions, live, rbdict_size(sessions), 0) == 0 && live[901] && !live[902],
+          "values skip expired pairs");
+    free(live);
+
+    /* write over an expired key starts from scratch */
+    rbdict_int_update(sessions, (void*) 70, 100, incint);
+    check(rbdict_search(sessions, (void*) 70) == (void*) 100, "update of expired pair");
+    check(rbdict_delete_one(sessions, (void*) 60) == -1 && errno == ENOENT, "delete one skips expired pair");
+    check(rbdict_delete_all(sessions, (void*) 60) == 0, "delete all skips expired pair");
+
+    check(rbdict_expire(sessions, 2000, (size_t) -1) == 968, "expire the rest");
+    check(rbdict_size(sessions) == 3, "no deadline pairs stay");
+    rbdict_destroy(sessions);
+
+    /* deadlines must land on the inserted pair whatever the rebalancing */
+    sessions = rbdict_create_predefined(RBDICT_INT_INT | RBDICT_TTL);
+    for (index = 0; index < 1000; ++index) {
+        size_t k = (index * 7919) % 1000;
+        rbdict_insert_ttl(sessions, (void*)(uintptr_t) k, (void*)(uintptr_t) k, (int64_t) k);
+    }
+    clone = rbdict_clone(sessions);
+    check(rbdict_expire(clone, 499, (size_t) -1) == 500, "clone expires by key deadline");
+    check(rbdict_search(clone, (void*) 500) == (void*) 500, "clone keeps later deadlines");
+    rbdict_destroy(clone);
+    rbdict_destroy(sessions);
+
+    memset(&opts, 0, sizeof opts);
+    opts.clock = test_clock;
+    struct rbdict* limits = rbdict_create_opt(NULL, RBDICT_STR_INT | RBDICT_TTL | RBDICT_HASH_INDEX, &opts);
+    test_clock_now = 100;
+    rbdict_insert_ttl(limits, "client-a", (void*) 1, 110);
+    rbdict_int_update(limits, "client-a", 1, incint);
+    clone = rbdict_clone(limits);
+    test_clock_now = 109;
+    check(rbdict_search(limits, "client-a") == (void*) 2, "update keeps deadline");
+    test_clock_now = 110;
+    check(rbdict_search(limits, "client-a") == NULL, "clock driven expiry");
+    check(rbdict_foreach_prefix(limits, "client", 0, NULL, NULL) == 0, "prefix scan skips expired pair");
+    check(rbdict_search(clone, "client-a") == NULL, "clone keeps deadline");
+    printf("TTL expiry ok\n");
+
+    rbdict_destroy(limits);
+    rbdict_destroy(clone);
+}
+
+void test_rbdict_export()
+{
+    struct rbdict* htab = build_hash_from_words_str_int();
+    size_t dsize = rbdict_size(htab);
+    char** all = (char**) malloc(dsize * sizeof(char*));
+    void* keys[64];
+    void* values[64];
+    struct rbdict_cursor cur;
+    size_t total = 0;
+    int n, index;
+
+    rbdict_keys(htab, (void**) all, dsize, 0);
+
+    rbdict_cursor_first(htab, &cur);
+    while ((n = rbdict_export(&cur, keys, values, 64, 0)) > 0) {
+        for (index = 0; index < n; ++index) {
+            check(keys[index] == all[total + index], "export key order");
+            check(values[index] == rbdict_search(htab, keys[index]), "export value");
+        }
+        total += n;
+    }
+    check(total == dsize, "export covers the dict");
+
+    /* resume after a write, with cloned keys the caller owns */
+    rbdict_cursor_first(htab, &cur);
+    n = rbdict_export(&cur, keys, NULL, 10, RBDICT_KEYS_CLONE);
+    rbdict_delete(htab, all[10]);
+    check(rbdict_export(&cur, keys + 10, NULL, 10, 0) == -1 && errno == EAGAIN, "stale cursor");
+    rbdict_cursor_seek_after(htab, &cur, keys[n - 1]);
+    check(rbdict_export(&cur, values, NULL, 1, 0) == 1 && values[0] == all[11], "resume after key");
+    for (index = 0; index < n; ++index)
+        free(keys[index]);
+
+    rbdict_cursor_seek(htab, &cur, "zzzz");
+    check(rbdict_export(&cur, keys, values, 64, 0) == 0, "export at end");
+    printf("Exported %zu pairs in chunks\n", total);
+
+    rbdict_destroy(htab);
+    free(all);
+
+    /* key 0 is a key, not a failed clone */
+    htab = rbdict_create_predefined(RBDICT_INT_INT);
+    rbdict_insert(htab, 0, 5);
+    rbdict_insert(htab, 1, 6);
+    rbdict_cursor_first(htab, &cur);
+    check(rbdict_export(&cur, keys, values, 64, RBDICT_KEYS_CLONE | RBDICT_VALUES_CLONE) == 2 &&
+          keys[0] == (void*) 0 && values[0] == (void*) 5, "clone export of key 0");
+    rbdict_destroy(htab);
+}
+
+struct collect {
+    int64_t* keys;
+    size_t n;
+};
+
+static int collect_key(const void* k, const void* v, void* user_data)
+{
+    struct collect* c = (struct collect*) user_data;
+    c->keys[c->n++] = (int64_t)(intptr_t) k;
+    return 0;
+}
+
+static int collect_ten(const void* k, const void* v, void* user_data)
+{
+    collect_key(k, v, user_data);
+    return ((struct collect*) user_data)->n == 10;
+}
+
+void test_rbdict_threaded()
+{
+    struct rbdict* plain = rbdict_create_predefined(RBDICT_INT_INT);
+    struct rbdict* htab = rbdict_create_predefined(RBDICT_INT_INT | RBDICT_THREADED);
+    struct rbdict* copy;
+    int64_t a[2000], b[2000];
+    struct collect ca = { a, 0 }, cb = { b, 0 };
+    void* key;
+    size_t i;
+
+    check(rbdict_min(htab, &key, NULL) == -1 && errno == ENOENT, "min of empty dict");
+
+    for (i = 0; i < 2000; ++i) {
+        int64_t k = (int64_t)((i * 7919) % 2003) - 1000;
+        rbdict_insert(plain, k, i);
+        rbdict_insert(htab, k, i);
+    }
+    for (i = 0; i < 2000; i += 3) {
+        rbdict_delete(plain, (void*)(intptr_t)((int64_t) i - 1000));
+        rbdict_delete(htab, (void*)(intptr_t)((int64_t) i - 1000));
+    }
+
+    rbdict_foreach(plain, collect_key, &ca);
+    rbdict_foreach(htab, collect_key, &cb);
+    check(ca.n == rbdict_size(htab) && cb.n == ca.n, "threaded size");
+    check(memcmp(a, b, ca.n * sizeof(int64_t)) == 0, "threaded order");
+
+    cb.n = 0;
+    rbdict_foreach_reverse(htab, collect_key, &cb);
+    for (i = 0; i < cb.n; ++i)
+        check(b[i] == a[ca.n - 1 - i], "reverse order");
+
+    cb.n = 0;
+    rbdict_foreach(htab, collect_ten, &cb);
+    check(cb.n == ca.n && memcmp(a, b, ca.n * sizeof(int64_t)) == 0, "foreach visits every pair");
+    cb.n = 0;
+    rbdict_foreach_reverse(htab, collect_ten, &cb);
+    check(cb.n == 10 && b[0] == a[ca.n - 1], "foreach_reverse stops on non-zero");
+
+    check(rbdict_min(htab, &key, NULL) == 0 && (int64_t)(intptr_t) key == a[0], "min");
+    check(rbdict_max(htab, &key, NULL) == 0 && (int64_t)(intptr_t) key == a[ca.n - 1], "max");
+
+    copy = rbdict_clone(htab);
+    rbdict_delete(htab, (void*)(intptr_t) a[0]);
+    cb.n = 0;
+    rbdict_foreach(copy, collect_key, &cb);
+    check(cb.n == ca.n && memcmp(a, b, ca.n * sizeof(int64_t)) == 0, "threaded clone");
+    check(rbdict_min(htab, &key, NULL) == 0 && (int64_t)(intptr_t) key == a[1], "min after delete");
+
+    printf("Threaded dict of %zu pairs in order\n", ca.n);
+
+    rbdict_destroy(copy);
+    rbdict_destroy(htab);
+    rbdict_destroy(plain);
+}
+
+static int sum_values(const void* k, const void* v, void* user_data)
+{
+    *(int64_t*) user_data += (int64_t)(intptr_t) v;
+    return 0;
+}
+
+static void* double_value(const void* k, void* v, void* user_data)
+{
+    ++*(size_t*) user_data;
+    return (void*)(intptr_t)(2 * (int64_t)(intptr_t) v);
+}
+
+static int accept_change(int op, const void* key, const void* value, void* user_data)
+{
+    return 0;
+}
+
+void test_rbdict_parallel()
+{
+    struct rbdict* htab = rbdict_create_predefined(RBDICT_INT_INT);
+    struct rbdict_snapshot* snap;
+    int64_t sums[4] = { 0, 0, 0, 0 };
+    size_t counts[4] = { 0, 0, 0, 0 };
+    void* sum_ud[4] = { &sums[0], &sums[1], &sums[2], &sums[3] };
+    void* count_ud[4] = { &counts[0], &counts[1], &counts[2], &counts[3] };
+    int64_t i, expected = 0, total = 0;
+
+    for (i = 0; i < 10000; ++i) {
+        rbdict_insert(htab, i * 7919 % 10007, i);
+        expected += i;
+    }
+
+    check(rbdict_parallel_foreach(htab, 4, sum_values, sum_ud) == 0, "parallel foreach");
+    for (i = 0; i < 4; ++i)
+        total += sums[i];
+    check(total == expected, "parallel sum");
+
+    check(rbdict_parallel_map_values(htab, 3, double_value, count_ud) == 0, "parallel map");
+    check(counts[0] + counts[1] + counts[2] == 10000, "map visits every pair once");
+    check(rbdict_search(htab, (void*)(intptr_t)(5 * 7919 % 10007)) == (void*) 10, "mapped value");
+
+    memset(sums, 0, sizeof(sums));
+    check(rbdict_parallel_foreach(htab, 1, sum_values, sum_ud) == 0 && sums[0] == 2 * expected,
+          "serial foreach after map");
+
+    snap = rbdict_snapshot(htab);
+    check(rbdict_parallel_map_values(htab, 2, double_value, count_ud) == -1 && errno == EBUSY,
+          "map refused with a snapshot");
+    rbdict_snapshot_release(snap);
+    rbdict_set_change_hook(htab, accept_change, NULL);
+    check(rbdict_parallel_map_values(htab, 2, double_value, count_ud) == -1 && errno == EBUSY,
+          "map refused with a change hook");
+    rbdict_set_change_hook(htab, NULL, NULL);
+    check(rbdict_parallel_foreach(htab, 0, sum_values, NULL) == -1 && errno == EINVAL, "zero threads");
+
+    printf("Parallel sum %" PRId64 "\n", total);
+    rbdict_destroy(htab);
+}
+
+struct counting_arena {
+    size_t live;
+    size_t allocs;
+};
+
+static void* arena_alloc(void* ctx, size_t size)
+{
+    struct counting_arena* a = (struct counting_arena*) ctx;
+    a->live += size;
+    ++a->allocs;
+    return malloc(size);
+}
+
+static void arena_free(void* ctx, void* p, size_t size)
+{
+    ((struct counting_arena*) ctx)->live -= size;
+    free(p);
+}
+
+static void* arena_realloc(void* ctx, void* p, size_t old_size, size_t size)
+{
+    struct counting_arena* a = (struct counting_arena*) ctx;
+    a->live += size - old_size;
+    return realloc(p, size);
+}
+
+static int clear_str(void* p, void* unused)
+{
+    *(char*) p = '\0';
+    return 0;
+}
+
+static int flaky_fail;
+
+static void* flaky_alloc(void* ctx, size_t size)
+{
+    return flaky_fail ? NULL : malloc(size);
+}
+
+static void flaky_free(void* ctx, void* p, size_t size)
+{
+    free(p);
+}
+
+void test_rbdict_allocator()
+{
+    struct counting_arena arena = { 0, 0 };
+    struct rbdict_allocator alloc = { arena_alloc, arena_free, &arena, arena_realloc };
+    struct rbdict_options opts;
+    struct rbdict* htab;
+    struct rbdict* clone;
+    size_t i, used;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.allocator = &alloc;
+
+    htab = rbdict_create_opt(NULL, RBDICT_STR_STR | RBDICT_HASH_INDEX, &opts);
+    rbdict_insert_dup(htab, "alpha", "one");
+    rbdict_insert_dup(htab, "beta", "two");
+    rbdict_insert_nodup(htab, strdup("gamma"), strdup("three"));
+    rbdict_insert_nodup(htab, strdup("alpha"), strdup("uno"));
+    check(rbdict_size(htab) == 3 && strcmp((char*) rbdict_search(htab, "alpha"), "uno") == 0,
+          "allocator dict contents");
+    check(arena.live == rbdict_mem_used(htab), "all dict memory from the allocator");
+
+    clone = rbdict_clone(htab);
+    check(arena.live == rbdict_mem_used(htab) + rbdict_mem_used(clone), "clone uses the allocator");
+
+    /* overwrites resize the value, a shortened value frees what it was charged */
+    used = rbdict_mem_used(htab);
+    i = arena.allocs;
+    rbdict_insert_dup(htab, "beta", "a rather longer second value");
+    rbdict_insert_dup(htab, "beta", "2");
+    check(arena.allocs == i && strcmp((char*) rbdict_search(htab, "beta"), "2") == 0,
+          "overwrite reallocs in place");
+    rbdict_insert_dup(htab, "delta", "a value an updater will empty");
+    rbdict_update(htab, "delta", "", clear_str);
+    rbdict_delete(htab, "delta");
+    check(rbdict_mem_used(htab) == used - 2 && arena.live == rbdict_mem_used(htab) + rbdict_mem_used(clone),
+          "free by charged size");
+    rbdict_destroy(htab);
+    rbdict_destroy(clone);
+    check(arena.live == 0 && arena.allocs > 0, "allocator balanced");
+
+    /* memory budget */
+    memset(&opts, 0, sizeof(opts));
+    opts.mem_limit = 64 * 1024;
+    htab = rbdict_create_opt(NULL, RBDICT_INT_INT, &opts);
+    for (i = 0; rbdict_insert(htab, i, i) == 0; ++i)
+        ;
+    check(errno == ENOMEM && rbdict_mem_used(htab) <= opts.mem_limit, "insert fails at the limit");
+    check(rbdict_size(htab) == i, "failed insert adds nothing");
+    used = rbdict_mem_used(htab);
+    rbdict_delete(htab, (void*) 0);
+    check(rbdict_mem_used(htab) < used && rbdict_insert(htab, 0, 0) == 0, "delete frees budget");
+    printf("Memory limit reached after %zu pairs\n", i);
+    rbdict_destroy(htab);
+
+    /* a delete the snapshots cannot record leaves the pair */
+    struct rbdict_allocator flaky = { flaky_alloc, flaky_free, NULL, NULL };
+    struct rbdict_snapshot* snap;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.allocator = &flaky;
+    htab = rbdict_create_opt(NULL, RBDICT_INT_INT, &opts);
+    rbdict_insert(htab, 1, 10);
+    snap = rbdict_snapshot(htab);
+    flaky_fail = 1;
+    errno = 0;
+    rbdict_delete(htab, (void*) 1);
+    check(errno == ENOMEM && rbdict_search(htab, (void*) 1) == (void*) 10, "failed delete sets errno");
+    check(rbdict_delete_one(htab, (void*) 1) == -1 && errno == ENOMEM, "failed delete_one");
+    flaky_fail = 0;
+    rbdict_delete(htab, (void*) 1);
+    check(rbdict_search(htab, (void*) 1) == NULL && rbdict_snapshot_search(snap, (void*) 1) == (void*) 10,
+          "delete once the snapshot has room");
+    rbdict_snapshot_release(snap);
+    rbdict_destroy(htab);
+}
+
+void test_rbdict_arena()
+{
+    struct rbdict_arena_options aopts = { 1, RBDICT_NUMA_INTERLEAVE, 0 };
+    struct rbdict_arena* arena = rbdict_arena_create(&aopts);
+    struct rbdict_arena_stats stats;
+    struct rbdict_options opts;
+    struct rbdict* htab;
+    struct rbdict* clone;
+    int64_t i;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.allocator = rbdict_arena_allocator(arena);
+    htab = rbdict_create_opt(NULL, RBDICT_INT_STR | RBDICT_THREADED, &opts);
+
+    for (i = 0; i < 50000; ++i) {
+        char buf[32];
+        sprintf(buf, "value-%" PRId64, i);
+        rbdict_insert_dup(htab, (void*)(intptr_t) i, buf);
+    }
+    for (i = 0; i < 50000; i += 2)
+        rbdict_delete(htab, (void*)(intptr_t) i);
+    for (i = 0; i < 50000; i += 4)
+        rbdict_insert_dup(htab, (void*)(intptr_t) i, "again");
+
+    clone = rbdict_clone(htab);
+    check(rbdict_size(clone) == 37500, "arena dict size");
+    check(strcmp((char*) rbdict_search(clone, (void*) 4), "again") == 0 &&
+          strcmp((char*) rbdict_search(clone, (void*) 7), "value-7") == 0 &&
+          rbdict_search(clone, (void*) 6) == NULL, "arena dict contents");
+
+    rbdict_arena_get_stats(arena, &stats);
+    check(stats.chunk_bytes >= rbdict_mem_used(htab) && stats.numa_nodes >= 1, "arena stats");
+    printf("Arena: %zu KB mapped, %zu KB huge pages, %d NUMA node(s)\n",
+           stats.chunk_bytes / 1024, stats.huge_page_bytes / 1024, stats.numa_nodes);
+
+    rbdict_destroy(htab);
+    rbdict_destroy(clone);
+    rbdict_arena_destroy(arena);
+}
+
+static int check_frozen_order(const void* k, const void* v, void* user_data)
+{
+    const char*** next = (const char***) user_data;
+    check(strcmp((const char*) k, **next) == 0 && strcmp((const char*) v, **next) == 0,
+          "frozen foreach order");
+    ++*next;
+    return 0;
+}
+
+void test_rbdict_frozen()
+{
+    struct rbdict* htab = build_hash_from_words_str_str();
+    size_t dsize = rbdict_size(htab);
+    const char** all = (const char**) malloc(dsize * sizeof(char*));
+    const char** next = all;
+    struct rbdict* nums = rbdict_create_predefined(RBDICT_INT_INT);
+    struct rbdict* dbls = rbdict_create_predefined(RBDICT_DOUBLE_INT);
+    struct rbdict_frozen* fz;
+    struct rbdict_frozen* fnums;
+    struct rbdict_frozen* fdbls;
+    size_t i;
+
+    rbdict_keys(htab, (void**) all, dsize, 0);
+    fz = rbdict_freeze(htab);
+    check(rbdict_frozen_size(fz) == dsize, "frozen size");
+    check(rbdict_frozen_mem_used(fz) < rbdict_mem_used(htab), "frozen is smaller");
+    for (i = 0; i < dsize; ++i)
+        check(strcmp((char*) rbdict_frozen_search(fz, all[i]), all[i]) == 0, "frozen search");
+    check(rbdict_frozen_search(fz, "zzzzz") == NULL && rbdict_frozen_search(fz, "") == NULL,
+          "frozen miss");
+    rbdict_frozen_foreach(fz, check_frozen_order, &next);
+    check(next == all + dsize, "frozen foreach count");
+    check(rbdict_frozen_foreach_range(fz, all[10], all[20], NULL, NULL) == 10, "frozen range");
+    check(rbdict_frozen_foreach_range(fz, "", "zzzz", NULL, NULL) == dsize, "frozen full range");
+    check(rbdict_frozen_foreach_range(fz, all[20], all[10], NULL, NULL) == 0, "frozen empty range");
+
+    for (i = 0; i < 1000; ++i) {
+        rbdict_insert(nums, (int64_t) i * 3 - 1500, i);
+        rbdict_insert(dbls, rbdict_double_key((double) i / 4 - 100.0), i);
+    }
+    fnums = rbdict_freeze(nums);
+    fdbls = rbdict_freeze(dbls);
+    rbdict_destroy(nums);
+    rbdict_destroy(dbls);
+
+    for (i = 0; i < 1000; ++i) {
+        check(rbdict_frozen_search(fnums, (void*)(intptr_t)((int64_t) i * 3 - 1500)) == (void*) i,
+              "frozen int search");
+        check(rbdict_frozen_search(fdbls, rbdict_double_key((double) i / 4 - 100.0)) == (void*) i,
+              "frozen double search");
+    }
+    check(rbdict_frozen_search(fnums, (void*)(intptr_t) -1499) == NULL, "frozen int miss");
+    check(rbdict_frozen_foreach_range(fnums, (void*)(intptr_t) -10, (void*)(intptr_t) 10, NULL, NULL) == 7,
+          "frozen int range");
+    check(rbdict_frozen_foreach_range(fdbls, rbdict_double_key(-1.0), rbdict_double_key(1.0), NULL, NULL) == 8,
+          "frozen double range");
+
+    printf("Frozen %zu words in %zu bytes (live %zu)\n",
+           dsize, rbdict_frozen_mem_used(fz), rbdict_mem_used(htab));
+
+    rbdict_frozen_destroy(fz);
+    rbdict_frozen_destroy(fnums);
+    rbdict_frozen_destroy(fdbls);
+    rbdict_destroy(htab);
+    free(all);
+}
+
+static int check_in_other(const void* k, const void* v, void* user_data)
+{
+    const char* got = (const char*) rbdict_search((const struct rbdict*) user_data, (void*) k);
+    check(got && strcmp(got, (const char*) v) == 0, "recovered pair");
+    return 0;
+}
+
+static int refuse_change(int op, const void* key, const void* value, void* user_data)
+{
+    ++*(int*) user_data;
+    return -1;
+}
+
+/* counts the pairs the hook believes are in the dict, refuses a third */
+static int refuse_third_put(int op, const void* key, const void* value, void* user_data)
+{
+    int* live = (int*) user_data;
+
+    if (op == RBDICT_OP_PUT) {
+        if (*live == 2)
+            return -1;
+        ++*live;
+    }
+    else if (op == RBDICT_OP_DELETE) {
+        --*live;
+    }
+    return 0;
+}
+
+static int upcase_first(void* value, void* user_data)
+{
+    *(char*) value = 'X';
+    return 0;
+}
+
+static void check_recovered(const char* path, const struct rbdict* expect)
+{
+    struct rbdict* got = rbdict_journal_recover(path, RBDICT_STR_STR, NULL);
+
+    check(got && rbdict_size(got) == rbdict_size(expect), "recovered size");
+    rbdict_foreach(expect, check_in_other, got);
+    rbdict_destroy(got);
+}
+
+void test_rbdict_journal()
+{
+    const char* path = "rbdict_test.journal";
+    const char* snap = "rbdict_test.journal.snap";
+    struct rbdict* htab = build_hash_from_words_str_str();
+    size_t dsize = rbdict_size(htab);
+    char** all = (char**) malloc(dsize * sizeof(char*));
+    struct rbdict_journal_options opts = { RBDICT_JOURNAL_NOSYNC, 0, 0 };
+    struct rbdict_journal_options commit = { RBDICT_JOURNAL_SYNC_COMMIT, 0, 0 };
+    struct rbdict* dict;
+    struct rbdict* dict2;
+    struct rbdict* nums;
+    struct rbdict_journal* j;
+    FILE* fp;
+    size_t i;
+    int refused;
+
+    remove(path);
+    remove(snap);
+    rbdict_keys(htab, (void**) all, dsize, RBDICT_KEYS_SORTED);
+
+    /* bulk load matches one by one inserts */
+    dict = rbdict_create_predefined(RBDICT_STR_STR);
+    check(rbdict_load_sorted(dict, (void**) all, (void**) all, dsize) == 0, "load sorted");
+    check(rbdict_size(dict) == dsize, "load sorted size");
+    for (i = 0; i < dsize; ++i)
+        check(strcmp((char*) rbdict_search(dict, all[i]), all[i]) == 0, "load sorted search");
+    check(rbdict_load_sorted(dict, (void**) all, (void**) all, 1) == -1 && errno == EINVAL,
+          "load sorted into non empty");
+    rbdict_destroy(dict);
+    dict = rbdict_create_predefined(RBDICT_STR_STR);
+    check(rbdict_load_sorted(dict, (void**) all + 1, (void**) all, 2) == 0, "load sorted pair");
+    rbdict_destroy(dict);
+    dict = rbdict_create_predefined(RBDICT_STR_STR);
+    check(rbdict_load_sorted(dict, (void**) all + 1, (void**) all + 1, 1) == 0 &&
+          rbdict_load_sorted(dict, (void**) all, (void**) all, 0) == -1, "load sorted single");
+    rbdict_destroy(dict);
+    dict = rbdict_create_predefined(RBDICT_STR_STR);
+    refused = 0;
+    rbdict_set_change_hook(dict, refuse_third_put, &refused);
+    check(rbdict_load_sorted(dict, (void**) all, (void**) all, 5) == -1 && rbdict_size(dict) == 0 &&
+          refused == 0, "refused load sorted takes back its puts");
+    rbdict_destroy(dict);
+
+    /* the hook sees each change first and can refuse it */
+    dict = rbdict_create_predefined(RBDICT_STR_STR);
+    nums = rbdict_create_predefined(RBDICT_INT_INT);
+    rbdict_insert_dup(dict, "a", "one");
+    rbdict_insert_dup(nums, (void*) 1, (void*) 10);
+    refused = 0;
+    rbdict_set_change_hook(dict, refuse_change, &refused);
+    rbdict_set_change_hook(nums, refuse_change, &refused);
+    check(rbdict_insert_dup(dict, "b", "two") == -1 && !rbdict_search(dict, "b"), "refused insert");
+    check(rbdict_insert_dup(dict, "a", "uno") == -1 &&
+          strcmp((char*) rbdict_search(dict, "a"), "one") == 0, "refused overwrite");
+    check(rbdict_update_ex(dict, "a", "x", upcase_first, NULL) == -1 &&
+          strcmp((char*) rbdict_search(dict, "a"), "one") == 0, "refused update");
+    rbdict_delete(dict, "a");
+    check(rbdict_search(dict, "a") != NULL, "refused delete");
+    check(rbdict_int_update(nums, (void*) 1, 0, incint) == -1 &&
+          rbdict_search(nums, (void*) 1) == (void*) 10, "refused int update");
+    check(rbdict_int_update(nums, (void*) 2, 0, incint) == -1 && rbdict_size(nums) == 1,
+          "refused int insert");
+    check(refused == 6, "refused changes reported");
+    rbdict_set_change_hook(dict, NULL, NULL);
+    check(rbdict_update_ex(dict, "a", "x", upcase_first, NULL) == 0 &&
+          strcmp((char*) rbdict_search(dict, "a"), "Xne") == 0, "update without hook");
+    rbdict_destroy(nums);
+    rbdict_destroy(dict);
+
+    /* log, replay */
+    dict = rbdict_create_predefined(RBDICT_STR_STR);
+    j = rbdict_journal_open(dict, RBDICT_STR_STR, path, &opts);
+    check(j != NULL, "journal open");
+    for (i = 0; i < dsize; ++i)
+        rbdict_insert_dup(dict, all[i], all[i]);
+    for (i = 0; i < dsize; i += 3)
+        rbdict_delete(dict, all[i]);
+    for (i = 1; i < dsize; i += 7)
+        rbdict_insert_dup(dict, all[i], all[(i + 1) % dsize]);
+    check(rbdict_journal_lsn(j) == dsize + (dsize + 2) / 3 + (dsize + 5) / 7, "journal lsn");
+    check(rbdict_journal_close(j) == 0, "journal close");
+    check_recovered(path, dict);
+
+    /* compact, log more, replay over the snapshot */
+    j = rbdict_journal_open(dict, RBDICT_STR_STR, path, &opts);
+    check(rbdict_journal_compact(j) == 0, "journal compact");
+    check_recovered(path, dict);
+    for (i = 0; i < dsize; i += 5)
+        rbdict_insert_dup(dict, all[i], all[i]);
+    for (i = 2; i < dsize; i += 11)
+        rbdict_delete(dict, all[i]);
+    check(rbdict_journal_close(j) == 0, "journal close");
+    check_recovered(path, dict);
+
+    /* a torn last record is dropped, the log stays usable */
+    fp = fopen(path, "ab");
+    fwrite("\x40\0\0\0garbage", 1, 11, fp);
+    fclose(fp);
+    check_recovered(path, dict);
+    j = rbdict_journal_open(dict, RBDICT_STR_STR, path, &opts);
+    rbdict_delete(dict, all[1]);
+    rbdict_journal_close(j);
+    check_recovered(path, dict);
+
+    /* one hook per dict, and close leaves one that is not the journal's */
+    j = rbdict_journal_open(dict, RBDICT_STR_STR, path, &opts);
+    check(rbdict_journal_open(dict, RBDICT_STR_STR, path, &opts) == NULL && errno == EBUSY,
+          "journal hook taken");
+    rbdict_set_change_hook(dict, refuse_change, &refused);
+    rbdict_journal_close(j);
+    check(rbdict_get_change_hook(dict, NULL) == refuse_change, "journal close keeps other hook");
+    rbdict_set_change_hook(dict, NULL, NULL);
+
+    /* the wrong dict type is refused */
+    nums = rbdict_create_predefined(RBDICT_INT_INT);
+    check(rbdict_journal_open(nums, RBDICT_INT_INT, path, &opts) == NULL && errno == EINVAL,
+          "journal type mismatch");
+    rbdict_destroy(nums);
+
+    /* damage before the last record is an error, not a torn tail */
+    j = rbdict_journal_open(dict, RBDICT_STR_STR, path, &opts);
+    rbdict_insert_dup(dict, "corrupt1", "x");
+    rbdict_insert_dup(dict, "corrupt2", "y");
+    rbdict_journal_close(j);
+    fp = fopen(path, "r+b");
+    fseek(fp, 12 + 8, SEEK_SET);
+    fputc(0x7f, fp);
+    fclose(fp);
+    check(rbdict_journal_recover(path, RBDICT_STR_STR, NULL) == NULL && errno == EIO, "corrupt log");
+    check(rbdict_journal_open(dict, RBDICT_STR_STR, path, &opts) == NULL && errno == EIO,
+          "corrupt log open");
+    remove(path);
+    fp = fopen(snap, "r+b");
+    fseek(fp, 12 + 8, SEEK_SET);
+    fputc(0x7f, fp);
+    fclose(fp);
+    check(rbdict_journal_recover(path, RBDICT_STR_STR, NULL) == NULL && errno == EIO,
+          "corrupt snapshot");
+    remove(path);
+    remove(snap);
+
+    nums = rbdict_create_predefined(RBDICT_INT_INT);
+    j = rbdict_journal_open(nums, RBDICT_INT_INT, path, &commit);
+    for (i = 0; i < 100; ++i)
+        rbdict_int_update(nums, (void*)(intptr_t)(i % 10 - 5), 0, incint);
+    rbdict_journal_close(j);
+    dict2 = rbdict_journal_recover(path, RBDICT_INT_INT, NULL);
+    check(rbdict_size(dict2) == 10, "recovered int size");
+    for (i = 0; i < 10; ++i)
+        check(rbdict_search(dict2, (void*)(intptr_t)((int) i - 5)) ==
+              rbdict_search(nums, (void*)(intptr_t)((int) i - 5)), "recovered int");
+    rbdict_destroy(dict2);
+    rbdict_destroy(nums);
+    remove(path);
+
+    /* deadlines survive the log and compaction */
+    nums = rbdict_create_predefined(RBDICT_INT_INT | RBDICT_TTL);
+    j = rbdict_journal_open(nums, RBDICT_INT_INT, path, &opts);
+    rbdict_insert_ttl(nums, (void*) 1, (void*) 1, 100);
+    rbdict_insert_ttl(nums, (void*) 2, (void*) 2, 200);
+    rbdict_insert(nums, 3, 3);
+    rbdict_journal_compact(j);
+    rbdict_touch(nums, (void*) 2, 300);
+    rbdict_insert_ttl(nums, (void*) 3, (void*) 3, 50);
+    rbdict_insert(nums, 1, 10);
+    rbdict_journal_close(j);
+    dict2 = rbdict_journal_recover(path, RBDICT_INT_INT | RBDICT_TTL, NULL);
+    check(dict2 && rbdict_size(dict2) == 3, "recovered ttl size");
+    for (i = 1; i <= 3; ++i) {
+        int64_t want, got;
+        check(rbdict_get_expiry(nums, (void*) i, &want) == 0 &&
+              rbdict_get_expiry(dict2, (void*) i, &got) == 0 && got == want, "recovered deadline");
+    }
+    check(rbdict_expire(dict2, 250, (size_t) -1) == 1 && rbdict_search(dict2, (void*) 2) &&
+          rbdict_search(dict2, (void*) 1) == (void*) 10, "recovered deadlines expire");
+    rbdict_destroy(dict2);
+    rbdict_destroy(nums);
+
+    remove(path);
+    remove(snap);
+    rbdict_destroy(dict);
+    rbdict_destroy(htab);
+    free(all);
+}
+
+static int check_lsm_pair(const void* k, const void* v, void* user_data)
+{
+    struct rbdict* expect = (struct rbdict*) user_data;
+    void* e = rbdict_search(expect, (void*) k);
+
+    check(e == v, "lsm foreach value");
+    rbdict_delete(expect, k);
+    return 0;
+}
+
+struct lsm_visit {
+    struct rbdict_lsm* lsm;
+    size_t n;
+};
+
+static int count_lsm_pair(const void* k, const void* v, void* user_data)
+{
+    struct lsm_visit* visit = (struct lsm_visit*) user_data;
+    void* got;
+
+    check(rbdict_lsm_get(visit->lsm, k, &got) == 0 && got == v, "lsm get from foreach");
+    ++visit->n;
+    return 0;
+}
+
+void test_rbdict_lsm()
+{
+    struct rbdict* htab = build_hash_from_words_str_str();
+    size_t dsize = rbdict_size(htab);
+    char** all = (char**) malloc(dsize * sizeof(char*));
+    struct rbdict_lsm_options opts = { NULL, 16 * 1024, 3, RBDICT_LSM_SUM };
+    struct rbdict_lsm_stats stats;
+    struct rbdict* counts = rbdict_create_predefined(RBDICT_STR_INT);
+    struct rbdict_lsm* lsm;
+    void* v;
+    size_t i;
+
+    rbdict_keys(htab, (void**) all, dsize, 0);
+
+    /* counters: blind deltas across many runs */
+    lsm = rbdict_lsm_create(RBDICT_STR_INT, &opts);
+    check(lsm != NULL, "lsm create");
+    for (i = 0; i < 5 * dsize; ++i) {
+        const char* w = all[(i * 7919) % dsize];
+        rbdict_int_update(counts, w, 1, incint);
+        check(rbdict_lsm_int_update(lsm, w, 1, incint) == 0, "lsm int update");
+    }
+    for (i = 0; i < dsize; i += 13) {
+        rbdict_delete(counts, all[i]);
+        rbdict_lsm_delete(lsm, all[i]);
+    }
+    for (i = 0; i < dsize; i += 26) {
+        rbdict_int_update(counts, all[i], 1, incint);
+        rbdict_lsm_int_update(lsm, all[i], 1, incint);
+    }
+    rbdict_insert_dup(counts, all[1], (void*) 1000);
+    rbdict_lsm_put(lsm, all[1], (void*) 1000);
+
+    for (i = 0; i < dsize; ++i) {
+        void* e = rbdict_search(counts, all[i]);
+        if (e) {
+            check(rbdict_lsm_get(lsm, all[i], &v) == 0 && v == e, "lsm sum");
+        }
+        else {
+            check(rbdict_lsm_get(lsm, all[i], &v) == -1 && errno == ENOENT, "lsm deleted");
+        }
+    }
+    check(rbdict_lsm_get(lsm, "not-a-word-at-all", &v) == -1 && errno == ENOENT, "lsm miss");
+
+    rbdict_lsm_get_stats(lsm, &stats);
+    check(stats.flushes > 3 && stats.runs >= 1 && stats.bloom_skips > 0, "lsm stats");
+
+    check(rbdict_lsm_foreach(lsm, check_lsm_pair, counts) == 0, "lsm foreach");
+    check(rbdict_size(counts) == 0, "lsm foreach count");
+    rbdict_lsm_get_stats(lsm, &stats);
+    check(stats.runs == 1 && stats.compactions > 0, "lsm compacted");
+    rbdict_lsm_destroy(lsm);
+
+    /* a default other than F's constant, with the key in a run */
+    lsm = rbdict_lsm_create(RBDICT_STR_INT, &opts);
+    rbdict_lsm_int_update(lsm, "a", 0, incint);
+    rbdict_lsm_flush(lsm);
+    rbdict_lsm_int_update(lsm, "a", 0, incint);
+    rbdict_lsm_int_update(lsm, "a", 0, incint);
+    check(rbdict_lsm_get(lsm, "a", &v) == 0 && v == (void*) 2, "lsm sum over a run");
+    rbdict_lsm_flush(lsm);
+    rbdict_lsm_delete(lsm, "a");
+    rbdict_lsm_int_update(lsm, "a", 0, incint);
+    rbdict_lsm_int_update(lsm, "b", 0, incint);
+    check(rbdict_lsm_get(lsm, "a", &v) == 0 && v == (void*) 0, "lsm sum default after delete");
+    rbdict_lsm_flush(lsm);
+    rbdict_lsm_int_update(lsm, "b", 0, incint);
+    check(rbdict_lsm_get(lsm, "b", &v) == 0 && v == (void*) 1, "lsm sum default");
+    rbdict_lsm_destroy(lsm);
+
+    /* a lone run keeps its tombstones: foreach must skip them */
+    {
+        struct lsm_visit visit = { NULL, 0 };
+        visit.lsm = lsm = rbdict_lsm_create(RBDICT_STR_INT, &opts);
+        rbdict_lsm_put(lsm, "a", (void*) 10);
+        rbdict_lsm_put(lsm, "b", (void*) 20);
+        rbdict_lsm_delete(lsm, "b");
+        rbdict_lsm_flush(lsm);
+        check(rbdict_lsm_foreach(lsm, count_lsm_pair, &visit) == 0 && visit.n == 1, "lsm foreach skips tombstones");
+        rbdict_lsm_destroy(lsm);
+    }
+
+    /* newest value wins */
+    opts.merge = RBDICT_LSM_REPLACE;
+    lsm = rbdict_lsm_create(RBDICT_STR_STR, &opts);
+    for (i = 0; i < dsize; ++i)
+        rbdict_lsm_put(lsm, all[i], all[i]);
+    for (i = 0; i < dsize; i += 3)
+        rbdict_lsm_put(lsm, all[i], "changed");
+    for (i = 1; i < dsize; i += 3)
+        rbdict_lsm_delete(lsm, all[i]);
+    for (i = 0; i < dsize; ++i) {
+        int rc = rbdict_lsm_get(lsm, all[i], &v);
+        if (i % 3 == 1) {
+            check(rc == -1 && errno == ENOENT, "lsm replace deleted");
+            continue;
+        }
+        check(rc == 0 && strcmp((char*) v, i % 3 ? all[i] : "changed") == 0, "lsm replace get");
+        free(v);
+    }
+    rbdict_lsm_destroy(lsm);
+
+    check(rbdict_lsm_create(RBDICT_STR_STR, &(struct rbdict_lsm_options){ NULL, 0, 0, RBDICT_LSM_SUM }) == NULL &&
+          errno == EINVAL, "lsm sum needs int values");
+
+    rbdict_destroy(counts);
+    rbdict_destroy(htab);
+    free(all);
+}
+
+static int check_ascending(const void* k, const void* v, void* user_data)
+{
+    intptr_t* last = (intptr_t*) user_data;
+    check((intptr_t) v > *last, "multi insertion order");
+    *last = (intptr_t) v;
+    return 0;
+}
+
+void test_rbdict_multi()
+{
+    struct rbdict* multi = rbdict_create_predefined(RBDICT_INT_INT | RBDICT_MULTI);
+    struct rbdict* words = rbdict_create_predefined(RBDICT_STR_STR | RBDICT_MULTI | RBDICT_THREADED);
+    struct rbdict* copy;
+    void* keys[6] = { (void*) 1, (void*) 2, (void*) 2, (void*) 2, (void*) 3, (void*) 3 };
+    void* values[6] = { (void*) 10, (void*) 20, (void*) 21, (void*) 22, (void*) 30, (void*) 31 };
+    intptr_t last;
+    size_t i;
+
+    for (i = 0; i < 10000; ++i)
+        rbdict_insert(multi, i % 100, i);
+    check(rbdict_size(multi) == 10000, "multi size");
+    for (i = 0; i < 100; ++i) {
+        check(rbdict_count(multi, (void*) i) == 100, "multi count");
+        check(rbdict_search(multi, (void*) i) == (void*) i, "multi search finds the oldest");
+        last = -1;
+        check(rbdict_equal_range(multi, (void*) i, check_ascending, &last) == 100, "multi range");
+    }
+    check(rbdict_count(multi, (void*) 100) == 0, "multi count miss");
+
+    check(rbdict_delete_one(multi, (void*) 7) == 0, "multi delete one");
+    check(rbdict_count(multi, (void*) 7) == 99 && rbdict_search(multi, (void*) 7) == (void*) 107,
+          "multi delete one takes the oldest");
+    check(rbdict_delete_all(multi, (void*) 8) == 100 && rbdict_count(multi, (void*) 8) == 0,
+          "multi delete all");
+    rbdict_delete(multi, (void*) 9);
+    check(rbdict_count(multi, (void*) 9) == 0 && rbdict_size(multi) == 9799, "multi delete");
+    check(rbdict_delete_one(multi, (void*) 9) == -1 && errno == ENOENT, "multi delete one miss");
+
+    rbdict_int_update(multi, (void*) 5, 0, incint);
+    check(rbdict_search(multi, (void*) 5) == (void*) 6 && rbdict_count(multi, (void*) 5) == 100,
+          "multi int update");
+
+    copy = rbdict_clone(multi);
+    for (i = 0; i < 100; ++i) {
+        last = -1;
+        check(rbdict_equal_range(copy, (void*) i, check_ascending, &last) == rbdict_count(multi, (void*) i),
+              "multi clone order");
+    }
+    rbdict_destroy(copy);
+
+    rbdict_insert_dup(words, "b", "1");
+    rbdict_insert_dup(words, "a", "x");
+    rbdict_insert_dup(words, "b", "2");
+    rbdict_insert_dup(words, "b", "3");
+    check(rbdict_size(words) == 4 && strcmp((char*) rbdict_search(words, "b"), "1") == 0, "multi str");
+    rbdict_delete_one(words, "b");
+    check(strcmp((char*) rbdict_search(words, "b"), "2") == 0, "multi str delete one");
+    check(rbdict_delete_all(words, "b") == 2 && rbdict_size(words) == 1, "multi str delete all");
+
+    check(rbdict_snapshot(multi) == NULL && errno == EINVAL, "multi snapshot");
+    check(rbdict_create_predefined(RBDICT_INT_INT | RBDICT_MULTI | RBDICT_HASH_INDEX) == NULL &&
+          errno == EINVAL, "multi hash index");
+    rbdict_destroy(multi);
+
+    multi = rbdict_create_predefined(RBDICT_INT_INT | RBDICT_MULTI);
+    check(rbdict_load_sorted(multi, keys, values, 6) == 0, "multi load sorted");
+    check(rbdict_count(multi, (void*) 2) == 3 && rbdict_search(multi, (void*) 2) == (void*) 20 &&
+          rbdict_search(multi, (void*) 3) == (void*) 30, "multi load sorted order");
+    rbdict_destroy(multi);
+    rbdict_destroy(words);
+}
+
+struct agg_check {
+    int64_t lo;
+    int64_t hi;
+    struct rbdict_aggregate agg;
+};
+
+static int agg_brute(const void* k, const void* v, void* user_data)
+{
+    struct agg_check* c = (struct agg_check*) user_data;
+    int64_t key = (int64_t)(intptr_t) k;
+    int64_t value = (int64_t)(intptr_t) v;
+
+    if (key >= c->lo && key < c->hi) {
+        c->agg.sum += value;
+        if (value < c->agg.min)
+            c->agg.min = value;
+        if (value > c->agg.max)
+            c->agg.max = value;
+        ++c->agg.count;
+    }
+    return 0;
+}
+
+static void check_aggregates(const struct rbdict* dict)
+{
+    struct rbdict_aggregate agg;
+    struct agg_check c;
+    int64_t m;
+    int i;
+
+    for (i = 0; i < 300; ++i) {
+        c.lo = rand() % 11000 - 500;
+        c.hi = c.lo + rand() % (i < 150 ? 200 : 12000);
+        c.agg.sum = 0;
+        c.agg.min = INT64_MAX;
+        c.agg.max = INT64_MIN;
+        c.agg.count = 0;
+        rbdict_foreach(dict, agg_brute, &c);
+
+        check(rbdict_range_aggregate(dict, (void*)(intptr_t) c.lo, (void*)(intptr_t) c.hi, &agg) == 0,
+              "range aggregate");
+        check(agg.sum == c.agg.sum && agg.min == c.agg.min && agg.max == c.agg.max &&
+              agg.count == c.agg.count, "range aggregate values");
+        check(rbdict_range_sum(dict, (void*)(intptr_t) c.lo, (void*)(intptr_t) c.hi) == c.agg.sum,
+              "range sum");
+        if (c.agg.count)
+            check(rbdict_range_min(dict, (void*)(intptr_t) c.lo, (void*)(intptr_t) c.hi, &m) == 0 &&
+                  m == c.agg.min && rbdict_range_max(dict, (void*)(intptr_t) c.lo, (void*)(intptr_t) c.hi, &m) == 0 &&
+                  m == c.agg.max, "range min max");
+        else
+            check(rbdict_range_min(dict, (void*)(intptr_t) c.lo, (void*)(intptr_t) c.hi, &m) == -1 &&
+                  errno == ENOENT, "empty range");
+    }
+
+    check(rbdict_aggregate(dict, &agg) == 0 && agg.count == rbdict_size(dict), "aggregate count");
+}
+
+void test_rbdict_aggregate()
+{
+    int flags[3] = { RBDICT_INT_INT, RBDICT_INT_INT | RBDICT_THREADED, RBDICT_INT_INT | RBDICT_MULTI };
+    void* keys[1000];
+    void* values[1000];
+    struct rbdict* copy;
+    int f, i;
+
+    srand(43);
+    for (f = 0; f < 3; ++f) {
+        struct rbdict* dict = rbdict_create_predefined(flags[f] | RBDICT_AGGREGATE);
+
+        for (i = 0; i < 20000; ++i) {
+            int64_t key = rand() % 10000;
+            switch (rand() % 4) {
+            case 0:
+            case 1:
+                rbdict_insert(dict, key, rand() % 2001 - 1000);
+                break;
+            case 2:
+                rbdict_int_update(dict, (void*)(intptr_t) key, -7, incint);
+                break;
+            default:
+                rbdict_delete(dict, (void*)(intptr_t) key);
+                break;
+            }
+        }
+        check_aggregates(dict);
+
+        copy = rbdict_clone(dict);
+        check_aggregates(copy);
+        rbdict_destroy(copy);
+        rbdict_destroy(dict);
+    }
+
+    for (i = 0; i < 1000; ++i) {
+        keys[i] = (void*)(intptr_t)(i * 10);
+        values[i] = (void*)(intptr_t)(i % 37 - 18);
+    }
+    copy = rbdict_create_predefined(RBDICT_INT_INT | RBDICT_AGGREGATE);
+    check(rbdict_load_sorted(copy, keys, values, 1000) == 0, "aggregate load sorted");
+    check_aggregates(copy);
+    rbdict_destroy(copy);
+
+    check(rbdict_create_predefined(RBDICT_STR_STR | RBDICT_AGGREGATE) == NULL && errno == EINVAL,
+          "aggregate needs int values");
+    copy = rbdict_create_predefined(RBDICT_INT_INT);
+    check(rbdict_range_sum(copy, (void*) 0, (void*) 10) == 0 && errno == EINVAL, "aggregate not enabled");
+    rbdict_destroy(copy);
+}
+
+struct overlap_check {
+    int64_t lo;
+    int64_t hi;
+    size_t count;
+    size_t seen;
+    int64_t sum;
+    struct rbdict_interval last;
+    int stop_at;
+};
+
+static int overlap_brute(const void* k, const void* v, void* user_data)
+{
+    struct overlap_check* c = (struct overlap_check*) user_data;
+    const struct rbdict_interval* iv = (const struct rbdict_interval*) k;
+
+    if (iv->lo <= c->hi && iv->hi >= c->lo) {
+        ++c->count;
+        c->sum += (int64_t)(intptr_t) v;
+    }
+    return 0;
+}
+
+static int overlap_visit(const void* k, const void* v, void* user_data)
+{
+    struct overlap_check* c = (struct overlap_check*) user_data;
+    const struct rbdict_interval* iv = (const struct rbdict_interval*) k;
+
+    check(iv->lo <= c->hi && iv->hi >= c->lo, "overlap visits overlaps");
+    check(!c->seen || c->last.lo < iv->lo || (c->last.lo == iv->lo && c->last.hi <= iv->hi),
+          "overlap visits in key order");
+    c->last = *iv;
+    ++c->seen;
+    c->sum -= (int64_t)(intptr_t) v;
+    return c->stop_at && c->seen == (size_t) c->stop_at;
+}
+
+static void check_overlaps(const struct rbdict* dict)
+{
+    struct overlap_check c;
+    int i;
+
+    for (i = 0; i < 300; ++i) {
+        memset(&c, 0, sizeof(c));
+        c.lo = rand() % 11000 - 500;
+        c.hi = c.lo + rand() % (i < 150 ? 50 : 3000);
+        rbdict_foreach(dict, overlap_brute, &c);
+
+        check(rbdict_foreach_overlap(dict, c.lo, c.hi, overlap_visit, &c) == c.count &&
+              c.seen == c.count && c.sum == 0, "overlap matches brute force");
+
+        if (c.count > 1) {
+            c.seen = 0;
+            c.stop_at = 1;
+            check(rbdict_foreach_overlap(dict, c.lo, c.hi, overlap_visit, &c) == 1, "overlap early stop");
+        }
+    }
+}
+
+void test_rbdict_interval()
+{
+    int flags[3] = { RBDICT_INTERVAL_INT, RBDICT_INTERVAL_INT | RBDICT_MULTI,
+                     RBDICT_INTERVAL_INT | RBDICT_AGGREGATE | RBDICT_THREADED };
+    struct rbdict_interval keys[1000];
+    void* kp[1000];
+    void* values[1000];
+    struct rbdict_interval iv;
+    struct rbdict* copy;
+    int f, i;
+
+    srand(44);
+    for (f = 0; f < 3; ++f) {
+        struct rbdict* dict = rbdict_create_predefined(flags[f]);
+
+        for (i = 0; i < 20000; ++i) {
+            iv.lo = rand() % 10000;
+            iv.hi = iv.lo + (rand() % 8 ? rand() % 20 : rand() % 2000);
+            if (rand() % 4)
+                rbdict_insert_dup(dict, &iv, (void*)(intptr_t)(rand() % 100));
+            else
+                rbdict_delete(dict, &iv);
+        }
+        check_overlaps(dict);
+
+        copy = rbdict_clone(dict);
+        check_overlaps(copy);
+        rbdict_destroy(copy);
+        rbdict_destroy(dict);
+    }
+
+    for (i = 0; i < 1000; ++i) {
+        keys[i].lo = i * 10;
+        keys[i].hi = i * 10 + (i % 7) * 25;
+        kp[i] = &keys[i];
+        values[i] = (void*)(intptr_t) i;
+    }
+    copy = rbdict_create_predefined(RBDICT_INTERVAL_INT);
+    check(rbdict_load_sorted(copy, kp, values, 1000) == 0, "interval load sorted");
+    check_overlaps(copy);
+    check(rbdict_foreach_overlap(copy, 0, 0, NULL, NULL) == 1 &&
+          rbdict_foreach_overlap(copy, -10, -1, NULL, NULL) == 0, "overlap point query");
+
+    iv.lo = 5;
+    iv.hi = 4;
+    check(rbdict_insert_dup(copy, &iv, (void*) 1) == -1 && errno == EINVAL, "interval hi < lo");
+    rbdict_destroy(copy);
+
+    copy = rbdict_create_predefined(RBDICT_INT_INT);
+    check(rbdict_foreach_overlap(copy, 0, 10, NULL, NULL) == 0 && errno == EINVAL, "overlap needs intervals");
+    rbdict_destroy(copy);
+}
+
+static int latency_search(const void* k, const void* v, void* user_data)
+{
+    const struct rbdict* dict = (const struct rbdict*) user_data;
+
+    check(rbdict_search(dict, (void*) k) == v, "latency search from thread");
+    return 0;
+}
+
+static void check_latency(int op, uint64_t count)
+{
+    struct rbdict_latency lat;
+
+    check(rbdict_latency_get(op, &lat) == 0 && lat.count == count, "latency count");
+    if (count)
+        check(lat.min_ns <= lat.p50_ns && lat.p50_ns <= lat.p90_ns && lat.p90_ns <= lat.p99_ns &&
+              lat.p99_ns <= lat.p999_ns && lat.p999_ns <= lat.max_ns && lat.mean_ns <= lat.max_ns,
+              "latency percentiles ordered");
+}
+
+void test_rbdict_latency()
+{
+    struct rbdict* dict = rbdict_create_predefined(RBDICT_INT_INT);
+    void* ud[4] = { dict, dict, dict, dict };
+    struct rbdict_latency lat;
+    int i;
+
+    for (i = 0; i < 1000; ++i)
+        rbdict_insert(dict, i, i);
+    check_latency(RBDICT_LAT_INSERT, 0);
+
+    check(rbdict_latency_enable(1) == 0, "latency enable");
+    for (i = 0; i < 1000; ++i) {
+        rbdict_search(dict, (void*)(intptr_t) i);
+        rbdict_int_update(dict, (void*)(intptr_t) i, 0, incint);
+    }
+    for (i = 1000; i < 1500; ++i)
+        rbdict_insert(dict, i, i);
+    for (i = 0; i < 200; ++i)
+        rbdict_delete(dict, (void*)(intptr_t) i);
+
+    /* threads that exited keep their counts */
+    check(rbdict_parallel_foreach(dict, 4, latency_search, ud) == 0, "latency parallel");
+
+    check_latency(RBDICT_LAT_SEARCH, 1000 + 1300);
+    check_latency(RBDICT_LAT_UPDATE, 1000);
+    check_latency(RBDICT_LAT_INSERT, 500);
+    check_latency(RBDICT_LAT_DELETE, 200);
+
+    rbdict_latency_reset();
+    check_latency(RBDICT_LAT_SEARCH, 0);
+    rbdict_search(dict, (void*) 500);
+    check_latency(RBDICT_LAT_SEARCH, 1);
+
+    check(rbdict_latency_enable(0) == 0, "latency disable");
+    rbdict_search(dict, (void*) 500);
+    check_latency(RBDICT_LAT_SEARCH, 1);
+    check(rbdict_latency_get(RBDICT_LAT_NOPS, &lat) == -1 && errno == EINVAL, "latency bad op");
+
+    rbdict_destroy(dict);
+}
+
+static int count_pairs(const void* k, const void* v, void* user_data)
+{
+    ++*(size_t*) user_data;
+    return 0;
+}
+
+static int check_in_clone(const void* k, const void* v, void* user_data)
+{
+    check(rbdict_search((struct rbdict*) user_data, (void*) k) == v, "incremental clone pair");
+    return 0;
+}
+
+static void check_same_pairs(struct rbdict* a, struct rbdict* b)
+{
+    size_t na = 0, nb = 0;
+
+    rbdict_foreach(a, count_pairs, &na);
+    rbdict_foreach(b, count_pairs, &nb);
+    check(na == nb && na == rbdict_size(a) && nb == rbdict_size(b), "incremental clone size");
+    rbdict_foreach(a, check_in_clone, b);
+}
+
+static int values_freed;
+
+static void* counted_clone(const void* v)
+{
+    return strdup((const char*) v);
+}
+
+static void counted_destroy(void* v)
+{
+    free(v);
+#ifdef __GNUC__
+    __atomic_add_fetch(&values_freed, 1, __ATOMIC_RELAXED);
+#else
+    ++values_freed;
+#endif
+}
+
+static int compare_str_keys(const void* a, const void* b)
+{
+    return strcmp((const char*) a, (const char*) b);
+}
+
+void test_rbdict_incremental()
+{
+    struct rbdict_operations ops = { compare_str_keys, free, counted_clone, counted_destroy, counted_clone, NULL };
+    int flags[3] = { RBDICT_INT_INT | RBDICT_TTL, RBDICT_STR_INT | RBDICT_HASH_INDEX, RBDICT_INT_INT | RBDICT_AGGREGATE };
+    struct rbdict* dict;
+    struct rbdict* before;
+    struct rbdict* copy;
+    struct rbdict_job* job;
+    char key[32];
+    int f, i, steps, result;
+
+    srand(46);
+    for (f = 0; f < 3; ++f) {
+        dict = rbdict_create_predefined(flags[f]);
+        for (i = 0; i < 20000; ++i) {
+            sprintf(key, "k%d", rand() % 30000);
+            if (flags[f] & RBDICT_STR_KEY)
+                rbdict_insert_dup(dict, key, (void*)(intptr_t) i);
+            else if (flags[f] & RBDICT_TTL)
+                rbdict_insert_ttl(dict, (void*)(intptr_t)(rand() % 30000), (void*)(intptr_t) i, rand() % 3 ? 1000 : RBDICT_NO_EXPIRY);
+            else
+                rbdict_insert(dict, rand() % 30000, i);
+        }
+        before = rbdict_clone(dict);
+
+        /* the source changes under the clone */
+        job = rbdict_clone_incremental(dict);
+        check(job != NULL, "clone incremental");
+        for (steps = 0; (result = rbdict_step(job, 100)) > 0; ++steps) {
+            for (i = 0; i < 20; ++i) {
+                int64_t k = rand() % 30000;
+                sprintf(key, "k%d", (int) k);
+                if (flags[f] & RBDICT_STR_KEY) {
+                    if (rand() % 2)
+                        rbdict_insert_dup(dict, key, (void*)(intptr_t) -i);
+                    else
+                        rbdict_delete(dict, key);
+                }
+                else if (rand() % 2) {
+                    rbdict_int_update(dict, (void*)(intptr_t) k, 0, incint);
+                }
+                else {
+                    rbdict_delete(dict, (void*)(intptr_t) k);
+                }
+            }
+        }
+        check(result == 0 && steps > 10, "clone steps");
+        copy = rbdict_job_finish(job);
+        check(copy != NULL, "clone job result");
+        check_same_pairs(before, copy);
+        rbdict_destroy(copy);
+        rbdict_destroy(before);
+
+        job = rbdict_destroy_async(dict);
+        for (steps = 0; rbdict_step(job, 1000) > 0; ++steps)
+            ;
+        check(steps > 10, "destroy steps");
+        check(rbdict_job_finish(job) == NULL, "destroy job result");
+    }
+
+    /* the source goes away first */
+    dict = rbdict_create_predefined(RBDICT_INT_INT);
+    for (i = 0; i < 1000; ++i)
+        rbdict_insert(dict, i, i);
+    job = rbdict_clone_incremental(dict);
+    check(rbdict_step(job, 10) == 1, "clone first step");
+    rbdict_destroy(dict);
+    check(rbdict_step(job, 10) == -1 && errno == EINVAL, "clone source destroyed");
+    check(rbdict_job_finish(job) == NULL && errno == EINVAL, "clone job failed");
+
+    /* background destroy runs the value destructors elsewhere */
+    dict = rbdict_create_ex(&ops, RBDICT_STR_KEY);
+    for (i = 0; i < 5000; ++i) {
+        sprintf(key, "k%d", i);
+        rbdict_insert_dup(dict, key, key);
+    }
+    job = rbdict_destroy_async(dict);
+    check(rbdict_step(job, 10) == 1, "destroy first step");
+    check(rbdict_job_background(job) == 0, "destroy in background");
+    for (i = 0; i < 100000000; ++i) {
+#ifdef __GNUC__
+        if (__atomic_load_n(&values_freed, __ATOMIC_RELAXED) == 5000)
+#else
+        if (values_freed == 5000)
+#endif
+            break;
+    }
+    check(i < 100000000, "background destroy done");
+
+    job = rbdict_clone_incremental(dict = rbdict_create_predefined(RBDICT_INT_INT));
+    check(rbdict_job_background(job) == -1 && errno == EINVAL, "no background clone");
+    rbdict_destroy(rbdict_job_finish(job));
+    rbdict_destroy(dict);
+}
+
+void test_rbdict_hot_cache()
+{
+    struct rbdict_operations ops = { compare_str_keys, free, counted_clone, counted_destroy, counted_clone, NULL };
+    struct rbdict_options opts;
+    struct rbdict* mirror;
+    struct rbdict* dict;
+    struct rbdict* copy;
+    char key[32];
+    int f, i;
+
+    srand(47);
+    for (f = 0; f < 3; ++f) {
+        memset(&opts, 0, sizeof(opts));
+        opts.hot_slots = 64;
+        if (f == 1)
+            opts.max_entries = 500;
+        dict = rbdict_create_opt(NULL, (f == 2 ? RBDICT_STR_INT | RBDICT_TTL : RBDICT_INT_INT) | RBDICT_HOT_CACHE, &opts);
+        mirror = rbdict_create_predefined(f == 2 ? RBDICT_STR_INT : RBDICT_INT_INT);
+        check(dict && mirror, "hot cache create");
+
+        for (i = 0; i < 100000; ++i) {
+            /* a few keys take most of the traffic */
+            int k = rand() % 8 ? rand() % 50 : rand() % 2000;
+            void* kp = (void*)(intptr_t) k;
+            void* found;
+
+            if (f == 2) {
+                sprintf(key, "key%d", k);
+                kp = key;
+            }
+            switch (rand() % 8) {
+            case 0:
+                rbdict_insert_dup(dict, kp, (void*)(intptr_t) i);
+                rbdict_insert_dup(mirror, kp, (void*)(intptr_t) i);
+                break;
+            case 1:
+                rbdict_delete(dict, kp);
+                rbdict_delete(mirror, kp);
+                break;
+            case 2:
+                if (f == 2 && rbdict_search(dict, kp)) {
+                    /* expired pairs leave through the hot slot too */
+                    rbdict_touch(dict, kp, i);
+                    rbdict_delete(mirror, kp);
+                }
+                break;
+            default:
+                found = rbdict_search(dict, kp);
+                if (f == 1)
+                    check(!found || found == rbdict_search(mirror, kp), "hot cache bounded search");
+                else
+                    check(found == rbdict_search(mirror, kp), "hot cache search");
+                break;
+            }
+            if (f == 2)
+                rbdict_expire(dict, i, (size_t) -1);
+        }
+
+        copy = rbdict_clone(dict);
+        for (i = 0; i < 2000 && f != 1; ++i) {
+            void* kp = (void*)(intptr_t) i;
+            if (f == 2) {
+                sprintf(key, "key%d", i);
+                kp = key;
+            }
+            check(rbdict_search(copy, kp) == rbdict_search(mirror, kp), "hot cache clone");
+        }
+        rbdict_destroy(copy);
+        rbdict_destroy(mirror);
+        rbdict_destroy(dict);
+    }
+
+    check(rbdict_create_predefined(RBDICT_INT_INT | RBDICT_HOT_CACHE | RBDICT_HASH_INDEX) == NULL &&
+          errno == EINVAL, "hot cache with hash index");
+    check(rbdict_create_ex(&ops, RBDICT_HOT_CACHE) == NULL && errno == EINVAL, "hot cache needs k_hash");
+    memset(&opts, 0, sizeof(opts));
+    opts.hot_slots = 100;
+    check(rbdict_create_opt(NULL, RBDICT_INT_INT | RBDICT_HOT_CACHE, &opts) == NULL && errno == EINVAL,
+          "hot slots power of 2");
+}
+
+/* reads and counter adds from inside foreach go ahead, writes are refused */
+static int visit_concurrent(const void* k, const void* v, void* user_data)
+{
+    struct rbdict* counts = (struct rbdict*) user_data;
+    size_t n = 0;
+
+    check(rbdict_search(counts, (void*) k) == v, "search from foreach");
+    check(rbdict_int_add(counts, (void*) k, 1) == 0, "add from foreach");
+    check(rbdict_insert(counts, 1 << 30, 0) == -1 && errno == EDEADLK, "insert from foreach");
+    rbdict_delete(counts, k);
+    rbdict_foreach(counts, count_elem, &n);
+    check(n == rbdict_size(counts), "foreach from foreach");
+    return 0;
+}
+
+static int add_counts(const void* k, const void* v, void* user_data)
+{
+    struct rbdict* counts = (struct rbdict*) user_data;
+    int64_t i = (int64_t)(intptr_t) k;
+
+    rbdict_int_add(counts, (void*)(intptr_t)(i % 64), 1);
+    rbdict_int_update(counts, (void*)(intptr_t)(i % 64 + 1000), 1, incint);
+    rbdict_int_add(counts, (void*)(intptr_t)(i % 64), 2);
+    if (i % 97 == 0)
+        rbdict_insert(counts, -1 - i, i);
+    if (i % 89 == 0)
+        rbdict_search(counts, (void*)(intptr_t)(i % 64));
+    return 0;
+}
+
+/* inserts and deletes racing range reads and copies of the keys */
+static int churn_counts(const void* k, const void* v, void* user_data)
+{
+    struct rbdict* counts = (struct rbdict*) user_data;
+    int64_t i = (int64_t)(intptr_t) k;
+    int64_t key = 1 + i % 256;
+    void* keys[256] = { NULL };
+    size_t j;
+
+    if (i % 2)
+        rbdict_insert(counts, key, i);
+    else
+        rbdict_delete_one(counts, (void*)(intptr_t) key);
+    if (i % 3 == 0)
+        rbdict_delete_all(counts, (void*)(intptr_t)(key + 1));
+    check(rbdict_equal_range(counts, (void*)(intptr_t) key, NULL, NULL) <= 1, "concurrent equal range");
+    if (i % 101 == 0) {
+        check(rbdict_keys(counts, keys, 256, 0) == 0, "concurrent keys");
+        for (j = 1; j < 256 && keys[j]; ++j)
+            check((intptr_t) keys[j - 1] < (intptr_t) keys[j], "concurrent keys sorted");
+    }
+    return 0;
+}
+
+struct conc_snapshot {
+    struct rbdict* counts;
+    struct rbdict_snapshot* snap;
+};
+
+/* counter adds racing reads of a snapshot taken before them */
+static int add_read_snapshot(const void* k, const void* v, void* user_data)
+{
+    struct conc_snapshot* cs = (struct conc_snapshot*) user_data;
+    int64_t i = (int64_t)(intptr_t) k;
+    size_t n = 0;
+
+    rbdict_int_add(cs->counts, (void*)(intptr_t)(i % 64), 1);
+    check(rbdict_snapshot_search(cs->snap, (void*)(intptr_t)(i % 64)) == (void*) 100, "concurrent snapshot search");
+    if (i % 101 == 0) {
+        check(rbdict_snapshot_foreach_n(cs->snap, 16, count_pairs, &n) == 16 &&
+              rbdict_snapshot_foreach_after(cs->snap, (void*) 15, 0, count_pairs, &n) == 48 && n == 64,
+              "concurrent snapshot chunks");
+    }
+    return 0;
+}
+
+void test_rbdict_concurrent()
+{
+    struct rbdict_options opts;
+    struct rbdict_aggregate agg;
+    struct rbdict* work = rbdict_create_predefined(RBDICT_INT_INT);
+    struct rbdict* counts = rbdict_create_predefined(RBDICT_INT_INT | RBDICT_CONCURRENT);
+    struct rbdict* copy;
+    void* ud[4];
+    int64_t i, n = 20000;
+
+    if (!counts && errno == ENOSYS) {
+        rbdict_destroy(work);
+        return;
+    }
+    check(work && counts, "concurrent create");
+
+    for (i = 0; i < n; ++i)
+        rbdict_insert(work, i, 0);
+    for (i = 0; i < 4; ++i)
+        ud[i] = counts;
+    check(rbdict_parallel_foreach(work, 4, add_counts, ud) == 0, "concurrent adds");
+
+    for (i = 0; i < 64; ++i) {
+        int64_t hits = n / 64 + (i < n % 64);
+        check(rbdict_search(counts, (void*)(intptr_t) i) == (void*)(intptr_t)(3 * hits), "concurrent add sum");
+        check(rbdict_search(counts, (void*)(intptr_t)(i + 1000)) == (void*)(intptr_t) hits, "concurrent update sum");
+    }
+    check(rbdict_size(counts) == 128 + (size_t)((n + 96) / 97), "concurrent inserts");
+
+    /* every visit adds 1 to each pair */
+    copy = rbdict_clone(counts);
+    rbdict_foreach(counts, visit_concurrent, counts);
+    check(rbdict_size(counts) == rbdict_size(copy) && !rbdict_search(counts, (void*)(1 << 30)) &&
+          (intptr_t) rbdict_search(counts, (void*) 5) == (intptr_t) rbdict_search(copy, (void*) 5) + 1,
+          "foreach visitor writes");
+    rbdict_int_add(counts, (void*) 5, -1);
+    rbdict_destroy(copy);
+
+    copy = rbdict_clone(counts);
+    check(copy && rbdict_int_add(copy, (void*) 5, 10) == 0 &&
+          rbdict_search(copy, (void*) 5) == (void*)(intptr_t)(3 * (n / 64 + 1) + 10), "concurrent clone");
+    rbdict_destroy(copy);
+
+    /* wraps like the aggregates do */
+    rbdict_insert(counts, 5000, INT64_MAX);
+    rbdict_int_add(counts, (void*) 5000, 1);
+    check(rbdict_search(counts, (void*) 5000) == (void*)(intptr_t) INT64_MIN, "concurrent add wraps");
+    rbdict_destroy(counts);
+
+    /* aggregates take the writer path */
+    counts = rbdict_create_predefined(RBDICT_INT_INT | RBDICT_CONCURRENT | RBDICT_AGGREGATE);
+    for (i = 0; i < 4; ++i)
+        ud[i] = counts;
+    check(rbdict_parallel_foreach(work, 3, add_counts, ud) == 0, "concurrent aggregate adds");
+    check(rbdict_aggregate(counts, &agg) == 0 && agg.sum == 4 * n + 97 * (n / 97) * (n / 97 + 1) / 2,
+          "concurrent aggregate");
+    check(rbdict_range_sum(counts, (void*) 0, (void*) 64) == 3 * n, "concurrent aggregate sum");
+    rbdict_destroy(counts);
+
+    /* snapshot reads take the shared lock */
+    {
+        struct conc_snapshot cs;
+
+        cs.counts = rbdict_create_predefined(RBDICT_INT_INT | RBDICT_CONCURRENT);
+        for (i = 0; i < 64; ++i)
+            rbdict_insert(cs.counts, i, 100);
+        cs.snap = rbdict_snapshot(cs.counts);
+        for (i = 0; i < 4; ++i)
+            ud[i] = &cs;
+        check(rbdict_parallel_foreach(work, 4, add_read_snapshot, ud) == 0 &&
+              rbdict_search(cs.counts, (void*) 0) == (void*)(intptr_t)(100 + n / 64 + 1), "concurrent snapshot");
+        rbdict_snapshot_release(cs.snap);
+        rbdict_destroy(cs.counts);
+    }
+
+    /* the calls beyond the point operations lock too */
+    counts = rbdict_create_predefined(RBDICT_INT_INT | RBDICT_CONCURRENT);
+    for (i = 0; i < 4; ++i)
+        ud[i] = counts;
+    check(rbdict_parallel_foreach(work, 4, churn_counts, ud) == 0 && rbdict_size(counts) <= 256,
+          "concurrent churn");
+    rbdict_destroy(counts);
+
+    /* not concurrent: same result, no locks */
+    counts = rbdict_create_predefined(RBDICT_STR_INT);
+    rbdict_int_add(counts, "a", 5);
+    rbdict_int_add(counts, "a", -7);
+    check(rbdict_search(counts, "a") == (void*)(intptr_t) -2, "int add");
+    rbdict_destroy(counts);
+    counts = rbdict_create_predefined(RBDICT_STR_STR);
+    check(rbdict_int_add(counts, "a", 1) == -1 && errno == EINVAL, "int add needs int values");
+    rbdict_destroy(counts);
+
+    check(rbdict_create_predefined(RBDICT_STR_STR | RBDICT_CONCURRENT) == NULL && errno == EINVAL,
+          "concurrent needs int values");
+    check(rbdict_create_predefined(RBDICT_INT_INT | RBDICT_CONCURRENT | RBDICT_TTL) == NULL && errno == EINVAL,
+          "concurrent without ttl");
+    memset(&opts, 0, sizeof(opts));
+    opts.max_entries = 10;
+    check(rbdict_create_opt(NULL, RBDICT_INT_INT | RBDICT_CONCURRENT, &opts) == NULL && errno == EINVAL,
+          "concurrent without cache");
+    rbdict_destroy(work);
+}
+
+#ifndef _WIN32
+/* a reader process checking every value it sees against its key */
+static int shm_reader(int fd, int nkeys)
+{
+    struct rbdict_shm* shm = rbdict_shm_open_fd(fd);
+    char key[32];
+    void* v;
+    int i, bad = 0;
+
+    if (!shm)
+        return 1;
+    for (i = 0; i < 200000; ++i) {
+        sprintf(key, "k%d", rand() % nkeys);
+        if (rbdict_shm_get(shm, key, &v) == 0) {
+            size_t len = strlen(key);
+            bad |= strncmp((char*) v, key, len) != 0 || ((char*) v)[len] != '=';
+            free(v);
+        }
+        else {
+            bad |= errno != ENOENT;
+        }
+    }
+    rbdict_shm_close(shm);
+    return bad;
+}
+#endif
+
+void test_rbdict_shm()
+{
+#ifndef _WIN32
+    struct rbdict_shm_options opts;
+    struct rbdict* mirror = rbdict_create_predefined(RBDICT_STR_STR);
+    struct rbdict_shm* shm = rbdict_shm_create(NULL, RBDICT_STR_STR, NULL);
+    struct rbdict_shm* other;
+    struct rbdict_blob* blob;
+    char key[32], val[32], name[64];
+    uint64_t* seq;
+    void* v;
+    int i, status;
+    pid_t pid;
+
+    check(shm && mirror, "shm create");
+
+    srand(49);
+    for (i = 0; i < 100000; ++i) {
+        sprintf(key, "key%d", rand() % 3000);
+        if (rand() % 3) {
+            sprintf(val, "value%d", i);
+            check(rbdict_shm_put(shm, key, val) == 0, "shm put");
+            rbdict_insert_dup(mirror, key, val);
+        }
+        else {
+            int found = rbdict_search(mirror, key) != NULL;
+            check((rbdict_shm_delete(shm, key) == 0) == found, "shm delete");
+            rbdict_delete(mirror, key);
+        }
+    }
+    check(rbdict_shm_size(shm) == rbdict_size(mirror), "shm size");
+    for (i = 0; i < 3000; ++i) {
+        char* expected;
+
+        sprintf(key, "key%d", i);
+        expected = (char*) rbdict_search(mirror, key);
+        if (expected) {
+            check(rbdict_shm_get(shm, key, &v) == 0 && strcmp((char*) v, expected) == 0, "shm get");
+            free(v);
+        }
+        else {
+            check(rbdict_shm_get(shm, key, &v) == -1 && errno == ENOENT, "shm get missing");
+        }
+    }
+
+    /* a copy of a dict, then readers in another process during writes */
+    rbdict_shm_close(shm);
+    shm = rbdict_shm_create(NULL, RBDICT_STR_STR, NULL);
+    check(rbdict_shm_load(shm, mirror) == 0 && rbdict_shm_size(shm) == rbdict_size(mirror), "shm load");
+    rbdict_shm_close(shm);
+
+    shm = rbdict_shm_create(NULL, RBDICT_STR_STR, NULL);
+    fflush(stdout);
+    if ((pid = fork()) == 0)
+        _exit(shm_reader(rbdict_shm_fd(shm), 500));
+    check(pid > 0, "shm fork");
+    for (i = 0; i < 100000; ++i) {
+        int k = rand() % 500;
+
+        sprintf(key, "k%d", k);
+        sprintf(val, "k%d=%d", k, i);
+        if (rand() % 4)
+            rbdict_shm_put(shm, key, val);
+        else
+            rbdict_shm_delete(shm, key);
+    }
+    check(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0,
+          "shm reader process");
+    rbdict_shm_close(shm);
+    rbdict_destroy(mirror);
+
+    /* sorted inserts stay balanced: a lookup gives up past depth 128 */
+    shm = rbdict_shm_create(NULL, RBDICT_INT_INT, NULL);
+    for (i = 0; i < 100000; ++i)
+        rbdict_shm_put(shm, (void*)(intptr_t) i, (void*)(intptr_t)(-i));
+    for (i = 0; i < 100000; i += 2)
+        rbdict_shm_delete(shm, (void*)(intptr_t) i);
+    for (i = 0; i < 100000; ++i) {
+        int rc = rbdict_shm_get(shm, (void*)(intptr_t) i, &v);
+        check(i % 2 ? rc == 0 && v == (void*)(intptr_t)(-i) : rc == -1 && errno == ENOENT, "shm int keys");
+    }
+    check(rbdict_shm_size(shm) == 50000, "shm int size");
+    rbdict_shm_close(shm);
+
+    /* named segment */
+    sprintf(name, "/rbdict_test_%d", (int) getpid());
+    shm = rbdict_shm_create(name, RBDICT_INT_INT, NULL);
+    check(shm && rbdict_shm_put(shm, (void*) 1, (void*) 2) == 0, "shm named");
+    check(rbdict_shm_create(name, RBDICT_INT_INT, NULL) == NULL && errno == EEXIST, "shm name taken");
+    other = rbdict_shm_open(name);
+    check(other && rbdict_shm_get(other, (void*) 1, &v) == 0 && v == (void*) 2, "shm open");
+    check(rbdict_shm_fd(other) == -1 && rbdict_shm_put(other, (void*) 3, (void*) 4) == -1 && errno == EBADF,
+          "shm reader is read only");
+
+    /* a writer that died in a change leaves the header's SEQ odd */
+    seq = (uint64_t*) mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, rbdict_shm_fd(shm), 0) + 3;
+    ++*seq;
+    check(rbdict_shm_get(other, (void*) 1, &v) == -1 && errno == EAGAIN, "shm writer died");
+    --*seq;
+    munmap(seq - 3, 4096);
+    rbdict_shm_close(other);
+    rbdict_shm_close(shm);
+    shm_unlink(name);
+
+    /* blob values, and a full segment */
+    memset(&opts, 0, sizeof(opts));
+    opts.size = 8192;
+    shm = rbdict_shm_create(NULL, RBDICT_STR_KEY | RBDICT_BLOB_VAL, &opts);
+    blob = rbdict_blob_new("", 0);
+    check(rbdict_shm_put(shm, "empty", blob) == 0 && rbdict_shm_put(shm, "null", NULL) == 0, "shm blob put");
+    free(blob);
+    check(rbdict_shm_get(shm, "empty", &v) == 0 && v && ((struct rbdict_blob*) v)->len == 0, "shm empty blob");
+    free(v);
+    check(rbdict_shm_get(shm, "null", &v) == 0 && v == NULL, "shm null blob");
+    blob = rbdict_blob_new("0123456789abcdef", 16);
+    for (i = 0; ; ++i) {
+        sprintf(key, "key%d", i);
+        if (rbdict_shm_put(shm, key, blob) < 0)
+            break;
+    }
+    check(errno == ENOMEM && i > 50, "shm full");
+    check(rbdict_shm_mem_used(shm) <= 8192, "shm mem used");
+    check(rbdict_shm_delete(shm, "key0") == 0 && rbdict_shm_put(shm, key, blob) == 0, "shm reuse");
+    check(rbdict_shm_get(shm, "key7", &v) == 0 && ((struct rbdict_blob*) v)->len == 16 &&
+          memcmp(((struct rbdict_blob*) v)->data, "0123456789abcdef", 16) == 0, "shm blob get");
+    free(v);
+    free(blob);
+    rbdict_shm_close(shm);
+
+    check(rbdict_shm_create(NULL, RBDICT_STR_STR | RBDICT_MULTI, NULL) == NULL && errno == EINVAL,
+          "shm no multi");
+#endif
+}
+
+struct diff_check {
+    const struct rbdict* a;
+    const struct rbdict* b;
+    char last[32];
+    size_t count;
+};
+
+/* every reported key really differs, in ascending order */
+static int check_diff(int change, const void* key, const void* old_value, const void* new_value, void* user_data)
+{
+    struct diff_check* d = (struct diff_check*) user_data;
+    void* va = rbdict_search(d->a, (void*) key);
+    void* vb = rbdict_search(d->b, (void*) key);
+
+    check(d->count == 0 || strcmp(d->last, (const char*) key) < 0, "diff in key order");
+    check(va == old_value && vb == new_value, "diff values");
+    check(change == (!va ? RBDICT_DIFF_ADDED : !vb ? RBDICT_DIFF_REMOVED : RBDICT_DIFF_CHANGED) &&
+          (change != RBDICT_DIFF_CHANGED || strcmp((char*) va, (char*) vb) != 0), "diff change");
+    strcpy(d->last, (const char*) key);
+    ++d->count;
+    return 0;
+}
+
+/* make the dict in USER_DATA follow the changes */
+static int apply_diff(int change, const void* key, const void* old_value, const void* new_value, void* user_data)
+{
+    if (change == RBDICT_DIFF_REMOVED)
+        rbdict_delete((struct rbdict*) user_data, key);
+    else
+        rbdict_insert_dup((struct rbdict*) user_data, (void*) key, (void*) new_value);
+    return 0;
+}
+
+static int count_diff(int change, const void* key, const void* old_value, const void* new_value, void* user_data)
+{
+    ++*(size_t*) user_data;
+    return 0;
+}
+
+static int stop_diff(int change, const void* key, const void* old_value, const void* new_value, void* user_data)
+{
+    return 7;
+}
+
+static void random_writes(struct rbdict* dict, int n, int nkeys)
+{
+    char key[32], val[32];
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        sprintf(key, "key%d", rand() % nkeys);
+        sprintf(val, "value%d", rand() % 4);
+        if (rand() % 3)
+            rbdict_insert_dup(dict, key, val);
+        else
+            rbdict_delete(dict, key);
+    }
+}
+
+void test_rbdict_diff()
+{
+    struct rbdict* a = rbdict_create_predefined(RBDICT_STR_STR);
+    struct rbdict* b;
+    struct rbdict* replica;
+    struct rbdict* other;
+    struct rbdict_snapshot* snap;
+    struct diff_check d;
+    size_t n1 = 0, n2 = 0, count = 0;
+
+    srand(50);
+    random_writes(a, 5000, 1000);
+    b = rbdict_clone(a);
+    random_writes(b, 500, 1200);
+
+    memset(&d, 0, sizeof(d));
+    d.a = a;
+    d.b = b;
+    check(rbdict_diff(a, b, check_diff, &d) == 0 && d.count > 100, "diff");
+    check(rbdict_diff(b, b, count_diff, &count) == 0 && count == 0, "diff with itself");
+    check(rbdict_diff(a, b, stop_diff, NULL) == 7, "diff stopped");
+
+    /* a replica kept in step through snapshot diffs */
+    replica = rbdict_clone(b);
+    other = rbdict_clone(b);
+    snap = rbdict_snapshot(b);
+    random_writes(b, 300, 1500);
+    check(rbdict_snapshot_diff(snap, count_diff, &n1) == 0 && rbdict_diff(other, b, count_diff, &n2) == 0 &&
+          n1 == n2 && n1 > 0, "snapshot diff");
+    check(rbdict_snapshot_diff(snap, apply_diff, replica) == 0, "snapshot diff apply");
+    count = 0;
+    check(rbdict_diff(replica, b, count_diff, &count) == 0 && count == 0, "replica in step");
+    rbdict_snapshot_release(snap);
+    rbdict_destroy(other);
+    rbdict_destroy(replica);
+
+    other = rbdict_create_predefined(RBDICT_INT_INT);
+    check(rbdict_diff(a, other, count_diff, &count) == -1 && errno == EINVAL, "diff of other types");
+    rbdict_destroy(other);
+    rbdict_destroy(b);
+    rbdict_destroy(a);
+}
+
+/* move what the feed has to the replica */
+static int drain_feed(struct rbdict_feed* feed, struct rbdict* replica, char* buf, size_t size)
+{
+    size_t len;
+
+    do {
+        if (rbdict_feed_read(feed, buf, size, &len) < 0)
+            return -1;
+        check(rbdict_feed_apply(replica, RBDICT_STR_STR, buf, len) == 0, "feed apply");
+    } while (len);
+    return 0;
+}
+
+void test_rbdict_feed()
+{
+    struct rbdict* primary = rbdict_create_predefined(RBDICT_STR_STR);
+    struct rbdict* replica = rbdict_create_predefined(RBDICT_STR_STR);
+    struct rbdict_feed* feed = rbdict_feed_open(primary, RBDICT_STR_STR, 4096);
+    char buf[1000];
+    size_t count = 0, len;
+    int i;
+
+    check(feed != NULL, "feed open");
+    srand(51);
+    for (i = 0; i < 200; ++i) {
+        random_writes(primary, 20, 300);
+        check(drain_feed(feed, replica, buf, sizeof(buf)) == 0, "feed read");
+    }
+    check(rbdict_diff(primary, replica, count_diff, &count) == 0 && count == 0, "feed replica");
+
+    /* a record larger than the caller's buffer */
+    rbdict_insert_dup(primary, "big", "0123456789");
+    check(rbdict_feed_read(feed, buf, 8, &len) == -1 && errno == ENOBUFS && len > 8, "feed buffer too small");
+    check(drain_feed(feed, replica, buf, sizeof(buf)) == 0, "feed read after ENOBUFS");
+
+    /* a feed left behind drops records and says so; resync, go on */
+    random_writes(primary, 1000, 300);
+    check(rbdict_feed_read(feed, buf, sizeof(buf), &len) == -1 && errno == EOVERFLOW, "feed overflow");
+    rbdict_destroy(replica);
+    replica = rbdict_clone(primary);
+    random_writes(primary, 50, 300);
+    check(drain_feed(feed, replica, buf, sizeof(buf)) == 0, "feed after resync");
+    count = 0;
+    check(rbdict_diff(primary, replica, count_diff, &count) == 0 && count == 0, "feed replica after resync");
+
+    memset(buf, 0xff, 16);
+    check(rbdict_feed_apply(replica, RBDICT_STR_STR, buf, 16) == -1 && errno == EINVAL, "feed bad record");
+
+    /* one hook per dict; closing a feed leaves someone else's hook */
+    check(rbdict_feed_open(primary, RBDICT_STR_STR, 4096) == NULL && errno == EBUSY, "feed hook taken");
+    rbdict_set_change_hook(primary, refuse_change, &i);
+    rbdict_feed_close(feed);
+    check(rbdict_get_change_hook(primary, NULL) == refuse_change, "feed close keeps other hook");
+    rbdict_set_change_hook(primary, NULL, NULL);
+    check(rbdict_feed_open(primary, RBDICT_STR_STR, 1000) == NULL && errno == EINVAL, "feed capacity power of 2");
+    rbdict_destroy(replica);
+    rbdict_destroy(primary);
+}
 
 int main()
 {
     test_rbdict_str_str();
     test_rbdict_str_int();
     test_rbdict_int_int();
+    test_rbdict_prefix();
+    test_rbdict_blob();
+    test_rbdict_strpool();
+    test_rbdict_numeric_keys();
+    test_rbdict_hash_index();
+    test_rbdict_snapshot();
+    test_rbdict_cache();
+    test_rbdict_ttl();
+    test_rbdict_export();
+    test_rbdict_threaded();
+    test_rbdict_parallel();
+    test_rbdict_allocator();
+    test_rbdict_arena();
+    test_rbdict_frozen();
+    test_rbdict_journal();
+    test_rbdict_lsm();
+    test_rbdict_multi();
+    test_rbdict_aggregate();
+    test_rbdict_interval();
+    test_rbdict_latency();
+    test_rbdict_incremental();
+    test_rbdict_hot_cache();
+    test_rbdict_concurrent();
+    test_rbdict_shm();
+    test_rbdict_diff();
+    test_rbdict_feed();
 
     return 0;
 }
@@ -0,0 +1,43 @@
+#ifndef RBDICT_TRACE_H
+#define RBDICT_TRACE_H
+
+/*
+ * Instrumentation. Latency histograms of the point operations are
+ * always compiled in and cost one load of a global flag while off.
+ * USDT probes (rbdict:<op>__entry / rbdict:<op>__return) need a build
+ * with -DRBDICT_USDT and <sys/sdt.h>; otherwise they are no-ops and
+ * their arguments are not evaluated. Point operations pass the key
+ * size, then the result, with the dict size. Scans, copies, expiry,
+ * snapshots and diffs pass a size or limit (0 when they have none),
+ * then their count or result, with the dict size.
+ */
+
+#include <stdint.h>
+
+#ifdef RBDICT_USDT
+#include <sys/sdt.h>
+#define RBDICT_PROBE2(name, a, b) DTRACE_PROBE2(rbdict, name, a, b)
+#else
+#define RBDICT_PROBE2(name, a, b) ((void)0)
+#endif
+
+extern int _rbdict_lat_on;
+uint64_t _rbdict_lat_now(void);
+void _rbdict_lat_record(int op, uint64_t start);
+
+static __inline uint64_t _lat_begin(void)
+{
+#ifdef _WIN32
+    return 0;
+#else
+    return __atomic_load_n(&_rbdict_lat_on, __ATOMIC_RELAXED) ? _rbdict_lat_now() : 0;
+#endif
+}
+
+static __inline void _lat_end(int op, uint64_t start)
+{
+    if (start)
+        _rbdict_lat_record(op, start);
+}
+
+#endif